@@ -10,6 +10,7 @@
 #include <fstream>
 #include <iterator>
 #include <iostream>
+#include <numeric>
 #include <regex>
 #include <sstream>
 #include <string>
@@ -102,6 +103,22 @@ static void process_escapes(std::string& input) {
     input.resize(output_idx);
 }
 
+ggml_type kv_cache_type_from_str(const std::string & s) {
+    if (s == "f32") {
+        return GGML_TYPE_F32;
+    }
+    if (s == "f16") {
+        return GGML_TYPE_F16;
+    }
+    if (s == "q8_0") {
+        return GGML_TYPE_Q8_0;
+    }
+    if (s == "q4_0") {
+        return GGML_TYPE_Q4_0;
+    }
+    return GGML_TYPE_COUNT;
+}
+
 bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
     bool invalid_param = false;
     std::string arg;
@@ -200,6 +217,18 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.rope_freq_scale = 1.0f/std::stof(argv[i]);
         } else if (arg == "--memory-f32") {
             params.memory_f16 = false;
+        } else if (arg == "-ctk" || arg == "--cache-type-k") {
+            if (++i >= argc || kv_cache_type_from_str(argv[i]) == GGML_TYPE_COUNT) {
+                invalid_param = true;
+                break;
+            }
+            params.cache_type_k = argv[i];
+        } else if (arg == "-ctv" || arg == "--cache-type-v") {
+            if (++i >= argc || kv_cache_type_from_str(argv[i]) == GGML_TYPE_COUNT) {
+                invalid_param = true;
+                break;
+            }
+            params.cache_type_v = argv[i];
         } else if (arg == "--top-p") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -311,6 +340,12 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
                 break;
             }
             params.n_draft = std::stoi(argv[i]);
+        } else if (arg == "-np" || arg == "--parallel") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            params.n_parallel = std::stoi(argv[i]);
         } else if (arg == "--chunks") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -352,6 +387,8 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
             params.interactive = true;
         } else if (arg == "--embedding") {
             params.embedding = true;
+        } else if (arg == "--embd-lines") {
+            params.embd_lines = true;
         } else if (arg == "--interactive-first") {
             params.interactive_first = true;
         } else if (arg == "-ins" || arg == "--instruct") {
@@ -434,6 +471,16 @@ bool gpt_params_parse(int argc, char ** argv, gpt_params & params) {
 #endif // GGML_USE_CUBLAS
         } else if (arg == "--no-mmap") {
             params.use_mmap = false;
+        } else if (arg == "--no-flash-attn") {
+            params.flash_attn = false;
+        } else if (arg == "--hugepages") {
+            params.use_hugepages = true;
+        } else if (arg == "--mpi-tensor-parallel") {
+#ifdef GGML_USE_MPI
+            params.mpi_tensor_parallel = true;
+#else
+            fprintf(stderr, "warning: llama.cpp was compiled without MPI. It is not possible to split the layers across nodes.\n");
+#endif // GGML_USE_MPI
         } else if (arg == "--numa") {
             params.numa = true;
         } else if (arg == "--export") {
@@ -654,19 +701,32 @@ void gpt_print_usage(int /*argc*/, char ** argv, const gpt_params & params) {
     printf("  --no-penalize-nl      do not penalize newline token\n");
     printf("  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                        not recommended: doubles context memory required and no measurable increase in quality\n");
+    printf("  -ctk TYPE, --cache-type-k TYPE\n");
+    printf("                        KV cache data type for K: f32, f16, q8_0, q4_0 (default: %s)\n", params.cache_type_k.c_str());
+    printf("  -ctv TYPE, --cache-type-v TYPE\n");
+    printf("                        KV cache data type for V: f32, f16, q8_0, q4_0 (default: %s)\n", params.cache_type_v.c_str());
+    printf("                        a quantized V cache requires flash attention\n");
     printf("  --temp N              temperature (default: %.1f)\n", (double)params.temp);
     printf("  --perplexity          compute perplexity over each ctx window of the prompt\n");
     printf("  --hellaswag           compute HellaSwag score over random tasks from datafile supplied with -f\n");
     printf("  --hellaswag-tasks N   number of tasks to use when computing the HellaSwag score (default: %zu)\n", params.hellaswag_tasks);
+    printf("  --embd-lines          embedding: compute a separate embedding for every non-empty line of the prompt\n");
     printf("  --keep N              number of tokens to keep from the initial prompt (default: %d, -1 = all)\n", params.n_keep);
     printf("  --draft N             number of tokens to draft for speculative decoding (default: %d)\n", params.n_draft);
     printf("  --chunks N            max number of chunks to process (default: %d, -1 = all)\n", params.n_chunks);
+    printf("  -np N, --parallel N   number of parallel sequences to decode (default: %d)\n", params.n_parallel);
     if (llama_mlock_supported()) {
         printf("  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
     }
     if (llama_mmap_supported()) {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --no-flash-attn       compute attention with separate KQ, softmax and KQV ops instead of the fused CPU op\n");
+    printf("  --hugepages           back the weights, KV cache and compute buffers with huge pages (reads the weights instead of mmap)\n");
+#ifdef GGML_USE_MPI
+    printf("  --mpi-tensor-parallel split the attention heads and feed-forward columns of every layer across the MPI nodes\n");
+    printf("                        instead of giving each node a range of layers (llama models only)\n");
+#endif // GGML_USE_MPI
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
     printf("                        if run without this previously, it is recommended to drop the system page cache before using this\n");
     printf("                        see https://github.com/ggerganov/llama.cpp/issues/1437\n");
@@ -736,10 +796,15 @@ struct llama_context_params llama_context_params_from_gpt_params(const gpt_param
     lparams.mul_mat_q       = params.mul_mat_q;
     lparams.seed            = params.seed;
     lparams.f16_kv          = params.memory_f16;
+    lparams.type_k          = kv_cache_type_from_str(params.cache_type_k);
+    lparams.type_v          = kv_cache_type_from_str(params.cache_type_v);
     lparams.use_mmap        = params.use_mmap;
     lparams.use_mlock       = params.use_mlock;
     lparams.logits_all      = params.perplexity;
     lparams.embedding       = params.embedding;
+    lparams.flash_attn      = params.flash_attn;
+    lparams.use_hugepages   = params.use_hugepages;
+    lparams.mpi_tensor_parallel = params.mpi_tensor_parallel;
     lparams.rope_freq_base  = params.rope_freq_base;
     lparams.rope_freq_scale = params.rope_freq_scale;
 
@@ -782,8 +847,9 @@ std::tuple<struct llama_model *, struct llama_context *> llama_init_from_gpt_par
     {
         LOG("warming up the model with an empty run\n");
 
-        const std::vector<llama_token> tmp = { llama_token_bos(lctx), llama_token_eos(lctx), };
-        llama_eval(lctx, tmp.data(), std::min(tmp.size(), (size_t) params.n_batch), 0, params.n_threads);
+        std::vector<llama_token> tmp = { llama_token_bos(lctx), llama_token_eos(lctx), };
+        llama_decode(lctx, llama_batch_get_one(tmp.data(), std::min(tmp.size(), (size_t) params.n_batch), 0, 0), params.n_threads);
+        llama_kv_cache_tokens_rm(lctx, -1, -1);
         llama_reset_timings(lctx);
     }
 
@@ -812,6 +878,77 @@ std::vector<llama_token> llama_tokenize(
     return result;
 }
 
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+                     struct llama_context * ctx,
+           const std::vector<std::string> & texts,
+                                    bool   add_bos,
+                                     int   n_threads,
+        std::vector<std::vector<int32_t>> * offsets) {
+    const int n_texts = texts.size();
+
+    std::vector<std::vector<llama_token>> result(n_texts);
+    if (offsets) {
+        offsets->assign(n_texts, {});
+    }
+
+    // upper limit for the number of tokens, as in llama_tokenize; the texts for which it is too low are done again
+    std::vector<int> max_tokens(n_texts);
+    for (int i = 0; i < n_texts; ++i) {
+        max_tokens[i] = texts[i].length() + add_bos;
+    }
+
+    std::vector<int> todo(n_texts);
+    std::iota(todo.begin(), todo.end(), 0);
+
+    std::vector<const char *>  text_ptrs;
+    std::vector<int>           text_lens;
+    std::vector<llama_token *> token_ptrs;
+    std::vector<int32_t *>     offset_ptrs;
+    std::vector<int>           n_max_tokens;
+    std::vector<int>           n_tokens;
+
+    while (!todo.empty()) {
+        text_ptrs.clear();
+        text_lens.clear();
+        token_ptrs.clear();
+        offset_ptrs.clear();
+        n_max_tokens.clear();
+
+        for (const int i : todo) {
+            result[i].resize(max_tokens[i]);
+            text_ptrs.push_back(texts[i].data());
+            text_lens.push_back(texts[i].length());
+            token_ptrs.push_back(result[i].data());
+            n_max_tokens.push_back(max_tokens[i]);
+            if (offsets) {
+                (*offsets)[i].resize(max_tokens[i]);
+                offset_ptrs.push_back((*offsets)[i].data());
+            }
+        }
+
+        n_tokens.resize(todo.size());
+        llama_tokenize_batch(ctx, text_ptrs.data(), text_lens.data(), todo.size(), token_ptrs.data(),
+                offsets ? offset_ptrs.data() : nullptr, n_max_tokens.data(), n_tokens.data(), add_bos, n_threads);
+
+        std::vector<int> retry;
+        for (size_t j = 0; j < todo.size(); ++j) {
+            const int i = todo[j];
+            if (n_tokens[j] < 0) {
+                max_tokens[i] = -n_tokens[j];
+                retry.push_back(i);
+            } else {
+                result[i].resize(n_tokens[j]);
+                if (offsets) {
+                    (*offsets)[i].resize(n_tokens[j]);
+                }
+            }
+        }
+        todo = std::move(retry);
+    }
+
+    return result;
+}
+
 std::string llama_token_to_piece(const struct llama_context * ctx, llama_token token) {
     std::vector<char> result(8, 0);
     const int n_tokens = llama_token_to_piece(ctx, token, result.data(), result.size());
@@ -1176,11 +1313,14 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
 
     fprintf(stream, "alias: %s # default: unknown\n", params.model_alias.c_str());
     fprintf(stream, "batch_size: %d # default: 512\n", params.n_batch);
+    fprintf(stream, "cache_type_k: %s # default: f16\n", params.cache_type_k.c_str());
+    fprintf(stream, "cache_type_v: %s # default: f16\n", params.cache_type_v.c_str());
     dump_string_yaml_multiline(stream, "cfg_negative_prompt", params.cfg_negative_prompt.c_str());
     fprintf(stream, "cfg_scale: %f # default: 1.0\n", params.cfg_scale);
     fprintf(stream, "chunks: %d # default: -1 (unlimited)\n", params.n_chunks);
     fprintf(stream, "color: %s # default: false\n", params.use_color ? "true" : "false");
     fprintf(stream, "ctx_size: %d # default: 512\n", params.n_ctx);
+    fprintf(stream, "embd_lines: %s # default: false\n", params.embd_lines ? "true" : "false");
     fprintf(stream, "escape: %s # default: false\n", params.escape ? "true" : "false");
     fprintf(stream, "export: %s # default: false\n", params.export_cgraph ? "true" : "false");
     fprintf(stream, "file: # never logged, see prompt instead. Can still be specified for input.\n");
@@ -1222,10 +1362,13 @@ void dump_non_result_info_yaml(FILE * stream, const gpt_params & params, const l
     fprintf(stream, "mlock: %s # default: false\n", params.use_mlock ? "true" : "false");
     fprintf(stream, "model: %s # default: models/7B/ggml-model.bin\n", params.model.c_str());
     fprintf(stream, "model_draft: %s # default:\n", params.model_draft.c_str());
+    fprintf(stream, "mpi_tensor_parallel: %s # default: false\n", params.mpi_tensor_parallel ? "true" : "false");
     fprintf(stream, "multiline_input: %s # default: false\n", params.multiline_input ? "true" : "false");
     fprintf(stream, "n_gpu_layers: %d # default: -1\n", params.n_gpu_layers);
     fprintf(stream, "n_predict: %d # default: -1 (unlimited)\n", params.n_predict);
     fprintf(stream, "n_probs: %d # only used by server binary, default: 0\n", params.n_probs);
+    fprintf(stream, "no_flash_attn: %s # default: false\n", !params.flash_attn ? "true" : "false");
+    fprintf(stream, "hugepages: %s # default: false\n", params.use_hugepages ? "true" : "false");
     fprintf(stream, "no_mmap: %s # default: false\n", !params.use_mmap ? "true" : "false");
     fprintf(stream, "no_mul_mat_q: %s # default: false\n", !params.mul_mat_q ? "true" : "false");
     fprintf(stream, "no_penalize_nl: %s # default: false\n", !params.penalize_nl ? "true" : "false");
@@ -42,6 +42,7 @@ struct gpt_params {
     int32_t n_batch                         = 512;  // batch size for prompt processing (must be >=32 to use BLAS)
     int32_t n_keep                          = 0;    // number of tokens to keep from initial prompt
     int32_t n_draft                         = 16;   // number of tokens to draft during speculative decoding
+    int32_t n_parallel                      = 1;    // number of parallel sequences to decode
     int32_t n_chunks                        = -1;   // max number of chunks to process (-1 = unlimited)
     int32_t n_gpu_layers                    = -1;   // number of layers to store in VRAM (-1 - use default)
     int32_t n_gpu_layers_draft              = -1;   // number of layers to store in VRAM for the draft model (-1 - use default)
@@ -87,6 +88,9 @@ struct gpt_params {
     std::string lora_adapter = "";  // lora adapter path
     std::string lora_base    = "";  // base model path for the lora adapter
 
+    std::string cache_type_k = "f16"; // KV cache data type for the K: f32, f16, q8_0 or q4_0
+    std::string cache_type_v = "f16"; // KV cache data type for the V: f32, f16, q8_0 or q4_0
+
     int  ppl_stride        = 0;     // stride for perplexity calculations. If left at 0, the pre-existing approach will be used.
     int  ppl_output_type   = 0;     // = 0 -> ppl output is as usual, = 1 -> ppl output is num_tokens, ppl, one per line
                                     //                                       (which is more convenient to use for plotting)
@@ -104,6 +108,7 @@ struct gpt_params {
     bool prompt_cache_ro   = false; // open the prompt cache read-only and do not update it
 
     bool embedding         = false; // get only sentence embedding
+    bool embd_lines        = false; // embedding: every non-empty line of the prompt is a separate document
     bool escape            = false; // escape "\n", "\r", "\t", "\'", "\"", and "\\"
     bool interactive_first = false; // wait for user input immediately
     bool multiline_input   = false; // reverse the usage of `\`
@@ -116,6 +121,9 @@ struct gpt_params {
     bool perplexity        = false; // compute perplexity over the prompt
     bool use_mmap          = true;  // use mmap for faster loads
     bool use_mlock         = false; // use mlock to keep model in memory
+    bool flash_attn        = true;  // use the fused attention op on the CPU
+    bool use_hugepages     = false; // back the weights, KV cache and compute buffers with huge pages
+    bool mpi_tensor_parallel = false; // split every layer across the MPI nodes instead of giving each a range of layers
     bool numa              = false; // attempt optimizations that help on some NUMA systems
     bool export_cgraph     = false; // export the computation graph
     bool verbose_prompt    = false; // print prompt tokens before generation
@@ -127,6 +135,9 @@ void gpt_print_usage(int argc, char ** argv, const gpt_params & params);
 
 std::string gpt_random_prompt(std::mt19937 & rng);
 
+// returns GGML_TYPE_COUNT for a name that is not a supported KV cache type
+ggml_type kv_cache_type_from_str(const std::string & s);
+
 //
 // Model utils
 //
@@ -145,6 +156,15 @@ std::vector<llama_token> llama_tokenize(
            const std::string & text,
                         bool   add_bos);
 
+// tokenizes many strings at once, on n_threads threads
+// if offsets is not NULL, it receives for every token the byte offset in its string at which the token starts
+std::vector<std::vector<llama_token>> llama_tokenize_batch(
+                     struct llama_context * ctx,
+           const std::vector<std::string> & texts,
+                                    bool   add_bos,
+                                     int   n_threads,
+        std::vector<std::vector<int32_t>> * offsets = nullptr);
+
 // tokenizes a token into a piece
 // should work similar to Python's `tokenizer.id_to_piece`
 std::string llama_token_to_piece(
@@ -2,6 +2,7 @@
 #include "llama.h"
 
 #include <ctime>
+#include <sstream>
 
 #if defined(_MSC_VER)
 #pragma warning(disable: 4244 4267) // possible loss of data
@@ -54,44 +55,66 @@ int main(int argc, char ** argv) {
                 params.n_threads, std::thread::hardware_concurrency(), llama_print_system_info());
     }
 
-    int n_past = 0;
-
-    // tokenize the prompt
-    auto embd_inp = ::llama_tokenize(ctx, params.prompt, true);
-
-    if (params.verbose_prompt) {
-        fprintf(stderr, "\n");
-        fprintf(stderr, "%s: prompt: '%s'\n", __func__, params.prompt.c_str());
-        fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
-        for (int i = 0; i < (int) embd_inp.size(); i++) {
-            fprintf(stderr, "%6d -> '%s'\n", embd_inp[i], llama_token_to_piece(ctx, embd_inp[i]).c_str());
+    // with --embd-lines, every non-empty line of the prompt is a separate document, with its own embedding
+    std::vector<std::string> prompts;
+    if (!params.embd_lines) {
+        prompts.push_back(params.prompt);
+    } else {
+        std::istringstream strstream(params.prompt);
+        std::string line;
+        while (std::getline(strstream, line)) {
+            if (!line.empty()) {
+                prompts.push_back(line);
+            }
         }
-        fprintf(stderr, "\n");
     }
 
-    if (embd_inp.size() > (size_t)params.n_ctx) {
-        fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
-                __func__, embd_inp.size(), params.n_ctx);
-        return 1;
-    }
+    // tokenize the prompts
+    std::vector<std::vector<llama_token>> inputs = ::llama_tokenize_batch(ctx, prompts, true, params.n_threads);
+
+    for (size_t i = 0; i < prompts.size(); i++) {
+        auto & embd_inp = inputs[i];
 
-    while (!embd_inp.empty()) {
-        int n_tokens = std::min(params.n_batch, (int) embd_inp.size());
-        if (llama_eval(ctx, embd_inp.data(), n_tokens, n_past, params.n_threads)) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
+        if (params.verbose_prompt) {
+            fprintf(stderr, "\n");
+            fprintf(stderr, "%s: prompt: '%s'\n", __func__, prompts[i].c_str());
+            fprintf(stderr, "%s: number of tokens in prompt = %zu\n", __func__, embd_inp.size());
+            for (int j = 0; j < (int) embd_inp.size(); j++) {
+                fprintf(stderr, "%6d -> '%s'\n", embd_inp[j], llama_token_to_piece(ctx, embd_inp[j]).c_str());
+            }
+            fprintf(stderr, "\n");
+        }
+
+        if (embd_inp.size() > (size_t)params.n_ctx) {
+            fprintf(stderr, "%s: error: prompt is longer than the context window (%zu tokens, n_ctx = %d)\n",
+                    __func__, embd_inp.size(), params.n_ctx);
             return 1;
         }
-        n_past += n_tokens;
-        embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_tokens);
     }
 
-    const int n_embd = llama_n_embd(ctx);
-    const auto embeddings = llama_get_embeddings(ctx);
+    for (auto & embd_inp : inputs) {
+        int n_past = 0;
 
-    for (int i = 0; i < n_embd; i++) {
-        printf("%f ", embeddings[i]);
+        llama_kv_cache_tokens_rm(ctx, -1, -1);
+
+        while (!embd_inp.empty()) {
+            int n_tokens = std::min(params.n_batch, (int) embd_inp.size());
+            if (llama_decode(ctx, llama_batch_get_one(embd_inp.data(), n_tokens, n_past, 0), params.n_threads)) {
+                fprintf(stderr, "%s : failed to eval\n", __func__);
+                return 1;
+            }
+            n_past += n_tokens;
+            embd_inp.erase(embd_inp.begin(), embd_inp.begin() + n_tokens);
+        }
+
+        const int n_embd = llama_n_embd(ctx);
+        const auto embeddings = llama_get_embeddings(ctx);
+
+        for (int i = 0; i < n_embd; i++) {
+            printf("%f ", embeddings[i]);
+        }
+        printf("\n");
     }
-    printf("\n");
 
     llama_print_timings(ctx);
     llama_free(ctx);
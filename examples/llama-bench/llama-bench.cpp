@@ -40,6 +40,13 @@ static std::string join(const std::vector<T> & values, const std::string & delim
     return str.str();
 }
 
+template<typename T, typename F>
+static std::vector<std::string> transform_to_str(const std::vector<T> & values, F f) {
+    std::vector<std::string> str_values;
+    std::transform(values.begin(), values.end(), std::back_inserter(str_values), f);
+    return str_values;
+}
+
 template<class T>
 static std::vector<T> split(const std::string & str, char delim) {
     std::vector<T> values;
@@ -128,11 +135,16 @@ struct cmd_params {
     std::vector<int> n_gen;
     std::vector<int> n_batch;
     std::vector<bool> f32_kv;
+    std::vector<ggml_type> type_k;
+    std::vector<ggml_type> type_v;
     std::vector<int> n_threads;
+    std::vector<int> n_spin;
     std::vector<int> n_gpu_layers;
     std::vector<int> main_gpu;
     std::vector<bool> mul_mat_q;
     std::vector<bool> low_vram;
+    std::vector<bool> flash_attn;
+    std::vector<bool> hugepages;
     std::vector<std::array<float, LLAMA_MAX_DEVICES>> tensor_split;
     int reps;
     bool verbose;
@@ -145,11 +157,16 @@ static const cmd_params cmd_params_defaults = {
     /* n_gen         */ {128},
     /* n_batch       */ {512},
     /* f32_kv        */ {false},
+    /* type_k        */ {GGML_TYPE_F16},
+    /* type_v        */ {GGML_TYPE_F16},
     /* n_threads     */ {get_num_physical_cores()},
+    /* n_spin        */ {GGML_DEFAULT_N_SPIN},
     /* n_gpu_layers  */ {99},
     /* main_gpu      */ {0},
     /* mul_mat_q     */ {true},
     /* low_vram      */ {false},
+    /* flash_attn    */ {true},
+    /* hugepages     */ {false},
     /* tensor_split  */ {{}},
     /* reps          */ 5,
     /* verbose       */ false,
@@ -166,11 +183,16 @@ static void print_usage(int /* argc */, char ** argv) {
     printf("  -n, --n-gen <n>                   (default: %s)\n", join(cmd_params_defaults.n_gen, ",").c_str());
     printf("  -b, --batch-size <n>              (default: %s)\n", join(cmd_params_defaults.n_batch, ",").c_str());
     printf("  --memory-f32 <0|1>                (default: %s)\n", join(cmd_params_defaults.f32_kv, ",").c_str());
+    printf("  -ctk, --cache-type-k <t>          (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_k, ggml_type_name), ",").c_str());
+    printf("  -ctv, --cache-type-v <t>          (default: %s)\n", join(transform_to_str(cmd_params_defaults.type_v, ggml_type_name), ",").c_str());
     printf("  -t, --threads <n>                 (default: %s)\n", join(cmd_params_defaults.n_threads, ",").c_str());
+    printf("  -spin, --spin-count <n>           (default: %s)\n", join(cmd_params_defaults.n_spin, ",").c_str());
     printf("  -ngl N, --n-gpu-layers <n>        (default: %s)\n", join(cmd_params_defaults.n_gpu_layers, ",").c_str());
     printf("  -mg i, --main-gpu <n>             (default: %s)\n", join(cmd_params_defaults.main_gpu, ",").c_str());
     printf("  -lv, --low-vram <0|1>             (default: %s)\n", join(cmd_params_defaults.low_vram, ",").c_str());
     printf("  -mmq, --mul-mat-q <0|1>           (default: %s)\n", join(cmd_params_defaults.mul_mat_q, ",").c_str());
+    printf("  -fa, --flash-attn <0|1>           (default: %s)\n", join(cmd_params_defaults.flash_attn, ",").c_str());
+    printf("  -hp, --hugepages <0|1>            (default: %s)\n", join(cmd_params_defaults.hugepages, ",").c_str());
     printf("  -ts, --tensor_split <ts0/ts1/..>               \n");
     printf("  -r, --repetitions <n>             (default: %d)\n", cmd_params_defaults.reps);
     printf("  -o, --output <csv|json|md|sql>    (default: %s)\n", cmd_params_defaults.output_format == CSV ? "csv" : cmd_params_defaults.output_format == JSON ? "json" : cmd_params_defaults.output_format == MARKDOWN ? "md" : "sql");
@@ -235,6 +257,23 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = split<int>(argv[i], split_delim);
             params.f32_kv.insert(params.f32_kv.end(), p.begin(), p.end());
+        } else if (arg == "-ctk" || arg == "--cache-type-k" || arg == "-ctv" || arg == "--cache-type-v") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto & types = arg == "-ctk" || arg == "--cache-type-k" ? params.type_k : params.type_v;
+            for (const auto & name : split<std::string>(argv[i], split_delim)) {
+                ggml_type type = kv_cache_type_from_str(name);
+                if (type == GGML_TYPE_COUNT) {
+                    invalid_param = true;
+                    break;
+                }
+                types.push_back(type);
+            }
+            if (invalid_param) {
+                break;
+            }
         } else if (arg == "-t" || arg == "--threads") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -242,6 +281,13 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = split<int>(argv[i], split_delim);
             params.n_threads.insert(params.n_threads.end(), p.begin(), p.end());
+        } else if (arg == "-spin" || arg == "--spin-count") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<int>(argv[i], split_delim);
+            params.n_spin.insert(params.n_spin.end(), p.begin(), p.end());
         } else if (arg == "-ngl" || arg == "--n-gpu-layers") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -269,6 +315,20 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
             }
             auto p = split<bool>(argv[i], split_delim);
             params.mul_mat_q.insert(params.mul_mat_q.end(), p.begin(), p.end());
+        } else if (arg == "-fa" || arg == "--flash-attn") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<bool>(argv[i], split_delim);
+            params.flash_attn.insert(params.flash_attn.end(), p.begin(), p.end());
+        } else if (arg == "-hp" || arg == "--hugepages") {
+            if (++i >= argc) {
+                invalid_param = true;
+                break;
+            }
+            auto p = split<bool>(argv[i], split_delim);
+            params.hugepages.insert(params.hugepages.end(), p.begin(), p.end());
         } else if (arg == "-ts" || arg == "--tensor-split") {
             if (++i >= argc) {
                 invalid_param = true;
@@ -333,12 +393,17 @@ static cmd_params parse_cmd_params(int argc, char ** argv) {
     if (params.n_gen.empty())        { params.n_gen = cmd_params_defaults.n_gen; }
     if (params.n_batch.empty())      { params.n_batch = cmd_params_defaults.n_batch; }
     if (params.f32_kv.empty())       { params.f32_kv = cmd_params_defaults.f32_kv; }
+    if (params.type_k.empty())       { params.type_k = cmd_params_defaults.type_k; }
+    if (params.type_v.empty())       { params.type_v = cmd_params_defaults.type_v; }
     if (params.n_gpu_layers.empty()) { params.n_gpu_layers = cmd_params_defaults.n_gpu_layers; }
     if (params.main_gpu.empty())     { params.main_gpu = cmd_params_defaults.main_gpu; }
     if (params.mul_mat_q.empty())    { params.mul_mat_q = cmd_params_defaults.mul_mat_q; }
     if (params.low_vram.empty())     { params.low_vram = cmd_params_defaults.low_vram; }
+    if (params.flash_attn.empty())   { params.flash_attn = cmd_params_defaults.flash_attn; }
+    if (params.hugepages.empty())    { params.hugepages = cmd_params_defaults.hugepages; }
     if (params.tensor_split.empty()) { params.tensor_split = cmd_params_defaults.tensor_split; }
     if (params.n_threads.empty())    { params.n_threads = cmd_params_defaults.n_threads; }
+    if (params.n_spin.empty())       { params.n_spin = cmd_params_defaults.n_spin; }
 
     return params;
 }
@@ -349,11 +414,16 @@ struct cmd_params_instance {
     int n_gen;
     int n_batch;
     bool f32_kv;
+    ggml_type type_k;
+    ggml_type type_v;
     int n_threads;
+    int n_spin;
     int n_gpu_layers;
     int main_gpu;
     bool mul_mat_q;
     bool low_vram;
+    bool flash_attn;
+    bool hugepages;
     std::array<float, LLAMA_MAX_DEVICES> tensor_split;
 
     llama_context_params to_llama_params() const {
@@ -361,10 +431,15 @@ struct cmd_params_instance {
         lparams.n_ctx = n_prompt + n_gen;
         lparams.n_batch = n_batch;
         lparams.f16_kv = !f32_kv;
+        lparams.type_k = type_k;
+        lparams.type_v = type_v;
         lparams.n_gpu_layers = n_gpu_layers;
         lparams.main_gpu = main_gpu;
+        lparams.n_spin = n_spin;
         lparams.mul_mat_q = mul_mat_q;
         lparams.low_vram = low_vram;
+        lparams.flash_attn = flash_attn;
+        lparams.use_hugepages = hugepages;
         lparams.tensor_split = tensor_split.data();
 
         return lparams;
@@ -377,23 +452,33 @@ static std::vector<cmd_params_instance> get_cmd_params_instances_int(const cmd_p
     for (const auto & m : params.model)
     for (const auto & nb : params.n_batch)
     for (const auto & fk : params.f32_kv)
+    for (const auto & tk : params.type_k)
+    for (const auto & tv : params.type_v)
     for (const auto & nl : params.n_gpu_layers)
     for (const auto & mg : params.main_gpu)
     for (const auto & mmq : params.mul_mat_q)
     for (const auto & lv : params.low_vram)
+    for (const auto & fa : params.flash_attn)
+    for (const auto & hp : params.hugepages)
     for (const auto & ts : params.tensor_split)
-    for (const auto & nt : params.n_threads) {
+    for (const auto & nt : params.n_threads)
+    for (const auto & ns : params.n_spin) {
         cmd_params_instance instance = {
             /* .model        = */ m,
             /* .n_prompt     = */ n_prompt,
             /* .n_gen        = */ n_gen,
             /* .n_batch      = */ nb,
             /* .f32_kv       = */ fk,
+            /* .type_k       = */ tk,
+            /* .type_v       = */ tv,
             /* .n_threads    = */ nt,
+            /* .n_spin       = */ ns,
             /* .n_gpu_layers = */ nl,
             /* .main_gpu     = */ mg,
             /* .mul_mat_q    = */ mmq,
             /* .low_vram     = */ lv,
+            /* .flash_attn   = */ fa,
+            /* .hugepages    = */ hp,
             /* .tensor_split = */ ts,
         };
         instances.push_back(instance);
@@ -439,16 +524,22 @@ struct test {
     uint64_t model_n_params;
     int n_batch;
     int n_threads;
+    int n_spin;
     bool f32_kv;
+    ggml_type type_k;
+    ggml_type type_v;
     int n_gpu_layers;
     int main_gpu;
     bool mul_mat_q;
     bool low_vram;
+    bool flash_attn;
+    bool hugepages;
     std::array<float, LLAMA_MAX_DEVICES> tensor_split;
     int n_prompt;
     int n_gen;
     std::string test_time;
     std::vector<uint64_t> samples_ns;
+    std::vector<uint64_t> samples_cpu_ns;
 
     test(const cmd_params_instance & inst, const llama_model * lmodel, const llama_context * ctx) {
         model_filename = inst.model;
@@ -459,11 +550,16 @@ struct test {
         model_n_params = llama_model_n_params(lmodel);
         n_batch = inst.n_batch;
         n_threads = inst.n_threads;
+        n_spin = inst.n_spin;
         f32_kv = inst.f32_kv;
+        type_k = inst.type_k;
+        type_v = inst.type_v;
         n_gpu_layers = inst.n_gpu_layers;
         main_gpu = inst.main_gpu;
         mul_mat_q = inst.mul_mat_q;
         low_vram = inst.low_vram;
+        flash_attn = inst.flash_attn;
+        hugepages = inst.hugepages;
         tensor_split = inst.tensor_split;
         n_prompt = inst.n_prompt;
         n_gen = inst.n_gen;
@@ -498,6 +594,13 @@ struct test {
         return ::stdev(get_ts());
     }
 
+    // process CPU time over wall time, 1.0 per fully busy core
+    double cpu_util() const {
+        uint64_t wall = std::accumulate(samples_ns.begin(), samples_ns.end(), (uint64_t) 0);
+        uint64_t cpu  = std::accumulate(samples_cpu_ns.begin(), samples_cpu_ns.end(), (uint64_t) 0);
+        return wall > 0 ? (double) cpu / wall : 0.0;
+    }
+
     static std::string get_backend() {
         if (cuda) {
             return GGML_CUDA_NAME;
@@ -523,11 +626,11 @@ struct test {
             "cuda", "opencl", "metal", "gpu_blas", "blas",
             "cpu_info", "gpu_info",
             "model_filename", "model_type", "model_size", "model_n_params",
-            "n_batch", "n_threads", "f16_kv",
-            "n_gpu_layers", "main_gpu", "mul_mat_q", "low_vram", "tensor_split",
+            "n_batch", "n_threads", "n_spin", "f16_kv", "type_k", "type_v",
+            "n_gpu_layers", "main_gpu", "mul_mat_q", "low_vram", "flash_attn", "hugepages", "tensor_split",
             "n_prompt", "n_gen", "test_time",
             "avg_ns", "stddev_ns",
-            "avg_ts", "stddev_ts"
+            "avg_ts", "stddev_ts", "cpu_util"
         };
         return fields;
     }
@@ -535,7 +638,7 @@ struct test {
     enum field_type {STRING, BOOL, INT, FLOAT};
 
     static field_type get_field_type(const std::string & field) {
-        if (field == "build_number" || field == "n_batch" || field == "n_threads" ||
+        if (field == "build_number" || field == "n_batch" || field == "n_threads" || field == "n_spin" ||
             field == "model_size" || field == "model_n_params" ||
             field == "n_gpu_layers" || field == "main_gpu" ||
             field == "n_prompt" || field == "n_gen" ||
@@ -543,10 +646,11 @@ struct test {
             return INT;
         }
         if (field == "cuda" || field == "opencl" || field == "metal" || field == "gpu_blas" || field == "blas" ||
-            field == "f16_kv" || field == "mul_mat_q" || field == "low_vram") {
+            field == "f16_kv" || field == "mul_mat_q" || field == "low_vram" || field == "flash_attn" ||
+            field == "hugepages") {
             return BOOL;
         }
-        if (field == "avg_ts" || field == "stddev_ts") {
+        if (field == "avg_ts" || field == "stddev_ts" || field == "cpu_util") {
             return FLOAT;
         }
         return STRING;
@@ -573,11 +677,11 @@ struct test {
             std::to_string(cuda), std::to_string(opencl), std::to_string(metal), std::to_string(gpu_blas), std::to_string(blas),
             cpu_info, gpu_info,
             model_filename, model_type, std::to_string(model_size), std::to_string(model_n_params),
-            std::to_string(n_batch), std::to_string(n_threads), std::to_string(!f32_kv),
-            std::to_string(n_gpu_layers), std::to_string(main_gpu), std::to_string(mul_mat_q), std::to_string(low_vram), tensor_split_str,
+            std::to_string(n_batch), std::to_string(n_threads), std::to_string(n_spin), std::to_string(!f32_kv), ggml_type_name(type_k), ggml_type_name(type_v),
+            std::to_string(n_gpu_layers), std::to_string(main_gpu), std::to_string(mul_mat_q), std::to_string(low_vram), std::to_string(flash_attn), std::to_string(hugepages), tensor_split_str,
             std::to_string(n_prompt), std::to_string(n_gen), test_time,
             std::to_string(avg_ns()), std::to_string(stdev_ns()),
-            std::to_string(avg_ts()), std::to_string(stdev_ts())
+            std::to_string(avg_ts()), std::to_string(stdev_ts()), std::to_string(cpu_util())
         };
         return values;
     }
@@ -735,9 +839,18 @@ struct markdown_printer : public printer {
         if (field == "mul_mat_q") {
             return "mmq";
         }
+        if (field == "n_spin") {
+            return "spin";
+        }
         if (field == "tensor_split") {
             return "ts";
         }
+        if (field == "flash_attn") {
+            return "fa";
+        }
+        if (field == "hugepages") {
+            return "hp";
+        }
         return field;
     }
 
@@ -754,12 +867,22 @@ struct markdown_printer : public printer {
         if (params.n_threads.size() > 1 || params.n_threads != cmd_params_defaults.n_threads || is_cpu_backend) {
             fields.push_back("n_threads");
         }
+        const bool show_spin = params.n_spin.size() > 1 || params.n_spin != cmd_params_defaults.n_spin;
+        if (show_spin) {
+            fields.push_back("n_spin");
+        }
         if (params.n_batch.size() > 1 || params.n_batch != cmd_params_defaults.n_batch) {
             fields.push_back("n_batch");
         }
         if (params.f32_kv.size() > 1 || params.f32_kv != cmd_params_defaults.f32_kv) {
             fields.push_back("f16_kv");
         }
+        if (params.type_k.size() > 1 || params.type_k != cmd_params_defaults.type_k) {
+            fields.push_back("type_k");
+        }
+        if (params.type_v.size() > 1 || params.type_v != cmd_params_defaults.type_v) {
+            fields.push_back("type_v");
+        }
         if (params.main_gpu.size() > 1 || params.main_gpu != cmd_params_defaults.main_gpu) {
             fields.push_back("main_gpu");
         }
@@ -769,11 +892,20 @@ struct markdown_printer : public printer {
         if (params.low_vram.size() > 1 || params.low_vram != cmd_params_defaults.low_vram) {
             fields.push_back("low_vram");
         }
+        if (params.flash_attn.size() > 1 || params.flash_attn != cmd_params_defaults.flash_attn) {
+            fields.push_back("flash_attn");
+        }
+        if (params.hugepages.size() > 1 || params.hugepages != cmd_params_defaults.hugepages) {
+            fields.push_back("hugepages");
+        }
         if (params.tensor_split.size() > 1 || params.tensor_split != cmd_params_defaults.tensor_split) {
             fields.push_back("tensor_split");
         }
         fields.push_back("test");
         fields.push_back("t/s");
+        if (show_spin) {
+            fields.push_back("cpu_util");
+        }
 
         fprintf(fout, "|");
         for (const auto & field : fields) {
@@ -826,6 +958,9 @@ struct markdown_printer : public printer {
             } else if (field == "t/s") {
                 snprintf(buf, sizeof(buf), "%.2f ± %.2f", t.avg_ts(), t.stdev_ts());
                 value = buf;
+            } else if (field == "cpu_util") {
+                snprintf(buf, sizeof(buf), "%.2f", t.cpu_util());
+                value = buf;
             } else if (vmap.find(field) != vmap.end()) {
                 value = vmap.at(field);
             } else {
@@ -891,7 +1026,7 @@ static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_bat
     int n_processed = 0;
     while (n_processed < n_prompt) {
         int n_tokens = std::min(n_prompt - n_processed, n_batch);
-        llama_eval(ctx, tokens.data(), n_tokens, n_past + n_processed, n_threads);
+        llama_decode(ctx, llama_batch_get_one(tokens.data(), n_tokens, n_past + n_processed, 0), n_threads);
         n_processed += n_tokens;
     }
 }
@@ -899,7 +1034,7 @@ static void test_prompt(llama_context * ctx, int n_prompt, int n_past, int n_bat
 static void test_gen(llama_context * ctx, int n_gen, int n_past, int n_threads) {
     llama_token token = llama_token_bos(ctx);
     for (int i = 0; i < n_gen; i++) {
-        llama_eval(ctx, &token, 1, n_past + i, n_threads);
+        llama_decode(ctx, llama_batch_get_one(&token, 1, n_past + i, 0), n_threads);
     }
 }
 
@@ -986,7 +1121,10 @@ int main(int argc, char ** argv) {
         }
 
         for (int i = 0; i < params.reps; i++) {
+            llama_kv_cache_tokens_rm(ctx, -1, -1);
+
             uint64_t t_start = get_time_ns();
+            std::clock_t c_start = std::clock();
             if (t.n_prompt > 0) {
                 test_prompt(ctx, t.n_prompt, 0, t.n_batch, t.n_threads);
             }
@@ -995,6 +1133,7 @@ int main(int argc, char ** argv) {
             }
             uint64_t t_ns = get_time_ns() - t_start;
             t.samples_ns.push_back(t_ns);
+            t.samples_cpu_ns.push_back((uint64_t) (1e9 * (std::clock() - c_start) / CLOCKS_PER_SEC));
         }
 
         p->print_test(t);
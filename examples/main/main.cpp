@@ -318,6 +318,9 @@ int main(int argc, char ** argv) {
         session_tokens.resize(embd_inp.size() - 1);
     }
 
+    // remove any "future" tokens that we might have inherited from the previous session
+    llama_kv_cache_tokens_rm(ctx, std::min(n_matching_session_tokens, session_tokens.size()), -1);
+
     // number of tokens to keep when resetting context
     if (params.n_keep < 0 || params.n_keep > (int) embd_inp.size() || params.instruct) {
         params.n_keep = (int)embd_inp.size();
@@ -517,6 +520,12 @@ int main(int argc, char ** argv) {
 
                 LOG("after swap: n_past = %d, n_past_guidance = %d\n", n_past, n_past_guidance);
 
+                // drop the discarded tail from the KV cache so that it can be recomputed in place
+                llama_kv_cache_tokens_rm(ctx, n_past, -1);
+                if (ctx_guidance) {
+                    llama_kv_cache_tokens_rm(ctx_guidance, n_past_guidance, -1);
+                }
+
                 // insert n_left/2 tokens at the start of embd from last_tokens
                 embd.insert(embd.begin(), last_tokens.begin() + n_ctx - n_left/2 - embd.size(), last_tokens.end() - embd.size());
 
@@ -580,7 +589,7 @@ int main(int argc, char ** argv) {
 
                 for (int i = 0; i < input_size; i += params.n_batch) {
                     int n_eval = std::min(input_size - i, params.n_batch);
-                    if (llama_eval(ctx_guidance, input_buf + i, n_eval, n_past_guidance, params.n_threads)) {
+                    if (llama_decode(ctx_guidance, llama_batch_get_one(input_buf + i, n_eval, n_past_guidance, 0), params.n_threads)) {
                         LOG_TEE("%s : failed to eval\n", __func__);
                         return 1;
                     }
@@ -597,7 +606,7 @@ int main(int argc, char ** argv) {
 
                 LOG("eval: %s\n", LOG_TOKENS_TOSTR_PRETTY(ctx, embd));
 
-                if (llama_eval(ctx, &embd[i], n_eval, n_past, params.n_threads)) {
+                if (llama_decode(ctx, llama_batch_get_one(&embd[i], n_eval, n_past, 0), params.n_threads)) {
                     LOG_TEE("%s : failed to eval\n", __func__);
                     return 1;
                 }
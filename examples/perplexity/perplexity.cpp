@@ -194,12 +194,15 @@ static results_perplexity perplexity_v2(llama_context * ctx, const gpt_params &
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
+        // clear the KV cache
+        llama_kv_cache_tokens_rm(ctx, -1, -1);
+
         for (int j = 0; j < num_batches; ++j) {
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
             //fprintf(stderr, "    Batch %d: starts at %d, size is %d, n_past is %d\n",j,batch_start,batch_size,j * n_batch);
-            if (llama_eval(ctx, tokens.data() + batch_start, batch_size, j * n_batch, params.n_threads)) {
+            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + batch_start, batch_size, j * n_batch, 0), params.n_threads)) {
                 //fprintf(stderr, "%s : failed to eval\n", __func__);
                 return {tokens, -1, logit_history, prob_history};
             }
@@ -309,6 +312,11 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 
     std::vector<std::thread> workers(std::thread::hardware_concurrency() - 1);
 
+    // only the logits of the last half of each window are scored (see below)
+    const int first = params.n_ctx/2;
+
+    llama_batch batch = llama_batch_init(n_batch, 0);
+
     for (int i = 0; i < n_chunk; ++i) {
         const int start =     i * params.n_ctx;
         const int end   = start + params.n_ctx;
@@ -316,31 +324,44 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         const int num_batches = (params.n_ctx + n_batch - 1) / n_batch;
 
         std::vector<float> logits;
+        logits.reserve((size_t)(params.n_ctx - 1 - first) * n_vocab);
 
         const auto t_start = std::chrono::high_resolution_clock::now();
 
+        // clear the KV cache
+        llama_kv_cache_tokens_rm(ctx, -1, -1);
+
         for (int j = 0; j < num_batches; ++j) {
             const int batch_start = start + j * n_batch;
             const int batch_size  = std::min(end - batch_start, n_batch);
 
-            // save original token and restore it after eval
-            const auto token_org = tokens[batch_start];
+            batch.n_tokens = batch_size;
+            for (int k = 0; k < batch_size; ++k) {
+                const int pos = j*n_batch + k;
+
+                batch.token[k]  = tokens[batch_start + k];
+                batch.pos[k]    = pos;
+                batch.seq_id[k] = 0;
+                batch.logits[k] = pos >= first && pos < params.n_ctx - 1;
+            }
 
             // add BOS token for the first batch of each chunk
             if (add_bos && j == 0) {
-                tokens[batch_start] = llama_token_bos(ctx);
+                batch.token[0] = llama_token_bos(ctx);
             }
 
-            if (llama_eval(ctx, tokens.data() + batch_start, batch_size, j * n_batch, params.n_threads)) {
+            if (llama_decode(ctx, batch, params.n_threads)) {
                 fprintf(stderr, "%s : failed to eval\n", __func__);
+                llama_batch_free(batch);
                 return {tokens, -1, logit_history, prob_history};
             }
 
-            // restore the original token in case it was set to BOS
-            tokens[batch_start] = token_org;
-
-            const auto batch_logits = llama_get_logits(ctx);
-            logits.insert(logits.end(), batch_logits, batch_logits + batch_size * n_vocab);
+            for (int k = 0; k < batch_size; ++k) {
+                if (batch.logits[k]) {
+                    const float * row = llama_get_logits_ith(ctx, k);
+                    logits.insert(logits.end(), row, row + n_vocab);
+                }
+            }
         }
 
         const auto t_end = std::chrono::high_resolution_clock::now();
@@ -356,9 +377,9 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
             fprintf(stderr, "%.2f minutes\n", total_seconds / 60.0);
         }
 
-        // We get the logits for all the tokens in the context window (params.n_ctx)
-        // from llama_eval above.  Now, based on https://huggingface.co/docs/transformers/perplexity,
-        // calculate the perplexity over the last half of the window (so the model always has
+        // We request the logits for the last half of the context window (params.n_ctx)
+        // from llama_decode above.  Based on https://huggingface.co/docs/transformers/perplexity,
+        // we calculate the perplexity over the last half of the window (so the model always has
         // some context to predict the token).
         //
         // We rely on the fact that attention in the forward pass only looks at previous
@@ -368,8 +389,7 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
         // Example, we have a context window of 512, we will compute perplexity for each of the
         // last 256 tokens.  Then, we split the input up into context window size chunks to
         // process the entire prompt.
-        const int first = params.n_ctx/2;
-        process_logits(n_vocab, logits.data() + first*n_vocab, tokens.data() + start + first, params.n_ctx - 1 - first,
+        process_logits(n_vocab, logits.data(), tokens.data() + start + first, params.n_ctx - 1 - first,
                        workers, nll, nll2, logit_history.data() + start + first, prob_history.data() + start + first);
         count += params.n_ctx - first - 1;
 
@@ -386,6 +406,8 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
     }
     printf("\n");
 
+    llama_batch_free(batch);
+
     nll2 /= count;
     nll /= count;
     const double ppl = exp(nll);
@@ -401,15 +423,19 @@ static results_perplexity perplexity(llama_context * ctx, const gpt_params & par
 }
 
 static std::vector<float> hellaswag_evaluate_tokens(
-    llama_context * ctx, const std::vector<int>& tokens, int n_past, int n_batch, int n_vocab, int n_thread
+    llama_context * ctx, std::vector<int> & tokens, int n_past, int n_batch, int n_vocab, int n_thread
 ) {
     std::vector<float> result;
     result.reserve(tokens.size() * n_vocab);
+
+    // discard anything cached past n_past from the previous evaluation
+    llama_kv_cache_tokens_rm(ctx, n_past, -1);
+
     size_t n_chunk = (tokens.size() + n_batch - 1)/n_batch;
     for (size_t i_chunk = 0; i_chunk < n_chunk; ++i_chunk) {
         size_t n_tokens = tokens.size() - i_chunk * n_batch;
         n_tokens = std::min(n_tokens, size_t(n_batch));
-        if (llama_eval(ctx, tokens.data() + i_chunk * n_batch, n_tokens, n_past, n_thread)) {
+        if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i_chunk * n_batch, n_tokens, n_past, 0), n_thread)) {
             fprintf(stderr, "%s : failed to eval\n", __func__);
             return {};
         }
@@ -513,17 +539,29 @@ static void hellaswag_score(llama_context * ctx, const gpt_params & params) {
     double acc = 0.0f;
     const int n_vocab = llama_n_vocab(ctx);
 
+    // tokenize the contexts and the context + ending queries of all the tasks up front, on all threads
+    std::vector<std::string> hs_texts;
+    hs_texts.reserve(hs_task_count*5);
+    for (size_t task_idx = 0; task_idx < hs_task_count; task_idx++) {
+        hs_texts.push_back(hs_data[task_idx].context);
+        for (int i = 0; i < 4; ++i) {
+            hs_texts.push_back(hs_data[task_idx].context + " " + hs_data[task_idx].ending[i]);
+        }
+    }
+
+    std::vector<std::vector<int>> hs_tokens = ::llama_tokenize_batch(ctx, hs_texts, add_bos, params.n_threads);
+
     std::vector<std::vector<int>> ending_tokens(4);
 
     std::vector<float> tok_logits(n_vocab);
 
     for (size_t task_idx = 0; task_idx < hs_task_count; task_idx++) {
         // Tokenize the context to count tokens
-        std::vector<int> context_embd = ::llama_tokenize(ctx, hs_data[task_idx].context, add_bos);
+        std::vector<int> context_embd = std::move(hs_tokens[task_idx*5]);
         size_t context_size = context_embd.size();
 
         for (int i = 0; i < 4; ++i) {
-            ending_tokens[i] = ::llama_tokenize(ctx, hs_data[task_idx].context + " " + hs_data[task_idx].ending[i], add_bos);
+            ending_tokens[i] = std::move(hs_tokens[task_idx*5 + 1 + i]);
             for (int k = 0; k < int(context_size); ++k) {
                 if (ending_tokens[i][k] != context_embd[k]) {
                     fprintf(stderr, "Oops: ending %d of task %d differs from context at position %d\n",i,int(task_idx),k);
@@ -18,6 +18,11 @@
 #include "json-schema-to-grammar.mjs.hpp"
 
 #include <cstddef>
+#include <atomic>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
 #ifndef SERVER_VERBOSE
 #define SERVER_VERBOSE 1
@@ -33,6 +38,7 @@ struct server_params
     int32_t port = 8080;
     int32_t read_timeout = 600;
     int32_t write_timeout = 600;
+    std::string system_prompt;
 };
 
 // completion token output with probabilities
@@ -181,8 +187,28 @@ static bool server_verbose = false;
 #define LOG_WARNING(MSG, ...) server_log("WARNING", __func__, __LINE__, MSG, __VA_ARGS__)
 #define LOG_INFO(MSG, ...) server_log("INFO", __func__, __LINE__, MSG, __VA_ARGS__)
 
-struct llama_server_context
+// state of a client slot
+enum slot_state
+{
+    SLOT_IDLE,       // free, can be assigned to a new request
+    SLOT_PROCESSING, // assigned to a request
+};
+
+// a client slot holds the generation state of one request
+// each slot owns the sequence with id == slot.id in the KV cache of the shared context
+struct llama_client_slot
 {
+    int id = 0;
+    slot_state state = SLOT_IDLE;
+
+    // context budget of the slot (n_ctx / n_parallel)
+    int32_t n_ctx = 0;
+
+    // set by the request thread when it needs the next token,
+    // cleared by the scheduler once the token has been sampled
+    bool waiting_token = false;
+    completion_token_output next_result;
+
     bool stream = false;
     bool has_next_token = false;
     std::string generated_text;
@@ -197,7 +223,9 @@ struct llama_server_context
     std::vector<llama_token> embd;
     std::vector<llama_token> last_n_tokens;
 
-    llama_model *model = nullptr;
+    // reused by every sampling step, so that the vocabulary-sized buffer is allocated only once
+    std::vector<llama_token_data> candidates;
+
     llama_context *ctx = nullptr;
     gpt_params params;
 
@@ -211,24 +239,20 @@ struct llama_server_context
     std::string stopping_word;
     int32_t multibyte_pending = 0;
 
-    std::mutex mutex;
+    float mirostat_mu = 0.0f;
 
-    std::unique_lock<std::mutex> lock()
-    {
-        return std::unique_lock<std::mutex>(mutex);
-    }
+    // per-request timings, the context timings are shared by all slots
+    int32_t n_prompt_eval = 0;
+    int64_t t_prompt_eval_us = 0;
+    int32_t n_eval = 0;
+    int64_t t_eval_us = 0;
 
-    ~llama_server_context()
+    ~llama_client_slot()
     {
-        if (ctx)
+        if (grammar != nullptr)
         {
-            llama_free(ctx);
-            ctx = nullptr;
-        }
-        if (model)
-        {
-            llama_free_model(model);
-            model = nullptr;
+            llama_grammar_free(grammar);
+            grammar = nullptr;
         }
     }
 
@@ -239,7 +263,7 @@ struct llama_server_context
         num_prompt_tokens = 0;
         num_tokens_predicted = 0;
         generated_text = "";
-        generated_text.reserve(params.n_ctx);
+        generated_text.reserve(n_ctx);
         generated_token_probs.clear();
         truncated = false;
         stopped_eos = false;
@@ -249,6 +273,10 @@ struct llama_server_context
         multibyte_pending = 0;
         n_remain = 0;
         n_past = 0;
+        n_prompt_eval = 0;
+        t_prompt_eval_us = 0;
+        n_eval = 0;
+        t_eval_us = 0;
 
         if (grammar != nullptr) {
             llama_grammar_free(grammar);
@@ -256,21 +284,6 @@ struct llama_server_context
         }
     }
 
-    bool loadModel(const gpt_params &params_)
-    {
-        params = params_;
-        std::tie(model, ctx) = llama_init_from_gpt_params(params);
-        if (model == nullptr)
-        {
-            LOG_ERROR("unable to load model", {{"model", params_.model}});
-            return false;
-        }
-
-        last_n_tokens.resize(params.n_ctx);
-        std::fill(last_n_tokens.begin(), last_n_tokens.end(), 0);
-        return true;
-    }
-
     std::vector<llama_token> tokenize(const json & json_prompt, bool add_bos) const
     {
         // If `add_bos` is true, we only add BOS, when json_prompt is a string,
@@ -341,29 +354,34 @@ struct llama_server_context
         return true;
     }
 
-    void loadPrompt()
+    // the prompt tokens start with the n_system tokens of the system prompt, which are always kept
+    // must be called with the server lock held, as it modifies the KV cache of the slot
+    void loadPrompt(std::vector<llama_token> prompt_tokens, size_t n_system)
     {
-        auto prompt_tokens = tokenize(prompt, true);  // always add BOS
-
         num_prompt_tokens = prompt_tokens.size();
 
         if (params.n_keep < 0)
         {
             params.n_keep = (int)num_prompt_tokens;
         }
-        params.n_keep = std::min(params.n_ctx - 4, params.n_keep);
+        else
+        {
+            params.n_keep += (int)n_system;
+        }
+        params.n_keep = std::min(n_ctx - 4, params.n_keep);
 
         // if input prompt is too big, truncate like normal
-        if (num_prompt_tokens >= (size_t)params.n_ctx)
+        if (num_prompt_tokens >= (size_t)n_ctx)
         {
-            const int n_left = (params.n_ctx - params.n_keep) / 2;
+            const int n_left = (n_ctx - params.n_keep) / 2;
             std::vector<llama_token> new_tokens(prompt_tokens.begin(), prompt_tokens.begin() + params.n_keep);
             const int erased_blocks = (num_prompt_tokens - params.n_keep - n_left - 1) / n_left;
             new_tokens.insert(new_tokens.end(), prompt_tokens.begin() + params.n_keep + erased_blocks * n_left, prompt_tokens.end());
-            std::copy(prompt_tokens.end() - params.n_ctx, prompt_tokens.end(), last_n_tokens.begin());
+            std::copy(prompt_tokens.end() - n_ctx, prompt_tokens.end(), last_n_tokens.begin());
 
             LOG_VERBOSE("input truncated", {
-                                               {"n_ctx", params.n_ctx},
+                                               {"slot_id", id},
+                                               {"n_ctx", n_ctx},
                                                {"n_keep", params.n_keep},
                                                {"n_left", n_left},
                                                {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
@@ -388,65 +406,79 @@ struct llama_server_context
             n_past--;
         }
 
+        // drop the part of the cached sequence that is not shared with the new prompt
+        llama_kv_cache_seq_rm(ctx, id, n_past, -1);
+
+        has_next_token = true;
+    }
+
+    // number of leading tokens of the new prompt (embd) that are cached in the sequence of this slot
+    size_t cachedPrefix(const std::vector<llama_token> &tokens) const
+    {
+        return std::min(common_part(embd, tokens), n_past);
+    }
+
+    // share the first n tokens cached by another slot instead of evaluating them again
+    // must be called with the server lock held
+    void forkPrefix(const llama_client_slot &src, size_t n)
+    {
+        llama_kv_cache_seq_rm(ctx, id, -1, -1);
+        llama_kv_cache_seq_cp(ctx, src.id, id, 0, n);
+        n_past = n;
+    }
+
+    void logPromptIngested() const
+    {
         LOG_VERBOSE("prompt ingested", {
+                                           {"slot_id", id},
                                            {"n_past", n_past},
                                            {"cached", tokens_to_str(ctx, embd.cbegin(), embd.cbegin() + n_past)},
                                            {"to_eval", tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend())},
                                        });
-
-        has_next_token = true;
     }
 
     void beginCompletion()
     {
         // number of tokens to keep when resetting context
         n_remain = params.n_predict;
+        mirostat_mu = 2.0f * params.mirostat_tau;
         llama_set_rng_seed(ctx, params.seed);
     }
 
-    completion_token_output nextToken()
+    // make room for the next tokens once the slot has used up its context budget
+    // must be called with the server lock held
+    void contextShift()
     {
-        completion_token_output result;
-        result.tok = -1;
-
-        if (embd.size() >= (size_t)params.n_ctx)
+        if (embd.size() < (size_t)n_ctx)
         {
-            // Reset context
-            const int n_left = (params.n_ctx - params.n_keep) / 2;
-
-            std::vector<llama_token> new_tokens(embd.begin(), embd.begin() + params.n_keep);
-            new_tokens.insert(new_tokens.end(), embd.end() - n_left, embd.end());
-            embd = new_tokens;
-            n_past = params.n_keep;
-            truncated = true;
-            LOG_VERBOSE("input truncated", {
-                                               {"n_ctx", params.n_ctx},
-                                               {"n_keep", params.n_keep},
-                                               {"n_left", n_left},
-                                               {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
-                                           });
+            return;
         }
 
-        while (n_past < embd.size())
-        {
-            int n_eval = (int)embd.size() - n_past;
-            if (n_eval > params.n_batch)
-            {
-                n_eval = params.n_batch;
-            }
-            if (llama_eval(ctx, &embd[n_past], n_eval, n_past, params.n_threads))
-            {
-                LOG_ERROR("failed to eval", {
-                                                {"n_eval", n_eval},
-                                                {"n_past", n_past},
-                                                {"n_threads", params.n_threads},
-                                                {"embd", tokens_to_str(ctx, embd.cbegin() + n_past, embd.cend())},
-                                            });
-                has_next_token = false;
-                return result;
-            }
-            n_past += n_eval;
-        }
+        // Reset context
+        const int n_left = (n_ctx - params.n_keep) / 2;
+
+        std::vector<llama_token> new_tokens(embd.begin(), embd.begin() + params.n_keep);
+        new_tokens.insert(new_tokens.end(), embd.end() - n_left, embd.end());
+        embd = new_tokens;
+        n_past = params.n_keep;
+        truncated = true;
+
+        llama_kv_cache_seq_rm(ctx, id, n_past, -1);
+
+        LOG_VERBOSE("input truncated", {
+                                           {"slot_id", id},
+                                           {"n_ctx", n_ctx},
+                                           {"n_keep", params.n_keep},
+                                           {"n_left", n_left},
+                                           {"new_tokens", tokens_to_str(ctx, new_tokens.cbegin(), new_tokens.cend())},
+                                       });
+    }
+
+    // sample the next token from the logits of row idx of the last decoded batch
+    completion_token_output sample(int idx)
+    {
+        completion_token_output result;
+        result.tok = -1;
 
         if (params.n_predict == 0)
         {
@@ -461,7 +493,7 @@ struct llama_server_context
         const float top_p = params.top_p;
         const float tfs_z = params.tfs_z;
         const float typical_p = params.typical_p;
-        const int32_t repeat_last_n = params.repeat_last_n < 0 ? params.n_ctx : params.repeat_last_n;
+        const int32_t repeat_last_n = params.repeat_last_n < 0 ? n_ctx : params.repeat_last_n;
         const float repeat_penalty = params.repeat_penalty;
         const float alpha_presence = params.presence_penalty;
         const float alpha_frequency = params.frequency_penalty;
@@ -472,8 +504,8 @@ struct llama_server_context
         const int32_t n_probs = params.n_probs;
 
         {
-            auto *logits = llama_get_logits(ctx);
             auto n_vocab = llama_n_vocab(ctx);
+            auto *logits = llama_get_logits_ith(ctx, idx);
 
             // Apply params.logit_bias map
             for (const auto &it : params.logit_bias)
@@ -481,7 +513,7 @@ struct llama_server_context
                 logits[it.first] += it.second;
             }
 
-            std::vector<llama_token_data> candidates;
+            candidates.clear();
             candidates.reserve(n_vocab);
             for (llama_token token_id = 0; token_id < n_vocab; token_id++)
             {
@@ -492,7 +524,7 @@ struct llama_server_context
 
             // Apply penalties
             float nl_logit = logits[llama_token_nl(ctx)];
-            auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), params.n_ctx);
+            auto last_n_repeat = std::min(std::min((int)last_n_tokens.size(), repeat_last_n), n_ctx);
             llama_sample_repetition_penalty(ctx, &candidates_p,
                                             last_n_tokens.data() + last_n_tokens.size() - last_n_repeat,
                                             last_n_repeat, repeat_penalty);
@@ -521,14 +553,12 @@ struct llama_server_context
             {
                 if (mirostat == 1)
                 {
-                    static float mirostat_mu = 2.0f * mirostat_tau;
                     const int mirostat_m = 100;
                     llama_sample_temperature(ctx, &candidates_p, temp);
                     result.tok = llama_sample_token_mirostat(ctx, &candidates_p, mirostat_tau, mirostat_eta, mirostat_m, &mirostat_mu);
                 }
                 else if (mirostat == 2)
                 {
-                    static float mirostat_mu = 2.0f * mirostat_tau;
                     llama_sample_temperature(ctx, &candidates_p, temp);
                     result.tok = llama_sample_token_mirostat_v2(ctx, &candidates_p, mirostat_tau, mirostat_eta, &mirostat_mu);
                 }
@@ -569,7 +599,7 @@ struct llama_server_context
             // stopping_word = llama_token_to_piece(ctx, embd.back());
             has_next_token = false;
             stopped_eos = true;
-            LOG_VERBOSE("eos token found", {});
+            LOG_VERBOSE("eos token found", {{"slot_id", id}});
             return result;
         }
 
@@ -608,22 +638,429 @@ struct llama_server_context
         }
         return stop_pos;
     }
+};
 
-    completion_token_output doCompletion()
+struct llama_server_context
+{
+    llama_model *model = nullptr;
+    llama_context *ctx = nullptr;
+    gpt_params params;
+
+    std::vector<llama_client_slot> slots;
+
+    // prefix of every prompt, evaluated once and shared by the sequences of all slots
+    std::string system_prompt;
+    std::vector<llama_token> system_tokens;
+
+    // batch shared by all slots for each decoding step
+    llama_batch batch = {};
+
+    // the lock protects the context and the slots
+    // condition_tasks wakes up the scheduler, condition_results wakes up the request threads
+    std::mutex mutex;
+    std::condition_variable condition_tasks;
+    std::condition_variable condition_results;
+
+    std::atomic<bool> running{true};
+
+    std::unique_lock<std::mutex> lock()
+    {
+        return std::unique_lock<std::mutex>(mutex);
+    }
+
+    ~llama_server_context()
+    {
+        slots.clear();
+        if (batch.token)
+        {
+            llama_batch_free(batch);
+        }
+        if (ctx)
+        {
+            llama_free(ctx);
+            ctx = nullptr;
+        }
+        if (model)
+        {
+            llama_free_model(model);
+            model = nullptr;
+        }
+    }
+
+    bool loadModel(const gpt_params &params_)
+    {
+        params = params_;
+        std::tie(model, ctx) = llama_init_from_gpt_params(params);
+        if (model == nullptr)
+        {
+            LOG_ERROR("unable to load model", {{"model", params_.model}});
+            return false;
+        }
+
+        const int32_t n_parallel = std::max(1, params.n_parallel);
+
+        slots.resize(n_parallel);
+        for (int32_t i = 0; i < n_parallel; i++)
+        {
+            llama_client_slot &slot = slots[i];
+            slot.id = i;
+            slot.ctx = ctx;
+            slot.params = params;
+            slot.n_ctx = params.n_ctx / n_parallel;
+            slot.last_n_tokens.resize(slot.n_ctx);
+            std::fill(slot.last_n_tokens.begin(), slot.last_n_tokens.end(), 0);
+        }
+
+        // every slot can have at most n_ctx tokens pending in a step, so the total never exceeds n_ctx
+        batch = llama_batch_init(params.n_ctx, 0);
+
+        LOG_INFO("slots initialized", {
+                                          {"n_parallel", n_parallel},
+                                          {"n_ctx_slot", slots[0].n_ctx},
+                                      });
+        return true;
+    }
+
+    // evaluate the system prompt once and share its KV cells with the sequences of all the slots
+    // the slots split the rest of the context between them
+    // must be called before the server starts accepting requests
+    bool updateSystemPrompt()
     {
-        auto token_with_probs = nextToken();
+        system_tokens = ::llama_tokenize(ctx, system_prompt, true);
+
+        const int32_t n_system = (int32_t) system_tokens.size();
+        const int32_t n_parallel = (int32_t) slots.size();
+
+        if (n_system + 4*n_parallel > params.n_ctx)
+        {
+            LOG_ERROR("system prompt does not fit in the context", {
+                                                                       {"n_system", n_system},
+                                                                       {"n_ctx", params.n_ctx},
+                                                                       {"n_parallel", n_parallel},
+                                                                   });
+            system_tokens.clear();
+            return false;
+        }
+
+        llama_kv_cache_tokens_rm(ctx, -1, -1);
+
+        for (int32_t i = 0; i < n_system; i += params.n_batch)
+        {
+            const int32_t n_eval = std::min(n_system - i, params.n_batch);
+            if (llama_decode(ctx, llama_batch_get_one(system_tokens.data() + i, n_eval, i, 0), params.n_threads) != 0)
+            {
+                LOG_ERROR("failed to eval the system prompt", {
+                                                                  {"n_eval", n_eval},
+                                                                  {"n_past", i},
+                                                              });
+                llama_kv_cache_tokens_rm(ctx, -1, -1);
+                system_tokens.clear();
+                return false;
+            }
+        }
+
+        for (llama_client_slot &slot : slots)
+        {
+            llama_kv_cache_seq_cp(ctx, 0, slot.id, 0, n_system);
+            slot.embd = system_tokens;
+            slot.n_past = n_system;
+            slot.n_ctx = n_system + (params.n_ctx - n_system) / n_parallel;
+            slot.last_n_tokens.resize(slot.n_ctx);
+            std::fill(slot.last_n_tokens.begin(), slot.last_n_tokens.end(), 0);
+        }
+
+        LOG_INFO("system prompt evaluated", {
+                                                {"n_system", n_system},
+                                                {"n_ctx_slot", slots[0].n_ctx},
+                                            });
+        return true;
+    }
+
+    // the system prompt goes in front of the prompt of every request, the BOS token is added only once
+    std::vector<llama_token> tokenizePrompt(const json &prompt) const
+    {
+        if (system_tokens.empty())
+        {
+            return slots[0].tokenize(prompt, true);
+        }
+
+        std::vector<llama_token> prompt_tokens = system_tokens;
+        const std::vector<llama_token> user_tokens = slots[0].tokenize(prompt, false);
+        prompt_tokens.insert(prompt_tokens.end(), user_tokens.begin(), user_tokens.end());
+        return prompt_tokens;
+    }
+
+    // set the prompt of the request in the slot and reuse as much of the KV cache as possible:
+    // either the tokens cached by the slot itself, or a longer prefix cached by any other slot
+    // must be called with the lock held
+    void loadPrompt(llama_client_slot &slot)
+    {
+        slot.loadPrompt(tokenizePrompt(slot.prompt), system_tokens.size());
+
+        // at least one token has to be evaluated to get the logits
+        const size_t n_max = slot.embd.empty() ? 0 : slot.embd.size() - 1;
+
+        const llama_client_slot *src = nullptr;
+        size_t n_src = slot.n_past;
+        for (const llama_client_slot &other : slots)
+        {
+            if (other.id == slot.id)
+            {
+                continue;
+            }
+            const size_t n_common = std::min(other.cachedPrefix(slot.embd), n_max);
+            if (n_common > n_src)
+            {
+                src = &other;
+                n_src = n_common;
+            }
+        }
+
+        if (src != nullptr)
+        {
+            slot.forkPrefix(*src, n_src);
+            LOG_VERBOSE("prompt prefix shared", {
+                                                    {"slot_id", slot.id},
+                                                    {"src_slot_id", src->id},
+                                                    {"n_shared", n_src},
+                                                });
+        }
+
+        slot.logPromptIngested();
+    }
+
+    // wait for a free slot and assign it to a new request
+    // prefers the idle slot whose cached tokens share the longest prefix with the prompt
+    // must be called with the lock held
+    llama_client_slot &acquireSlot(std::unique_lock<std::mutex> &lock, const json &prompt)
+    {
+        condition_results.wait(lock, [&]
+                               { return std::any_of(slots.begin(), slots.end(),
+                                                    [](const llama_client_slot &slot) { return slot.state == SLOT_IDLE; }); });
+
+        const std::vector<llama_token> prompt_tokens = tokenizePrompt(prompt);
+
+        llama_client_slot *best = nullptr;
+        size_t best_common = 0;
+        for (llama_client_slot &slot : slots)
+        {
+            if (slot.state != SLOT_IDLE)
+            {
+                continue;
+            }
+            const size_t n_common = common_part(slot.embd, prompt_tokens);
+            if (best == nullptr || n_common > best_common)
+            {
+                best = &slot;
+                best_common = n_common;
+            }
+        }
+
+        best->state = SLOT_PROCESSING;
+        return *best;
+    }
+
+    void releaseSlot(llama_client_slot &slot)
+    {
+        auto lock = this->lock();
+        slot.state = SLOT_IDLE;
+        slot.waiting_token = false;
+        // the last sampled token has not been evaluated, keep only what is in the KV cache for the next request
+        slot.embd.resize(std::min(slot.embd.size(), slot.n_past));
+        condition_results.notify_all();
+    }
+
+    // wait for the scheduler to evaluate the pending tokens of the slot and to sample the next one
+    completion_token_output nextToken(llama_client_slot &slot)
+    {
+        auto lock = this->lock();
+        slot.waiting_token = true;
+        condition_tasks.notify_one();
+        condition_results.wait(lock, [&]
+                               { return !slot.waiting_token || !running; });
+        if (slot.waiting_token)
+        {
+            // the server is shutting down
+            slot.waiting_token = false;
+            slot.has_next_token = false;
+            completion_token_output result;
+            result.tok = -1;
+            return result;
+        }
+        return slot.next_result;
+    }
+
+    // one step of the scheduler: merge the pending tokens of all waiting slots into a single batch,
+    // decode it and sample the next token of every slot
+    void updateSlots()
+    {
+        auto lock = this->lock();
+
+        condition_tasks.wait(lock, [&]
+                             { return !running || std::any_of(slots.begin(), slots.end(),
+                                                              [](const llama_client_slot &slot) { return slot.waiting_token; }); });
+        if (!running)
+        {
+            return;
+        }
+
+        // give the other busy slots a moment to post their next token so they join this step
+        condition_tasks.wait_for(lock, std::chrono::milliseconds(5), [&]
+                                 { return std::all_of(slots.begin(), slots.end(),
+                                                      [](const llama_client_slot &slot) { return slot.state != SLOT_PROCESSING || slot.waiting_token; }); });
+
+        const int64_t t_start_us = ggml_time_us();
+
+        // row of the batch to sample from for each slot, -1 if the slot is not part of this step
+        std::vector<int32_t> i_batch(slots.size(), -1);
+        std::vector<int32_t> n_batch_slot(slots.size(), 0);
+        std::vector<bool> is_prompt(slots.size(), false);
+
+        batch.n_tokens = 0;
+
+        for (llama_client_slot &slot : slots)
+        {
+            if (!slot.waiting_token)
+            {
+                continue;
+            }
+
+            slot.contextShift();
+
+            is_prompt[slot.id] = slot.num_tokens_predicted == 0;
+
+            while (slot.n_past < slot.embd.size())
+            {
+                batch.token [batch.n_tokens] = slot.embd[slot.n_past];
+                batch.pos   [batch.n_tokens] = slot.n_past;
+                batch.seq_id[batch.n_tokens] = slot.id;
+                batch.logits[batch.n_tokens] = false;
+                batch.n_tokens++;
+                slot.n_past++;
+                n_batch_slot[slot.id]++;
+            }
+
+            // only the last pending token of each slot is sampled from
+            i_batch[slot.id] = batch.n_tokens - 1;
+            batch.logits[i_batch[slot.id]] = true;
+        }
+
+        // decode the batch in views of at most n_batch tokens
+        // if the KV cache is too fragmented for a view, retry with smaller views
+        int32_t n_batch = params.n_batch;
+        bool failed = false;
+
+        for (int32_t i = 0; i < batch.n_tokens; i += n_batch)
+        {
+            const int32_t n_tokens = std::min(n_batch, batch.n_tokens - i);
+
+            llama_batch batch_view = {
+                n_tokens,
+                batch.token  + i,
+                nullptr,
+                batch.pos    + i,
+                batch.seq_id + i,
+                batch.logits + i,
+                0, 0, 0, // unused
+            };
+
+            const int ret = llama_decode(ctx, batch_view, params.n_threads);
+            if (ret != 0)
+            {
+                if (n_batch == 1 || ret < 0)
+                {
+                    LOG_ERROR("failed to decode the batch", {
+                                                                {"n_tokens", batch.n_tokens},
+                                                                {"n_batch", n_batch},
+                                                                {"ret", ret},
+                                                            });
+                    failed = true;
+                    break;
+                }
+
+                // retry with half the batch size to try to find a free slot in the KV cache
+                n_batch /= 2;
+                i -= n_batch;
+                continue;
+            }
+
+            // sample the slots whose last pending token is in this view
+            for (llama_client_slot &slot : slots)
+            {
+                if (i_batch[slot.id] < i || i_batch[slot.id] >= i + n_tokens)
+                {
+                    continue;
+                }
+
+                slot.next_result = slot.sample(i_batch[slot.id] - i);
+            }
+        }
+
+        const int64_t t_step_us = ggml_time_us() - t_start_us;
+
+        for (llama_client_slot &slot : slots)
+        {
+            if (i_batch[slot.id] < 0)
+            {
+                continue;
+            }
+
+            if (failed)
+            {
+                // the state of the sequence is unknown, start over on the next request
+                llama_kv_cache_seq_rm(ctx, slot.id, -1, -1);
+                slot.embd.clear();
+                slot.n_past = 0;
+                slot.next_result = completion_token_output();
+                slot.next_result.tok = -1;
+                slot.has_next_token = false;
+            }
+
+            if (is_prompt[slot.id])
+            {
+                slot.n_prompt_eval += n_batch_slot[slot.id];
+                slot.t_prompt_eval_us += t_step_us;
+            }
+            else
+            {
+                slot.n_eval += 1;
+                slot.t_eval_us += t_step_us;
+            }
+
+            slot.waiting_token = false;
+        }
+
+        LOG_VERBOSE("batch decoded", {
+                                         {"n_tokens", batch.n_tokens},
+                                         {"t_ms", t_step_us / 1e3},
+                                     });
+
+        condition_results.notify_all();
+    }
+
+    void stop()
+    {
+        auto lock = this->lock();
+        running = false;
+        condition_tasks.notify_all();
+        condition_results.notify_all();
+    }
+
+    completion_token_output doCompletion(llama_client_slot &slot)
+    {
+        auto token_with_probs = nextToken(slot);
 
         const std::string token_text = token_with_probs.tok == -1 ? "" : llama_token_to_piece(ctx, token_with_probs.tok);
-        generated_text += token_text;
+        slot.generated_text += token_text;
 
-        if (params.n_probs > 0)
+        if (slot.params.n_probs > 0)
         {
-            generated_token_probs.push_back(token_with_probs);
+            slot.generated_token_probs.push_back(token_with_probs);
         }
 
-        if (multibyte_pending > 0)
+        if (slot.multibyte_pending > 0)
         {
-            multibyte_pending -= token_text.size();
+            slot.multibyte_pending -= token_text.size();
         }
         else if (token_text.size() == 1)
         {
@@ -631,51 +1068,53 @@ struct llama_server_context
             // 2-byte characters: 110xxxxx 10xxxxxx
             if ((c & 0xE0) == 0xC0)
             {
-                multibyte_pending = 1;
+                slot.multibyte_pending = 1;
                 // 3-byte characters: 1110xxxx 10xxxxxx 10xxxxxx
             }
             else if ((c & 0xF0) == 0xE0)
             {
-                multibyte_pending = 2;
+                slot.multibyte_pending = 2;
                 // 4-byte characters: 11110xxx 10xxxxxx 10xxxxxx 10xxxxxx
             }
             else if ((c & 0xF8) == 0xF0)
             {
-                multibyte_pending = 3;
+                slot.multibyte_pending = 3;
             }
             else
             {
-                multibyte_pending = 0;
+                slot.multibyte_pending = 0;
             }
         }
 
-        if (multibyte_pending > 0 && !has_next_token)
+        if (slot.multibyte_pending > 0 && !slot.has_next_token)
         {
-            has_next_token = true;
-            n_remain++;
+            slot.has_next_token = true;
+            slot.n_remain++;
         }
 
-        if (!has_next_token && n_remain == 0)
+        if (!slot.has_next_token && slot.n_remain == 0)
         {
-            stopped_limit = true;
+            slot.stopped_limit = true;
         }
 
         LOG_VERBOSE("next token", {
+                                      {"slot_id", slot.id},
                                       {"token", token_with_probs.tok},
                                       {"token_text", tokens_to_output_formatted_string(ctx, token_with_probs.tok)},
-                                      {"has_next_token", has_next_token},
-                                      {"n_remain", n_remain},
-                                      {"num_tokens_predicted", num_tokens_predicted},
-                                      {"stopped_eos", stopped_eos},
-                                      {"stopped_word", stopped_word},
-                                      {"stopped_limit", stopped_limit},
-                                      {"stopping_word", stopping_word},
+                                      {"has_next_token", slot.has_next_token},
+                                      {"n_remain", slot.n_remain},
+                                      {"num_tokens_predicted", slot.num_tokens_predicted},
+                                      {"stopped_eos", slot.stopped_eos},
+                                      {"stopped_word", slot.stopped_word},
+                                      {"stopped_limit", slot.stopped_limit},
+                                      {"stopping_word", slot.stopping_word},
                                   });
 
         return token_with_probs;
     }
 
-    std::vector<float> getEmbedding()
+    // compute the embedding of the prompt in a private sequence, outside of the slots
+    std::vector<float> getEmbedding(const json &content)
     {
         static const int n_embd = llama_n_embd(ctx);
         if (!params.embedding)
@@ -685,8 +1124,36 @@ struct llama_server_context
                                               });
             return std::vector<float>(n_embd, 0.0f);
         }
+
+        std::vector<llama_token> tokens = slots[0].tokenize(content, true);
+        if (tokens.empty())
+        {
+            return std::vector<float>(n_embd, 0.0f);
+        }
+
+        const llama_seq_id seq_id = (llama_seq_id) slots.size();
+
+        auto lock = this->lock();
+
+        for (size_t i = 0; i < tokens.size(); i += params.n_batch)
+        {
+            const int32_t n_eval = std::min((int32_t) (tokens.size() - i), params.n_batch);
+            if (llama_decode(ctx, llama_batch_get_one(tokens.data() + i, n_eval, i, seq_id), params.n_threads) != 0)
+            {
+                LOG_ERROR("failed to eval", {
+                                                {"n_eval", n_eval},
+                                                {"n_past", i},
+                                            });
+                llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+                return std::vector<float>(n_embd, 0.0f);
+            }
+        }
+
         const float *data = llama_get_embeddings(ctx);
         std::vector<float> embedding(data, data + n_embd);
+
+        llama_kv_cache_seq_rm(ctx, seq_id, -1, -1);
+
         return embedding;
     }
 };
@@ -704,8 +1171,13 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --rope-freq-base N    RoPE base frequency (default: %.1f)\n", params.rope_freq_base);
     printf("  --rope-freq-scale N   RoPE frequency scaling factor (default: %g)\n", params.rope_freq_scale);
     printf("  -b N, --batch-size N  batch size for prompt processing (default: %d)\n", params.n_batch);
+    printf("  -np N, --parallel N   number of slots for processing requests in parallel (default: %d)\n", params.n_parallel);
     printf("  --memory-f32          use f32 instead of f16 for memory key+value (default: disabled)\n");
     printf("                        not recommended: doubles context memory required and no measurable increase in quality\n");
+    printf("  -ctk TYPE, --cache-type-k TYPE\n");
+    printf("                        KV cache data type for K: f32, f16, q8_0, q4_0 (default: %s)\n", params.cache_type_k.c_str());
+    printf("  -ctv TYPE, --cache-type-v TYPE\n");
+    printf("                        KV cache data type for V: f32, f16, q8_0, q4_0 (default: %s)\n", params.cache_type_v.c_str());
     if (llama_mlock_supported())
     {
         printf("  --mlock               force system to keep model in RAM rather than swapping or compressing\n");
@@ -714,6 +1186,8 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     {
         printf("  --no-mmap             do not memory-map model (slower load but may reduce pageouts if not using mlock)\n");
     }
+    printf("  --no-flash-attn       compute attention with separate KQ, softmax and KQV ops instead of the fused CPU op\n");
+    printf("  --hugepages           back the weights, KV cache and compute buffers with huge pages (reads the weights instead of mmap)\n");
     printf("  --numa                attempt optimizations that help on some NUMA systems\n");
 #ifdef LLAMA_SUPPORTS_GPU_OFFLOAD
     printf("  -ngl N, --n-gpu-layers N\n");
@@ -737,6 +1211,8 @@ static void server_print_usage(const char *argv0, const gpt_params &params,
     printf("  --path PUBLIC_PATH    path from which to serve static files (default %s)\n", sparams.public_path.c_str());
     printf("  -to N, --timeout N    server read/write timeout in seconds (default: %d)\n", sparams.read_timeout);
     printf("  --embedding           enable embedding vector output (default: %s)\n", params.embedding ? "enabled" : "disabled");
+    printf("  -spf FNAME, --system-prompt-file FNAME\n");
+    printf("                        prompt prepended to every request, evaluated once and shared by all slots\n");
     printf("\n");
 }
 
@@ -842,6 +1318,24 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.memory_f16 = false;
         }
+        else if (arg == "--cache-type-k" || arg == "-ctk")
+        {
+            if (++i >= argc || kv_cache_type_from_str(argv[i]) == GGML_TYPE_COUNT)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.cache_type_k = argv[i];
+        }
+        else if (arg == "--cache-type-v" || arg == "-ctv")
+        {
+            if (++i >= argc || kv_cache_type_from_str(argv[i]) == GGML_TYPE_COUNT)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.cache_type_v = argv[i];
+        }
         else if (arg == "--threads" || arg == "-t")
         {
             if (++i >= argc)
@@ -861,6 +1355,31 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
             params.n_batch = std::stoi(argv[i]);
             params.n_batch = std::min(512, params.n_batch);
         }
+        else if (arg == "-spf" || arg == "--system-prompt-file")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            std::ifstream file(argv[i]);
+            if (!file)
+            {
+                fprintf(stderr, "error: failed to open file '%s'\n", argv[i]);
+                invalid_param = true;
+                break;
+            }
+            std::copy(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>(), back_inserter(sparams.system_prompt));
+        }
+        else if (arg == "-np" || arg == "--parallel")
+        {
+            if (++i >= argc)
+            {
+                invalid_param = true;
+                break;
+            }
+            params.n_parallel = std::stoi(argv[i]);
+        }
         else if (arg == "--gpu-layers" || arg == "-ngl" || arg == "--n-gpu-layers")
         {
             if (++i >= argc)
@@ -971,6 +1490,14 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
         {
             params.use_mmap = false;
         }
+        else if (arg == "--no-flash-attn")
+        {
+            params.flash_attn = false;
+        }
+        else if (arg == "--hugepages")
+        {
+            params.use_hugepages = true;
+        }
         else if (arg == "--numa")
         {
             params.numa = true;
@@ -995,105 +1522,105 @@ static void server_params_parse(int argc, char **argv, server_params &sparams,
     }
 }
 
-static json format_generation_settings(llama_server_context &llama)
+static json format_generation_settings(llama_client_slot &slot)
 {
-    const auto eos_bias = llama.params.logit_bias.find(llama_token_eos(llama.ctx));
-    const bool ignore_eos = eos_bias != llama.params.logit_bias.end() &&
+    const auto eos_bias = slot.params.logit_bias.find(llama_token_eos(slot.ctx));
+    const bool ignore_eos = eos_bias != slot.params.logit_bias.end() &&
                             eos_bias->second < 0.0f && std::isinf(eos_bias->second);
 
     return json{
-        {"n_ctx", llama.params.n_ctx},
-        {"model", llama.params.model_alias},
-        {"seed", llama.params.seed},
-        {"temp", llama.params.temp},
-        {"top_k", llama.params.top_k},
-        {"top_p", llama.params.top_p},
-        {"tfs_z", llama.params.tfs_z},
-        {"typical_p", llama.params.typical_p},
-        {"repeat_last_n", llama.params.repeat_last_n},
-        {"repeat_penalty", llama.params.repeat_penalty},
-        {"presence_penalty", llama.params.presence_penalty},
-        {"frequency_penalty", llama.params.frequency_penalty},
-        {"mirostat", llama.params.mirostat},
-        {"mirostat_tau", llama.params.mirostat_tau},
-        {"mirostat_eta", llama.params.mirostat_eta},
-        {"penalize_nl", llama.params.penalize_nl},
-        {"stop", llama.params.antiprompt},
-        {"n_predict", llama.params.n_predict},
-        {"n_keep", llama.params.n_keep},
+        {"n_ctx", slot.params.n_ctx},
+        {"model", slot.params.model_alias},
+        {"seed", slot.params.seed},
+        {"temp", slot.params.temp},
+        {"top_k", slot.params.top_k},
+        {"top_p", slot.params.top_p},
+        {"tfs_z", slot.params.tfs_z},
+        {"typical_p", slot.params.typical_p},
+        {"repeat_last_n", slot.params.repeat_last_n},
+        {"repeat_penalty", slot.params.repeat_penalty},
+        {"presence_penalty", slot.params.presence_penalty},
+        {"frequency_penalty", slot.params.frequency_penalty},
+        {"mirostat", slot.params.mirostat},
+        {"mirostat_tau", slot.params.mirostat_tau},
+        {"mirostat_eta", slot.params.mirostat_eta},
+        {"penalize_nl", slot.params.penalize_nl},
+        {"stop", slot.params.antiprompt},
+        {"n_predict", slot.params.n_predict},
+        {"n_keep", slot.params.n_keep},
         {"ignore_eos", ignore_eos},
-        {"stream", llama.stream},
-        {"logit_bias", llama.params.logit_bias},
-        {"n_probs", llama.params.n_probs},
-        {"grammar", llama.params.grammar},
+        {"stream", slot.stream},
+        {"logit_bias", slot.params.logit_bias},
+        {"n_probs", slot.params.n_probs},
+        {"grammar", slot.params.grammar},
     };
 }
 
-static json format_embedding_response(llama_server_context &llama)
+static json format_embedding_response(const std::vector<float> &embedding)
 {
     return json{
-        {"embedding", llama.getEmbedding()},
+        {"embedding", embedding},
     };
 }
 
-static json format_timings(llama_server_context &llama)
+static json format_timings(llama_client_slot &slot)
 {
-    const auto timings = llama_get_timings(llama.ctx);
-
-    assert(timings.n_eval == ptrdiff_t(llama.num_tokens_predicted));
+    // the steps are shared with the other slots decoded in the same batch
+    const double t_p_eval_ms = 1e-3 * slot.t_prompt_eval_us;
+    const double t_eval_ms   = 1e-3 * slot.t_eval_us;
 
     return json{
-        {"prompt_n", timings.n_p_eval},
-        {"prompt_ms", timings.t_p_eval_ms},
-        {"prompt_per_token_ms", timings.t_p_eval_ms / timings.n_p_eval},
-        {"prompt_per_second", 1e3 / timings.t_p_eval_ms * timings.n_p_eval},
-
-        {"predicted_n", timings.n_eval},
-        {"predicted_ms", timings.t_eval_ms},
-        {"predicted_per_token_ms", timings.t_eval_ms / timings.n_eval},
-        {"predicted_per_second", 1e3 / timings.t_eval_ms * timings.n_eval},
+        {"prompt_n", slot.n_prompt_eval},
+        {"prompt_ms", t_p_eval_ms},
+        {"prompt_per_token_ms", t_p_eval_ms / slot.n_prompt_eval},
+        {"prompt_per_second", 1e3 / t_p_eval_ms * slot.n_prompt_eval},
+
+        {"predicted_n", slot.n_eval},
+        {"predicted_ms", t_eval_ms},
+        {"predicted_per_token_ms", t_eval_ms / slot.n_eval},
+        {"predicted_per_second", 1e3 / t_eval_ms * slot.n_eval},
     };
 }
 
-static json format_final_response(llama_server_context &llama, const std::string &content, const std::vector<completion_token_output> &probs)
+static json format_final_response(llama_client_slot &slot, const std::string &content, const std::vector<completion_token_output> &probs)
 {
 
     json res = json{
         {"content", content},
         {"stop", true},
-        {"model", llama.params.model_alias},
-        {"tokens_predicted", llama.num_tokens_predicted},
-        {"tokens_evaluated", llama.num_prompt_tokens},
-        {"generation_settings", format_generation_settings(llama)},
-        {"prompt", llama.prompt},
-        {"truncated", llama.truncated},
-        {"stopped_eos", llama.stopped_eos},
-        {"stopped_word", llama.stopped_word},
-        {"stopped_limit", llama.stopped_limit},
-        {"stopping_word", llama.stopping_word},
-        {"tokens_cached", llama.n_past},
-        {"timings", format_timings(llama)},
+        {"model", slot.params.model_alias},
+        {"tokens_predicted", slot.num_tokens_predicted},
+        {"tokens_evaluated", slot.num_prompt_tokens},
+        {"generation_settings", format_generation_settings(slot)},
+        {"prompt", slot.prompt},
+        {"truncated", slot.truncated},
+        {"stopped_eos", slot.stopped_eos},
+        {"stopped_word", slot.stopped_word},
+        {"stopped_limit", slot.stopped_limit},
+        {"stopping_word", slot.stopping_word},
+        {"tokens_cached", slot.n_past},
+        {"timings", format_timings(slot)},
     };
 
-    if (llama.params.n_probs > 0)
+    if (slot.params.n_probs > 0)
     {
-        res["completion_probabilities"] = probs_vector_to_json(llama.ctx, probs);
+        res["completion_probabilities"] = probs_vector_to_json(slot.ctx, probs);
     }
 
     return res;
 }
 
 static json format_partial_response(
-    llama_server_context &llama, const std::string &content, const std::vector<completion_token_output> &probs
+    llama_client_slot &slot, const std::string &content, const std::vector<completion_token_output> &probs
 ) {
     json res = json{
         {"content", content},
         {"stop", false},
     };
 
-    if (llama.params.n_probs > 0)
+    if (slot.params.n_probs > 0)
     {
-        res["completion_probabilities"] = probs_vector_to_json(llama.ctx, probs);
+        res["completion_probabilities"] = probs_vector_to_json(slot.ctx, probs);
     }
 
     return res;
@@ -1120,49 +1647,49 @@ static T json_value(const json &body, const std::string &key, const T &default_v
         : default_value;
 }
 
-static void parse_options_completion(const json &body, llama_server_context &llama)
+static void parse_options_completion(const json &body, llama_client_slot &slot)
 {
     gpt_params default_params;
 
-    llama.stream = json_value(body, "stream", false);
-    llama.params.n_predict = json_value(body, "n_predict", default_params.n_predict);
-    llama.params.top_k = json_value(body, "top_k", default_params.top_k);
-    llama.params.top_p = json_value(body, "top_p", default_params.top_p);
-    llama.params.tfs_z = json_value(body, "tfs_z", default_params.tfs_z);
-    llama.params.typical_p = json_value(body, "typical_p", default_params.typical_p);
-    llama.params.repeat_last_n = json_value(body, "repeat_last_n", default_params.repeat_last_n);
-    llama.params.temp = json_value(body, "temperature", default_params.temp);
-    llama.params.repeat_penalty = json_value(body, "repeat_penalty", default_params.repeat_penalty);
-    llama.params.presence_penalty = json_value(body, "presence_penalty", default_params.presence_penalty);
-    llama.params.frequency_penalty = json_value(body, "frequency_penalty", default_params.frequency_penalty);
-    llama.params.mirostat = json_value(body, "mirostat", default_params.mirostat);
-    llama.params.mirostat_tau = json_value(body, "mirostat_tau", default_params.mirostat_tau);
-    llama.params.mirostat_eta = json_value(body, "mirostat_eta", default_params.mirostat_eta);
-    llama.params.penalize_nl = json_value(body, "penalize_nl", default_params.penalize_nl);
-    llama.params.n_keep = json_value(body, "n_keep", default_params.n_keep);
-    llama.params.seed = json_value(body, "seed", default_params.seed);
-    llama.params.grammar = json_value(body, "grammar", default_params.grammar);
-    llama.params.n_probs = json_value(body, "n_probs", default_params.n_probs);
+    slot.stream = json_value(body, "stream", false);
+    slot.params.n_predict = json_value(body, "n_predict", default_params.n_predict);
+    slot.params.top_k = json_value(body, "top_k", default_params.top_k);
+    slot.params.top_p = json_value(body, "top_p", default_params.top_p);
+    slot.params.tfs_z = json_value(body, "tfs_z", default_params.tfs_z);
+    slot.params.typical_p = json_value(body, "typical_p", default_params.typical_p);
+    slot.params.repeat_last_n = json_value(body, "repeat_last_n", default_params.repeat_last_n);
+    slot.params.temp = json_value(body, "temperature", default_params.temp);
+    slot.params.repeat_penalty = json_value(body, "repeat_penalty", default_params.repeat_penalty);
+    slot.params.presence_penalty = json_value(body, "presence_penalty", default_params.presence_penalty);
+    slot.params.frequency_penalty = json_value(body, "frequency_penalty", default_params.frequency_penalty);
+    slot.params.mirostat = json_value(body, "mirostat", default_params.mirostat);
+    slot.params.mirostat_tau = json_value(body, "mirostat_tau", default_params.mirostat_tau);
+    slot.params.mirostat_eta = json_value(body, "mirostat_eta", default_params.mirostat_eta);
+    slot.params.penalize_nl = json_value(body, "penalize_nl", default_params.penalize_nl);
+    slot.params.n_keep = json_value(body, "n_keep", default_params.n_keep);
+    slot.params.seed = json_value(body, "seed", default_params.seed);
+    slot.params.grammar = json_value(body, "grammar", default_params.grammar);
+    slot.params.n_probs = json_value(body, "n_probs", default_params.n_probs);
 
     if (body.count("prompt") != 0)
     {
-        llama.prompt = body["prompt"];
+        slot.prompt = body["prompt"];
     }
     else
     {
-        llama.prompt = "";
+        slot.prompt = "";
     }
 
-    llama.params.logit_bias.clear();
+    slot.params.logit_bias.clear();
     if (json_value(body, "ignore_eos", false))
     {
-        llama.params.logit_bias[llama_token_eos(llama.ctx)] = -INFINITY;
+        slot.params.logit_bias[llama_token_eos(slot.ctx)] = -INFINITY;
     }
 
     const auto &logit_bias = body.find("logit_bias");
     if (logit_bias != body.end() && logit_bias->is_array())
     {
-        const int n_vocab = llama_n_vocab(llama.ctx);
+        const int n_vocab = llama_n_vocab(slot.ctx);
         for (const auto &el : *logit_bias)
         {
             if (el.is_array() && el.size() == 2 && el[0].is_number_integer())
@@ -1172,18 +1699,18 @@ static void parse_options_completion(const json &body, llama_server_context &lla
                 {
                     if (el[1].is_number())
                     {
-                        llama.params.logit_bias[tok] = el[1].get<float>();
+                        slot.params.logit_bias[tok] = el[1].get<float>();
                     }
                     else if (el[1].is_boolean() && !el[1].get<bool>())
                     {
-                        llama.params.logit_bias[tok] = -INFINITY;
+                        slot.params.logit_bias[tok] = -INFINITY;
                     }
                 }
             }
         }
     }
 
-    llama.params.antiprompt.clear();
+    slot.params.antiprompt.clear();
     const auto &stop = body.find("stop");
     if (stop != body.end() && stop->is_array())
     {
@@ -1191,12 +1718,12 @@ static void parse_options_completion(const json &body, llama_server_context &lla
         {
             if (!word.empty())
             {
-                llama.params.antiprompt.push_back(word);
+                slot.params.antiprompt.push_back(word);
             }
         }
     }
 
-    LOG_VERBOSE("completion parameters parsed", format_generation_settings(llama));
+    LOG_VERBOSE("completion parameters parsed", format_generation_settings(slot));
 }
 
 static void log_server_request(const Request &req, const Response &res)
@@ -1216,8 +1743,8 @@ static void log_server_request(const Request &req, const Response &res)
                            });
 }
 
-static bool is_at_eob(llama_server_context &server_context, const llama_token *tokens, const size_t n_tokens) {
-    return n_tokens && tokens[n_tokens-1] == llama_token_eos(server_context.ctx);
+static bool is_at_eob(llama_client_slot &slot, const llama_token *tokens, const size_t n_tokens) {
+    return n_tokens && tokens[n_tokens-1] == llama_token_eos(slot.ctx);
 }
 
 // Function matching type llama_beam_search_callback_fn_t.
@@ -1227,21 +1754,21 @@ static bool is_at_eob(llama_server_context &server_context, const llama_token *t
 //    This is also called when the stop condition is met.
 //    Collect tokens into std::vector<llama_token> response which is pointed to by callback_data.
 static void beam_search_callback(void *callback_data, llama_beams_state beams_state) {
-    auto & llama = *static_cast<llama_server_context*>(callback_data);
+    auto & slot = *static_cast<llama_client_slot*>(callback_data);
     // Mark beams as EOS as needed.
     for (size_t i = 0 ; i < beams_state.n_beams ; ++i) {
         llama_beam_view& beam_view = beams_state.beam_views[i];
-        if (!beam_view.eob && is_at_eob(llama, beam_view.tokens, beam_view.n_tokens)) {
+        if (!beam_view.eob && is_at_eob(slot, beam_view.tokens, beam_view.n_tokens)) {
             beam_view.eob = true;
         }
     }
     printf(",");  // Show progress
     if (const size_t n = beams_state.common_prefix_length) {
-        llama.generated_token_probs.resize(llama.generated_token_probs.size() + n);
+        slot.generated_token_probs.resize(slot.generated_token_probs.size() + n);
         assert(0u < beams_state.n_beams);
         const llama_token * tokens = beams_state.beam_views[0].tokens;
         const auto map = [](llama_token tok) { return completion_token_output{{},tok}; };
-        std::transform(tokens, tokens + n, llama.generated_token_probs.end() - n, map);
+        std::transform(tokens, tokens + n, slot.generated_token_probs.end() - n, map);
         printf("%zu", n);
     }
     fflush(stdout);
@@ -1259,17 +1786,17 @@ struct token_translator {
     std::string operator()(const completion_token_output & cto) const { return (*this)(cto.tok); }
 };
 
-static void append_to_generated_text_from_generated_token_probs(llama_server_context &llama)
+static void append_to_generated_text_from_generated_token_probs(llama_client_slot &slot)
 {
-    auto & gtps = llama.generated_token_probs;
-    auto translator = token_translator{llama.ctx};
+    auto & gtps = slot.generated_token_probs;
+    auto translator = token_translator{slot.ctx};
     auto add_strlen = [=](size_t sum, const completion_token_output & cto) { return sum + translator(cto).size(); };
     const size_t len = std::accumulate(gtps.begin(), gtps.end(), size_t(0), add_strlen);
-    if (llama.generated_text.capacity() < llama.generated_text.size() + len) {
-        llama.generated_text.reserve(llama.generated_text.size() + len);
+    if (slot.generated_text.capacity() < slot.generated_text.size() + len) {
+        slot.generated_text.reserve(slot.generated_text.size() + len);
     }
     for (const completion_token_output & cto : gtps) {
-        llama.generated_text += translator(cto);
+        slot.generated_text += translator(cto);
     }
 }
 
@@ -1305,6 +1832,15 @@ int main(int argc, char **argv)
         return 1;
     }
 
+    if (!sparams.system_prompt.empty())
+    {
+        llama.system_prompt = sparams.system_prompt;
+        if (!llama.updateSystemPrompt())
+        {
+            return 1;
+        }
+    }
+
     Server svr;
 
     svr.set_default_headers({{"Server", "llama.cpp"},
@@ -1337,59 +1873,92 @@ int main(int argc, char **argv)
 
     svr.Post("/completion", [&llama](const Request &req, Response &res)
              {
+        const json body = json::parse(req.body);
+
         auto lock = llama.lock();
 
-        llama.rewind();
+        llama_client_slot &slot = llama.acquireSlot(lock, json_value(body, "prompt", json("")));
 
-        llama_reset_timings(llama.ctx);
+        slot.rewind();
 
-        parse_options_completion(json::parse(req.body), llama);
+        parse_options_completion(body, slot);
 
-        if (!llama.loadGrammar())
+        if (!slot.loadGrammar())
         {
+            slot.state = SLOT_IDLE;
+            llama.condition_results.notify_all();
             res.status = 400;
             return;
         }
 
-        llama.loadPrompt();
-        llama.beginCompletion();
+        llama.loadPrompt(slot);
+        slot.beginCompletion();
+
+        if (!slot.stream && slot.params.n_beams) {
+            // beam search drives the context with the sequential API in the sequence of the slot
+            // the lock is kept until the beams are done, the scheduler and the other slots wait meanwhile
+            const size_t n_prompt = slot.embd.size();
+            // evaluate the prompt, the beams start from its logits
+            for (size_t i = slot.n_past; i < n_prompt; i += slot.params.n_batch) {
+                const int n_eval = std::min((int) (n_prompt - i), slot.params.n_batch);
+                if (llama_decode(llama.ctx, llama_batch_get_one(&slot.embd[i], n_eval, i, slot.id), slot.params.n_threads) != 0) {
+                    LOG_ERROR("failed to eval", {
+                                                    {"slot_id", slot.id},
+                                                    {"n_eval", n_eval},
+                                                    {"n_past", i},
+                                                });
+                    llama_kv_cache_seq_rm(llama.ctx, slot.id, -1, -1);
+                    slot.embd.clear();
+                    slot.n_past = 0;
+                    slot.state = SLOT_IDLE;
+                    llama.condition_results.notify_all();
+                    res.status = 500;
+                    return;
+                }
+            }
+            slot.n_past = n_prompt;
+            // Fill slot.generated_token_probs vector with final beam.
+            llama_beam_search(llama.ctx, beam_search_callback, &slot, slot.params.n_beams,
+                              slot.n_past, slot.n_remain, slot.id, slot.params.n_threads);
+            // keep the prompt cached for the next request of the slot, drop the tokens evaluated by the beams
+            llama_kv_cache_seq_rm(llama.ctx, slot.id, n_prompt, -1);
+        }
+
+        lock.unlock();
 
-        if (!llama.stream) {
-            if (llama.params.n_beams) {
-                // Fill llama.generated_token_probs vector with final beam.
-                llama_beam_search(llama.ctx, beam_search_callback, &llama, llama.params.n_beams,
-                                  llama.n_past, llama.n_remain, llama.params.n_threads);
-                // Translate llama.generated_token_probs to llama.generated_text.
-                append_to_generated_text_from_generated_token_probs(llama);
+        if (!slot.stream) {
+            if (slot.params.n_beams) {
+                // Translate slot.generated_token_probs to slot.generated_text.
+                append_to_generated_text_from_generated_token_probs(slot);
             } else {
                 size_t stop_pos = std::string::npos;
 
-                while (llama.has_next_token) {
-                    const completion_token_output token_with_probs = llama.doCompletion();
-                    const std::string token_text = token_with_probs.tok == -1 ? "" : llama_token_to_piece(llama.ctx, token_with_probs.tok);
+                while (slot.has_next_token) {
+                    const completion_token_output token_with_probs = llama.doCompletion(slot);
+                    const std::string token_text = token_with_probs.tok == -1 ? "" : llama_token_to_piece(slot.ctx, token_with_probs.tok);
 
-                    stop_pos = llama.findStoppingStrings(llama.generated_text,
+                    stop_pos = slot.findStoppingStrings(slot.generated_text,
                         token_text.size(), STOP_FULL);
                 }
 
                 if (stop_pos == std::string::npos) {
-                    stop_pos = llama.findStoppingStrings(llama.generated_text, 0, STOP_PARTIAL);
+                    stop_pos = slot.findStoppingStrings(slot.generated_text, 0, STOP_PARTIAL);
                 }
                 if (stop_pos != std::string::npos) {
-                    llama.generated_text.erase(llama.generated_text.begin() + stop_pos,
-                        llama.generated_text.end());
+                    slot.generated_text.erase(slot.generated_text.begin() + stop_pos,
+                        slot.generated_text.end());
                 }
             }
 
-            auto probs = llama.generated_token_probs;
-            if (llama.params.n_probs > 0 && llama.stopped_word) {
-                const std::vector<llama_token> stop_word_toks = llama_tokenize(llama.ctx, llama.stopping_word, false);
-                probs = std::vector<completion_token_output>(llama.generated_token_probs.begin(), llama.generated_token_probs.end() - stop_word_toks.size());
+            auto probs = slot.generated_token_probs;
+            if (slot.params.n_probs > 0 && slot.stopped_word) {
+                const std::vector<llama_token> stop_word_toks = llama_tokenize(slot.ctx, slot.stopping_word, false);
+                probs = std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.end() - stop_word_toks.size());
             }
 
-            const json data = format_final_response(llama, llama.generated_text, probs);
+            const json data = format_final_response(slot, slot.generated_text, probs);
 
-            llama_print_timings(llama.ctx);
+            llama.releaseSlot(slot);
 
             res.set_content(data.dump(-1, ' ', false, json::error_handler_t::replace),
                             "application/json");
@@ -1398,53 +1967,53 @@ int main(int argc, char **argv)
                 size_t sent_count = 0;
                 size_t sent_token_probs_index = 0;
 
-                while (llama.has_next_token) {
-                    const completion_token_output token_with_probs = llama.doCompletion();
-                    if (token_with_probs.tok == -1 || llama.multibyte_pending > 0) {
+                while (slot.has_next_token) {
+                    const completion_token_output token_with_probs = llama.doCompletion(slot);
+                    if (token_with_probs.tok == -1 || slot.multibyte_pending > 0) {
                         continue;
                     }
-                    const std::string token_text = llama_token_to_piece(llama.ctx, token_with_probs.tok);
+                    const std::string token_text = llama_token_to_piece(slot.ctx, token_with_probs.tok);
 
-                    size_t pos = std::min(sent_count, llama.generated_text.size());
+                    size_t pos = std::min(sent_count, slot.generated_text.size());
 
-                    const std::string str_test = llama.generated_text.substr(pos);
+                    const std::string str_test = slot.generated_text.substr(pos);
                     bool is_stop_full = false;
                     size_t stop_pos =
-                        llama.findStoppingStrings(str_test, token_text.size(), STOP_FULL);
+                        slot.findStoppingStrings(str_test, token_text.size(), STOP_FULL);
                     if (stop_pos != std::string::npos) {
                         is_stop_full = true;
-                        llama.generated_text.erase(
-                            llama.generated_text.begin() + pos + stop_pos,
-                            llama.generated_text.end());
-                        pos = std::min(sent_count, llama.generated_text.size());
+                        slot.generated_text.erase(
+                            slot.generated_text.begin() + pos + stop_pos,
+                            slot.generated_text.end());
+                        pos = std::min(sent_count, slot.generated_text.size());
                     } else {
                         is_stop_full = false;
-                        stop_pos = llama.findStoppingStrings(str_test, token_text.size(),
+                        stop_pos = slot.findStoppingStrings(str_test, token_text.size(),
                             STOP_PARTIAL);
                     }
 
                     if (
                         stop_pos == std::string::npos ||
                         // Send rest of the text if we are at the end of the generation
-                        (!llama.has_next_token && !is_stop_full && stop_pos > 0)
+                        (!slot.has_next_token && !is_stop_full && stop_pos > 0)
                     ) {
-                        const std::string to_send = llama.generated_text.substr(pos, std::string::npos);
+                        const std::string to_send = slot.generated_text.substr(pos, std::string::npos);
 
                         sent_count += to_send.size();
 
                         std::vector<completion_token_output> probs_output = {};
 
-                        if (llama.params.n_probs > 0) {
-                            const std::vector<llama_token> to_send_toks = llama_tokenize(llama.ctx, to_send, false);
-                            size_t probs_pos = std::min(sent_token_probs_index, llama.generated_token_probs.size());
-                            size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), llama.generated_token_probs.size());
+                        if (slot.params.n_probs > 0) {
+                            const std::vector<llama_token> to_send_toks = llama_tokenize(slot.ctx, to_send, false);
+                            size_t probs_pos = std::min(sent_token_probs_index, slot.generated_token_probs.size());
+                            size_t probs_stop_pos = std::min(sent_token_probs_index + to_send_toks.size(), slot.generated_token_probs.size());
                             if (probs_pos < probs_stop_pos) {
-                                probs_output = std::vector<completion_token_output>(llama.generated_token_probs.begin() + probs_pos, llama.generated_token_probs.begin() + probs_stop_pos);
+                                probs_output = std::vector<completion_token_output>(slot.generated_token_probs.begin() + probs_pos, slot.generated_token_probs.begin() + probs_stop_pos);
                             }
                             sent_token_probs_index = probs_stop_pos;
                         }
 
-                        const json data = format_partial_response(llama, to_send, probs_output);
+                        const json data = format_partial_response(slot, to_send, probs_output);
 
                         const std::string str =
                             "data: " +
@@ -1457,17 +2026,16 @@ int main(int argc, char **argv)
 
                         if (!sink.write(str.data(), str.size())) {
                             LOG_VERBOSE("stream closed", {});
-                            llama_print_timings(llama.ctx);
                             return false;
                         }
                     }
 
-                    if (!llama.has_next_token) {
+                    if (!slot.has_next_token) {
                         // Generation is done, send extra information.
                         const json data = format_final_response(
-                            llama,
+                            slot,
                             "",
-                            std::vector<completion_token_output>(llama.generated_token_probs.begin(), llama.generated_token_probs.begin() + sent_token_probs_index)
+                            std::vector<completion_token_output>(slot.generated_token_probs.begin(), slot.generated_token_probs.begin() + sent_token_probs_index)
                         );
 
                         const std::string str =
@@ -1481,26 +2049,25 @@ int main(int argc, char **argv)
 
                         if (!sink.write(str.data(), str.size())) {
                             LOG_VERBOSE("stream closed", {});
-                            llama_print_timings(llama.ctx);
                             return false;
                         }
                     }
                 }
 
-                llama_print_timings(llama.ctx);
                 sink.done();
                 return true;
             };
             const auto on_complete = [&](bool) {
-                llama.mutex.unlock();
+                llama.releaseSlot(slot);
             };
-            lock.release();
             res.set_chunked_content_provider("text/event-stream", chunked_content_provider, on_complete);
         } });
 
     svr.Get("/model.json", [&llama](const Request &, Response &res)
             {
-        const json data = format_generation_settings(llama);
+        auto lock = llama.lock();
+
+        const json data = format_generation_settings(llama.slots[0]);
         return res.set_content(data.dump(), "application/json"); });
 
     svr.Options(R"(/.*)", [](const Request &, Response &res)
@@ -1508,21 +2075,18 @@ int main(int argc, char **argv)
 
     svr.Post("/tokenize", [&llama](const Request &req, Response &res)
              {
-        auto lock = llama.lock();
-
+        // tokenization only reads the vocab, no need to wait for the decoding steps
         const json body = json::parse(req.body);
         std::vector<llama_token> tokens;
         if (body.count("content") != 0)
         {
-            tokens = llama.tokenize(body["content"], false);
+            tokens = llama.slots[0].tokenize(body["content"], false);
         }
         const json data = format_tokenizer_response(tokens);
         return res.set_content(data.dump(), "application/json"); });
 
     svr.Post("/detokenize", [&llama](const Request &req, Response &res)
              {
-        auto lock = llama.lock();
-
         const json body = json::parse(req.body);
         std::string content;
         if (body.count("tokens") != 0)
@@ -1536,26 +2100,11 @@ int main(int argc, char **argv)
 
     svr.Post("/embedding", [&llama](const Request &req, Response &res)
              {
-        auto lock = llama.lock();
-
         const json body = json::parse(req.body);
 
-        llama.rewind();
-        llama_reset_timings(llama.ctx);
-        if (body.count("content") != 0)
-        {
-            llama.prompt = body["content"];
-        }
-        else
-        {
-            llama.prompt = "";
-        }
-        llama.params.n_predict = 0;
-        llama.loadPrompt();
-        llama.beginCompletion();
-        llama.doCompletion();
+        const json content = json_value(body, "content", json(""));
 
-        const json data = format_embedding_response(llama);
+        const json data = format_embedding_response(llama.getEmbedding(content));
         return res.set_content(data.dump(), "application/json"); });
 
     svr.set_logger(log_server_request);
@@ -1604,14 +2153,24 @@ int main(int argc, char **argv)
                                           {"port", sparams.port},
                                       });
 
-    if (!svr.listen_after_bind())
+    // the scheduler decodes the pending tokens of all the slots in a single batch per step
+    std::thread scheduler([&llama]()
+                          {
+        while (llama.running)
+        {
+            llama.updateSlots();
+        } });
+
+    const bool ok = svr.listen_after_bind();
+
+    llama.stop();
+    scheduler.join();
+
+    if (!ok)
     {
         return 1;
     }
 
-    if (llama.grammar != nullptr) {
-        llama_grammar_free(llama.grammar);
-    }
     llama_backend_free();
 
     return 0;
@@ -71,22 +71,36 @@ int main(int argc, char ** argv) {
 
     const int n_gen = std::min(32, max_context_size);
 
-    while (llama_get_kv_cache_token_count(ctx) < n_gen) {
-        // evaluate the transformer
+    // create a llama_batch with size 512
+    // we use this object to submit token data for decoding
 
-        if (llama_eval(ctx, tokens_list.data(), int(tokens_list.size()), llama_get_kv_cache_token_count(ctx), params.n_threads)) {
-            fprintf(stderr, "%s : failed to eval\n", __func__);
-            return 1;
-        }
+    llama_batch batch = llama_batch_init(512, 0);
 
-        tokens_list.clear();
+    // evaluate the initial prompt
+    batch.n_tokens = tokens_list.size();
 
-        // sample the next token
+    for (int32_t i = 0; i < batch.n_tokens; i++) {
+        batch.token[i]  = tokens_list[i];
+        batch.pos[i]    = i;
+        batch.seq_id[i] = 0;
+        batch.logits[i] = false;
+    }
+
+    // llama_decode will output logits only for the last token of the prompt
+    batch.logits[batch.n_tokens - 1] = true;
+
+    if (llama_decode(ctx, batch, params.n_threads) != 0) {
+        fprintf(stderr, "%s : llama_decode() failed\n", __func__);
+        return 1;
+    }
 
-        llama_token new_token_id = 0;
+    int n_cur = batch.n_tokens;
 
-        auto logits  = llama_get_logits(ctx);
-        auto n_vocab = llama_n_vocab(ctx);
+    while (n_cur < n_gen) {
+        // sample the next token
+
+        auto   n_vocab = llama_n_vocab(ctx);
+        auto * logits  = llama_get_logits_ith(ctx, batch.n_tokens - 1);
 
         std::vector<llama_token_data> candidates;
         candidates.reserve(n_vocab);
@@ -97,7 +111,7 @@ int main(int argc, char ** argv) {
 
         llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
 
-        new_token_id = llama_sample_token_greedy(ctx , &candidates_p);
+        const llama_token new_token_id = llama_sample_token_greedy(ctx, &candidates_p);
 
         // is it an end of stream ?
         if (new_token_id == llama_token_eos(ctx)) {
@@ -109,10 +123,25 @@ int main(int argc, char ** argv) {
         printf("%s", llama_token_to_piece(ctx, new_token_id).c_str());
         fflush(stdout);
 
-        // push this new token for next evaluation
-        tokens_list.push_back(new_token_id);
+        // prepare the next batch with the sampled token
+        batch.n_tokens = 1;
+
+        batch.token[0]  = new_token_id;
+        batch.pos[0]    = n_cur;
+        batch.seq_id[0] = 0;
+        batch.logits[0] = true;
+
+        n_cur += 1;
+
+        // evaluate the current batch with the transformer model
+        if (llama_decode(ctx, batch, params.n_threads)) {
+            fprintf(stderr, "%s : failed to eval\n", __func__);
+            return 1;
+        }
     }
 
+    llama_batch_free(batch);
+
     llama_free(ctx);
     llama_free_model(model);
 
@@ -1,7 +1,9 @@
 #include "ggml-alloc.h"
 #include "ggml.h"
 #include <assert.h>
+#include <limits.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -39,6 +41,11 @@ struct hash_node {
     struct ggml_tensor * t;
     int n_children;
     int n_views;
+
+    // used by the graph planner
+    int  id;        // order of the first visit, starting at 1 (0 = not visited yet)
+    int  rec;       // allocation record holding the data of the tensor, -1 if none
+    bool allocated;
 };
 
 static size_t hash(void * p) {
@@ -91,6 +98,18 @@ struct ggml_allocr {
     int parse_seq[GGML_MAX_CONCUR];
     int parse_seq_len;
 
+    // plan of the last graph allocated with the planner, reused while the structure of the graph does not change
+    // (see ggml_allocr_plan_graph)
+    int64_t * plan_key;
+    int       plan_key_len;
+    int       plan_key_cap;
+    int64_t * plan_key_tmp; // key of the graph being allocated
+    int       plan_key_tmp_len;
+    int       plan_key_tmp_cap;
+    size_t  * plan_offs;    // offset of each tensor allocated by the plan, in the order of the walk
+    int       plan_n_offs;
+    size_t    plan_max_size;
+
 #ifdef GGML_ALLOCATOR_DEBUG
     struct ggml_tensor * allocated_tensors[1024];
 #endif
@@ -300,6 +319,15 @@ struct ggml_allocr * ggml_allocr_new(void * data, size_t size, size_t alignment)
         /*.measure       = */ false,
         /*.parse_seq     = */ {0},
         /*.parse_seq_len = */ 0,
+        /*.plan_key      = */ NULL,
+        /*.plan_key_len  = */ 0,
+        /*.plan_key_cap  = */ 0,
+        /*.plan_key_tmp  = */ NULL,
+        /*.plan_key_tmp_len = */ 0,
+        /*.plan_key_tmp_cap = */ 0,
+        /*.plan_offs     = */ NULL,
+        /*.plan_n_offs   = */ 0,
+        /*.plan_max_size = */ 0,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
 #endif
@@ -380,6 +408,15 @@ struct ggml_allocr * ggml_allocr_new_measure(size_t alignment) {
         /*.measure       = */ true,
         /*.parse_seq     = */ {0},
         /*.parse_seq_len = */ 0,
+        /*.plan_key      = */ NULL,
+        /*.plan_key_len  = */ 0,
+        /*.plan_key_cap  = */ 0,
+        /*.plan_key_tmp  = */ NULL,
+        /*.plan_key_tmp_len = */ 0,
+        /*.plan_key_tmp_cap = */ 0,
+        /*.plan_offs     = */ NULL,
+        /*.plan_n_offs   = */ 0,
+        /*.plan_max_size = */ 0,
 #ifdef GGML_ALLOCATOR_DEBUG
         /*.allocated_tensors = */ {0},
 #endif
@@ -394,6 +431,9 @@ void ggml_allocr_free(struct ggml_allocr * alloc) {
     if (alloc->measure) {
         free_measure_vmem(alloc->data, alloc->size);
     }
+    free(alloc->plan_key);
+    free(alloc->plan_key_tmp);
+    free(alloc->plan_offs);
     free(alloc);
 }
 
@@ -628,6 +668,463 @@ static size_t ggml_allocr_alloc_graph_tensors_n(
     return alloc->max_size;
 }
 
+//////////// graph planner
+
+// instead of allocating the tensors one at a time while the graph is walked, the planner replays the walk of
+// ggml_allocr_alloc_graph_tensors_n (same in-place reuse and same free points) to find the lifetime of every
+// allocation, then packs the allocations offline: from the largest to the smallest, each one goes into the smallest
+// gap left by the allocations already placed whose lifetimes overlap its own (greedy by size, best fit)
+// the offsets are cached with a key that describes the structure of the graph, so the next graph with the same
+// shapes only assigns the cached offsets
+
+struct alloc_rec {
+    size_t size;
+    size_t offs;
+    int    start; // first step where the allocation is live
+    int    end;   // last step where the allocation is live
+    bool   fixed; // allocated before the graph, the offset is given
+};
+
+struct alloc_range {
+    size_t offs;
+    size_t size;
+};
+
+static void plan_key_push(struct ggml_allocr * alloc, int64_t v) {
+    if (alloc->plan_key_tmp_len >= alloc->plan_key_tmp_cap) {
+        alloc->plan_key_tmp_cap = MAX(1024, 2*alloc->plan_key_tmp_cap);
+        alloc->plan_key_tmp = (int64_t *) realloc(alloc->plan_key_tmp, alloc->plan_key_tmp_cap*sizeof(int64_t));
+        GGML_ASSERT(alloc->plan_key_tmp);
+    }
+    alloc->plan_key_tmp[alloc->plan_key_tmp_len++] = v;
+}
+
+// assign the visit order of a tensor and describe everything the allocation of the tensor depends on
+static void plan_key_visit(struct ggml_allocr * alloc, int * n_ids, struct ggml_tensor * t) {
+    struct hash_node * hn = hash_get(alloc->hash_table, t);
+    if (hn->id != 0) {
+        return;
+    }
+    hn->id = ++(*n_ids);
+
+    if (t->data != NULL) {
+        if (ggml_allocr_is_own(alloc, t)) {
+            // the size of a view does not matter, only the size of the allocation it points into
+            plan_key_push(alloc, (int64_t) ((char *) t->data - (char *) alloc->data));
+            plan_key_push(alloc, ggml_is_view(t) ? -1 : (int64_t) ggml_nbytes(t));
+        } else {
+            plan_key_push(alloc, -1);
+        }
+        return;
+    }
+
+    plan_key_push(alloc, t->op);
+    plan_key_push(alloc, t->type);
+    for (int i = 0; i < GGML_MAX_DIMS; i++) {
+        plan_key_push(alloc, t->ne[i]);
+        plan_key_push(alloc, (int64_t) t->nb[i]);
+    }
+    plan_key_push(alloc, t->view_src ? hash_get(alloc->hash_table, t->view_src)->id : 0);
+    plan_key_push(alloc, (int64_t) t->view_offs);
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        plan_key_push(alloc, t->src[j] ? hash_get(alloc->hash_table, t->src[j])->id : 0);
+    }
+}
+
+static void plan_build_key(struct ggml_allocr * alloc, struct ggml_cgraph * gf) {
+    alloc->plan_key_tmp_len = 0;
+
+    plan_key_push(alloc, gf->n_nodes);
+    plan_key_push(alloc, (int64_t) alloc->size);
+    plan_key_push(alloc, (int64_t) alloc->alignment);
+    plan_key_push(alloc, (int64_t) aligned_offset(alloc->data, 0, alloc->alignment));
+    plan_key_push(alloc, alloc->n_free_blocks);
+    for (int i = 0; i < alloc->n_free_blocks; i++) {
+        plan_key_push(alloc, (int64_t) ((char *) alloc->free_blocks[i].addr - (char *) alloc->data));
+        plan_key_push(alloc, (int64_t) alloc->free_blocks[i].size);
+    }
+
+    int n_ids = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] == NULL) {
+                break;
+            }
+            plan_key_visit(alloc, &n_ids, node->src[j]);
+        }
+        plan_key_visit(alloc, &n_ids, node);
+    }
+}
+
+// same as allocate_node, with the offsets of the plan
+static void plan_apply_node(struct ggml_allocr * alloc, struct ggml_tensor * t, int * i_offs) {
+    if (t->data != NULL) {
+        return;
+    }
+    if (ggml_is_view(t)) {
+        assert(t->view_src->data != NULL);
+        t->data = (char *) t->view_src->data + t->view_offs;
+    } else {
+        GGML_ASSERT(*i_offs < alloc->plan_n_offs);
+        t->data = (char *) alloc->data + alloc->plan_offs[(*i_offs)++];
+    }
+}
+
+static void plan_apply(struct ggml_allocr * alloc, struct ggml_cgraph * gf) {
+    int i_offs = 0;
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] == NULL) {
+                break;
+            }
+            plan_apply_node(alloc, node->src[j], &i_offs);
+        }
+        plan_apply_node(alloc, node, &i_offs);
+    }
+    GGML_ASSERT(i_offs == alloc->plan_n_offs);
+
+    alloc->max_size = MAX(alloc->max_size, alloc->plan_max_size);
+
+    // everything below the end of the plan may be in use until the next reset
+    size_t end = alloc->plan_max_size;
+    alloc->n_free_blocks = 0;
+    if (end < alloc->size) {
+        alloc->free_blocks[0].addr = (char *) alloc->data + end;
+        alloc->free_blocks[0].size = alloc->size - end;
+        alloc->n_free_blocks = 1;
+    }
+}
+
+struct plan_state {
+    struct alloc_rec * recs;
+    int n_recs;
+    int cap_recs;
+    int * order; // record of each tensor allocated by the plan, in the order of the walk
+    int n_order;
+    int cap_order;
+};
+
+static int plan_new_rec(struct plan_state * st, size_t size, int start) {
+    if (st->n_recs == st->cap_recs) {
+        st->cap_recs = MAX(256, 2*st->cap_recs);
+        st->recs = (struct alloc_rec *) realloc(st->recs, st->cap_recs*sizeof(struct alloc_rec));
+        GGML_ASSERT(st->recs);
+    }
+    struct alloc_rec * rec = &st->recs[st->n_recs];
+    rec->size  = size;
+    rec->offs  = 0;
+    rec->start = start;
+    rec->end   = INT_MAX;
+    rec->fixed = false;
+    return st->n_recs++;
+}
+
+static void plan_alloc_node(struct ggml_allocr * alloc, struct plan_state * st, struct ggml_tensor * t, int step) {
+    struct hash_node * ht = alloc->hash_table;
+    struct hash_node * hn = hash_get(ht, t);
+    if (hn->allocated) {
+        return;
+    }
+    hn->allocated = true;
+    hn->rec = -1;
+
+    if (t->data != NULL) {
+        // allocated before the graph with ggml_allocr_alloc: live from the start, until the graph frees it
+        if (!ggml_is_view(t) && ggml_allocr_is_own(alloc, t)) {
+            hn->rec = plan_new_rec(st, aligned_offset(NULL, ggml_allocr_get_alloc_size(alloc, t), alloc->alignment), 0);
+            st->recs[hn->rec].offs  = (char *) t->data - (char *) alloc->data;
+            st->recs[hn->rec].fixed = true;
+        }
+        return;
+    }
+
+    if (ggml_is_view(t)) {
+        hn->rec = hash_get(ht, t->view_src)->rec;
+        return;
+    }
+
+    int rec = -1;
+
+    // see if we can reuse a parent's buffer (inplace), with the same conditions as allocate_node
+    if (ggml_op_can_inplace(t->op)) {
+        for (int i = 0; i < GGML_MAX_SRC; i++) {
+            struct ggml_tensor * parent = t->src[i];
+            if (parent == NULL) {
+                break;
+            }
+            struct hash_node * p_hn = hash_get(ht, parent);
+            if (!p_hn->allocated || p_hn->rec < 0) {
+                continue;
+            }
+            if (p_hn->n_children == 1 && p_hn->n_views == 0 && ggml_are_same_layout(t, parent)) {
+                if (ggml_is_view(parent)) {
+                    struct hash_node * view_src_hn = hash_get(ht, parent->view_src);
+                    if (view_src_hn->n_views == 1 && view_src_hn->n_children == 0 && parent->view_offs == 0) {
+                        rec = p_hn->rec;
+                        break;
+                    }
+                } else {
+                    rec = p_hn->rec;
+                    break;
+                }
+            }
+        }
+    }
+
+    if (rec < 0) {
+        rec = plan_new_rec(st, aligned_offset(NULL, ggml_allocr_get_alloc_size(alloc, t), alloc->alignment), step);
+    }
+
+    hn->rec = rec;
+
+    if (st->n_order == st->cap_order) {
+        st->cap_order = MAX(256, 2*st->cap_order);
+        st->order = (int *) realloc(st->order, st->cap_order*sizeof(int));
+        GGML_ASSERT(st->order);
+    }
+    st->order[st->n_order++] = rec;
+}
+
+static void plan_free_rec(struct plan_state * st, int rec, int step) {
+    if (rec >= 0 && st->recs[rec].end == INT_MAX) {
+        st->recs[rec].end = step;
+    }
+}
+
+// fixed records first, then by decreasing size
+static int plan_cmp_size_desc(const void * a, const void * b) {
+    const struct alloc_rec * ra = *(const struct alloc_rec * const *) a;
+    const struct alloc_rec * rb = *(const struct alloc_rec * const *) b;
+    if (ra->fixed != rb->fixed) {
+        return ra->fixed ? -1 : 1;
+    }
+    if (ra->size != rb->size) {
+        return ra->size > rb->size ? -1 : 1;
+    }
+    return (ra->start > rb->start) - (ra->start < rb->start);
+}
+
+static int plan_cmp_offs(const void * a, const void * b) {
+    const struct alloc_range * ra = (const struct alloc_range *) a;
+    const struct alloc_range * rb = (const struct alloc_range *) b;
+    return (ra->offs > rb->offs) - (ra->offs < rb->offs);
+}
+
+// add the range [begin, end) minus the ranges in used (sorted by offset) to fixed
+static int plan_add_fixed(struct alloc_range * fixed, int n_fixed, size_t begin, size_t end, const struct alloc_range * used, int n_used) {
+    for (int i = 0; i < n_used && begin < end; i++) {
+        if (used[i].offs + used[i].size <= begin || used[i].offs >= end) {
+            continue;
+        }
+        if (used[i].offs > begin) {
+            fixed[n_fixed++] = (struct alloc_range) { begin, used[i].offs - begin };
+        }
+        begin = used[i].offs + used[i].size;
+    }
+    if (begin < end) {
+        fixed[n_fixed++] = (struct alloc_range) { begin, end - begin };
+    }
+    return n_fixed;
+}
+
+// returns false if the plan does not fit in the buffer
+static bool ggml_allocr_plan_graph(struct ggml_allocr * alloc, struct ggml_cgraph * gf) {
+    struct hash_node * ht = alloc->hash_table;
+
+    // count number of children and views
+    for (int i = 0; i < gf->n_nodes; i++) {
+        struct ggml_tensor * node = gf->nodes[i];
+
+        if (ggml_is_view(node)) {
+            hash_get(ht, node->view_src)->n_views += 1;
+        }
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            struct ggml_tensor * parent = node->src[j];
+            if (parent == NULL) {
+                break;
+            }
+            hash_get(ht, parent)->n_children += 1;
+        }
+    }
+
+    // replay the walk to find the lifetime of each allocation
+    struct plan_state st = { NULL, 0, 0, NULL, 0, 0 };
+
+    for (int step = 0; step < gf->n_nodes; step++) {
+        struct ggml_tensor * node = gf->nodes[step];
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            if (node->src[j] == NULL) {
+                break;
+            }
+            plan_alloc_node(alloc, &st, node->src[j], step);
+        }
+        plan_alloc_node(alloc, &st, node, step);
+
+        const int node_rec = hash_get(ht, node)->rec;
+
+        for (int j = 0; j < GGML_MAX_SRC; j++) {
+            struct ggml_tensor * parent = node->src[j];
+            if (parent == NULL) {
+                break;
+            }
+            struct hash_node * p_hn = hash_get(ht, parent);
+            p_hn->n_children -= 1;
+
+            if (p_hn->n_children == 0 && p_hn->n_views == 0) {
+                if (ggml_is_view(parent)) {
+                    struct hash_node * view_src_hn = hash_get(ht, parent->view_src);
+                    view_src_hn->n_views -= 1;
+                    if (view_src_hn->n_views == 0 && view_src_hn->n_children == 0 && view_src_hn->rec != node_rec) {
+                        plan_free_rec(&st, view_src_hn->rec, step);
+                    }
+                } else if (p_hn->rec != node_rec) {
+                    plan_free_rec(&st, p_hn->rec, step);
+                }
+            }
+        }
+    }
+
+    struct alloc_rec ** sorted = (struct alloc_rec **) malloc(MAX(1, st.n_recs)*sizeof(struct alloc_rec *));
+    int n_fixed_recs = 0;
+    for (int i = 0; i < st.n_recs; i++) {
+        if (st.recs[i].end == INT_MAX) {
+            st.recs[i].end = gf->n_nodes; // not freed by the graph
+        }
+        sorted[i] = &st.recs[i];
+        n_fixed_recs += st.recs[i].fixed;
+    }
+    qsort(sorted, st.n_recs, sizeof(struct alloc_rec *), plan_cmp_size_desc);
+
+    // the rest of the memory in use before the graph (allocated with ggml_allocr_alloc, but not used by the graph)
+    // stays in use for the whole graph
+    int n_fixed = 0;
+    struct alloc_range * fixed = (struct alloc_range *) malloc((alloc->n_free_blocks + n_fixed_recs + 1)*sizeof(struct alloc_range));
+    {
+        struct alloc_range * used = (struct alloc_range *) malloc((n_fixed_recs + 1)*sizeof(struct alloc_range));
+        for (int i = 0; i < n_fixed_recs; i++) {
+            used[i] = (struct alloc_range) { sorted[i]->offs, sorted[i]->size };
+        }
+        qsort(used, n_fixed_recs, sizeof(struct alloc_range), plan_cmp_offs);
+
+        size_t cur = aligned_offset(alloc->data, 0, alloc->alignment);
+        for (int i = 0; i < alloc->n_free_blocks; i++) {
+            const size_t offs = (char *) alloc->free_blocks[i].addr - (char *) alloc->data;
+            if (offs > cur) {
+                n_fixed = plan_add_fixed(fixed, n_fixed, cur, offs, used, n_fixed_recs);
+            }
+            cur = offs + alloc->free_blocks[i].size;
+        }
+        if (cur < alloc->size) {
+            n_fixed = plan_add_fixed(fixed, n_fixed, cur, alloc->size, used, n_fixed_recs);
+        }
+        free(used);
+    }
+
+    // place the allocations
+    struct alloc_range * conflicts = (struct alloc_range *) malloc((st.n_recs + n_fixed + 1)*sizeof(struct alloc_range));
+    size_t max_size = aligned_offset(alloc->data, 0, alloc->alignment);
+    for (int i = 0; i < n_fixed; i++) {
+        if (fixed[i].offs + fixed[i].size < alloc->size) {
+            max_size = MAX(max_size, fixed[i].offs + fixed[i].size);
+        }
+    }
+    for (int i = 0; i < n_fixed_recs; i++) {
+        max_size = MAX(max_size, sorted[i]->offs + sorted[i]->size);
+    }
+
+    for (int i = n_fixed_recs; i < st.n_recs; i++) {
+        struct alloc_rec * rec = sorted[i];
+
+        int n_conflicts = 0;
+        for (int k = 0; k < n_fixed; k++) {
+            conflicts[n_conflicts++] = fixed[k];
+        }
+        for (int k = 0; k < i; k++) {
+            const struct alloc_rec * other = sorted[k];
+            if (other->start <= rec->end && rec->start <= other->end) {
+                conflicts[n_conflicts++] = (struct alloc_range) { other->offs, other->size };
+            }
+        }
+        qsort(conflicts, n_conflicts, sizeof(struct alloc_range), plan_cmp_offs);
+
+        // smallest gap that fits, otherwise after the last conflict
+        size_t best_offs = SIZE_MAX;
+        size_t best_gap  = SIZE_MAX;
+        size_t cur = aligned_offset(alloc->data, 0, alloc->alignment);
+        for (int k = 0; k < n_conflicts; k++) {
+            if (conflicts[k].offs > cur) {
+                const size_t gap = conflicts[k].offs - cur;
+                if (gap >= rec->size && gap < best_gap) {
+                    best_offs = cur;
+                    best_gap  = gap;
+                }
+            }
+            cur = MAX(cur, conflicts[k].offs + conflicts[k].size);
+        }
+        if (best_offs == SIZE_MAX) {
+            best_offs = cur;
+        }
+
+        rec->offs = best_offs;
+        max_size = MAX(max_size, rec->offs + rec->size);
+    }
+
+    free(conflicts);
+    free(sorted);
+    free(fixed);
+
+    const bool fits = max_size <= alloc->size;
+
+    if (fits) {
+        // cache the plan
+        int64_t * key = alloc->plan_key;
+        const int key_cap = alloc->plan_key_cap;
+        alloc->plan_key         = alloc->plan_key_tmp;
+        alloc->plan_key_len     = alloc->plan_key_tmp_len;
+        alloc->plan_key_cap     = alloc->plan_key_tmp_cap;
+        alloc->plan_key_tmp     = key;
+        alloc->plan_key_tmp_len = 0;
+        alloc->plan_key_tmp_cap = key_cap;
+
+        free(alloc->plan_offs);
+        alloc->plan_offs = (size_t *) malloc(MAX(1, st.n_order)*sizeof(size_t));
+        for (int i = 0; i < st.n_order; i++) {
+            alloc->plan_offs[i] = st.recs[st.order[i]].offs;
+        }
+        alloc->plan_n_offs   = st.n_order;
+        alloc->plan_max_size = max_size;
+    }
+
+    free(st.recs);
+    free(st.order);
+
+    return fits;
+}
+
 size_t ggml_allocr_alloc_graph(struct ggml_allocr * alloc, struct ggml_cgraph * graph) {
+#ifndef GGML_ALLOCATOR_DEBUG
+    // the planner follows the nodes in graph order, the allocations of a parse_seq are done by the greedy allocator
+    if (alloc->parse_seq_len == 0) {
+        memset(alloc->hash_table, 0, sizeof(struct hash_node) * GGML_GRAPH_HASHTABLE_SIZE);
+
+        plan_build_key(alloc, graph);
+
+        const bool cached = alloc->plan_key != NULL && alloc->plan_key_len == alloc->plan_key_tmp_len &&
+            memcmp(alloc->plan_key, alloc->plan_key_tmp, alloc->plan_key_len*sizeof(int64_t)) == 0;
+
+        if (cached || ggml_allocr_plan_graph(alloc, graph)) {
+            plan_apply(alloc, graph);
+            return alloc->max_size;
+        }
+
+        // the plan does not fit in the buffer, fall back to the greedy allocator
+        memset(alloc->hash_table, 0, sizeof(struct hash_node) * GGML_GRAPH_HASHTABLE_SIZE);
+    }
+#endif
+
     return ggml_allocr_alloc_graph_tensors_n(alloc, &graph, 1, NULL, NULL);
 }
@@ -738,12 +738,17 @@ void ggml_metal_graph_compute(
 
                             // utilize float4
                             GGML_ASSERT(ne00 % 4 == 0);
-                            const int64_t nb = ne00/4;
+                            int64_t nb = ne00/4;
 
                             if (ggml_nelements(src1) == ne10) {
                                 // src1 is a row
                                 GGML_ASSERT(ne11 == 1);
                                 [encoder setComputePipelineState:ctx->pipeline_add_row];
+                            } else if (ggml_nelements(src1) < ggml_nelements(src0)) {
+                                // src1 is repeated along the outer dimensions of src0 (e.g. KQ_mask)
+                                GGML_ASSERT(ggml_nelements(src0) % ggml_nelements(src1) == 0);
+                                nb = ggml_nelements(src1)/4;
+                                [encoder setComputePipelineState:ctx->pipeline_add_row];
                             } else {
                                 [encoder setComputePipelineState:ctx->pipeline_add];
                             }
@@ -1210,6 +1215,11 @@ void ggml_metal_graph_compute(
                             [encoder setBytes:&freq_base  length:sizeof(float) atIndex:21];
                             [encoder setBytes:&freq_scale length:sizeof(float) atIndex:22];
 
+                            // optional per-row positions, overrides n_past
+                            const int has_pos = src1 != NULL;
+                            [encoder setBuffer:(has_pos ? id_src1 : id_src0) offset:(has_pos ? offs_src1 : offs_src0) atIndex:23];
+                            [encoder setBytes:&has_pos length:sizeof(     int) atIndex:24];
+
                             [encoder dispatchThreadgroups:MTLSizeMake(ne01, ne02, ne03) threadsPerThreadgroup:MTLSizeMake(32, 1, 1)];
                         } break;
                     case GGML_OP_DUP:
@@ -830,6 +830,8 @@ kernel void kernel_rope(
         constant       int & mode,
         constant     float & freq_base,
         constant     float & freq_scale,
+        device const int32_t * pos,
+        constant       int & has_pos,
         uint  tiitg[[thread_index_in_threadgroup]],
         uint3 tptg[[threads_per_threadgroup]],
         uint3 tgpig[[threadgroup_position_in_grid]]) {
@@ -839,7 +841,7 @@ kernel void kernel_rope(
 
     const bool is_neox = mode & 2;
 
-    const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+    const int64_t p = has_pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
 
     const float theta_0 = freq_scale * (float)p;
     const float inv_ndims = -1.f/n_dims;
@@ -14,10 +14,18 @@
 struct ggml_mpi_context {
     int rank;
     int size;
+
+    int thread_level; // MPI_THREAD_* level provided by the MPI library
+
+    bool tensor_parallel;
 };
 
+static int g_mpi_thread_level = MPI_THREAD_SINGLE;
+
 void ggml_mpi_backend_init(void) {
-    MPI_Init(NULL, NULL);
+    // the reductions of the tensor parallel mode are computed by whichever compute thread runs the node,
+    // never by two threads at the same time
+    MPI_Init_thread(NULL, NULL, MPI_THREAD_SERIALIZED, &g_mpi_thread_level);
 }
 
 void ggml_mpi_backend_free(void) {
@@ -30,6 +38,8 @@ struct ggml_mpi_context * ggml_mpi_init(void) {
     MPI_Comm_rank(MPI_COMM_WORLD, &ctx->rank);
     MPI_Comm_size(MPI_COMM_WORLD, &ctx->size);
 
+    ctx->thread_level = g_mpi_thread_level;
+
     return ctx;
 }
 
@@ -41,6 +51,40 @@ int ggml_mpi_rank(struct ggml_mpi_context * ctx) {
     return ctx->rank;
 }
 
+int ggml_mpi_size(struct ggml_mpi_context * ctx) {
+    return ctx->size;
+}
+
+bool ggml_mpi_tensor_parallel_supported(struct ggml_mpi_context * ctx) {
+    return ctx->thread_level >= MPI_THREAD_SERIALIZED;
+}
+
+void ggml_mpi_set_tensor_parallel(struct ggml_mpi_context * ctx, bool tensor_parallel) {
+    GGML_ASSERT(!tensor_parallel || ggml_mpi_tensor_parallel_supported(ctx));
+
+    ctx->tensor_parallel = tensor_parallel;
+}
+
+static void ggml_mpi_allreduce_f32(struct ggml_tensor * dst, const struct ggml_tensor * a, int ith, int nth, void * userdata) {
+    UNUSED(ith);
+    UNUSED(nth);
+    UNUSED(userdata);
+
+    GGML_ASSERT(dst->type == GGML_TYPE_F32 && ggml_is_contiguous(dst));
+    GGML_ASSERT(dst->data == a->data);
+
+    const int retval = MPI_Allreduce(MPI_IN_PLACE, dst->data, ggml_nelements(dst), MPI_FLOAT, MPI_SUM, MPI_COMM_WORLD);
+    GGML_ASSERT(retval == MPI_SUCCESS);
+}
+
+struct ggml_tensor * ggml_mpi_allreduce(
+        struct ggml_mpi_context * ctx_mpi,
+            struct ggml_context * ctx,
+             struct ggml_tensor * a) {
+    // a single task: the nodes must call MPI in the same order, and one at a time
+    return ggml_map_custom1_inplace(ctx, a, ggml_mpi_allreduce_f32, 1, ctx_mpi);
+}
+
 void ggml_mpi_eval_init(
         struct ggml_mpi_context * ctx_mpi,
                             int * n_tokens,
@@ -115,14 +159,13 @@ void ggml_mpi_graph_compute_pre(
         return;
     }
 
-    struct ggml_tensor * inp0 = ggml_graph_get_tensor(gf, "layer_inp_0");
-    if (inp0 == NULL) {
-        fprintf(stderr, "%s: tensor 'inp0' not found\n", __func__);
+    if (ctx_mpi->tensor_parallel) {
+        // every node computes the whole graph with its part of the weights, it only needs the input tokens
+        const int retval = MPI_Bcast(inp_tokens->data, ggml_nelements(inp_tokens), MPI_INT32_T, 0, MPI_COMM_WORLD);
+        GGML_ASSERT(retval == MPI_SUCCESS);
         return;
     }
 
-    GGML_ASSERT(inp0 == gf->nodes[0]);
-
     // distribute the compute graph into slices across the MPI nodes
     //
     // the main node (0) processes the last layers + the remainder of the compute graph
@@ -134,70 +177,60 @@ void ggml_mpi_graph_compute_pre(
     // node n-1: [(n-2) * n_per_node, (n-1) * n_per_node)
     // node 0:   [(n-1) * n_per_node,            n_nodes)
     //
+    const int n_per_node = (n_layers + (mpi_size - 1)) / mpi_size;
+
+    const int mpi_idx = mpi_rank > 0 ? mpi_rank - 1 : mpi_size - 1;
+
+    const int il0 =               (mpi_idx + 0) * n_per_node;
+    const int il1 = MIN(n_layers, (mpi_idx + 1) * n_per_node);
+
+    char name_l0[GGML_MAX_NAME];
+    char name_l1[GGML_MAX_NAME];
+
+    snprintf(name_l0, sizeof(name_l0), "layer_inp_%d", il0);
+    snprintf(name_l1, sizeof(name_l1), "layer_inp_%d", il1);
+
+    const int idx_l0 =                ggml_graph_get_node_idx(gf, name_l0);
+    const int idx_l1 = mpi_rank > 0 ? ggml_graph_get_node_idx(gf, name_l1) + 1 : gf->n_nodes;
+
+    if (idx_l0 < 0 || idx_l1 < 0) {
+        fprintf(stderr, "%s: layer input nodes not found\n", __func__);
+        return;
+    }
+
+    // the input of the first layer of the slice is received from the previous node, straight into its tensor:
+    // the graph allocator keeps its memory until its last use in that layer
+    struct ggml_tensor * inp = gf->nodes[idx_l0];
+
     if (mpi_rank > 0) {
         if (mpi_rank == 1) {
             // the first node (1) receives the input tokens from the main node (0)
             ggml_mpi_tensor_recv(inp_tokens, 0);
         } else {
-            // recv input data for each node into the "inp0" tensor (i.e. the first node in the compute graph)
-            ggml_mpi_tensor_recv(inp0, mpi_rank - 1);
+            ggml_mpi_tensor_recv(inp, mpi_rank - 1);
         }
     } else if (mpi_size > 1) {
         // node 0 sends the input tokens to node 1
         ggml_mpi_tensor_send(inp_tokens, 1);
 
         // recv the output data from the last node
-        ggml_mpi_tensor_recv(inp0, mpi_size - 1);
+        ggml_mpi_tensor_recv(inp, mpi_size - 1);
     }
 
-    {
-        const int n_per_node = (n_layers + (mpi_size - 1)) / mpi_size;
-
-        const int mpi_idx = mpi_rank > 0 ? mpi_rank - 1 : mpi_size - 1;
-
-        const int il0 =               (mpi_idx + 0) * n_per_node;
-        const int il1 = MIN(n_layers, (mpi_idx + 1) * n_per_node);
-
-        char name_l0[GGML_MAX_NAME];
-        char name_l1[GGML_MAX_NAME];
-
-        snprintf(name_l0, sizeof(name_l0), "layer_inp_%d", il0);
-        snprintf(name_l1, sizeof(name_l1), "layer_inp_%d", il1);
-
-        const int idx_l0 =                ggml_graph_get_node_idx(gf, name_l0);
-        const int idx_l1 = mpi_rank > 0 ? ggml_graph_get_node_idx(gf, name_l1) + 1 : gf->n_nodes;
-
-        if (idx_l0 < 0 || idx_l1 < 0) {
-            fprintf(stderr, "%s: layer input nodes not found\n", __func__);
-            return;
-        }
-
-        // attach the input data to all nodes that need it
-        // TODO: not great - should be able to do this without modifying the compute graph (see next TODO below)
-        for (int i = idx_l0; i < idx_l1; i++) {
-            if (gf->nodes[i]->src[0] == gf->nodes[idx_l0]) {
-                gf->nodes[i]->src[0] =  inp0;
-            }
-            if (gf->nodes[i]->src[1] == gf->nodes[idx_l0]) {
-                gf->nodes[i]->src[1] =  inp0;
-            }
-        }
-
-        // TODO: instead of rearranging the nodes, we should be able to execute a subset of the compute graph
-        for (int i = 1; i < idx_l1 - idx_l0; i++) {
-            gf->nodes[i] = gf->nodes[idx_l0 + i];
-            gf->grads[i] = gf->grads[idx_l0 + i];
-        }
+    // the first node performs the "get_rows" operation, the rest of the nodes get the data from the previous node
+    if (mpi_idx != 0) {
+        inp->op = GGML_OP_NONE;
+    }
 
-        // the first node performs the "get_rows" operation, the rest of the nodes get the data from the previous node
-        if (mpi_idx != 0) {
-            gf->nodes[0]->op = GGML_OP_NONE;
-        }
+    // TODO: instead of rearranging the nodes, we should be able to execute a subset of the compute graph
+    for (int i = 0; i < idx_l1 - idx_l0; i++) {
+        gf->nodes[i] = gf->nodes[idx_l0 + i];
+        gf->grads[i] = gf->grads[idx_l0 + i];
+    }
 
-        gf->n_nodes = idx_l1 - idx_l0;
+    gf->n_nodes = idx_l1 - idx_l0;
 
-        //fprintf(stderr, "%s: node %d: processing %d nodes [%d, %d)\n", __func__, mpi_rank, gf->n_nodes, il0, il1);
-    }
+    //fprintf(stderr, "%s: node %d: processing %d nodes [%d, %d)\n", __func__, mpi_rank, gf->n_nodes, il0, il1);
 }
 
 void ggml_mpi_graph_compute_post(
@@ -209,6 +242,11 @@ void ggml_mpi_graph_compute_post(
     const int mpi_rank = ctx_mpi->rank;
     const int mpi_size = ctx_mpi->size;
 
+    // the partial results were already summed inside the graph
+    if (ctx_mpi->tensor_parallel) {
+        return;
+    }
+
     // send the output data to the next node
     if (mpi_rank > 0) {
         ggml_mpi_tensor_send(gf->nodes[gf->n_nodes - 1], (mpi_rank + 1) % mpi_size);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 struct ggml_context;
 struct ggml_tensor;
 struct ggml_cgraph;
@@ -17,6 +19,20 @@ struct ggml_mpi_context * ggml_mpi_init(void);
 void ggml_mpi_free(struct ggml_mpi_context * ctx);
 
 int ggml_mpi_rank(struct ggml_mpi_context * ctx);
+int ggml_mpi_size(struct ggml_mpi_context * ctx);
+
+// the tensor parallel mode calls MPI from the compute threads, which the MPI library must allow
+bool ggml_mpi_tensor_parallel_supported(struct ggml_mpi_context * ctx);
+
+// split the layers across the nodes by tensor instead of by layer: every node computes its part of all the layers
+// from the same input tokens, and sums the partial results with the other nodes with ggml_mpi_allreduce
+void ggml_mpi_set_tensor_parallel(struct ggml_mpi_context * ctx, bool tensor_parallel);
+
+// sum a over all the nodes, in-place, when the graph is computed
+struct ggml_tensor * ggml_mpi_allreduce(
+        struct ggml_mpi_context * ctx_mpi,
+            struct ggml_context * ctx,
+             struct ggml_tensor * a);
 
 void ggml_mpi_eval_init(
         struct ggml_mpi_context * ctx_mpi,
@@ -96,6 +96,56 @@ static int sched_yield (void) {
     Sleep (0);
     return 0;
 }
+
+typedef CRITICAL_SECTION   pthread_mutex_t;
+typedef CONDITION_VARIABLE pthread_cond_t;
+
+static int pthread_mutex_init(pthread_mutex_t * mutex, void * unused) {
+    (void) unused;
+    InitializeCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_destroy(pthread_mutex_t * mutex) {
+    DeleteCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_lock(pthread_mutex_t * mutex) {
+    EnterCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_mutex_unlock(pthread_mutex_t * mutex) {
+    LeaveCriticalSection(mutex);
+    return 0;
+}
+
+static int pthread_cond_init(pthread_cond_t * cond, void * unused) {
+    (void) unused;
+    InitializeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_destroy(pthread_cond_t * cond) {
+    (void) cond;
+    return 0;
+}
+
+static int pthread_cond_wait(pthread_cond_t * cond, pthread_mutex_t * mutex) {
+    SleepConditionVariableCS(cond, mutex, INFINITE);
+    return 0;
+}
+
+static int pthread_cond_signal(pthread_cond_t * cond) {
+    WakeConditionVariable(cond);
+    return 0;
+}
+
+static int pthread_cond_broadcast(pthread_cond_t * cond) {
+    WakeAllConditionVariable(cond);
+    return 0;
+}
 #else
 #include <pthread.h>
 #include <stdatomic.h>
@@ -3977,6 +4027,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "UPSCALE",
 
     "FLASH_ATTN",
+    "FLASH_ATTN_EXT",
     "FLASH_FF",
     "FLASH_ATTN_BACK",
     "WIN_PART",
@@ -4001,7 +4052,7 @@ static const char * GGML_OP_NAME[GGML_OP_COUNT] = {
     "CROSS_ENTROPY_LOSS_BACK",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "none",
@@ -4059,6 +4110,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "upscale(x)",
 
     "flash_attn(x)",
+    "flash_attn_ext(x)",
     "flash_ff(x)",
     "flash_attn_back(x)",
     "win_part(x)",
@@ -4083,7 +4135,7 @@ static const char * GGML_OP_SYMBOL[GGML_OP_COUNT] = {
     "cross_entropy_loss_back(x,y)",
 };
 
-static_assert(GGML_OP_COUNT == 68, "GGML_OP_COUNT != 68");
+static_assert(GGML_OP_COUNT == 69, "GGML_OP_COUNT != 69");
 
 static_assert(GGML_OP_POOL_COUNT == 2, "GGML_OP_POOL_COUNT != 2");
 
@@ -4343,6 +4395,11 @@ float ggml_type_sizef(enum ggml_type type) {
     return ((float)(type_traits[type].type_size))/type_traits[type].blck_size;
 }
 
+size_t ggml_row_size(enum ggml_type type, int64_t ne) {
+    assert(ne % ggml_blck_size(type) == 0);
+    return ggml_type_size(type)*ne/ggml_blck_size(type);
+}
+
 const char * ggml_type_name(enum ggml_type type) {
     return type_traits[type].type_name;
 }
@@ -6968,6 +7025,7 @@ struct ggml_tensor * ggml_soft_max_back_inplace(
 static struct ggml_tensor * ggml_rope_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
         int                   n_past,
         int                   n_dims,
         int                   mode,
@@ -6978,6 +7036,12 @@ static struct ggml_tensor * ggml_rope_impl(
         bool                  xpos_down,
         bool                  inplace) {
     GGML_ASSERT(n_past >= 0);
+    if (b) {
+        GGML_ASSERT(ggml_is_vector(b));
+        GGML_ASSERT(b->type == GGML_TYPE_I32);
+        GGML_ASSERT(a->ne[2] == b->ne[0]);
+    }
+
     bool is_node = false;
 
     if (a->grad) {
@@ -6996,6 +7060,7 @@ static struct ggml_tensor * ggml_rope_impl(
     result->op   = GGML_OP_ROPE;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
+    result->src[1] = b;
 
     return result;
 }
@@ -7007,7 +7072,7 @@ struct ggml_tensor * ggml_rope(
         int                   n_dims,
         int                   mode,
         int                   n_ctx) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, false);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, false);
 }
 
 struct ggml_tensor * ggml_rope_inplace(
@@ -7017,7 +7082,7 @@ struct ggml_tensor * ggml_rope_inplace(
         int                   n_dims,
         int                   mode,
         int                   n_ctx) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, 10000.0f, 1.0f, 0.0f, false, true);
 }
 
 struct ggml_tensor * ggml_rope_custom(
@@ -7029,7 +7094,7 @@ struct ggml_tensor * ggml_rope_custom(
         int                   n_ctx,
         float                 freq_base,
         float                 freq_scale) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, false);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, false);
 }
 
 struct ggml_tensor * ggml_rope_custom_inplace(
@@ -7041,7 +7106,31 @@ struct ggml_tensor * ggml_rope_custom_inplace(
         int                   n_ctx,
         float                 freq_base,
         float                 freq_scale) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
+}
+
+struct ggml_tensor * ggml_rope_custom_pos(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        float                 freq_base,
+        float                 freq_scale) {
+    return ggml_rope_impl(ctx, a, b, 0, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, false);
+}
+
+struct ggml_tensor * ggml_rope_custom_pos_inplace(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        float                 freq_base,
+        float                 freq_scale) {
+    return ggml_rope_impl(ctx, a, b, 0, n_dims, mode, n_ctx, freq_base, freq_scale, 0.0f, false, true);
 }
 
 struct ggml_tensor * ggml_rope_xpos_inplace(
@@ -7051,14 +7140,15 @@ struct ggml_tensor * ggml_rope_xpos_inplace(
         int                   n_dims,
         float                 base,
         bool                  down) {
-    return ggml_rope_impl(ctx, a, n_past, n_dims, 0, 0, 10000.0f, 1.0f, base, down, true);
+    return ggml_rope_impl(ctx, a, NULL, n_past, n_dims, 0, 0, 10000.0f, 1.0f, base, down, true);
 }
 
 // ggml_rope_back
 
-struct ggml_tensor * ggml_rope_back(
+static struct ggml_tensor * ggml_rope_back_impl(
         struct ggml_context * ctx,
         struct ggml_tensor  * a,
+        struct ggml_tensor  * b,
         int                   n_past,
         int                   n_dims,
         int                   mode,
@@ -7088,10 +7178,25 @@ struct ggml_tensor * ggml_rope_back(
     result->op   = GGML_OP_ROPE_BACK;
     result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
     result->src[0] = a;
+    result->src[1] = b;
 
     return result;
 }
 
+struct ggml_tensor * ggml_rope_back(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * a,
+        int                   n_past,
+        int                   n_dims,
+        int                   mode,
+        int                   n_ctx,
+        float                 freq_base,
+        float                 freq_scale,
+        float                 xpos_base,
+        bool                  xpos_down) {
+    return ggml_rope_back_impl(ctx, a, NULL, n_past, n_dims, mode, n_ctx, freq_base, freq_scale, xpos_base, xpos_down);
+}
+
 // ggml_alibi
 
 struct ggml_tensor * ggml_alibi(
@@ -7438,6 +7543,51 @@ struct ggml_tensor * ggml_flash_attn(
     return result;
 }
 
+// ggml_flash_attn_ext
+
+struct ggml_tensor * ggml_flash_attn_ext(
+        struct ggml_context * ctx,
+        struct ggml_tensor  * q,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+        struct ggml_tensor  * mask,
+        float                 scale) {
+    GGML_ASSERT(q->type == GGML_TYPE_F32);
+    GGML_ASSERT(k->ne[0] == q->ne[0]);
+    GGML_ASSERT(v->ne[0] == q->ne[0]);
+    GGML_ASSERT(k->ne[1] == v->ne[1]);
+    GGML_ASSERT(k->ne[2] == v->ne[2]);
+    GGML_ASSERT(q->ne[2] % k->ne[2] == 0);
+    GGML_ASSERT(q->ne[3] == 1 && k->ne[3] == 1 && v->ne[3] == 1);
+
+    if (mask) {
+        GGML_ASSERT(mask->type == GGML_TYPE_F32);
+        GGML_ASSERT(mask->ne[0] == k->ne[1]);
+        GGML_ASSERT(mask->ne[1] >= q->ne[1]);
+    }
+
+    bool is_node = false;
+
+    if (q->grad || k->grad || v->grad) {
+        GGML_ASSERT(false); // TODO: implement backward
+        is_node = true;
+    }
+
+    // permute(0, 2, 1, 3)
+    struct ggml_tensor * result = ggml_new_tensor_3d(ctx, GGML_TYPE_F32, q->ne[0], q->ne[2], q->ne[1]);
+
+    ggml_set_op_params(result, &scale, sizeof(scale));
+
+    result->op   = GGML_OP_FLASH_ATTN_EXT;
+    result->grad = is_node ? ggml_dup_tensor(ctx, result) : NULL;
+    result->src[0] = q;
+    result->src[1] = k;
+    result->src[2] = v;
+    result->src[3] = mask;
+
+    return result;
+}
+
 // ggml_flash_ff
 
 struct ggml_tensor * ggml_flash_ff(
@@ -8170,6 +8320,34 @@ void ggml_set_param(
     tensor->grad = ggml_dup_tensor(ctx, tensor);
 }
 
+// max number of nodes in a step of ggml_graph_schedule
+#define GGML_SCHED_MAX_STEP 8
+
+struct ggml_compute_state_shared {
+    const struct ggml_cgraph * cgraph;
+    const struct ggml_cplan  * cplan;
+
+    int64_t perf_node_start_cycles;
+    int64_t perf_node_start_time_us;
+
+    const int n_threads;
+
+    // synchronization primitives
+    atomic_int n_active; // num active threads
+    atomic_int node_n;   // active step of the plan, the active graph node without a schedule
+
+    // threads that ran out of spins wait here for node_n to change
+    atomic_int        n_sleeping;
+    pthread_mutex_t * mutex;
+    pthread_cond_t  * cond;
+
+    // next work chunk to be claimed by the threads of each node of the current step
+    atomic_int current_chunk[GGML_SCHED_MAX_STEP];
+
+    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
+    void * abort_callback_data;
+};
+
 // ggml_compute_forward_dup
 
 static void ggml_compute_forward_dup_same_cont(
@@ -10791,6 +10969,67 @@ static void ggml_compute_forward_silu_back(
     }
 }
 
+// ggml_compute_forward_fused
+
+// apply the nodes fused into dst by ggml_graph_fuse to the elements [ic0, ic1) of the rows [ir0, ir1) of dst, which
+// the calling thread has just computed. the rows are counted over the dimensions 1, 2 and 3
+// the same vector functions as the unfused ops are used, so that the results do not change
+static void ggml_compute_forward_fused(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * dst,
+        const int64_t ic0, const int64_t ic1,
+        const int64_t ir0, const int64_t ir1) {
+    const int64_t ne1 = dst->ne[1];
+    const int64_t ne2 = dst->ne[2];
+
+    const int n = ic1 - ic0;
+
+    for (int64_t ir = ir0; ir < ir1; ++ir) {
+        const int64_t i3 = ir/(ne2*ne1);
+        const int64_t i2 = (ir - i3*ne2*ne1)/ne1;
+        const int64_t i1 = (ir - i3*ne2*ne1 - i2*ne1);
+
+        const struct ggml_tensor * prev = dst;
+
+        for (int k = 0; k < params->n_fused; ++k) {
+            const struct ggml_tensor * node = params->fused[k];
+
+            const float * x = (const float *) ((const char *) prev->data + i1*prev->nb[1] + i2*prev->nb[2] + i3*prev->nb[3]) + ic0;
+                  float * y = (float *)       ((char *)       node->data + i1*node->nb[1] + i2*node->nb[2] + i3*node->nb[3]) + ic0;
+
+            switch (node->op) {
+                case GGML_OP_ADD:
+                case GGML_OP_MUL:
+                    {
+                        // the other operand is broadcastable across the rows
+                        const struct ggml_tensor * src = node->src[0] == prev ? node->src[1] : node->src[0];
+
+                        const float * z = (const float *) ((const char *) src->data +
+                                (i1 % src->ne[1])*src->nb[1] + (i2 % src->ne[2])*src->nb[2] + (i3 % src->ne[3])*src->nb[3]) + ic0;
+
+                        if (node->op == GGML_OP_ADD) {
+                            ggml_vec_add_f32(n, y, x, z);
+                        } else {
+                            ggml_vec_mul_f32(n, y, x, z);
+                        }
+                    } break;
+                case GGML_OP_UNARY:
+                    {
+                        switch (ggml_get_unary_op(node)) {
+                            case GGML_UNARY_OP_SILU: ggml_vec_silu_f32(n, y, x); break;
+                            case GGML_UNARY_OP_GELU: ggml_vec_gelu_f32(n, y, x); break;
+                            default: GGML_ASSERT(false);
+                        }
+                    } break;
+                default:
+                    GGML_ASSERT(false);
+            }
+
+            prev = node;
+        }
+    }
+}
+
 // ggml_compute_forward_norm
 
 static void ggml_compute_forward_norm_f32(
@@ -10839,6 +11078,11 @@ static void ggml_compute_forward_norm_f32(
                 const float scale = 1.0f/sqrtf(variance + eps);
 
                 ggml_vec_scale_f32(ne00, y, scale);
+
+                if (params->n_fused > 0) {
+                    const int64_t ir = i01 + ne01*(i02 + ne02*i03);
+                    ggml_compute_forward_fused(params, dst, 0, ne00, ir, ir + 1);
+                }
             }
         }
     }
@@ -10905,6 +11149,11 @@ static void ggml_compute_forward_rms_norm_f32(
                 const float scale = 1.0f/sqrtf(mean + eps);
 
                 ggml_vec_scale_f32(ne00, y, scale);
+
+                if (params->n_fused > 0) {
+                    const int64_t ir = i01 + ne01*(i02 + ne02*i03);
+                    ggml_compute_forward_fused(params, dst, 0, ne00, ir, ir + 1);
+                }
             }
         }
     }
@@ -11220,6 +11469,84 @@ static bool ggml_compute_forward_mul_mat_use_blas(
 }
 #endif
 
+static void ggml_compute_forward_mul_mat_one_chunk(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
+              struct ggml_tensor * dst,
+        const int64_t ir010, const int64_t ir011,
+        const int64_t ir110, const int64_t ir111) {
+    GGML_TENSOR_BINARY_OP_LOCALS;
+
+    if (ir010 >= ir011 || ir110 >= ir111) {
+        return;
+    }
+
+    const enum ggml_type type = src0->type;
+
+    const bool src1_cont = ggml_is_contiguous(src1);
+
+    ggml_vec_dot_t const vec_dot      = type_traits[type].vec_dot;
+    enum ggml_type const vec_dot_type = type_traits[type].vec_dot_type;
+
+    // broadcast factors
+    const int64_t r2 = ne12/ne02;
+    const int64_t r3 = ne13/ne03;
+
+    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
+    const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
+
+    assert(ne12 % ne02 == 0);
+    assert(ne13 % ne03 == 0);
+
+    // block-tiling attempt
+    const int64_t blck_0 = 16;
+    const int64_t blck_1 = 16;
+
+    // attempt to reduce false-sharing (does not seem to make a difference)
+    float tmp[16];
+
+    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
+        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
+            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
+                const int64_t i13 = (ir1/(ne12*ne11));
+                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
+                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
+
+                // broadcast src0 into src1
+                const int64_t i03 = i13/r3;
+                const int64_t i02 = i12/r2;
+
+                const int64_t i1 = i11;
+                const int64_t i2 = i12;
+                const int64_t i3 = i13;
+
+                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
+
+                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
+                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
+                //       the original src1 data pointer, so we should index using the indices directly
+                // TODO: this is a bit of a hack, we should probably have a better way to handle this
+                const char * src1_col = (const char *) wdata +
+                    (src1_cont || src1->type != vec_dot_type
+                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
+                     : (i11*nb11 + i12*nb12 + i13*nb13));
+
+                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
+
+                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
+                //}
+
+                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
+                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
+                }
+                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
+            }
+        }
+    }
+}
+
 static void ggml_compute_forward_mul_mat(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
@@ -11235,9 +11562,6 @@ static void ggml_compute_forward_mul_mat(
 
     const enum ggml_type type = src0->type;
 
-    const bool src1_cont = ggml_is_contiguous(src1);
-
-    ggml_vec_dot_t    const vec_dot               = type_traits[type].vec_dot;
     enum ggml_type    const vec_dot_type          = type_traits[type].vec_dot_type;
     ggml_from_float_t const from_float_to_vec_dot = type_traits[vec_dot_type].from_float;
 
@@ -11256,10 +11580,6 @@ static void ggml_compute_forward_mul_mat(
     GGML_ASSERT(nb1 <= nb2);
     GGML_ASSERT(nb2 <= nb3);
 
-    // broadcast factors
-    const int64_t r2 = ne12/ne02;
-    const int64_t r3 = ne13/ne03;
-
     // nb01 >= nb00 - src0 is not transposed
     //   compute by src0 rows
 
@@ -11283,6 +11603,10 @@ static void ggml_compute_forward_mul_mat(
             return;
         }
 
+        // broadcast factors
+        const int64_t r2 = ne12/ne02;
+        const int64_t r3 = ne13/ne03;
+
         if (params->type == GGML_TASK_INIT) {
             return;
         }
@@ -11331,6 +11655,8 @@ static void ggml_compute_forward_mul_mat(
 #endif
 
     if (params->type == GGML_TASK_INIT) {
+        atomic_store(&params->shared->current_chunk[params->islot], nth);
+
         if (src1->type != vec_dot_type) {
             char * wdata = params->wdata;
             const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
@@ -11352,91 +11678,52 @@ static void ggml_compute_forward_mul_mat(
         return;
     }
 
-    const void * wdata    = (src1->type == vec_dot_type) ? src1->data : params->wdata;
-    const size_t row_size = ne10*ggml_type_size(vec_dot_type)/ggml_blck_size(vec_dot_type);
-
     const int64_t nr0 = ne01;           // src0 rows
     const int64_t nr1 = ne11*ne12*ne13; // src1 rows
 
     //printf("nr0 = %lld, nr1 = %lld\n", nr0, nr1);
 
-    // distribute the thread work across the inner or outer loop based on which one is larger
+    // split the work into chunks that the threads claim one at a time, so that a thread that gets
+    // preempted or runs on a slower core does not hold back the others until the end of the node
+    // chunks are 16 rows (64 if one side is a single row) of each of src0 and src1
+    const int64_t chunk_size = (nr0 == 1 || nr1 == 1) ? 64 : 16;
 
-    const int64_t nth0 = nr0 > nr1 ? nth : 1; // parallelize by src0 rows
-    const int64_t nth1 = nr0 > nr1 ? 1 : nth; // parallelize by src1 rows
+    int64_t nchunk0 = (nr0 + chunk_size - 1)/chunk_size;
+    int64_t nchunk1 = (nr1 + chunk_size - 1)/chunk_size;
 
-    const int64_t ith0 = ith % nth0;
-    const int64_t ith1 = ith / nth0;
+    // too few chunks to balance the load - fall back to one chunk per thread along the larger dimension
+    if (nchunk0*nchunk1 < nth*4) {
+        nchunk0 = nr0 > nr1 ? nth : 1;
+        nchunk1 = nr0 > nr1 ? 1 : nth;
+    }
 
-    const int64_t dr0 = (nr0 + nth0 - 1)/nth0;
-    const int64_t dr1 = (nr1 + nth1 - 1)/nth1;
+    const int64_t dr0 = (nr0 + nchunk0 - 1)/nchunk0;
+    const int64_t dr1 = (nr1 + nchunk1 - 1)/nchunk1;
 
-    const int64_t ir010 = dr0*ith0;
-    const int64_t ir011 = MIN(ir010 + dr0, nr0);
+    // each thread starts with the chunk matching its index, the counter was set to nth in INIT
+    int current_chunk = ith;
 
-    const int64_t ir110 = dr1*ith1;
-    const int64_t ir111 = MIN(ir110 + dr1, nr1);
+    while (current_chunk < nchunk0*nchunk1) {
+        const int64_t ith0 = current_chunk % nchunk0;
+        const int64_t ith1 = current_chunk / nchunk0;
 
-    //printf("ir010 = %6lld, ir011 = %6lld, ir110 = %6lld, ir111 = %6lld\n", ir010, ir011, ir110, ir111);
+        const int64_t ir010 = dr0*ith0;
+        const int64_t ir011 = MIN(ir010 + dr0, nr0);
 
-    // threads with no work simply yield (not sure if it helps)
-    if (ir010 >= ir011 || ir110 >= ir111) {
-        sched_yield();
-        return;
-    }
+        const int64_t ir110 = dr1*ith1;
+        const int64_t ir111 = MIN(ir110 + dr1, nr1);
 
-    assert(ne12 % ne02 == 0);
-    assert(ne13 % ne03 == 0);
+        ggml_compute_forward_mul_mat_one_chunk(params, src0, src1, dst, ir010, ir011, ir110, ir111);
 
-    // block-tiling attempt
-    const int64_t blck_0 = 16;
-    const int64_t blck_1 = 16;
+        if (params->n_fused > 0 && ir010 < ir011) {
+            ggml_compute_forward_fused(params, dst, ir010, ir011, ir110, ir111);
+        }
 
-    // attempt to reduce false-sharing (does not seem to make a difference)
-    float tmp[16];
+        current_chunk = atomic_fetch_add(&params->shared->current_chunk[params->islot], 1);
+    }
+}
 
-    for (int64_t iir1 = ir110; iir1 < ir111; iir1 += blck_1) {
-        for (int64_t iir0 = ir010; iir0 < ir011; iir0 += blck_0) {
-            for (int64_t ir1 = iir1; ir1 < iir1 + blck_1 && ir1 < ir111; ++ir1) {
-                const int64_t i13 = (ir1/(ne12*ne11));
-                const int64_t i12 = (ir1 - i13*ne12*ne11)/ne11;
-                const int64_t i11 = (ir1 - i13*ne12*ne11 - i12*ne11);
-
-                // broadcast src0 into src1
-                const int64_t i03 = i13/r3;
-                const int64_t i02 = i12/r2;
-
-                const int64_t i1 = i11;
-                const int64_t i2 = i12;
-                const int64_t i3 = i13;
-
-                const char * src0_row = (const char *) src0->data + (0 + i02*nb02 + i03*nb03);
-
-                // desc: when src1 is not a contiguous memory block we have to calculate the offset using the strides
-                //       if it is, then we have either copied the data to params->wdata and made it contiguous or we are using
-                //       the original src1 data pointer, so we should index using the indices directly
-                // TODO: this is a bit of a hack, we should probably have a better way to handle this
-                const char * src1_col = (const char *) wdata +
-                    (src1_cont || src1->type != vec_dot_type
-                     ? (i11      + i12*ne11 + i13*ne12*ne11)*row_size
-                     : (i11*nb11 + i12*nb12 + i13*nb13));
-
-                float * dst_col = (float *) ((char *) dst->data + (i1*nb1 + i2*nb2 + i3*nb3));
-
-                //for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                //    vec_dot(ne00, &dst_col[ir0], src0_row + ir0*nb01, src1_col);
-                //}
-
-                for (int64_t ir0 = iir0; ir0 < iir0 + blck_0 && ir0 < ir011; ++ir0) {
-                    vec_dot(ne00, &tmp[ir0 - iir0], src0_row + ir0*nb01, src1_col);
-                }
-                memcpy(&dst_col[iir0], tmp, (MIN(iir0 + blck_0, ir011) - iir0)*sizeof(float));
-            }
-        }
-    }
-}
-
-// ggml_compute_forward_out_prod
+// ggml_compute_forward_out_prod
 
 static void ggml_compute_forward_out_prod_f32(
         const struct ggml_compute_params * params,
@@ -12414,7 +12701,7 @@ static void ggml_compute_forward_alibi_f32(
     //const int nb3 = src0->nb[3];
 
     GGML_ASSERT(nb0 == sizeof(float));
-    GGML_ASSERT(ne1 + n_past == ne0);
+    GGML_ASSERT(ne1 + n_past <= ne0);
     GGML_ASSERT(n_head == ne2);
 
     // add alibi to src0 (KQ_scaled)
@@ -12477,7 +12764,7 @@ static void ggml_compute_forward_alibi_f16(
     //const int nb3 = src0->nb[3];
 
     GGML_ASSERT(nb0 == sizeof(ggml_fp16_t));
-    GGML_ASSERT(ne1 + n_past == ne0); (void) n_past;
+    GGML_ASSERT(ne1 + n_past <= ne0); (void) n_past;
     GGML_ASSERT(n_head == ne2);
 
     // add alibi to src0 (KQ_scaled)
@@ -12623,6 +12910,7 @@ static void ggml_compute_forward_clamp(
 static void ggml_compute_forward_rope_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -12647,6 +12935,9 @@ static void ggml_compute_forward_rope_f32(
 
     assert(n_past >= 0);
 
+    // optional per-row positions, overrides n_past
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     //printf("ne0: %d, ne1: %d, ne2: %d, ne3: %d\n", ne0, ne1, ne2, ne3);
@@ -12678,8 +12969,8 @@ static void ggml_compute_forward_rope_f32(
     const bool is_glm  = mode & 4;
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+        for (int64_t i2 = ((mode & 1) == 0 || pos ? 0 : n_past); i2 < ne2; i2++) {
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -12716,7 +13007,7 @@ static void ggml_compute_forward_rope_f32(
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
                         // zeta scaling for xPos only:
-                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), (n_past + i2) / xpos_base) : 1.0f;
+                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), p / xpos_base) : 1.0f;
                         if (xpos_down) zeta = 1.0f / zeta;
 
                         theta *= theta_scale;
@@ -12761,6 +13052,7 @@ static void ggml_compute_forward_rope_f32(
 static void ggml_compute_forward_rope_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -12779,6 +13071,9 @@ static void ggml_compute_forward_rope_f16(
 
     assert(n_past >= 0);
 
+    // optional per-row positions, overrides n_past
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     //printf("ne0: %d, ne1: %d, ne2: %d, ne3: %d\n", ne0, ne1, ne2, ne3);
@@ -12810,8 +13105,8 @@ static void ggml_compute_forward_rope_f16(
     const bool is_glm  = mode & 4;
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+        for (int64_t i2 = ((mode & 1) == 0 || pos ? 0 : n_past); i2 < ne2; i2++) {
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -12890,15 +13185,16 @@ static void ggml_compute_forward_rope_f16(
 static void ggml_compute_forward_rope(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_rope_f16(params, src0, dst);
+                ggml_compute_forward_rope_f16(params, src0, src1, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_f32(params, src0, dst);
+                ggml_compute_forward_rope_f32(params, src0, src1, dst);
             } break;
         default:
             {
@@ -12912,6 +13208,7 @@ static void ggml_compute_forward_rope(
 static void ggml_compute_forward_rope_back_f32(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -12940,6 +13237,9 @@ static void ggml_compute_forward_rope_back_f32(
 
     assert(n_past >= 0);
 
+    // optional per-row positions, overrides n_past
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     //printf("ne0: %d, ne1: %d, ne2: %d, ne3: %d\n", ne0, ne1, ne2, ne3);
@@ -12967,8 +13267,8 @@ static void ggml_compute_forward_rope_back_f32(
     const bool is_neox = mode & 2;
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+        for (int64_t i2 = ((mode & 1) == 0 || pos ? 0 : n_past); i2 < ne2; i2++) {
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -12980,7 +13280,7 @@ static void ggml_compute_forward_rope_back_f32(
                         const float cos_theta = cosf(theta);
                         const float sin_theta = sinf(theta);
                         // zeta scaling for xPos only:
-                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), (n_past + i2) / xpos_base) : 1.0f;
+                        float zeta = xpos_base != 0.0f ? powf((i0 + 0.4f * ne0) / (1.4f * ne0), p / xpos_base) : 1.0f;
                         if (xpos_down) zeta = 1.0f / zeta;
 
                         theta *= theta_scale;
@@ -13023,6 +13323,7 @@ static void ggml_compute_forward_rope_back_f32(
 static void ggml_compute_forward_rope_back_f16(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
 
     if (params->type == GGML_TASK_INIT || params->type == GGML_TASK_FINALIZE) {
@@ -13039,6 +13340,9 @@ static void ggml_compute_forward_rope_back_f16(
 
     assert(n_past >= 0);
 
+    // optional per-row positions, overrides n_past
+    const int32_t * pos = src1 ? (const int32_t *) src1->data : NULL;
+
     GGML_TENSOR_UNARY_OP_LOCALS;
 
     //printf("ne0: %d, ne1: %d, ne2: %d, ne3: %d\n", ne0, ne1, ne2, ne3);
@@ -13066,8 +13370,8 @@ static void ggml_compute_forward_rope_back_f16(
     const bool is_neox = mode & 2;
 
     for (int64_t i3 = 0; i3 < ne3; i3++) {
-        for (int64_t i2 = ((mode & 1) == 0 ? 0 : n_past); i2 < ne2; i2++) {
-            const int64_t p = ((mode & 1) == 0 ? n_past + i2 : i2);
+        for (int64_t i2 = ((mode & 1) == 0 || pos ? 0 : n_past); i2 < ne2; i2++) {
+            const int64_t p = pos ? pos[i2] : ((mode & 1) == 0 ? n_past + i2 : i2);
             for (int64_t i1 = 0; i1 < ne1; i1++) {
                 if (ir++ < ir0) continue;
                 if (ir   > ir1) break;
@@ -13119,15 +13423,16 @@ static void ggml_compute_forward_rope_back_f16(
 static void ggml_compute_forward_rope_back(
         const struct ggml_compute_params * params,
         const struct ggml_tensor * src0,
+        const struct ggml_tensor * src1,
         struct ggml_tensor * dst) {
     switch (src0->type) {
         case GGML_TYPE_F16:
             {
-                ggml_compute_forward_rope_back_f16(params, src0, dst);
+                ggml_compute_forward_rope_back_f16(params, src0, src1, dst);
             } break;
         case GGML_TYPE_F32:
             {
-                ggml_compute_forward_rope_back_f32(params, src0, dst);
+                ggml_compute_forward_rope_back_f32(params, src0, src1, dst);
             } break;
         default:
             {
@@ -14420,6 +14725,155 @@ static void ggml_compute_forward_flash_attn(
     }
 }
 
+// ggml_compute_forward_flash_attn_ext
+
+static void ggml_compute_forward_flash_attn_ext(
+        const struct ggml_compute_params * params,
+        const struct ggml_tensor * q,
+        const struct ggml_tensor * k,
+        const struct ggml_tensor * v,
+        const struct ggml_tensor * mask,
+        struct ggml_tensor * dst) {
+    int64_t t0 = ggml_perf_time_us();
+    UNUSED(t0);
+
+    GGML_TENSOR_LOCALS(int64_t, neq, q,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbq, q,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nek, k,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbk, k,   nb);
+    GGML_TENSOR_LOCALS(int64_t, nev, v,   ne);
+    GGML_TENSOR_LOCALS(size_t,  nbv, v,   nb);
+    GGML_TENSOR_LOCALS(int64_t, ne,  dst, ne);
+    GGML_TENSOR_LOCALS(size_t,  nb,  dst, nb);
+
+    const int ith = params->ith;
+    const int nth = params->nth;
+
+    const int64_t D = neq0; // head size
+    const int64_t N = neq1; // batch size
+    const int64_t M = nek1; // kv size
+
+    GGML_ASSERT(ne0 == D);
+    GGML_ASSERT(ne1 == neq2);
+    GGML_ASSERT(ne2 == N);
+
+    GGML_ASSERT(nbq0 == sizeof(float));
+    GGML_ASSERT(nbk0 == ggml_type_size(k->type));
+    GGML_ASSERT(nbv0 == ggml_type_size(v->type));
+
+    // dst cannot be transposed or permuted
+    GGML_ASSERT(nb0 == sizeof(float));
+    GGML_ASSERT(nb0 <= nb1);
+    GGML_ASSERT(nb1 <= nb2);
+    GGML_ASSERT(nb2 <= nb3);
+
+    if (params->type == GGML_TASK_INIT) {
+        return;
+    }
+
+    if (params->type == GGML_TASK_FINALIZE) {
+        return;
+    }
+
+    float scale = 1.0f;
+    memcpy(&scale, (float *) dst->op_params + 0, sizeof(float));
+
+    // broadcast factor for grouped-query attention
+    const int64_t rk2 = neq2/nek2;
+
+    ggml_vec_dot_t    const kq_vec_dot   = type_traits[k->type].vec_dot;
+    enum ggml_type    const kq_vec_type  = type_traits[k->type].vec_dot_type;
+    ggml_from_float_t const q_to_vec_dot = type_traits[kq_vec_type].from_float;
+    ggml_to_float_t   const v_to_float   = type_traits[v->type].to_float;
+
+    GGML_ASSERT(kq_vec_type == GGML_TYPE_F32 || q_to_vec_dot);
+    GGML_ASSERT(v->type     == GGML_TYPE_F32 || v_to_float);
+
+    // per-thread scratch: output accumulator, converted V row and converted Q row
+    float * VKQ = (float *) params->wdata + ith*(3*D + CACHE_LINE_SIZE_F32);
+    float * V32 = VKQ + D;
+    void  * Q_q = VKQ + 2*D;
+
+    // parallelize by q rows
+    const int nr = neq1*neq2;
+
+    // rows per thread
+    const int dr = (nr + nth - 1)/nth;
+
+    // row range for this thread
+    const int ir0 = dr*ith;
+    const int ir1 = MIN(ir0 + dr, nr);
+
+    for (int ir = ir0; ir < ir1; ++ir) {
+        // q indices
+        const int iq2 = ir/neq1;
+        const int iq1 = ir - iq2*neq1;
+
+        // k and v head
+        const int ik2 = iq2/rk2;
+
+        const float * pq = (const float *) ((const char *) q->data + (iq1*nbq1 + iq2*nbq2));
+        const float * mp = mask ? (const float *) ((const char *) mask->data + iq1*mask->nb[1]) : NULL;
+
+        if (kq_vec_type == GGML_TYPE_F32) {
+            memcpy(Q_q, pq, D*sizeof(float));
+        } else {
+            q_to_vec_dot(pq, Q_q, D);
+        }
+
+        // online softmax: S is the running sum of exp(s - M_max), VKQ the running sum of exp(s - M_max)*v
+        float S     = 0.0f;
+        float M_max = -INFINITY;
+
+        memset(VKQ, 0, D*sizeof(float));
+
+        for (int64_t ic = 0; ic < M; ++ic) {
+            const float mv = mp ? mp[ic] : 0.0f;
+            if (mv == -INFINITY) {
+                continue;
+            }
+
+            float s;
+            kq_vec_dot(D, &s, (const char *) k->data + (ic*nbk1 + ik2*nbk2), Q_q);
+
+            s = s*scale + mv;
+
+            float ms = 1.0f; // rescale of the accumulated values
+            float vs = 1.0f; // weight of the current value
+
+            if (s > M_max) {
+                ms    = expf(M_max - s);
+                M_max = s;
+                ggml_vec_scale_f32(D, VKQ, ms);
+            } else {
+                vs = expf(s - M_max);
+            }
+
+            const char * pv = (const char *) v->data + (ic*nbv1 + ik2*nbv2);
+
+            if (v->type == GGML_TYPE_F32) {
+                ggml_vec_mad_f32(D, VKQ, (const float *) pv, vs);
+            } else {
+                v_to_float(pv, V32, D);
+                ggml_vec_mad_f32(D, VKQ, V32, vs);
+            }
+
+            S = S*ms + vs;
+        }
+
+        // a row that is fully masked out yields zeros
+        const float S_inv = S == 0.0f ? 0.0f : 1.0f/S;
+
+        float * out = (float *) ((char *) dst->data + (iq2*nb1 + iq1*nb2));
+
+        for (int64_t d = 0; d < D; ++d) {
+            out[d] = VKQ[d]*S_inv;
+        }
+    }
+
+    UNUSED(nev0);
+}
+
 // ggml_compute_forward_flash_ff
 
 static void ggml_compute_forward_flash_ff_f16(
@@ -15864,11 +16318,11 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
             } break;
         case GGML_OP_ROPE:
             {
-                ggml_compute_forward_rope(params, tensor->src[0], tensor);
+                ggml_compute_forward_rope(params, tensor->src[0], tensor->src[1], tensor);
             } break;
         case GGML_OP_ROPE_BACK:
             {
-                ggml_compute_forward_rope_back(params, tensor->src[0], tensor);
+                ggml_compute_forward_rope_back(params, tensor->src[0], tensor->src[1], tensor);
             } break;
         case GGML_OP_ALIBI:
             {
@@ -15909,6 +16363,10 @@ static void ggml_compute_forward(struct ggml_compute_params * params, struct ggm
                 const bool masked = t != 0;
                 ggml_compute_forward_flash_attn(params, tensor->src[0], tensor->src[1], tensor->src[2], masked, tensor);
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                ggml_compute_forward_flash_attn_ext(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor);
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 ggml_compute_forward_flash_ff(params, tensor->src[0], tensor->src[1], tensor->src[2], tensor->src[3], tensor->src[4], tensor);
@@ -16521,8 +16979,9 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
 
                     src0->grad = ggml_add_impl(ctx,
                             src0->grad,
-                            ggml_rope_back(ctx,
+                            ggml_rope_back_impl(ctx,
                                 tensor->grad,
+                                src1,
                                 n_past,
                                 n_dims,
                                 mode,
@@ -16554,6 +17013,7 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             src0->grad,
                             ggml_rope_impl(ctx,
                                 tensor->grad,
+                                src1,
                                 n_past,
                                 n_dims,
                                 mode,
@@ -16755,6 +17215,10 @@ static void ggml_compute_backward(struct ggml_context * ctx, struct ggml_tensor
                             inplace);
                 }
             } break;
+        case GGML_OP_FLASH_ATTN_EXT:
+            {
+                GGML_ASSERT(false); // TODO: not implemented
+            } break;
         case GGML_OP_FLASH_FF:
             {
                 GGML_ASSERT(false); // not supported
@@ -17179,27 +17643,27 @@ static void set_numa_thread_affinity(int thread_n, int n_threads) { UNUSED(threa
 static void clear_numa_thread_affinity(void) {}
 #endif
 
-struct ggml_compute_state_shared {
-    const struct ggml_cgraph * cgraph;
-    const struct ggml_cplan  * cplan;
-
-    int64_t perf_node_start_cycles;
-    int64_t perf_node_start_time_us;
-
-    const int n_threads;
-
-    // synchronization primitives
-    atomic_int n_active; // num active threads
-    atomic_int node_n;   // active graph node
-
-    bool (*abort_callback)(void * data); // abort ggml_graph_compute when true
-    void * abort_callback_data;
-};
-
 struct ggml_compute_state {
     ggml_thread_t thrd;
     int ith;
     struct ggml_compute_state_shared * shared;
+    struct ggml_threadpool * pool; // NULL if the thread only lives for one graph
+};
+
+struct ggml_threadpool {
+    int n_threads; // including the thread that calls ggml_graph_compute()
+
+    struct ggml_compute_state * workers; // [n_threads], workers[0] is the calling thread
+
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond_graph; // a new graph was posted or the pool is stopping
+    pthread_cond_t  cond_done;  // the last worker finished the current graph
+
+    struct ggml_compute_state_shared * shared; // the graph being computed
+    int  n_graph_threads; // threads of the graph being computed, the workers after them sit it out
+    int  n_graph;   // number of graphs posted so far
+    int  n_pending; // workers that have not finished the current graph yet
+    bool stop;
 };
 
 static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const struct ggml_compute_state_shared * st) {
@@ -17211,6 +17675,170 @@ static void ggml_graph_compute_perf_stats_node(struct ggml_tensor * node, const
     node->perf_time_us += time_us_cur;
 }
 
+// wake up the threads that went to sleep in ggml_graph_compute_wait, node_n must have been updated before
+static void ggml_graph_compute_wake(struct ggml_compute_state_shared * st) {
+    if (atomic_load(&st->n_sleeping) > 0) {
+        pthread_mutex_lock(st->mutex);
+        pthread_cond_broadcast(st->cond);
+        pthread_mutex_unlock(st->mutex);
+    }
+}
+
+// wait until node_n moves past last
+// the thread spins for cplan->n_spin checks, and then sleeps until ggml_graph_compute_wake is called
+static int ggml_graph_compute_wait(struct ggml_compute_state_shared * st, int last) {
+    const int n_spin = st->cplan->n_spin;
+
+    for (int i = 0; n_spin < 0 || i < n_spin; ++i) {
+        // TODO: this sched_yield can have significant impact on the performance - either positive or negative
+        //       depending on the workload and the operating system.
+        //       since it is not clear what is the best approach, it should potentially become user-configurable
+        //       ref: https://github.com/ggerganov/ggml/issues/291
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+        sched_yield();
+#endif
+
+        const int node_n = atomic_load(&st->node_n);
+        if (node_n != last) {
+            return node_n;
+        }
+    }
+
+    // n_sleeping is incremented before node_n is checked again, so either the thread sees the new node_n here,
+    // or the thread that updates node_n sees n_sleeping > 0 afterwards and wakes it up
+    int node_n;
+
+    pthread_mutex_lock(st->mutex);
+    atomic_fetch_add(&st->n_sleeping, 1);
+    while ((node_n = atomic_load(&st->node_n)) == last) {
+        pthread_cond_wait(st->cond, st->mutex);
+    }
+    atomic_fetch_sub(&st->n_sleeping, 1);
+    pthread_mutex_unlock(st->mutex);
+
+    return node_n;
+}
+
+// number of nodes after node_n that ggml_graph_fuse fused into it
+static int ggml_graph_n_fused(const struct ggml_cgraph * cgraph, const int * n_tasks, int node_n) {
+    int n = 0;
+    while (node_n + 1 + n < cgraph->n_nodes && n_tasks[node_n + 1 + n] == 0) {
+        n++;
+    }
+    return n;
+}
+
+// the matrix multiplication is computed by the threads in chunks, not by a library or a GPU in a single call
+static bool ggml_mul_mat_is_chunked(const struct ggml_tensor * node) {
+#if defined(GGML_USE_CUBLAS)
+    if (ggml_cuda_can_mul_mat(node->src[0], node->src[1], node)) {
+        return false;
+    }
+#elif defined(GGML_USE_CLBLAST)
+    if (ggml_cl_can_mul_mat(node->src[0], node->src[1], node)) {
+        return false;
+    }
+#endif
+#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
+    if (ggml_compute_forward_mul_mat_use_blas(node->src[0], node->src[1], (struct ggml_tensor *) node)) {
+        return false;
+    }
+#endif
+    UNUSED(node);
+    return true;
+}
+
+// work buffer used by a node computed with n_tasks threads, SIZE_MAX if the node is not known to be safe to compute in
+// the same step as other nodes
+static size_t ggml_sched_work_size(const struct ggml_tensor * node, int n_tasks) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+        case GGML_OP_GET_ROWS:
+        case GGML_OP_MUL:
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+        case GGML_OP_UNARY:
+        case GGML_OP_SCALE:
+        case GGML_OP_ROPE:
+        case GGML_OP_SOFT_MAX:
+        case GGML_OP_DIAG_MASK_INF:
+        case GGML_OP_DIAG_MASK_ZERO:
+            return 0;
+        case GGML_OP_ADD:
+            return ggml_is_quantized(node->src[0]->type) ? SIZE_MAX : 0;
+        case GGML_OP_CPY:
+        case GGML_OP_DUP:
+        case GGML_OP_CONT:
+            return ggml_is_quantized(node->type) ? SIZE_MAX : 0;
+        case GGML_OP_MUL_MAT:
+            {
+                if (!ggml_mul_mat_is_chunked(node)) {
+                    return SIZE_MAX;
+                }
+                const enum ggml_type vec_dot_type = type_traits[node->src[0]->type].vec_dot_type;
+                if (node->src[1]->type == vec_dot_type) {
+                    return 0;
+                }
+                return ggml_type_size(vec_dot_type)*ggml_nelements(node->src[1])/ggml_blck_size(vec_dot_type);
+            }
+        case GGML_OP_FLASH_ATTN_EXT:
+            return sizeof(float)*(3*node->src[0]->ne[0] + CACHE_LINE_SIZE_F32)*n_tasks;
+        default:
+            return SIZE_MAX;
+    }
+}
+
+static int ggml_graph_n_steps(const struct ggml_cgraph * cgraph, const struct ggml_cplan * cplan) {
+    return cplan->n_steps > 0 ? cplan->n_steps : cgraph->n_nodes;
+}
+
+static int ggml_graph_step_size(const struct ggml_cplan * cplan, int step_n) {
+    return cplan->n_steps > 0 ? cplan->step[step_n + 1] - cplan->step[step_n] : 1;
+}
+
+// the k-th node of a step
+static int ggml_graph_step_node(const struct ggml_cplan * cplan, int step_n, int k) {
+    return cplan->n_steps > 0 ? cplan->order[cplan->step[step_n] + k] : step_n;
+}
+
+// parameters of thread ith for the k-th node of a step, returns false if the thread does not take part in the node
+// the nodes of a step take their threads in turn, so that the nodes with fewer tasks than threads run next to each other
+// instead of all on the first threads, and each node has its own part of the work buffer
+static bool ggml_graph_step_params(
+        struct ggml_compute_state_shared * shared, int step_n, int k, int ith, struct ggml_compute_params * params) {
+    const struct ggml_cgraph * cgraph = shared->cgraph;
+    const struct ggml_cplan  * cplan  = shared->cplan;
+
+    int    ith0 = 0;
+    size_t offs = 0;
+    for (int j = 0; j < k; j++) {
+        const int node_j = ggml_graph_step_node(cplan, step_n, j);
+        ith0 += cplan->n_tasks[node_j];
+        offs += GGML_PAD(ggml_sched_work_size(cgraph->nodes[node_j], cplan->n_tasks[node_j]), CACHE_LINE_SIZE);
+    }
+
+    const int node_n  = ggml_graph_step_node(cplan, step_n, k);
+    const int n_tasks = cplan->n_tasks[node_n];
+
+    *params = (struct ggml_compute_params) {
+        /*.type  =*/ GGML_TASK_COMPUTE,
+        /*.ith   =*/ (ith - ith0 % shared->n_threads + shared->n_threads) % shared->n_threads,
+        /*.nth   =*/ n_tasks,
+        /*.wsize =*/ cplan->work_size - offs,
+        /*.wdata =*/ cplan->work_data + offs,
+        /*.shared=*/ shared,
+        /*.fused =*/ cgraph->nodes + node_n + 1,
+        /*.n_fused=*/ ggml_graph_n_fused(cgraph, cplan->n_tasks, node_n),
+        /*.islot =*/ k,
+    };
+
+    return params->ith < n_tasks;
+}
+
 static thread_ret_t ggml_graph_compute_thread(void * data) {
     struct ggml_compute_state * state = (struct ggml_compute_state *) data;
 
@@ -17219,67 +17847,86 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
 
     const int * n_tasks_arr = cplan->n_tasks;
     const int   n_threads   = state->shared->n_threads;
+    const int   n_steps     = ggml_graph_n_steps(cgraph, cplan);
 
     set_numa_thread_affinity(state->ith, n_threads);
 
-    int node_n = -1;
+    int step_n = -1;
 
     while (true) {
         if (cplan->abort_callback && cplan->abort_callback(cplan->abort_callback_data)) {
-            state->shared->node_n += 1;
+            atomic_fetch_add(&state->shared->node_n, 1);
+            ggml_graph_compute_wake(state->shared);
             return (thread_ret_t) GGML_EXIT_ABORTED;
         }
         if (atomic_fetch_sub(&state->shared->n_active, 1) == 1) {
             // all other threads are finished and spinning
             // do finalize and init here so we don't have synchronize again
-            struct ggml_compute_params params = {
-                /*.type  =*/ GGML_TASK_FINALIZE,
-                /*.ith   =*/ 0,
-                /*.nth   =*/ 0,
-                /*.wsize =*/ cplan->work_size,
-                /*.wdata =*/ cplan->work_data,
-            };
+            struct ggml_compute_params params;
 
-            if (node_n != -1) {
+            if (step_n != -1) {
                 /* FINALIZE */
-                struct ggml_tensor * node = state->shared->cgraph->nodes[node_n];
-                if (GGML_OP_HAS_FINALIZE[node->op]) {
-                    params.nth = n_tasks_arr[node_n];
-                    ggml_compute_forward(&params, node);
+                for (int k = 0; k < ggml_graph_step_size(cplan, step_n); k++) {
+                    struct ggml_tensor * node = cgraph->nodes[ggml_graph_step_node(cplan, step_n, k)];
+                    if (GGML_OP_HAS_FINALIZE[node->op]) {
+                        ggml_graph_step_params(state->shared, step_n, k, 0, &params);
+                        params.type = GGML_TASK_FINALIZE;
+                        params.ith  = 0;
+                        ggml_compute_forward(&params, node);
+                    }
+                    ggml_graph_compute_perf_stats_node(node, state->shared);
                 }
-                ggml_graph_compute_perf_stats_node(node, state->shared);
             }
 
             // distribute new work or execute it direct if 1T
-            while (++node_n < cgraph->n_nodes) {
-                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, node_n, cgraph->n_nodes);
+            while (++step_n < n_steps) {
+                GGML_PRINT_DEBUG_5("%s: %d/%d\n", __func__, step_n, n_steps);
 
-                struct ggml_tensor * node = cgraph->nodes[node_n];
+                const int n_step  = ggml_graph_step_size(cplan, step_n);
+                const int node_n  = ggml_graph_step_node(cplan, step_n, 0);
                 const int n_tasks = n_tasks_arr[node_n];
 
+                if (n_tasks == 0) {
+                    // computed with the node it is fused into
+                    continue;
+                }
+
                 state->shared->perf_node_start_cycles  = ggml_perf_cycles();
                 state->shared->perf_node_start_time_us = ggml_perf_time_us();
 
-                params.nth = n_tasks;
-
                 /* INIT */
-                if (GGML_OP_HAS_INIT[node->op]) {
-                    params.type = GGML_TASK_INIT;
-                    ggml_compute_forward(&params, node);
+                for (int k = 0; k < n_step; k++) {
+                    struct ggml_tensor * node = cgraph->nodes[ggml_graph_step_node(cplan, step_n, k)];
+                    if (GGML_OP_HAS_INIT[node->op]) {
+                        ggml_graph_step_params(state->shared, step_n, k, 0, &params);
+                        params.type = GGML_TASK_INIT;
+                        params.ith  = 0;
+                        ggml_compute_forward(&params, node);
+                    }
                 }
 
-                if (n_tasks == 1) {
+                bool single = true;
+                for (int k = 0; k < n_step; k++) {
+                    single = single && n_tasks_arr[ggml_graph_step_node(cplan, step_n, k)] == 1;
+                }
+
+                if (single) {
                     // TODO: maybe push node_n to the atomic but if other threads see n_tasks is 1,
                     // they do something more efficient than spinning (?)
-                    params.type = GGML_TASK_COMPUTE;
-                    ggml_compute_forward(&params, node);
+                    for (int k = 0; k < n_step; k++) {
+                        struct ggml_tensor * node = cgraph->nodes[ggml_graph_step_node(cplan, step_n, k)];
 
-                    if (GGML_OP_HAS_FINALIZE[node->op]) {
-                        params.type = GGML_TASK_FINALIZE;
+                        ggml_graph_step_params(state->shared, step_n, k, 0, &params);
+                        params.ith = 0;
                         ggml_compute_forward(&params, node);
-                    }
 
-                    ggml_graph_compute_perf_stats_node(node, state->shared);
+                        if (GGML_OP_HAS_FINALIZE[node->op]) {
+                            params.type = GGML_TASK_FINALIZE;
+                            ggml_compute_forward(&params, node);
+                        }
+
+                        ggml_graph_compute_perf_stats_node(node, state->shared);
+                    }
                 } else {
                     break;
                 }
@@ -17290,47 +17937,136 @@ static thread_ret_t ggml_graph_compute_thread(void * data) {
             }
 
             atomic_store(&state->shared->n_active, n_threads);
-            atomic_store(&state->shared->node_n,   node_n);
+            atomic_store(&state->shared->node_n,   step_n);
+            ggml_graph_compute_wake(state->shared);
         } else {
             // wait for other threads to finish
-            const int last = node_n;
-            while (true) {
-                // TODO: this sched_yield can have significant impact on the performance - either positive or negative
-                //       depending on the workload and the operating system.
-                //       since it is not clear what is the best approach, it should potentially become user-configurable
-                //       ref: https://github.com/ggerganov/ggml/issues/291
-#if defined(GGML_USE_ACCELERATE) || defined(GGML_USE_OPENBLAS)
-                sched_yield();
-#endif
-
-                node_n = atomic_load(&state->shared->node_n);
-                if (node_n != last) break;
-            };
+            step_n = ggml_graph_compute_wait(state->shared, step_n);
         }
 
         // check if we should stop
-        if (node_n >= cgraph->n_nodes) break;
+        if (step_n >= n_steps) break;
 
         /* COMPUTE */
-        struct ggml_tensor * node = cgraph->nodes[node_n];
-        const int n_tasks = n_tasks_arr[node_n];
-
-        struct ggml_compute_params params = {
-            /*.type  =*/ GGML_TASK_COMPUTE,
-            /*.ith   =*/ state->ith,
-            /*.nth   =*/ n_tasks,
-            /*.wsize =*/ cplan->work_size,
-            /*.wdata =*/ cplan->work_data,
-        };
-
-        if (state->ith < n_tasks) {
-            ggml_compute_forward(&params, node);
+        // the nodes of a step do not depend on each other: go to the next one as soon as done with this one
+        for (int k = 0; k < ggml_graph_step_size(cplan, step_n); k++) {
+            struct ggml_compute_params params;
+            if (ggml_graph_step_params(state->shared, step_n, k, state->ith, &params)) {
+                ggml_compute_forward(&params, cgraph->nodes[ggml_graph_step_node(cplan, step_n, k)]);
+            }
         }
     }
 
     return GGML_EXIT_SUCCESS;
 }
 
+static thread_ret_t ggml_threadpool_thread(void * data) {
+    struct ggml_compute_state * state = (struct ggml_compute_state *) data;
+    struct ggml_threadpool    * pool  = state->pool;
+
+    int n_graph = 0;
+
+    while (true) {
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->n_graph == n_graph && !pool->stop) {
+            pthread_cond_wait(&pool->cond_graph, &pool->mutex);
+        }
+        if (pool->stop) {
+            pthread_mutex_unlock(&pool->mutex);
+            break;
+        }
+        n_graph = pool->n_graph;
+
+        // the graph may use fewer threads than the pool has: the surplus workers are not waited for, so they must not
+        // touch the graph, which may already be gone once the mutex is released
+        if (state->ith >= pool->n_graph_threads) {
+            pthread_mutex_unlock(&pool->mutex);
+            continue;
+        }
+
+        state->shared = pool->shared;
+        pthread_mutex_unlock(&pool->mutex);
+
+        ggml_graph_compute_thread(state);
+
+        pthread_mutex_lock(&pool->mutex);
+        if (--pool->n_pending == 0) {
+            pthread_cond_signal(&pool->cond_done);
+        }
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return 0;
+}
+
+struct ggml_threadpool * ggml_threadpool_new(int n_threads) {
+    if (n_threads <= 0) {
+        n_threads = GGML_DEFAULT_N_THREADS;
+    }
+
+    struct ggml_threadpool * pool = malloc(sizeof(struct ggml_threadpool));
+    GGML_ASSERT(pool);
+
+    pool->n_threads = n_threads;
+    pool->workers   = malloc(sizeof(struct ggml_compute_state)*n_threads);
+    GGML_ASSERT(pool->workers);
+    pool->shared    = NULL;
+    pool->n_graph_threads = 0;
+    pool->n_graph   = 0;
+    pool->n_pending = 0;
+    pool->stop      = false;
+
+    pthread_mutex_init(&pool->mutex,      NULL);
+    pthread_cond_init (&pool->cond_graph, NULL);
+    pthread_cond_init (&pool->cond_done,  NULL);
+
+    for (int j = 0; j < n_threads; ++j) {
+        pool->workers[j] = (struct ggml_compute_state) {
+            .thrd   = 0,
+            .ith    = j,
+            .shared = NULL,
+            .pool   = pool,
+        };
+    }
+
+    // workers[0] is the thread that calls ggml_graph_compute()
+    for (int j = 1; j < n_threads; ++j) {
+        const int rc = ggml_thread_create(&pool->workers[j].thrd, NULL, ggml_threadpool_thread, &pool->workers[j]);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    return pool;
+}
+
+void ggml_threadpool_free(struct ggml_threadpool * pool) {
+    if (pool == NULL) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->mutex);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->cond_graph);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (int j = 1; j < pool->n_threads; ++j) {
+        const int rc = ggml_thread_join(pool->workers[j].thrd, NULL);
+        GGML_ASSERT(rc == 0);
+        UNUSED(rc);
+    }
+
+    pthread_cond_destroy (&pool->cond_done);
+    pthread_cond_destroy (&pool->cond_graph);
+    pthread_mutex_destroy(&pool->mutex);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int ggml_threadpool_n_threads(const struct ggml_threadpool * pool) {
+    return pool->n_threads;
+}
+
 struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     if (n_threads <= 0) {
         n_threads = GGML_DEFAULT_N_THREADS;
@@ -17622,6 +18358,17 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
                         cur += sizeof(float)*ne11*n_tasks; // this is overestimated by x2
                     }
 
+                    work_size = MAX(work_size, cur);
+                } break;
+            case GGML_OP_FLASH_ATTN_EXT:
+                {
+                    n_tasks = n_threads;
+
+                    // see ggml_compute_forward_flash_attn_ext, does not depend on the kv size
+                    const int64_t D = node->src[0]->ne[0];
+
+                    const size_t cur = sizeof(float)*(3*D + CACHE_LINE_SIZE_F32)*n_tasks;
+
                     work_size = MAX(work_size, cur);
                 } break;
             case GGML_OP_FLASH_FF:
@@ -17731,12 +18478,406 @@ struct ggml_cplan ggml_graph_plan(struct ggml_cgraph * cgraph, int n_threads) {
     }
 
     cplan.n_threads = n_threads;
+    cplan.n_spin    = GGML_DEFAULT_N_SPIN;
     cplan.work_size = work_size;
     cplan.work_data = NULL;
 
     return cplan;
 }
 
+// fusion of element-wise nodes, see ggml_graph_fuse
+
+static bool ggml_fuse_is_cpu(const struct ggml_tensor * node) {
+    if (node->backend != GGML_BACKEND_CPU || node->data == NULL) {
+        return false;
+    }
+    for (int j = 0; j < GGML_MAX_SRC; j++) {
+        if (node->src[j] && (node->src[j]->backend != GGML_BACKEND_CPU || node->src[j]->data == NULL)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// the node computes whole rows of its result, or blocks of them, and can apply the fused nodes to what it computed
+static bool ggml_fuse_can_head(const struct ggml_tensor * node) {
+    if (node->type != GGML_TYPE_F32 || node->nb[0] != sizeof(float) || !ggml_fuse_is_cpu(node)) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_NORM:
+        case GGML_OP_RMS_NORM:
+            return node->src[0]->type == GGML_TYPE_F32;
+        case GGML_OP_MUL_MAT:
+            // the matrix multiplications made by a library or a GPU in a single call are not split in blocks
+            return ggml_mul_mat_is_chunked(node);
+        default:
+            return false;
+    }
+}
+
+// node applies an element-wise op to prev, the result of the previous node
+static bool ggml_fuse_can_follow(const struct ggml_tensor * node, const struct ggml_tensor * prev) {
+    if (node->type != GGML_TYPE_F32 || node->nb[0] != sizeof(float) || !ggml_fuse_is_cpu(node) ||
+        !ggml_are_same_shape(node, prev)) {
+        return false;
+    }
+
+    switch (node->op) {
+        case GGML_OP_ADD:
+        case GGML_OP_MUL:
+            {
+                if (node->src[0] != prev && node->src[1] != prev) {
+                    return false;
+                }
+                const struct ggml_tensor * src = node->src[0] == prev ? node->src[1] : node->src[0];
+                return src != prev && src->type == GGML_TYPE_F32 && src->nb[0] == sizeof(float) && ggml_can_repeat_rows(src, prev);
+            }
+        case GGML_OP_UNARY:
+            {
+                const enum ggml_unary_op op = ggml_get_unary_op(node);
+                return (op == GGML_UNARY_OP_SILU || op == GGML_UNARY_OP_GELU) && node->src[0] == prev &&
+                    ggml_is_contiguous(node) && ggml_is_contiguous(prev);
+            }
+        default:
+            return false;
+    }
+}
+
+static bool ggml_fuse_overlap(const struct ggml_tensor * a, const struct ggml_tensor * b) {
+    const char * a0 = (const char *) a->data;
+    const char * b0 = (const char *) b->data;
+    return a0 < b0 + ggml_nbytes(b) && b0 < a0 + ggml_nbytes(a);
+}
+
+// the element-wise ops of a chain are applied to one element after the other by the thread that computed it, so
+// the result of node may only overlap the tensors read or written by the chain element by element (in-place)
+// the sources of a mul_mat are read by all the threads, they must not overlap at all
+static bool ggml_fuse_can_write(const struct ggml_tensor * node, struct ggml_tensor * const * chain, int n_chain) {
+    for (int k = 0; k <= n_chain; k++) {
+        const struct ggml_tensor * cur = k < n_chain ? chain[k] : node;
+
+        for (int j = -1; j < GGML_MAX_SRC; j++) {
+            const struct ggml_tensor * t = j < 0 ? cur : cur->src[j];
+            if (t == NULL || t == node || !ggml_fuse_overlap(node, t)) {
+                continue;
+            }
+            if (j >= 0 && cur->op == GGML_OP_MUL_MAT) {
+                return false;
+            }
+            if (t->data != node->data || !ggml_are_same_shape(t, node)) {
+                return false;
+            }
+            for (int i = 0; i < GGML_MAX_DIMS; i++) {
+                if (t->nb[i] != node->nb[i]) {
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+int ggml_graph_fuse(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    int n_fused = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        struct ggml_tensor * const * chain = cgraph->nodes + i;
+
+        int n = 1;
+        if (cplan->n_tasks[i] > 0 && ggml_fuse_can_head(chain[0])) {
+            while (i + n < cgraph->n_nodes &&
+                   ggml_fuse_can_follow(chain[n], chain[n - 1]) &&
+                   ggml_fuse_can_write (chain[n], chain, n)) {
+                cplan->n_tasks[i + n] = 0;
+                n++;
+            }
+        }
+
+        n_fused += n - 1;
+        i       += n;
+    }
+
+    return n_fused;
+}
+
+// ggml_graph_schedule
+
+// how far past the first node not computed yet the schedule looks for nodes to add to a step
+#define GGML_SCHED_WINDOW 16
+
+struct ggml_sched_range {
+    const char * begin;
+    const char * end;
+};
+
+// a node and the nodes fused into it
+struct ggml_sched_unit {
+    int    node_n;
+    int    n_nodes;
+    int    n_deps;  // units before it whose results it uses and that are not computed yet
+    bool   alone;   // computed in a step of its own
+    bool   done;
+    size_t wsize;
+
+    // memory written and read, in ranges[]
+    int i_writes, n_writes;
+    int i_reads,  n_reads;
+
+    // units that use its results, in consumers[]
+    int i_consumers, n_consumers;
+};
+
+// slot of p in the hash table, p is not in the table if the slot holds something else
+static size_t hash_find(void * const hash_table[], void * p) {
+    size_t h = hash(p);
+
+    // linear probing
+    size_t i = h;
+    while (hash_table[i] != NULL && hash_table[i] != p) {
+        i = (i + 1) % GGML_GRAPH_HASHTABLE_SIZE;
+        if (i == h) {
+            break;
+        }
+    }
+
+    return i;
+}
+
+static bool ggml_sched_is_view(const struct ggml_tensor * node) {
+    switch (node->op) {
+        case GGML_OP_NONE:
+        case GGML_OP_RESHAPE:
+        case GGML_OP_VIEW:
+        case GGML_OP_PERMUTE:
+        case GGML_OP_TRANSPOSE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static struct ggml_sched_range ggml_sched_range_of(const struct ggml_tensor * t) {
+    const char * data = (const char *) t->data;
+    return (struct ggml_sched_range) { data, data + ggml_nbytes(t) };
+}
+
+static bool ggml_sched_overlap(
+        const struct ggml_sched_range * ranges, int i_a, int n_a, int i_b, int n_b) {
+    for (int i = i_a; i < i_a + n_a; i++) {
+        for (int j = i_b; j < i_b + n_b; j++) {
+            if (ranges[i].begin < ranges[j].end && ranges[j].begin < ranges[i].end) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+// b can be computed at the same time as a: b does not write what a reads or writes, and does not read what a writes
+// this also covers the uses of memory that are not edges of the graph, like the reads of the kv cache through a view of
+// the whole cache after the write of the new tokens, or a node reusing the memory of a tensor after its last use
+static bool ggml_sched_independent(
+        const struct ggml_sched_range * ranges, const struct ggml_sched_unit * a, const struct ggml_sched_unit * b) {
+    return !ggml_sched_overlap(ranges, b->i_writes, b->n_writes, a->i_writes, a->n_writes) &&
+           !ggml_sched_overlap(ranges, b->i_writes, b->n_writes, a->i_reads,  a->n_reads)  &&
+           !ggml_sched_overlap(ranges, b->i_reads,  b->n_reads,  a->i_writes, a->n_writes);
+}
+
+int ggml_graph_schedule(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
+    cplan->n_steps = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; i++) {
+        if (!ggml_fuse_is_cpu(cgraph->nodes[i])) {
+            return 0;
+        }
+    }
+
+    struct ggml_sched_unit  * units     = malloc(sizeof(struct ggml_sched_unit)*cgraph->n_nodes);
+    struct ggml_sched_range * ranges    = malloc(sizeof(struct ggml_sched_range)*cgraph->n_nodes*(1 + GGML_MAX_SRC));
+    int                     * consumers = malloc(sizeof(int)*cgraph->n_nodes*GGML_MAX_SRC);
+    int                     * unit_of   = malloc(sizeof(int)*GGML_GRAPH_HASHTABLE_SIZE);
+    GGML_ASSERT(units && ranges && consumers && unit_of);
+
+    for (int i = 0; i < GGML_GRAPH_HASHTABLE_SIZE; i++) {
+        unit_of[i] = -1;
+    }
+
+    // units, with the memory they write and read
+    int n_units  = 0;
+    int n_ranges = 0;
+
+    for (int i = 0; i < cgraph->n_nodes; ) {
+        struct ggml_sched_unit * u = &units[n_units];
+
+        const int n_tasks = cplan->n_tasks[i];
+
+        u->node_n  = i;
+        u->n_nodes = 1 + ggml_graph_n_fused(cgraph, cplan->n_tasks, i);
+        u->n_deps  = 0;
+        u->wsize   = ggml_sched_work_size(cgraph->nodes[i], n_tasks);
+        u->alone   = u->wsize == SIZE_MAX;
+        // views are not computed, and are left out of the steps
+        u->done    = ggml_sched_is_view(cgraph->nodes[i]);
+
+        u->i_consumers = 0;
+        u->n_consumers = 0;
+
+        u->i_writes = n_ranges;
+        for (int j = i; j < i + u->n_nodes; j++) {
+            if (!ggml_sched_is_view(cgraph->nodes[j])) {
+                ranges[n_ranges++] = ggml_sched_range_of(cgraph->nodes[j]);
+            }
+        }
+        u->n_writes = n_ranges - u->i_writes;
+
+        u->i_reads = n_ranges;
+        for (int j = i; j < i + u->n_nodes; j++) {
+            const struct ggml_tensor * node = cgraph->nodes[j];
+            if (ggml_sched_is_view(node)) {
+                continue;
+            }
+            for (int k = 0; k < GGML_MAX_SRC; k++) {
+                // the nodes fused into the first one read the result of the node before them
+                if (node->src[k] && !(j > i && node->src[k] == cgraph->nodes[j - 1])) {
+                    ranges[n_ranges++] = ggml_sched_range_of(node->src[k]);
+                }
+            }
+        }
+        u->n_reads = n_ranges - u->i_reads;
+
+        for (int j = i; j < i + u->n_nodes; j++) {
+            const size_t slot = hash_find(cgraph->visited_hash_table, cgraph->nodes[j]);
+            if (cgraph->visited_hash_table[slot] == cgraph->nodes[j]) {
+                unit_of[slot] = n_units;
+            }
+        }
+
+        i += u->n_nodes;
+        n_units++;
+    }
+
+    // dependencies: the units whose results a unit uses, through an edge of the graph
+    for (int pass = 0; pass < 2; pass++) {
+        int n_consumers = 0;
+        for (int u = 0; u < n_units; u++) {
+            if (pass == 1) {
+                units[u].i_consumers = n_consumers;
+            }
+            n_consumers += units[u].n_consumers;
+            units[u].n_consumers = 0;
+        }
+
+        for (int u = 0; u < n_units; u++) {
+            for (int j = units[u].node_n; j < units[u].node_n + units[u].n_nodes; j++) {
+                for (int k = 0; k < GGML_MAX_SRC; k++) {
+                    struct ggml_tensor * src = cgraph->nodes[j]->src[k];
+                    // the result of a view is computed by the node of the tensor it is a view of
+                    while (src && ggml_sched_is_view(src) && src->src[0]) {
+                        src = src->src[0];
+                    }
+                    if (src == NULL) {
+                        continue;
+                    }
+                    const size_t slot = hash_find(cgraph->visited_hash_table, src);
+                    const int p = cgraph->visited_hash_table[slot] == src ? unit_of[slot] : -1;
+                    if (p < 0 || p == u) {
+                        continue;
+                    }
+                    if (pass == 1) {
+                        consumers[units[p].i_consumers + units[p].n_consumers] = u;
+                        units[u].n_deps++;
+                    }
+                    units[p].n_consumers++;
+                }
+            }
+        }
+    }
+
+    // steps: starting from the first unit not computed yet, the units in the window that have all their dependencies
+    // computed and are independent of the units before them not computed yet
+    size_t work_size = cplan->work_size;
+
+    int n_order = 0;
+    int first   = 0;
+
+    while (first < n_units && units[first].done) {
+        first++;
+    }
+
+    while (first < n_units) {
+        cplan->step[cplan->n_steps] = n_order;
+
+        const int step_begin = n_order;
+
+        size_t wsize = 0;
+
+        for (int u = first; u < n_units && u < first + GGML_SCHED_WINDOW && n_order - step_begin < GGML_SCHED_MAX_STEP; u++) {
+            if (units[u].done) {
+                continue;
+            }
+
+            if (units[u].alone) {
+                // nothing after it is computed before it
+                if (u == first) {
+                    cplan->order[n_order++] = units[u].node_n;
+                }
+                break;
+            }
+
+            if (units[u].n_deps > 0) {
+                continue;
+            }
+
+            bool independent = true;
+            for (int v = first; v < u && independent; v++) {
+                if (!units[v].done) {
+                    independent = ggml_sched_independent(ranges, &units[v], &units[u]);
+                }
+            }
+            if (!independent) {
+                continue;
+            }
+
+            cplan->order[n_order++] = units[u].node_n;
+
+            wsize += GGML_PAD(units[u].wsize, CACHE_LINE_SIZE);
+        }
+
+        for (int k = step_begin; k < n_order; k++) {
+            // the units in order[] are found back from their first node
+            int u = first;
+            while (units[u].node_n != cplan->order[k]) {
+                u++;
+            }
+
+            units[u].done = true;
+            for (int c = 0; c < units[u].n_consumers; c++) {
+                units[consumers[units[u].i_consumers + c]].n_deps--;
+            }
+        }
+
+        while (first < n_units && units[first].done) {
+            first++;
+        }
+
+        work_size = MAX(work_size, wsize);
+
+        cplan->n_steps++;
+    }
+
+    cplan->step[cplan->n_steps] = n_order;
+    cplan->work_size = work_size;
+
+    free(unit_of);
+    free(consumers);
+    free(ranges);
+    free(units);
+
+    return cplan->n_steps;
+}
+
 int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     {
         GGML_ASSERT(cplan);
@@ -17748,13 +18889,20 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
 
         for (int i = 0; i < cgraph->n_nodes; ++i) {
             if (cgraph->nodes[i]->op != GGML_OP_NONE) {
-                GGML_ASSERT(cplan->n_tasks[i] > 0);
+                // 0: fused into the previous node
+                GGML_ASSERT(cplan->n_tasks[i] > 0 || (i > 0 && cplan->n_tasks[i] == 0));
             }
         }
     }
 
     const int n_threads = cplan->n_threads;
 
+    pthread_mutex_t mutex;
+    pthread_cond_t  cond;
+
+    pthread_mutex_init(&mutex, NULL);
+    pthread_cond_init (&cond,  NULL);
+
     struct ggml_compute_state_shared state_shared = {
         /*.cgraph                  =*/ cgraph,
         /*.cgraph_plan             =*/ cplan,
@@ -17763,23 +18911,49 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
         /*.n_threads               =*/ n_threads,
         /*.n_active                =*/ n_threads,
         /*.node_n                  =*/ -1,
+        /*.n_sleeping              =*/ 0,
+        /*.mutex                   =*/ &mutex,
+        /*.cond                    =*/ &cond,
+        /*.current_chunk           =*/ { 0 },
         /*.abort_callback          =*/ NULL,
         /*.abort_callback_data     =*/ NULL,
     };
-    struct ggml_compute_state * workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
-
-    // create thread pool
-    if (n_threads > 1) {
-        for (int j = 1; j < n_threads; ++j) {
-            workers[j] = (struct ggml_compute_state) {
-                .thrd   = 0,
-                .ith = j,
-                .shared = &state_shared,
-            };
 
-            const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
-            GGML_ASSERT(rc == 0);
-            UNUSED(rc);
+    // with a single thread there is nothing to wake up
+    struct ggml_threadpool * pool = n_threads > 1 ? cplan->threadpool : NULL;
+
+    struct ggml_compute_state * workers = NULL;
+
+    if (pool) {
+        GGML_ASSERT(n_threads <= pool->n_threads);
+
+        workers = pool->workers;
+
+        // post the graph to the parked workers
+        pthread_mutex_lock(&pool->mutex);
+        pool->shared    = &state_shared;
+        pool->n_graph_threads = n_threads;
+        pool->n_pending = n_threads - 1;
+        pool->n_graph++;
+        pthread_cond_broadcast(&pool->cond_graph);
+        pthread_mutex_unlock(&pool->mutex);
+    } else {
+        workers = alloca(sizeof(struct ggml_compute_state)*n_threads);
+
+        // create thread pool
+        if (n_threads > 1) {
+            for (int j = 1; j < n_threads; ++j) {
+                workers[j] = (struct ggml_compute_state) {
+                    .thrd   = 0,
+                    .ith = j,
+                    .shared = &state_shared,
+                    .pool   = NULL,
+                };
+
+                const int rc = ggml_thread_create(&workers[j].thrd, NULL, ggml_graph_compute_thread, &workers[j]);
+                GGML_ASSERT(rc == 0);
+                UNUSED(rc);
+            }
         }
     }
 
@@ -17795,14 +18969,25 @@ int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan) {
     // don't leave affinity set on the main thread
     clear_numa_thread_affinity();
 
-    // join or kill thread pool
-    if (n_threads > 1) {
+    if (pool) {
+        // wait for the workers to be done with state_shared before it goes out of scope
+        pthread_mutex_lock(&pool->mutex);
+        while (pool->n_pending > 0) {
+            pthread_cond_wait(&pool->cond_done, &pool->mutex);
+        }
+        pool->shared = NULL;
+        pthread_mutex_unlock(&pool->mutex);
+    } else if (n_threads > 1) {
+        // join or kill thread pool
         for (int j = 1; j < n_threads; j++) {
             const int rc = ggml_thread_join(workers[j].thrd, NULL);
             GGML_ASSERT(rc == 0);
         }
     }
 
+    pthread_cond_destroy (&cond);
+    pthread_mutex_destroy(&mutex);
+
     // performance stats (graph)
     {
         int64_t perf_cycles_cur  = ggml_perf_cycles()  - perf_start_cycles;
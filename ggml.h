@@ -221,6 +221,7 @@
 #define GGML_MAX_NAME          64
 #define GGML_MAX_OP_PARAMS     32
 #define GGML_DEFAULT_N_THREADS 4
+#define GGML_DEFAULT_N_SPIN    32768
 
 #if UINTPTR_MAX == 0xFFFFFFFF
     #define GGML_MEM_ALIGN 4
@@ -400,6 +401,7 @@ extern "C" {
         GGML_OP_UPSCALE, // nearest interpolate
 
         GGML_OP_FLASH_ATTN,
+        GGML_OP_FLASH_ATTN_EXT,
         GGML_OP_FLASH_FF,
         GGML_OP_FLASH_ATTN_BACK,
         GGML_OP_WIN_PART,
@@ -501,6 +503,9 @@ extern "C" {
 
     static const size_t GGML_TENSOR_SIZE = sizeof(struct ggml_tensor);
 
+    // pool of worker threads that are kept alive between calls to ggml_graph_compute()
+    struct ggml_threadpool;
+
     // the compute plan that needs to be prepared for ggml_graph_compute()
     // since https://github.com/ggerganov/ggml/issues/287
     struct ggml_cplan {
@@ -509,12 +514,28 @@ extern "C" {
 
         int n_threads;
 
+        // number of times a thread that waits for the other threads checks if it can continue before it sleeps
+        // < 0: never sleep (lowest latency, but the waiting threads keep their cores busy), 0: sleep right away
+        int n_spin;
+
         // the `n_tasks` of nodes, 1:1 mapping to cgraph nodes
+        // 0 if the node is computed by the node before it, see ggml_graph_fuse()
         int n_tasks[GGML_MAX_NODES];
 
+        // optional, see ggml_graph_schedule(): the nodes are computed in steps of independent nodes, without a barrier
+        // between the nodes of a step. step s has the nodes order[step[s]] .. order[step[s + 1] - 1]
+        // 0: one node per step, in the order of the graph
+        int n_steps;
+        int step [GGML_MAX_NODES + 1];
+        int order[GGML_MAX_NODES];
+
         // abort ggml_graph_compute when true
         bool (*abort_callback)(void * data);
         void * abort_callback_data;
+
+        // optional, the workers of the pool are used instead of creating new threads
+        // the pool must have at least n_threads threads
+        struct ggml_threadpool * threadpool;
     };
 
     // next prime after GGML_MAX_NODES
@@ -566,6 +587,8 @@ extern "C" {
         GGML_TASK_FINALIZE,
     };
 
+    struct ggml_compute_state_shared;
+
     struct ggml_compute_params {
         enum ggml_task_type type;
 
@@ -575,6 +598,16 @@ extern "C" {
         // work buffer for all threads
         size_t wsize;
         void * wdata;
+
+        // state shared by the threads computing the graph (work chunk counter)
+        struct ggml_compute_state_shared * shared;
+
+        // nodes fused into the node being computed, see ggml_graph_fuse()
+        struct ggml_tensor * const * fused;
+        int n_fused;
+
+        // position of the node in the step being computed, the nodes of a step use separate work chunk counters
+        int islot;
     };
 
     // misc
@@ -600,6 +633,7 @@ extern "C" {
     GGML_API int     ggml_blck_size (enum ggml_type type);
     GGML_API size_t  ggml_type_size (enum ggml_type type); // size in bytes for all elements in a block
     GGML_API float   ggml_type_sizef(enum ggml_type type); // ggml_type_size()/ggml_blck_size() as float
+    GGML_API size_t  ggml_row_size  (enum ggml_type type, int64_t ne); // size in bytes for ne elements, ne must be a multiple of the block size
 
     GGML_API const char * ggml_type_name(enum ggml_type type);
     GGML_API const char * ggml_op_name  (enum ggml_op   op);
@@ -1262,6 +1296,29 @@ extern "C" {
             float                 freq_base,
             float                 freq_scale);
 
+    // custom RoPE with explicit positions
+    // b is an I32 vector of size a->ne[2] with the position of each row (token) of a
+    GGML_API struct ggml_tensor * ggml_rope_custom_pos(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx,
+            float                 freq_base,
+            float                 freq_scale);
+
+    // in-place, returns view(a)
+    GGML_API struct ggml_tensor * ggml_rope_custom_pos_inplace(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * a,
+            struct ggml_tensor  * b,
+            int                   n_dims,
+            int                   mode,
+            int                   n_ctx,
+            float                 freq_base,
+            float                 freq_scale);
+
     // xPos RoPE, in-place, returns view(a)
     GGML_API struct ggml_tensor * ggml_rope_xpos_inplace(
             struct ggml_context * ctx,
@@ -1402,6 +1459,22 @@ extern "C" {
             struct ggml_tensor  * v,
             bool                  masked);
 
+    // fused attention with an online softmax, the KQ matrix is never materialized
+    // q:    [n_embd_head, n_batch, n_head]
+    // k:    [n_embd_head, n_kv,    n_head_kv]
+    // v:    [n_embd_head, n_kv,    n_head_kv] - not transposed
+    // mask: [n_kv, n_batch] - added to the scaled KQ, can be NULL
+    // res:  [n_embd_head, n_head,  n_batch] - note the permutation
+    // n_head must be a multiple of n_head_kv (GQA)
+    // k and v can be f32, f16 or quantized, independently of each other
+    GGML_API struct ggml_tensor * ggml_flash_attn_ext(
+            struct ggml_context * ctx,
+            struct ggml_tensor  * q,
+            struct ggml_tensor  * k,
+            struct ggml_tensor  * v,
+            struct ggml_tensor  * mask,
+            float                 scale);
+
     GGML_API struct ggml_tensor * ggml_flash_attn_back(
            struct ggml_context * ctx,
            struct ggml_tensor  * q,
@@ -1641,6 +1714,26 @@ extern "C" {
     GGML_API               int ggml_graph_compute(struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
     GGML_API              void ggml_graph_reset  (struct ggml_cgraph * cgraph);
 
+    // fuse the element-wise nodes (add, mul, silu, gelu) that follow a mul_mat, norm or rms_norm node in the graph into
+    // it: each thread applies them to the part of the result it has just computed, without a barrier in between
+    // the results are the same as without fusion. the tensors must be allocated, the plan is only valid for the same
+    // graph with the same allocations. returns the number of fused nodes
+    GGML_API               int ggml_graph_fuse   (const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+
+    // group the nodes of the graph in steps of nodes that neither depend on each other nor use the same memory, so that
+    // the threads go from one node of a step to the next without waiting for the others. nodes that use fewer threads
+    // than the plan run on different threads. call after ggml_graph_fuse(), and allocate the work buffer afterwards:
+    // the nodes of a step have separate work buffers. like ggml_graph_fuse(), the schedule is only valid for the same
+    // graph with the same allocations. returns the number of steps, 0 if the graph is computed one node at a time
+    GGML_API               int ggml_graph_schedule(const struct ggml_cgraph * cgraph, struct ggml_cplan * cplan);
+
+    // the threads of a pool are created once and wait for new graphs between calls to ggml_graph_compute()
+    // n_threads includes the thread that calls ggml_graph_compute(), so the pool creates n_threads - 1 workers
+    // a pool can only be used by one ggml_graph_compute() call at a time
+    GGML_API struct ggml_threadpool * ggml_threadpool_new      (int n_threads);
+    GGML_API                    void ggml_threadpool_free     (struct ggml_threadpool * threadpool);
+    GGML_API                     int ggml_threadpool_n_threads(const struct ggml_threadpool * threadpool);
+
     // same as ggml_graph_compute() but the work data is allocated as a part of the context
     // note: the drawback of this API is that you must have ensured that the context has enough memory for the work data
     GGML_API void ggml_graph_compute_with_ctx(struct ggml_context * ctx, struct ggml_cgraph * cgraph, int n_threads);
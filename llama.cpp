@@ -51,24 +51,30 @@
 
 #include <algorithm>
 #include <array>
+#include <atomic>
 #include <cassert>
 #include <cinttypes>
 #include <climits>
+#include <cmath>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
+#include <exception>
 #include <fstream>
 #include <initializer_list>
+#include <limits>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <numeric>
 #include <queue>
 #include <random>
-#include <regex>
+#include <set>
 #include <sstream>
 #include <thread>
 #include <unordered_map>
@@ -466,8 +472,10 @@ struct LLM_TN {
 // ggml helpers
 //
 
-static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads) {
+static void ggml_graph_compute_helper(std::vector<uint8_t> & buf, ggml_cgraph * graph, int n_threads, ggml_threadpool * threadpool, int n_spin) {
     struct ggml_cplan plan = ggml_graph_plan(graph, n_threads);
+    plan.threadpool = threadpool;
+    plan.n_spin     = n_spin;
 
     if (plan.work_size > 0) {
         buf.resize(plan.work_size);
@@ -509,6 +517,76 @@ static std::string llama_format_win_err(DWORD err) {
 }
 #endif
 
+// allocate at least n bytes backed by huge pages, returns NULL if the system does not provide them
+// explicit huge pages (1 GiB for large buffers, then the default size, usually 2 MiB) are used when the system has
+// reserved some (vm.nr_hugepages), otherwise transparent huge pages are requested on a 2 MiB aligned mapping
+static void * llama_hugepage_malloc(size_t n, size_t & mapped_size) {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+    const size_t huge_2m = 2u*1024*1024;
+
+#ifdef MAP_HUGETLB
+#if !defined(MAP_HUGE_1GB) && defined(MAP_HUGE_SHIFT)
+#define MAP_HUGE_1GB (30 << MAP_HUGE_SHIFT) // only in <linux/mman.h>
+#endif
+#ifdef MAP_HUGE_1GB
+    const size_t huge_1g = 1024u*1024*1024;
+    if (n >= huge_1g) {
+        const size_t size = (n + huge_1g - 1) & ~(huge_1g - 1);
+        void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_HUGE_1GB, -1, 0);
+        if (addr != MAP_FAILED) {
+            mapped_size = size;
+            return addr;
+        }
+    }
+#endif
+    {
+        const size_t size = (n + huge_2m - 1) & ~(huge_2m - 1);
+        void * addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (addr != MAP_FAILED) {
+            mapped_size = size;
+            return addr;
+        }
+    }
+#endif
+
+#ifdef MADV_HUGEPAGE
+    {
+        // over-allocate by one huge page and trim, so that the buffer starts on a huge page boundary
+        const size_t size = (n + huge_2m - 1) & ~(huge_2m - 1);
+        char * raw = (char *) mmap(NULL, size + huge_2m, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw == MAP_FAILED) {
+            return NULL;
+        }
+        char * addr = (char *) (((uintptr_t) raw + huge_2m - 1) & ~(uintptr_t) (huge_2m - 1));
+        if (addr > raw) {
+            munmap(raw, addr - raw);
+        }
+        if (raw + size + huge_2m > addr + size) {
+            munmap(addr + size, raw + size + huge_2m - (addr + size));
+        }
+        if (madvise(addr, size, MADV_HUGEPAGE)) {
+            munmap(addr, size);
+            return NULL;
+        }
+        mapped_size = size;
+        return addr;
+    }
+#endif
+#endif
+    GGML_UNUSED(n);
+    GGML_UNUSED(mapped_size);
+    return NULL;
+}
+
+static void llama_hugepage_free(void * data, size_t mapped_size) {
+#if defined(__linux__) && defined(_POSIX_MAPPED_FILES)
+    munmap(data, mapped_size);
+#else
+    GGML_UNUSED(data);
+    GGML_UNUSED(mapped_size);
+#endif
+}
+
 struct llama_buffer {
     void * data = NULL;
     size_t size = 0;
@@ -517,8 +595,20 @@ struct llama_buffer {
     // useful in cases where CUDA can try to allocate PINNED memory
     bool fallback = false;
 
-    void resize(size_t n) {
-        llama_host_free(data);
+    // size of the huge page mapping, 0 if the buffer is not backed by huge pages
+    size_t mapped_size = 0;
+
+    void resize(size_t n, bool hugepages = false) {
+        release();
+
+        if (hugepages && n > 0) {
+            data = llama_hugepage_malloc(n, mapped_size);
+            if (data) {
+                size = n;
+                return;
+            }
+            LLAMA_LOG_WARN("%s: failed to allocate %.2f MB with huge pages, using regular pages\n", __func__, n/1024.0/1024.0);
+        }
 
         data = llama_host_malloc(n);
         if (!data) {
@@ -532,9 +622,11 @@ struct llama_buffer {
         size = n;
     }
 
-    ~llama_buffer() {
+    void release() {
         if (data) {
-            if (fallback) { // NOLINT
+            if (mapped_size) {
+                llama_hugepage_free(data, mapped_size);
+            } else if (fallback) { // NOLINT
                 free(data);
             } else {
                 llama_host_free(data);
@@ -542,6 +634,12 @@ struct llama_buffer {
         }
 
         data = NULL;
+        size = 0;
+        mapped_size = 0;
+    }
+
+    ~llama_buffer() {
+        release();
     }
 };
 
@@ -599,6 +697,39 @@ struct llama_file {
         return ret;
     }
 
+    // read len bytes at offset without moving the file position, safe to call from several threads at once
+    void read_raw_at(void * ptr, size_t len, size_t offset) const {
+        char * dst = (char *) ptr;
+#ifdef _WIN32
+        HANDLE hFile = (HANDLE) _get_osfhandle(_fileno(fp));
+        while (len > 0) {
+            OVERLAPPED ov = {};
+            ov.Offset     = (DWORD) (offset & 0xFFFFFFFF);
+            ov.OffsetHigh = (DWORD) (offset >> 32);
+            DWORD n_read = 0;
+            if (!ReadFile(hFile, dst, (DWORD) std::min<size_t>(len, 1u << 30), &n_read, &ov)) {
+                throw std::runtime_error(format("read error: %s", llama_format_win_err(GetLastError()).c_str()));
+            }
+#else
+        const int fd = fileno(fp);
+        while (len > 0) {
+            const ssize_t n_read = pread(fd, dst, len, (off_t) offset);
+            if (n_read < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(format("read error: %s", strerror(errno)));
+            }
+#endif
+            if (n_read == 0) {
+                throw std::runtime_error(std::string("unexpectedly reached end of file"));
+            }
+            dst    += n_read;
+            len    -= n_read;
+            offset += n_read;
+        }
+    }
+
     void write_raw(const void * ptr, size_t len) const {
         if (len == 0) {
             return;
@@ -1005,7 +1136,27 @@ struct llama_layer {
     struct ggml_tensor * b3; // ffn_up
 };
 
+struct llama_kv_cell {
+    llama_pos pos = -1;
+
+    std::set<llama_seq_id> seq_id;
+
+    bool has_seq_id(const llama_seq_id & id) const {
+        return seq_id.find(id) != seq_id.end();
+    }
+};
+
+// ring-buffer of cached KV data
 struct llama_kv_cache {
+    // the first cell that will be tried when placing a new batch
+    uint32_t head = 0;
+    uint32_t size = 0;
+
+    // computed before each graph build
+    uint32_t n = 0;
+
+    std::vector<llama_kv_cell> cells;
+
     struct ggml_tensor * k = NULL;
     struct ggml_tensor * v = NULL;
 
@@ -1013,8 +1164,6 @@ struct llama_kv_cache {
 
     llama_buffer buf;
 
-    int n; // number of tokens currently in the cache
-
     ~llama_kv_cache() {
         if (ctx) {
             ggml_free(ctx);
@@ -1043,7 +1192,16 @@ struct llama_vocab {
     std::unordered_map<token, id> token_to_id;
     std::vector<token_data>       id_to_token;
 
-    std::map<std::pair<std::string, std::string>, int> bpe_ranks;
+    // the BPE merges, keyed on the pair of merged pieces: every piece of text that takes part in a merge (in the
+    // byte-level encoding of the merges) gets an integer id at load time, so that looking up a candidate merge
+    // is one hash lookup on two ints
+    struct bpe_merge {
+        int rank;
+        int result; // piece id of the merged text
+    };
+
+    std::unordered_map<uint64_t, bpe_merge> bpe_merges;
+    std::unordered_map<uint64_t, int>       bpe_char_pieces; // a single utf8 char of the input -> its piece id
 
     // default LLaMA special tokens
     id special_bos_id = 1;
@@ -1054,14 +1212,82 @@ struct llama_vocab {
 
     id linefeed_id = 13;
 
-    int find_bpe_rank(std::string token_left, std::string token_right) const {
-        replace_all(token_left,  " ",  "\u0120");
-        replace_all(token_left,  "\n", "\u010A");
-        replace_all(token_right, " ",  "\u0120");
-        replace_all(token_right, "\n", "\u010A");
+    // token_to_id, but looked up by (pointer, length) so that the tokenizers do not have to build a
+    // std::string for every candidate piece: open addressing over the token ids, keyed by the FNV-1a
+    // hash of the text
+    std::vector<id> text_index;
+
+    static uint64_t text_hash(const char * text, size_t n) {
+        uint64_t h = 14695981039346656037ULL;
+        for (size_t i = 0; i < n; ++i) {
+            h ^= (uint8_t) text[i];
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void build_text_index() {
+        size_t n_slots = 1;
+        while (n_slots < 2*id_to_token.size()) {
+            n_slots <<= 1;
+        }
+
+        text_index.assign(n_slots, -1);
+
+        for (id i = 0; i < (id) id_to_token.size(); ++i) {
+            const token & text = id_to_token[i].text;
+            size_t slot = text_hash(text.data(), text.size()) & (n_slots - 1);
+            while (text_index[slot] != -1 && id_to_token[text_index[slot]].text != text) {
+                slot = (slot + 1) & (n_slots - 1);
+            }
+            // on duplicate texts the last id wins, as in token_to_id
+            text_index[slot] = i;
+        }
+    }
+
+    id find_token(const char * text, size_t n) const {
+        if (text_index.empty()) {
+            return -1;
+        }
+        const size_t mask = text_index.size() - 1;
+        for (size_t slot = text_hash(text, n) & mask; text_index[slot] != -1; slot = (slot + 1) & mask) {
+            const token & t = id_to_token[text_index[slot]].text;
+            if (t.size() == n && memcmp(t.data(), text, n) == 0) {
+                return text_index[slot];
+            }
+        }
+        return -1;
+    }
+
+    static uint64_t bpe_pair_key(int left, int right) {
+        return ((uint64_t) (uint32_t) left << 32) | (uint32_t) right;
+    }
+
+    static uint64_t bpe_char_key(const char * text, size_t n) {
+        GGML_ASSERT(n <= 4);
+        uint64_t key = n;
+        for (size_t i = 0; i < n; ++i) {
+            key |= (uint64_t) (uint8_t) text[i] << (8*(i + 1));
+        }
+        return key;
+    }
+
+    const bpe_merge * find_bpe_merge(int left, int right) const {
+        if (left < 0 || right < 0) {
+            return nullptr;
+        }
+
+        auto it = bpe_merges.find(bpe_pair_key(left, right));
+        if (it == bpe_merges.end()) {
+            return nullptr;
+        }
+
+        return &it->second;
+    }
 
-        auto it = bpe_ranks.find(std::make_pair(token_left, token_right));
-        if (it == bpe_ranks.end()) {
+    int find_bpe_char_piece(const char * text, size_t n) const {
+        auto it = bpe_char_pieces.find(bpe_char_key(text, n));
+        if (it == bpe_char_pieces.end()) {
             return -1;
         }
 
@@ -1069,6 +1295,27 @@ struct llama_vocab {
     }
 };
 
+// the token pieces decoded to code points, as a trie, so that the grammar sampler can match the whole
+// vocabulary against a grammar stack by walking the shared prefixes once
+struct llama_token_trie {
+    struct node {
+        uint32_t chr;         // code point on the edge from the parent
+        uint32_t child_begin; // children are nodes[child_begin, child_end), sorted by code point
+        uint32_t child_end;
+        uint32_t tok_begin;   // tokens whose piece ends at this node are toks[tok_begin, tok_end)
+        uint32_t tok_end;
+    };
+
+    struct token {
+        llama_token id;
+        uint32_t    partial_value;    // incomplete UTF-8 sequence at the end of the piece, see llama_partial_utf8
+        int         partial_n_remain;
+    };
+
+    std::vector<node>  nodes; // nodes[0] is the root
+    std::vector<token> toks;
+};
+
 struct llama_model {
     e_model     type  = MODEL_UNKNOWN;
     llm_arch    arch  = LLM_ARCH_UNKNOWN;
@@ -1106,6 +1353,10 @@ struct llama_model {
     // for quantize-stats only
     std::vector<std::pair<std::string, struct ggml_tensor *>> tensors_by_name;
 
+    // for the grammar sampler, built on first use
+    mutable std::once_flag   token_trie_once;
+    mutable llama_token_trie token_trie;
+
     int64_t t_load_us = 0;
     int64_t t_start_us = 0;
 
@@ -1127,6 +1378,64 @@ struct llama_model {
     }
 };
 
+// occurrence counts of the tokens in the penalty window, indexed by token id
+// the table is kept between calls and only the entries of the distinct tokens seen are touched, so a long window
+// costs O(window) instead of O(n_vocab)
+struct llama_token_counts {
+    std::vector<int32_t>     count;
+    std::vector<llama_token> ids; // distinct tokens with a non-zero count
+
+    void add(const llama_token * tokens, size_t n_tokens) {
+        for (size_t i = 0; i < n_tokens; ++i) {
+            const llama_token id = tokens[i];
+            if (id < 0) {
+                continue;
+            }
+            if ((size_t) id >= count.size()) {
+                count.resize(id + 1, 0);
+            }
+            if (count[id]++ == 0) {
+                ids.push_back(id);
+            }
+        }
+    }
+
+    int32_t get(llama_token id) const {
+        return id >= 0 && (size_t) id < count.size() ? count[id] : 0;
+    }
+
+    void clear() {
+        for (const llama_token id : ids) {
+            count[id] = 0;
+        }
+        ids.clear();
+    }
+};
+
+// the attention heads and feed-forward columns of every layer that a context computes: all of them, unless the layers
+// are split by tensor across the MPI nodes (see llama_context_params::mpi_tensor_parallel). the key/value heads are
+// split with their query heads, and the partial outputs of wo and w2 are then summed over the nodes
+struct llama_split {
+    bool enabled = false;
+
+    int64_t n_embd_head = 0;
+
+    int64_t head0     = 0; // first query head
+    int64_t n_head    = 0;
+    int64_t head_kv0  = 0; // first key/value head
+    int64_t n_head_kv = 0;
+    int64_t ff0       = 0; // first feed-forward column
+    int64_t n_ff      = 0;
+
+    int64_t n_embd_q() const {
+        return n_embd_head*n_head;
+    }
+
+    int64_t n_embd_gqa() const {
+        return n_embd_head*n_head_kv;
+    }
+};
+
 struct llama_context {
     llama_context(const llama_model & model) : model(model), t_load_us(model.t_load_us), t_start_us(model.t_start_us) {}
     ~llama_context() {
@@ -1141,10 +1450,28 @@ struct llama_context {
         if (alloc) {
             ggml_allocr_free(alloc);
         }
+        if (threadpool) {
+            ggml_threadpool_free(threadpool);
+        }
+#ifdef GGML_USE_MPI
+        if (ctx_mpi) {
+            if (ggml_mpi_rank(ctx_mpi) == 0 && ggml_mpi_size(ctx_mpi) > 1) {
+                // an empty batch ends the decode loop of the other nodes
+                int n_tokens  = 0;
+                int n_past    = 0;
+                int n_threads = 0;
+                ggml_mpi_eval_init(ctx_mpi, &n_tokens, &n_past, &n_threads);
+            }
+            ggml_mpi_free(ctx_mpi);
+        }
+#endif
     }
 
     std::mt19937 rng;
 
+    // scratch token counts for the penalty samplers
+    llama_token_counts token_counts;
+
     bool has_evaluated_once = false;
 
     int64_t t_sample_us = 0;
@@ -1169,12 +1496,41 @@ struct llama_context {
     std::vector<float> logits;
     bool logits_all = false;
 
+    // use ggml_flash_attn_ext for the attention, V is then cached in the same [n_embd, n_ctx] layout as K
+    // instead of transposed
+    bool flash_attn = false;
+
+    // the part of the layers computed by this context, the KV cache only holds its key/value heads
+    llama_split split;
+
     // input embedding (1-dimensional array: [n_embd])
     std::vector<float> embedding;
 
     // reusable buffer for `struct ggml_graph_plan.work_data`
     std::vector<uint8_t> work_buffer;
 
+    // inputs of the last graph built for a batch, filled by llama_set_inputs
+    struct ggml_tensor * inp_tokens   = NULL; // I32 [n_tokens]
+    struct ggml_tensor * inp_embd     = NULL; // F32 [n_embd, n_tokens]
+    struct ggml_tensor * inp_pos      = NULL; // I32 [n_tokens]
+    struct ggml_tensor * inp_KQ_mask  = NULL; // F32 [n_kv, n_tokens]
+    struct ggml_tensor * inp_KQ_scale = NULL; // F32 [1]
+
+    // the last graph built for a batch and its work plan, reused by the next batch with the same shape
+    // (see llama_decode_internal)
+    struct ggml_cgraph * gf_cached = NULL;
+    int32_t  gf_n_tokens = 0;
+    uint32_t gf_n_kv     = 0;
+    int32_t  gf_kv_head  = 0;
+    std::vector<struct ggml_tensor *> gf_kv_writes; // copies of the new K and V into the cache, moved with kv_head
+
+    int gf_n_threads = 0; // number of threads of gf_plan, 0 if gf_plan is not valid
+    struct ggml_cplan gf_plan;
+
+    // worker threads reused by every decode call, grown on demand
+    ggml_threadpool * threadpool = NULL;
+    int32_t n_spin = GGML_DEFAULT_N_SPIN;
+
     // memory buffers used to evaluate the model
     llama_buffer buf_compute;
 
@@ -1190,24 +1546,108 @@ struct llama_context {
 #endif
 };
 
+//
+// split helpers
+//
+
+// split the layers of the model for node rank out of size nodes
+// returns false if the model cannot be split that way, the context then computes all of every layer
+static bool llama_split_init(llama_split & split, const llama_model & model, int rank, int size) {
+    const auto & hparams = model.hparams;
+
+    split = llama_split();
+
+    split.n_embd_head = hparams.n_embd_head();
+    split.n_head      = hparams.n_head;
+    split.n_head_kv   = hparams.n_head_kv;
+    split.n_ff        = hparams.n_ff;
+
+    if (size == 1) {
+        return true;
+    }
+
+    // only the llama graph is split
+    if (model.arch != LLM_ARCH_LLAMA || model.layers.empty()) {
+        return false;
+    }
+
+    // the inputs of wo and w2 are split inside their rows, which must stay at block boundaries
+    int64_t blck_o  = 1;
+    int64_t blck_ff = 1;
+    for (const auto & layer : model.layers) {
+        blck_o  = std::max<int64_t>(blck_o,  ggml_blck_size(layer.wo->type));
+        blck_ff = std::max<int64_t>(blck_ff, ggml_blck_size(layer.w2->type));
+    }
+
+    // the attention is split in units of key/value heads together with their query heads
+    const int64_t n_gqa = hparams.n_gqa();
+
+    int64_t kv_per_unit = 1;
+    while (kv_per_unit < hparams.n_head_kv && (kv_per_unit*n_gqa*split.n_embd_head) % blck_o != 0) {
+        kv_per_unit++;
+    }
+
+    const int64_t n_unit_attn = hparams.n_head_kv % kv_per_unit == 0 ? hparams.n_head_kv/kv_per_unit : 0;
+    const int64_t n_unit_ff   = hparams.n_ff/blck_ff;
+
+    if (n_unit_attn < size || n_unit_ff < size) {
+        return false;
+    }
+
+    {
+        const int64_t u0 = (rank + 0)*n_unit_attn/size;
+        const int64_t u1 = (rank + 1)*n_unit_attn/size;
+
+        split.head_kv0  = u0*kv_per_unit;
+        split.n_head_kv = (u1 - u0)*kv_per_unit;
+        split.head0     = split.head_kv0*n_gqa;
+        split.n_head    = split.n_head_kv*n_gqa;
+    }
+
+    {
+        const int64_t u0 = (rank + 0)*n_unit_ff/size;
+        const int64_t u1 = (rank + 1)*n_unit_ff/size;
+
+        // the last node also takes the columns left over by the units
+        split.ff0  = u0*blck_ff;
+        split.n_ff = (rank == size - 1 ? (int64_t) hparams.n_ff : u1*blck_ff) - split.ff0;
+    }
+
+    split.enabled = true;
+
+    return true;
+}
+
 //
 // kv cache helpers
 //
 
 static bool llama_kv_cache_init(
         const struct llama_hparams & hparams,
+          const struct llama_split & split,
              struct llama_kv_cache & cache,
-                         ggml_type   wtype,
+                         ggml_type   type_k,
+                         ggml_type   type_v,
                                int   n_ctx,
-                               int   n_gpu_layers) {
-    const int n_embd  = hparams.n_embd_gqa();
+                               int   n_gpu_layers,
+                              bool   use_hugepages) {
+    const int n_embd  = split.n_embd_gqa();
     const int n_layer = hparams.n_layer;
 
     const int64_t n_mem      = n_layer*n_ctx;
     const int64_t n_elements = n_embd*n_mem;
 
-    cache.buf.resize(2u*n_elements*ggml_type_size(wtype) + 2u*MB);
-    cache.n = 0;
+    cache.head = 0;
+    cache.size = n_ctx;
+
+    cache.cells.clear();
+    cache.cells.resize(n_ctx);
+
+    cache.buf.resize(ggml_row_size(type_k, n_elements) + ggml_row_size(type_v, n_elements) + 2u*MB, use_hugepages);
+
+    // cells that are not yet used can still be attended (and masked) when the batch is padded,
+    // so make sure they never contain NaN/Inf garbage
+    memset(cache.buf.data, 0, cache.buf.size);
 
     struct ggml_init_params params;
     params.mem_size   = cache.buf.size;
@@ -1221,8 +1661,8 @@ static bool llama_kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(cache.ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(cache.ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(cache.ctx, type_v, n_elements);
     ggml_set_name(cache.k, "cache_k");
     ggml_set_name(cache.v, "cache_v");
 
@@ -1239,6 +1679,127 @@ static bool llama_kv_cache_init(
     return true;
 }
 
+// find an empty slot of size "n_tokens" in the cache
+// updates the cache head
+static bool llama_kv_cache_find_slot(
+           struct llama_kv_cache & cache,
+        const struct llama_batch & batch) {
+    const uint32_t n_ctx    = cache.size;
+    const uint32_t n_tokens = batch.n_tokens;
+
+    if (n_tokens > n_ctx) {
+        LLAMA_LOG_ERROR("%s: n_tokens=%d > n_ctx=%d\n", __func__, n_tokens, n_ctx);
+        return false;
+    }
+
+    uint32_t n_tested = 0;
+
+    while (true) {
+        if (cache.head + n_tokens > n_ctx) {
+            n_tested += n_ctx - cache.head;
+            cache.head = 0;
+            continue;
+        }
+
+        bool found = true;
+        for (uint32_t i = 0; i < n_tokens; i++) {
+            if (cache.cells[cache.head + i].pos >= 0) {
+                found = false;
+                cache.head += i + 1;
+                n_tested   += i + 1;
+                break;
+            }
+        }
+
+        if (found) {
+            break;
+        }
+
+        if (n_tested >= n_ctx) {
+            //LLAMA_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+            return false;
+        }
+    }
+
+    for (uint32_t i = 0; i < n_tokens; i++) {
+        cache.cells[cache.head + i].pos = batch.pos[i];
+        cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i]);
+    }
+
+    return true;
+}
+
+// find how many cells are currently in use
+static int32_t llama_kv_cache_cell_max(const struct llama_kv_cache & cache) {
+    for (uint32_t i = cache.size; i > 0; --i) {
+        if (cache.cells[i - 1].pos >= 0 && !cache.cells[i - 1].seq_id.empty()) {
+            return i;
+        }
+    }
+
+    return 0;
+}
+
+static void llama_kv_cache_tokens_rm(struct llama_kv_cache & cache, int32_t c0, int32_t c1) {
+    if (c0 < 0) c0 = 0;
+    if (c1 < 0) c1 = cache.size;
+
+    for (int32_t i = c0; i < c1; ++i) {
+        cache.cells[i].pos = -1;
+        cache.cells[i].seq_id.clear();
+    }
+
+    // start searching for a free slot from the first removed cell
+    cache.head = std::min(cache.head, (uint32_t) c0);
+}
+
+static void llama_kv_cache_seq_rm(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            cache.cells[i].seq_id.erase(seq_id);
+            if (cache.cells[i].seq_id.empty()) {
+                cache.cells[i].pos = -1;
+                cache.head = std::min(cache.head, i);
+            }
+        }
+    }
+}
+
+// the cells of the source sequence are tagged with the destination sequence as well
+// cells are never modified once written, so sharing them is safe: decoding a sequence always writes new cells
+static void llama_kv_cache_seq_cp(
+        struct llama_kv_cache & cache,
+                 llama_seq_id   seq_id_src,
+                 llama_seq_id   seq_id_dst,
+                    llama_pos   p0,
+                    llama_pos   p1) {
+    if (p0 < 0) p0 = 0;
+    if (p1 < 0) p1 = std::numeric_limits<llama_pos>::max();
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].has_seq_id(seq_id_src) && cache.cells[i].pos >= p0 && cache.cells[i].pos < p1) {
+            cache.cells[i].seq_id.insert(seq_id_dst);
+        }
+    }
+}
+
+static void llama_kv_cache_seq_keep(struct llama_kv_cache & cache, llama_seq_id seq_id) {
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (!cache.cells[i].has_seq_id(seq_id)) {
+            cache.cells[i].pos = -1;
+            cache.cells[i].seq_id.clear();
+            cache.head = std::min(cache.head, i);
+        }
+    }
+}
+
 //
 // model loading and saving
 //
@@ -1512,86 +2073,238 @@ struct llama_model_loader {
         }
     }
 
+    // offload a loaded tensor to its backend, returns false for tensors that stay where they are
+    bool finalize_tensor(struct ggml_tensor * cur, llama_mlock * lmlock, size_t & size_lock) const {
+        switch (cur->backend) {
+            case GGML_BACKEND_CPU:
+                if (use_mmap && lmlock) {
+                    size_lock += ggml_nbytes(cur);
+                    lmlock->grow_to(size_lock);
+                }
+                return true;
+#if defined(GGML_USE_CUBLAS)
+            case GGML_BACKEND_GPU:
+            case GGML_BACKEND_GPU_SPLIT:
+                // old code:
+                //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
+
+                // TODO: test if this works !!
+                ggml_cuda_transform_tensor(cur->data, cur);
+                if (!use_mmap) {
+                    free(cur->data);
+                }
+                return true;
+#elif defined(GGML_USE_CLBLAST)
+            case GGML_BACKEND_GPU:
+                ggml_cl_transform_tensor(cur->data, cur);
+                if (!use_mmap) {
+                    free(cur->data);
+                }
+                return true;
+#endif
+            default:
+                return false;
+        }
+    }
+
     void load_all_data(struct ggml_context * ctx, llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
         size_t size_data = 0;
         size_t size_lock = 0;
         size_t size_pref = 0; // prefetch
 
+        // visit the tensors in file order, so that the reads are sequential
+        std::vector<struct ggml_tensor *> tensors;
         for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
             struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
+            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+            tensors.push_back(cur);
             size_data += ggml_nbytes(cur);
             if (cur->backend == GGML_BACKEND_CPU) {
                 size_pref += ggml_nbytes(cur);
             }
         }
+        std::stable_sort(tensors.begin(), tensors.end(), [this](const ggml_tensor * a, const ggml_tensor * b) {
+            return file_offset(ggml_get_name(a)) < file_offset(ggml_get_name(b));
+        });
 
         if (use_mmap) {
             mapping.reset(new llama_mmap(&file, size_pref, ggml_is_numa()));
             if (lmlock) {
                 lmlock->init(mapping->addr);
             }
-        }
 
-        size_t done_size = 0;
-        for (int i = 0; i < gguf_get_n_tensors(ctx_gguf); i++) {
-            struct ggml_tensor * cur = ggml_get_tensor(ctx, gguf_get_tensor_name(ctx_gguf, i));
-            GGML_ASSERT(cur); // unused tensors should have been caught by load_data already
+            size_t done_size = 0;
+            for (struct ggml_tensor * cur : tensors) {
+                if (progress_callback) {
+                    progress_callback((float) done_size / size_data, progress_callback_user_data);
+                }
 
-            if (progress_callback) {
-                progress_callback((float) done_size / size_data, progress_callback_user_data);
-            }
+                load_data_for(cur);
 
-            // allocate temp buffer if not using mmap
-            if (!use_mmap && cur->data == NULL) {
-                GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
-                #ifdef GGML_USE_CPU_HBM
-                cur->data = (uint8_t*)hbw_malloc(ggml_nbytes(cur));
-                #else
-                cur->data = (uint8_t*)malloc(ggml_nbytes(cur));
-                #endif
+                if (finalize_tensor(cur, lmlock, size_lock)) {
+                    done_size += ggml_nbytes(cur);
+                }
             }
+        } else {
+            read_all_data(tensors, size_data, progress_callback, progress_callback_user_data, lmlock);
+        }
+    }
 
-            load_data_for(cur);
+    // read the tensor data with several threads in chunks of up to read_chunk_size bytes, in file order
+    // the calling thread reads too, and finalizes (offloads) each tensor in order as soon as all its chunks are in,
+    // so the offload of a tensor overlaps with the reads of the next ones
+    // tensors that are read into a temporary buffer are not read further ahead than read_max_temp bytes
+    void read_all_data(
+            const std::vector<struct ggml_tensor *> & tensors, size_t size_data,
+            llama_progress_callback progress_callback, void * progress_callback_user_data, llama_mlock * lmlock) {
+        static const size_t read_chunk_size = 16u*1024*1024;
+        static const size_t read_max_temp   = 512u*1024*1024;
+        static const int    read_max_threads = 8;
 
-            switch (cur->backend) {
-                case GGML_BACKEND_CPU:
-                    if (use_mmap && lmlock) {
-                        size_lock += ggml_nbytes(cur);
-                        lmlock->grow_to(size_lock);
-                    }
-                    break;
-#if defined(GGML_USE_CUBLAS)
-                case GGML_BACKEND_GPU:
-                case GGML_BACKEND_GPU_SPLIT:
-                    // old code:
-                    //ggml_cuda_transform_tensor(lt.data, lt.ggml_tensor);
-
-                    // TODO: test if this works !!
-                    ggml_cuda_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
-                    break;
-#elif defined(GGML_USE_CLBLAST)
-                case GGML_BACKEND_GPU:
-                    ggml_cl_transform_tensor(cur->data, cur);
-                    if (!use_mmap) {
-                        free(cur->data);
-                    }
-                    break;
-#endif
-                default:
-                    continue;
-            }
+        struct read_chunk {
+            int    tensor;
+            size_t offs; // offset in the tensor
+            size_t size;
+        };
 
-            done_size += ggml_nbytes(cur);
+        std::vector<read_chunk> chunks;
+        std::vector<int>  n_pending(tensors.size(), 0);
+        std::vector<bool> is_temp  (tensors.size(), false);
+        for (size_t i = 0; i < tensors.size(); ++i) {
+            const size_t nbytes = ggml_nbytes(tensors[i]);
+            for (size_t offs = 0; offs < nbytes; offs += read_chunk_size) {
+                chunks.push_back({ (int) i, offs, std::min(read_chunk_size, nbytes - offs) });
+                n_pending[i]++;
+            }
         }
-    }
-};
 
-//
-// load LLaMA models
-//
+        std::mutex mutex;
+        std::condition_variable cv;
+        size_t next_chunk = 0;
+        size_t size_temp  = 0;
+        bool   failed     = false;
+        std::exception_ptr error;
+
+        // hand out the next chunk, or -1 if there is none left (or none allowed yet when wait is false)
+        // the temporary buffer of a tensor is allocated when its first chunk is handed out
+        auto take_chunk = [&](std::unique_lock<std::mutex> & lock, bool wait) -> int {
+            while (!failed && next_chunk < chunks.size()) {
+                const read_chunk & chunk = chunks[next_chunk];
+                struct ggml_tensor * cur = tensors[chunk.tensor];
+                if (chunk.offs == 0 && cur->data == NULL) {
+                    GGML_ASSERT(cur->backend != GGML_BACKEND_CPU);
+                    const size_t nbytes = ggml_nbytes(cur);
+                    if (size_temp > 0 && size_temp + nbytes > read_max_temp) {
+                        if (!wait) {
+                            return -1;
+                        }
+                        cv.wait(lock);
+                        continue;
+                    }
+                    #ifdef GGML_USE_CPU_HBM
+                    cur->data = (uint8_t*)hbw_malloc(nbytes);
+                    #else
+                    cur->data = (uint8_t*)malloc(nbytes);
+                    #endif
+                    size_temp += nbytes;
+                    is_temp[chunk.tensor] = true;
+                }
+                return (int) next_chunk++;
+            }
+            return -1;
+        };
+
+        // read one chunk outside of the lock, returns with the lock held again
+        auto read_chunk_data = [&](std::unique_lock<std::mutex> & lock, int ic) {
+            const read_chunk & chunk = chunks[ic];
+            struct ggml_tensor * cur = tensors[chunk.tensor];
+            lock.unlock();
+            try {
+                file.read_raw_at((uint8_t *) cur->data + chunk.offs, chunk.size, file_offset(ggml_get_name(cur)) + chunk.offs);
+                lock.lock();
+            } catch (...) {
+                lock.lock();
+                if (!failed) {
+                    failed = true;
+                    error  = std::current_exception();
+                }
+                cv.notify_all();
+            }
+            if (--n_pending[chunk.tensor] == 0) {
+                cv.notify_all();
+            }
+        };
+
+        const int n_threads = std::max(1, std::min<int>(read_max_threads, (int) std::thread::hardware_concurrency()));
+
+        std::vector<std::thread> workers;
+        for (int i = 1; i < n_threads && (size_t) i < chunks.size(); ++i) {
+            workers.emplace_back([&]() {
+                std::unique_lock<std::mutex> lock(mutex);
+                for (int ic; (ic = take_chunk(lock, true)) >= 0; ) {
+                    read_chunk_data(lock, ic);
+                }
+            });
+        }
+
+        size_t done_size = 0;
+        size_t size_lock = 0;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            for (size_t i = 0; i < tensors.size() && !failed; ++i) {
+                struct ggml_tensor * cur = tensors[i];
+
+                // help with the reads until this tensor is complete
+                while (n_pending[i] > 0 && !failed) {
+                    const int ic = take_chunk(lock, false);
+                    if (ic >= 0) {
+                        read_chunk_data(lock, ic);
+                    } else {
+                        cv.wait(lock);
+                    }
+                }
+                if (failed) {
+                    break;
+                }
+
+                lock.unlock();
+                try {
+                    if (progress_callback) {
+                        progress_callback((float) done_size / size_data, progress_callback_user_data);
+                    }
+                    if (finalize_tensor(cur, lmlock, size_lock)) {
+                        done_size += ggml_nbytes(cur);
+                    }
+                    lock.lock();
+                } catch (...) {
+                    lock.lock();
+                    if (!failed) {
+                        failed = true;
+                        error  = std::current_exception();
+                    }
+                }
+
+                if (is_temp[i]) {
+                    size_temp -= ggml_nbytes(cur);
+                }
+                cv.notify_all();
+            }
+            cv.notify_all();
+        }
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+};
+
+//
+// load LLaMA models
+//
 
 static std::string llama_model_ftype_name(enum llama_ftype ftype) {
     if (ftype & LLAMA_FTYPE_GUESSED) {
@@ -1770,7 +2483,7 @@ static void llm_load_hparams(
 }
 
 // TODO: This should probably be in llama.h
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos);
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, std::vector<int32_t> * offsets);
 static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch);
 
 static void llm_load_vocab(
@@ -1827,6 +2540,11 @@ static void llm_load_vocab(
 
             const int n_merges = gguf_get_arr_n(ctx, merges_keyidx);
 
+            std::unordered_map<std::string, int> piece_ids;
+            auto piece_id = [&](const std::string & piece) {
+                return piece_ids.emplace(piece, (int) piece_ids.size()).first->second;
+            };
+
             for (int i = 0; i < n_merges; i++) {
                 const std::string word = gguf_get_arr_str(ctx, merges_keyidx, i);
 
@@ -1840,7 +2558,27 @@ static void llm_load_vocab(
                     second = word.substr(pos + 1);
                 }
 
-                vocab.bpe_ranks.emplace(std::make_pair(first, second), i);
+                const int left  = piece_id(first);
+                const int right = piece_id(second);
+
+                vocab.bpe_merges.emplace(llama_vocab::bpe_pair_key(left, right), llama_vocab::bpe_merge{ i, piece_id(first + second) });
+            }
+
+            // the tokenizer starts from the utf8 chars of the input, in which only spaces and newlines are
+            // written differently than in the merges
+            for (const auto & it : piece_ids) {
+                const std::string & piece = it.first;
+                if (piece.empty() || piece.size() != utf8_len(piece[0])) {
+                    continue;
+                }
+
+                vocab.bpe_char_pieces[llama_vocab::bpe_char_key(piece.data(), piece.size())] = it.second;
+
+                if (piece == "\u0120") {
+                    vocab.bpe_char_pieces[llama_vocab::bpe_char_key(" ", 1)]  = it.second;
+                } else if (piece == "\u010A") {
+                    vocab.bpe_char_pieces[llama_vocab::bpe_char_key("\n", 1)] = it.second;
+                }
             }
 
             // default special tokens
@@ -1872,11 +2610,13 @@ static void llm_load_vocab(
         token_data.type  = (llama_token_type) toktypes[i];
     }
 
+    vocab.build_text_index();
+
     // determine the newline token: LLaMA "<0x0A>" == 10 == '\n', Falcon 193 == '\n'
     if (vocab.type == LLAMA_VOCAB_TYPE_SPM) {
         vocab.linefeed_id = llama_byte_to_token(vocab, '\n');
     } else {
-        vocab.linefeed_id = llama_tokenize_internal(vocab, "\n", false)[0];
+        vocab.linefeed_id = llama_tokenize_internal(vocab, "\n", false, nullptr)[0];
     }
 
     // special tokens
@@ -1896,7 +2636,7 @@ static void llm_load_print_meta(llama_model_loader & ml, llama_model & model) {
     LLAMA_LOG_INFO("%s: arch           = %s\n",     __func__, LLM_ARCH_NAMES.at(model.arch).c_str());
     LLAMA_LOG_INFO("%s: vocab type     = %s\n",     __func__, vocab.type == LLAMA_VOCAB_TYPE_SPM ? "SPM" : "BPE"); // TODO: fix
     LLAMA_LOG_INFO("%s: n_vocab        = %u\n",     __func__, hparams.n_vocab);
-    LLAMA_LOG_INFO("%s: n_merges       = %u\n",     __func__, (int) vocab.bpe_ranks.size());
+    LLAMA_LOG_INFO("%s: n_merges       = %u\n",     __func__, (int) vocab.bpe_merges.size());
     LLAMA_LOG_INFO("%s: n_ctx_train    = %u\n",     __func__, hparams.n_ctx_train);
     LLAMA_LOG_INFO("%s: n_ctx          = %u\n",     __func__, hparams.n_ctx);
     LLAMA_LOG_INFO("%s: n_embd         = %u\n",     __func__, hparams.n_embd);
@@ -1942,6 +2682,7 @@ static void llm_load_tensors(
         bool low_vram,
         ggml_type memory_type,
         bool use_mlock,
+        bool use_hugepages,
         llama_progress_callback progress_callback,
         void * progress_callback_user_data) {
     model.t_start_us = ggml_time_us();
@@ -1960,7 +2701,7 @@ static void llm_load_tensors(
 
     // create the ggml context
     {
-        model.buf.resize(ctx_size);
+        model.buf.resize(ctx_size, use_hugepages);
         if (use_mlock) {
             model.mlock_buf.init   (model.buf.data);
             model.mlock_buf.grow_to(model.buf.size);
@@ -2375,12 +3116,22 @@ static void llm_load_tensors(
     }
 #endif
 
+    const int64_t t_start_load_us = ggml_time_us();
+
     ml.load_all_data(ctx, progress_callback, progress_callback_user_data, use_mlock ? &model.mlock_mmap : NULL);
 
     if (progress_callback) {
         progress_callback(1.0f, progress_callback_user_data);
     }
 
+    {
+        const double t_load_s = (ggml_time_us() - t_start_load_us) / 1e6;
+        const double size_gb  = ml.n_bytes / 1024.0 / 1024.0 / 1024.0;
+        LLAMA_LOG_INFO("%s: tensor data    = %7.2f s (%.2f s/GB, %.2f GB/s)%s\n", __func__,
+                t_load_s, size_gb > 0 ? t_load_s / size_gb : 0.0, t_load_s > 0 ? size_gb / t_load_s : 0.0,
+                ml.use_mmap ? " - mmap, pages are read on first use" : "");
+    }
+
     model.mapping = std::move(ml.mapping);
 
     // loading time will be recalculate after the first eval, so
@@ -2403,10 +3154,17 @@ static bool llama_model_load(
         ggml_type memory_type,
         bool use_mmap,
         bool use_mlock,
+        bool use_hugepages,
         bool vocab_only,
         llama_progress_callback progress_callback,
         void *progress_callback_user_data) {
     try {
+        // a file mapping uses the page size of the page cache: copy the weights into huge pages instead
+        if (use_hugepages && use_mmap) {
+            LLAMA_LOG_INFO("%s: using huge pages, the weights are read into memory instead of mmap\n", __func__);
+            use_mmap = false;
+        }
+
         std::unique_ptr<llama_model_loader> ml(new llama_model_loader(fname, use_mmap));
 
         llm_load_arch   (*ml, model);
@@ -2427,7 +3185,7 @@ static bool llama_model_load(
         llm_load_tensors(
                 *ml, model, n_batch, n_gpu_layers,
                 main_gpu, tensor_split, mul_mat_q, low_vram, memory_type,
-                use_mlock, progress_callback, progress_callback_user_data);
+                use_mlock, use_hugepages, progress_callback, progress_callback_user_data);
     } catch (const std::exception & err) {
         LLAMA_LOG_ERROR("error loading model: %s\n", err.what());
         return false;
@@ -2436,16 +3194,134 @@ static bool llama_model_load(
     return true;
 }
 
+// fill the attention mask for a batch: token j of the batch can attend cell i of the KV cache only if
+// the cell belongs to the same sequence and is not in the future relative to the token's position
+static void llama_build_kq_mask(
+        const llama_kv_cache & kv_self,
+         const llama_batch & batch,
+                     int32_t   n_kv,
+                       float * data) {
+    for (int j = 0; j < batch.n_tokens; ++j) {
+        const llama_pos    pos    = batch.pos[j];
+        const llama_seq_id seq_id = batch.seq_id[j];
+
+        for (int i = 0; i < n_kv; ++i) {
+            if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                data[j*n_kv + i] = -INFINITY;
+            } else {
+                data[j*n_kv + i] = 0.0f;
+            }
+        }
+    }
+}
+
+// allocate the KQ_mask input of a graph, filled by llama_set_inputs
+// the mask stays alive for the whole graph, so the allocation always reserves room for n_kv == n_ctx, as in the
+// worst-case graph used to measure the compute buffer. otherwise, a smaller n_kv shifts every tensor allocated after
+// the mask and the buffer can become too fragmented to fit a graph that the measure pass said would fit
+static struct ggml_tensor * llama_build_inp_kq_mask(
+         llama_context & lctx,
+          ggml_context * ctx0,
+     const llama_batch & batch,
+               int32_t   n_kv) {
+    const int32_t n_ctx = lctx.model.hparams.n_ctx;
+    const int32_t N     = batch.n_tokens;
+
+    struct ggml_tensor * KQ_mask_buf = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_ctx, N, 1);
+    ggml_allocr_alloc(lctx.alloc, KQ_mask_buf);
+
+    struct ggml_tensor * KQ_mask = ggml_view_3d(ctx0, KQ_mask_buf, n_kv, N, 1,
+            n_kv*ggml_element_size(KQ_mask_buf), n_kv*N*ggml_element_size(KQ_mask_buf), 0);
+    ggml_set_name(KQ_mask, "KQ_mask");
+
+    lctx.inp_KQ_mask = KQ_mask;
+
+    return KQ_mask;
+}
+
+// rows [i0, i0 + n) of the weight w: the outputs of a matrix multiplication that are computed by this context
+static struct ggml_tensor * llama_split_rows(ggml_context * ctx, ggml_tensor * w, int64_t i0, int64_t n) {
+    if (n == w->ne[1]) {
+        return w;
+    }
+    return ggml_view_2d(ctx, w, w->ne[0], n, w->nb[1], i0*w->nb[1]);
+}
+
+// columns [i0, i0 + n) of the weight w: for a matrix multiplication with only these inputs
+static struct ggml_tensor * llama_split_cols(ggml_context * ctx, ggml_tensor * w, int64_t i0, int64_t n) {
+    if (n == w->ne[0]) {
+        return w;
+    }
+    return ggml_view_2d(ctx, w, n, w->ne[1], w->nb[1], ggml_row_size(w->type, i0));
+}
+
+// sum the partial outputs of a matrix multiplication with split inputs over the nodes
+static struct ggml_tensor * llama_split_reduce(llama_context & lctx, ggml_context * ctx, ggml_tensor * cur) {
+#ifdef GGML_USE_MPI
+    if (lctx.split.enabled) {
+        return ggml_mpi_allreduce(lctx.ctx_mpi, ctx, cur);
+    }
+#endif
+    (void) lctx;
+    (void) ctx;
+    return cur;
+}
+
+// attention of Q [n_embd_head, n_head, N] over the cached K and V of layer il with a single fused op
+// the V cache must be stored row-wise, see llama_context::flash_attn. returns the [n_embd, N] attention output,
+// or the part of it of the heads of lctx.split
+static struct ggml_tensor * llm_build_flash_attn(
+         llama_context & lctx,
+          ggml_context * ctx0,
+           ggml_tensor * Q,
+           ggml_tensor * KQ_mask,
+               int32_t   n_kv,
+                   int   il) {
+    const auto & hparams = lctx.model.hparams;
+    const auto & kv_self = lctx.kv_self;
+
+    // the heads of this context
+    const int64_t n_embd      = lctx.split.n_embd_q();
+    const int64_t n_ctx       = hparams.n_ctx;
+    const int64_t n_head_kv   = lctx.split.n_head_kv;
+    const int64_t n_embd_head = hparams.n_embd_head();
+    const int64_t n_embd_gqa  = lctx.split.n_embd_gqa();
+
+    const int64_t N = Q->ne[2];
+
+    struct ggml_tensor * K =
+        ggml_view_3d(ctx0, kv_self.k,
+                n_embd_head, n_kv, n_head_kv,
+                ggml_row_size(kv_self.k->type, n_embd_gqa),
+                ggml_row_size(kv_self.k->type, n_embd_head),
+                ggml_row_size(kv_self.k->type, n_embd_gqa)*n_ctx*il);
+    ggml_set_name(K, "K");
+
+    struct ggml_tensor * V =
+        ggml_view_3d(ctx0, kv_self.v,
+                n_embd_head, n_kv, n_head_kv,
+                ggml_row_size(kv_self.v->type, n_embd_gqa),
+                ggml_row_size(kv_self.v->type, n_embd_head),
+                ggml_row_size(kv_self.v->type, n_embd_gqa)*n_ctx*il);
+    ggml_set_name(V, "V");
+
+    // KQV = soft_max(K*Q/sqrt(n_embd_head) + KQ_mask)*V, already permuted to [n_embd_head, n_head, N]
+    struct ggml_tensor * KQV = ggml_flash_attn_ext(ctx0, ggml_permute(ctx0, Q, 0, 2, 1, 3), K, V, KQ_mask, 1.0f/sqrtf(float(n_embd_head)));
+    ggml_set_name(KQV, "KQV");
+
+    struct ggml_tensor * cur = ggml_reshape_2d(ctx0, KQV, n_embd, N);
+    ggml_set_name(cur, "KQV_merged_contiguous");
+
+    return cur;
+}
+
 static struct ggml_cgraph * llm_build_llama(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past) {
+     const llama_batch & batch) {
 
-    GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
-    const int N = n_tokens;
+    const int N = batch.n_tokens;
 
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
@@ -2454,16 +3330,22 @@ static struct ggml_cgraph * llm_build_llama(
 
     GGML_ASSERT(!!kv_self.ctx);
 
+    // the heads and feed-forward columns of this context: all of them, unless the layers are split across the MPI nodes
+    const auto & split = lctx.split;
+
     const int64_t n_embd      = hparams.n_embd;
     const int64_t n_layer     = hparams.n_layer;
     const int64_t n_ctx       = hparams.n_ctx;
-    const int64_t n_head      = hparams.n_head;
-    const int64_t n_head_kv   = hparams.n_head_kv;
+    const int64_t n_head      = split.n_head;
+    const int64_t n_head_kv   = split.n_head_kv;
     const int64_t n_embd_head = hparams.n_embd_head();
-    const int64_t n_embd_gqa  = hparams.n_embd_gqa();
+    const int64_t n_embd_gqa  = split.n_embd_gqa();
 
     GGML_ASSERT(n_embd_head == hparams.n_rot);
 
+    const int32_t n_kv    = ggml_allocr_is_measure(lctx.alloc) ? n_ctx     : kv_self.n;
+    const int32_t kv_head = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - N : kv_self.head;
+
     const float freq_base    = hparams.rope_freq_base;
     const float freq_scale   = hparams.rope_freq_scale;
     const float norm_rms_eps = hparams.f_norm_rms_eps;
@@ -2487,14 +3369,12 @@ static struct ggml_cgraph * llm_build_llama(
     struct ggml_tensor * cur;
     struct ggml_tensor * inpL;
 
-    if (tokens) {
+    if (batch.token) {
         struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
 
         ggml_allocr_alloc(lctx.alloc, inp_tokens);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inp_tokens->data, tokens, N*ggml_element_size(inp_tokens));
-        }
         ggml_set_name(inp_tokens, "inp_tokens");
+        lctx.inp_tokens = inp_tokens;
 
         inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
@@ -2505,9 +3385,7 @@ static struct ggml_cgraph * llm_build_llama(
         inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
 
         ggml_allocr_alloc(lctx.alloc, inpL);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inpL->data, embd, N * n_embd * ggml_element_size(inpL));
-        }
+        lctx.inp_embd = inpL;
     }
 
     const int i_gpu_start = n_layer - n_gpu_layers;
@@ -2536,10 +3414,17 @@ static struct ggml_cgraph * llm_build_llama(
 
     struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
     ggml_allocr_alloc(lctx.alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(lctx.alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
-    }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    lctx.inp_KQ_scale = KQ_scale;
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = llama_build_inp_kq_mask(lctx, ctx0, batch, n_kv);
+
+    // inp_pos - contains the positions
+    struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(inp_pos, "inp_pos");
+    ggml_allocr_alloc(lctx.alloc, inp_pos);
+    lctx.inp_pos = inp_pos;
 
     for (int il = 0; il < n_layer; ++il) {
         ggml_format_name(inpL, "layer_inp_%d", il);
@@ -2569,41 +3454,52 @@ static struct ggml_cgraph * llm_build_llama(
         // self-attention
         {
             // compute Q and K and RoPE them
-            struct ggml_tensor * tmpk = ggml_mul_mat(ctx0, model.layers[il].wk, cur);
+            struct ggml_tensor * tmpk = ggml_mul_mat(ctx0, llama_split_rows(ctx0, model.layers[il].wk, split.head_kv0*n_embd_head, n_embd_gqa), cur);
             offload_func_kq(tmpk);
             ggml_set_name(tmpk, "tmpk");
 
-            struct ggml_tensor * tmpq = ggml_mul_mat(ctx0, model.layers[il].wq, cur);
+            struct ggml_tensor * tmpq = ggml_mul_mat(ctx0, llama_split_rows(ctx0, model.layers[il].wq, split.head0*n_embd_head, split.n_embd_q()), cur);
             offload_func_kq(tmpq);
             ggml_set_name(tmpq, "tmpq");
 
-            struct ggml_tensor * Kcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N), n_past, n_embd_head, 0, 0, freq_base, freq_scale);
+            struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, llama_split_rows(ctx0, model.layers[il].wv, split.head_kv0*n_embd_head, n_embd_gqa), cur);
+            offload_func_v(tmpv);
+            ggml_set_name(tmpv, "tmpv");
+
+            // the three projections are next to each other in the graph and alive at the same time,
+            // so that ggml_graph_schedule can compute them together
+            ggml_build_forward_expand(gf, tmpk);
+            ggml_build_forward_expand(gf, tmpq);
+            ggml_build_forward_expand(gf, tmpv);
+
+            struct ggml_tensor * Kcur = ggml_rope_custom_pos_inplace(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N), inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
             offload_func_kq(Kcur);
             ggml_set_name(Kcur, "Kcur");
 
-            struct ggml_tensor * Qcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head, N),    n_past, n_embd_head, 0, 0, freq_base, freq_scale);
+            struct ggml_tensor * Qcur = ggml_rope_custom_pos_inplace(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head, N),    inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
             offload_func_kq(Qcur);
             ggml_set_name(Qcur, "Qcur");
 
             // store key and value to memory
             {
                 // compute the transposed [N, n_embd] V matrix
-
-                struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
-                offload_func_v(tmpv);
-                ggml_set_name(tmpv, "tmpv");
-
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, N));
+                // the flash attention path keeps V in the same [n_embd, N] layout as K
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, N);
+                if (!lctx.flash_attn) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 offload_func_v(Vcur);
                 ggml_set_name(Vcur, "Vcur");
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, ggml_row_size(kv_self.k->type, n_embd_gqa)*(il*n_ctx + kv_head));
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
+                struct ggml_tensor * v = lctx.flash_attn
+                    ? ggml_view_1d(ctx0, kv_self.v, N*n_embd_gqa, ggml_row_size(kv_self.v->type, n_embd_gqa)*(il*n_ctx + kv_head))
+                    : ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
                         (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + n_past*ggml_element_size(kv_self.v));
+                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
                 offload_func_v(v);
                 ggml_set_name(v, "v");
 
@@ -2612,80 +3508,86 @@ static struct ggml_cgraph * llm_build_llama(
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
             }
 
-            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
-            offload_func_kq(Q);
-            ggml_set_name(Q, "Q");
-
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_embd_head, n_past + N, n_head_kv,
-                        ggml_element_size(kv_self.k)*n_embd_gqa,
-                        ggml_element_size(kv_self.k)*n_embd_head,
-                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
-            offload_func_kq(K);
-            ggml_set_name(K, "K");
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + N, N, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-            offload_func_kq(KQ_masked);
-            ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
-
-#if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
-#else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
-#endif
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            ggml_set_name(KQV_merged, "KQV_merged");
+            if (lctx.flash_attn) {
+                cur = llm_build_flash_attn(lctx, ctx0, Qcur, KQ_mask, n_kv, il);
+            } else {
+                struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+                offload_func_kq(Q);
+                ggml_set_name(Q, "Q");
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_kv, n_head_kv,
+                            ggml_row_size(kv_self.k->type, n_embd_gqa),
+                            ggml_row_size(kv_self.k->type, n_embd_head),
+                            ggml_row_size(kv_self.k->type, n_embd_gqa)*n_ctx*il);
+                offload_func_kq(K);
+                ggml_set_name(K, "K");
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, N, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            ggml_element_size(kv_self.v)*n_ctx,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                ggml_set_name(V, "V");
+
+    #if 1
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                ggml_set_name(KQV, "KQV");
+    #else
+                // make V contiguous in memory to speed up the matmul, however we waste time on the copy
+                // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
+                // is there a better way?
+                struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_kv, n_embd_head, n_head));
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
+    #endif
 
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-            offload_func_v(cur);
-            ggml_set_name(cur, "KQV_merged_contiguous");
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                ggml_set_name(KQV_merged, "KQV_merged");
+
+                // cur = KQV_merged.contiguous().view(n_embd, N)
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, split.n_embd_q(), N));
+                offload_func_v(cur);
+                ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
-                    model.layers[il].wo,
+                    llama_split_cols(ctx0, model.layers[il].wo, split.head0*n_embd_head, split.n_embd_q()),
                     cur);
             offload_func(cur);
             ggml_set_name(cur, "result_wo");
+
+            cur = llama_split_reduce(lctx, ctx0, cur);
         }
 
         struct ggml_tensor * inpFF = ggml_add(ctx0, cur, inpSA);
@@ -2707,13 +3609,13 @@ static struct ggml_cgraph * llm_build_llama(
             }
 
             struct ggml_tensor * tmp = ggml_mul_mat(ctx0,
-                    model.layers[il].w3,
+                    llama_split_rows(ctx0, model.layers[il].w3, split.ff0, split.n_ff),
                     cur);
             offload_func(tmp);
             ggml_set_name(tmp, "result_w3");
 
             cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w1,
+                    llama_split_rows(ctx0, model.layers[il].w1, split.ff0, split.n_ff),
                     cur);
             offload_func(cur);
             ggml_set_name(cur, "result_w1");
@@ -2728,10 +3630,12 @@ static struct ggml_cgraph * llm_build_llama(
             ggml_set_name(cur, "silu_x_result_w3");
 
             cur = ggml_mul_mat(ctx0,
-                    model.layers[il].w2,
+                    llama_split_cols(ctx0, model.layers[il].w2, split.ff0, split.n_ff),
                     cur);
             offload_func(cur);
             ggml_set_name(cur, "result_w2");
+
+            cur = llama_split_reduce(lctx, ctx0, cur);
         }
 
         cur = ggml_add(ctx0, cur, inpFF);
@@ -2770,14 +3674,11 @@ static struct ggml_cgraph * llm_build_llama(
 
 static struct ggml_cgraph * llm_build_baichaun(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past) {
+     const llama_batch & batch) {
 
-    GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
-    const int N = n_tokens;
+    const int N = batch.n_tokens;
 
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
@@ -2796,6 +3697,9 @@ static struct ggml_cgraph * llm_build_baichaun(
 
     GGML_ASSERT(n_embd_head == hparams.n_rot);
 
+    const int32_t n_kv    = ggml_allocr_is_measure(lctx.alloc) ? n_ctx     : kv_self.n;
+    const int32_t kv_head = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - N : kv_self.head;
+
     const float freq_base    = hparams.rope_freq_base;
     const float freq_scale   = hparams.rope_freq_scale;
     const float norm_rms_eps = hparams.f_norm_rms_eps;
@@ -2819,14 +3723,12 @@ static struct ggml_cgraph * llm_build_baichaun(
     struct ggml_tensor * cur;
     struct ggml_tensor * inpL;
 
-    if (tokens) {
+    if (batch.token) {
         struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
 
         ggml_allocr_alloc(lctx.alloc, inp_tokens);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inp_tokens->data, tokens, N*ggml_element_size(inp_tokens));
-        }
         ggml_set_name(inp_tokens, "inp_tokens");
+        lctx.inp_tokens = inp_tokens;
 
         inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
@@ -2837,9 +3739,7 @@ static struct ggml_cgraph * llm_build_baichaun(
         inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
 
         ggml_allocr_alloc(lctx.alloc, inpL);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inpL->data, embd, N * n_embd * ggml_element_size(inpL));
-        }
+        lctx.inp_embd = inpL;
     }
 
     const int i_gpu_start = n_layer - n_gpu_layers;
@@ -2868,10 +3768,17 @@ static struct ggml_cgraph * llm_build_baichaun(
 
     struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
     ggml_allocr_alloc(lctx.alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(lctx.alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
-    }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    lctx.inp_KQ_scale = KQ_scale;
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = llama_build_inp_kq_mask(lctx, ctx0, batch, n_kv);
+
+    // inp_pos - contains the positions
+    struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(inp_pos, "inp_pos");
+    ggml_allocr_alloc(lctx.alloc, inp_pos);
+    lctx.inp_pos = inp_pos;
 
     for (int il = 0; il < n_layer; ++il) {
         ggml_format_name(inpL, "layer_inp_%d", il);
@@ -2909,12 +3816,22 @@ static struct ggml_cgraph * llm_build_baichaun(
             offload_func_kq(tmpq);
             ggml_set_name(tmpq, "tmpq");
 
+            struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
+            offload_func_v(tmpv);
+            ggml_set_name(tmpv, "tmpv");
+
+            // the three projections are next to each other in the graph and alive at the same time,
+            // so that ggml_graph_schedule can compute them together
+            ggml_build_forward_expand(gf, tmpk);
+            ggml_build_forward_expand(gf, tmpq);
+            ggml_build_forward_expand(gf, tmpv);
+
             struct ggml_tensor * Kcur;
             struct ggml_tensor * Qcur;
             switch (model.type) {
                 case MODEL_7B:
-                    Kcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N), n_past, n_embd_head, 0, 0, freq_base, freq_scale);
-                    Qcur = ggml_rope_custom_inplace(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head, N),    n_past, n_embd_head, 0, 0, freq_base, freq_scale);
+                    Kcur = ggml_rope_custom_pos_inplace(ctx0, ggml_reshape_3d(ctx0, tmpk, n_embd_head, n_head_kv, N), inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
+                    Qcur = ggml_rope_custom_pos_inplace(ctx0, ggml_reshape_3d(ctx0, tmpq, n_embd_head, n_head, N),    inp_pos, n_embd_head, 0, 0, freq_base, freq_scale);
                     break;
                 case MODEL_13B:
                     Kcur  = ggml_reshape_3d(ctx0, tmpk, n_embd/n_head, n_head, N);
@@ -2933,22 +3850,23 @@ static struct ggml_cgraph * llm_build_baichaun(
             // store key and value to memory
             {
                 // compute the transposed [N, n_embd] V matrix
-
-                struct ggml_tensor * tmpv = ggml_mul_mat(ctx0, model.layers[il].wv, cur);
-                offload_func_v(tmpv);
-                ggml_set_name(tmpv, "tmpv");
-
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, N));
+                // the flash attention path keeps V in the same [n_embd, N] layout as K
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, tmpv, n_embd_gqa, N);
+                if (!lctx.flash_attn) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 offload_func_v(Vcur);
                 ggml_set_name(Vcur, "Vcur");
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, ggml_row_size(kv_self.k->type, n_embd_gqa)*(il*n_ctx + kv_head));
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
+                struct ggml_tensor * v = lctx.flash_attn
+                    ? ggml_view_1d(ctx0, kv_self.v, N*n_embd_gqa, ggml_row_size(kv_self.v->type, n_embd_gqa)*(il*n_ctx + kv_head))
+                    : ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
                         (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + n_past*ggml_element_size(kv_self.v));
+                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
                 offload_func_v(v);
                 ggml_set_name(v, "v");
 
@@ -2957,89 +3875,94 @@ static struct ggml_cgraph * llm_build_baichaun(
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
             }
 
-            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
-            offload_func_kq(Q);
-            ggml_set_name(Q, "Q");
-
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_embd_head, n_past + N, n_head_kv,
-                        ggml_element_size(kv_self.k)*n_embd_gqa,
-                        ggml_element_size(kv_self.k)*n_embd_head,
-                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
-            offload_func_kq(K);
-            ggml_set_name(K, "K");
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + N, N, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            struct ggml_tensor * KQ_masked;
-            struct ggml_tensor * KQ_scaled_alibi;
+            if (lctx.flash_attn) {
+                cur = llm_build_flash_attn(lctx, ctx0, Qcur, KQ_mask, n_kv, il);
+            } else {
+                struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+                offload_func_kq(Q);
+                ggml_set_name(Q, "Q");
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_kv, n_head_kv,
+                            ggml_row_size(kv_self.k->type, n_embd_gqa),
+                            ggml_row_size(kv_self.k->type, n_embd_head),
+                            ggml_row_size(kv_self.k->type, n_embd_gqa)*n_ctx*il);
+                offload_func_kq(K);
+                ggml_set_name(K, "K");
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, N, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct ggml_tensor * KQ_masked;
+                struct ggml_tensor * KQ_scaled_alibi;
+
+                switch (model.type) {
+                    case MODEL_7B:
+                        KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                        break;
+                    case MODEL_13B:
+                        // TODO: the ALiBi bias is computed from the cell index, which matches the position only for contiguous sequences
+                        KQ_scaled_alibi = ggml_alibi(ctx0, KQ_scaled, /*n_past*/ 0, n_head, 8);
+                        ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
+                        KQ_masked = ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
+                        break;
+                    default:
+                        GGML_ASSERT(false);
+                }
+                // KQ_masked = mask_past(KQ_scaled)
+                // struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                // struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled_alibi, KQ_mask);
+                // offload_func_kq(KQ_masked);
+                // ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            ggml_element_size(kv_self.v)*n_ctx,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                ggml_set_name(V, "V");
+
+    #if 1
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                ggml_set_name(KQV, "KQV");
+    #else
+                // make V contiguous in memory to speed up the matmul, however we waste time on the copy
+                // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
+                // is there a better way?
+                struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_kv, n_embd_head, n_head));
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
+    #endif
 
-            switch (model.type) {
-                case MODEL_7B:
-                    KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-                    break;
-                case MODEL_13B:
-                    KQ_scaled_alibi =ggml_alibi(ctx0, KQ_scaled, n_past, n_head, 8);
-                    ggml_set_name(KQ_scaled_alibi, "KQ_scaled_alibi");
-                    KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_alibi, n_past);
-                    break;
-                default:
-                    GGML_ASSERT(false);
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                ggml_set_name(KQV_merged, "KQV_merged");
+
+                // cur = KQV_merged.contiguous().view(n_embd, N)
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+                offload_func_v(cur);
+                ggml_set_name(cur, "KQV_merged_contiguous");
             }
-            // KQ_masked = mask_past(KQ_scaled)
-            // struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-            // struct ggml_tensor * KQ_masked = ggml_diag_mask_inf(ctx0, KQ_scaled_alibi, n_past);
-            // offload_func_kq(KQ_masked);
-            // ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
-
-#if 1
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
-#else
-            // make V contiguous in memory to speed up the matmul, however we waste time on the copy
-            // on M1 this is faster for the perplexity computation, but ~5% slower for the single-token generation
-            // is there a better way?
-            struct ggml_tensor * V_cont = ggml_cpy(ctx0, V, ggml_new_tensor_3d(ctx0, kv_self.v->type, n_past + N, n_embd_head, n_head));
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V_cont, KQ_soft_max);
-#endif
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            ggml_set_name(KQV_merged, "KQV_merged");
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-            offload_func_v(cur);
-            ggml_set_name(cur, "KQV_merged_contiguous");
 
             // projection (no bias)
             cur = ggml_mul_mat(ctx0,
@@ -3130,14 +4053,11 @@ static struct ggml_cgraph * llm_build_baichaun(
 
 static struct ggml_cgraph * llm_build_falcon(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past) {
+     const llama_batch & batch) {
 
-    GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
-    const int N = n_tokens;
+    const int N = batch.n_tokens;
 
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
@@ -3156,6 +4076,9 @@ static struct ggml_cgraph * llm_build_falcon(
 
     GGML_ASSERT(n_embd_head == hparams.n_rot);
 
+    const int32_t n_kv    = ggml_allocr_is_measure(lctx.alloc) ? n_ctx     : kv_self.n;
+    const int32_t kv_head = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - N : kv_self.head;
+
     const float freq_base  = hparams.rope_freq_base;
     const float freq_scale = hparams.rope_freq_scale;
     const float norm_eps   = hparams.f_norm_eps;
@@ -3179,14 +4102,12 @@ static struct ggml_cgraph * llm_build_falcon(
     struct ggml_tensor * cur;
     struct ggml_tensor * inpL;
 
-    if (tokens) {
+    if (batch.token) {
         struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
 
         ggml_allocr_alloc(lctx.alloc, inp_tokens);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inp_tokens->data, tokens, N*ggml_element_size(inp_tokens));
-        }
         ggml_set_name(inp_tokens, "inp_tokens");
+        lctx.inp_tokens = inp_tokens;
 
         inpL = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
@@ -3197,9 +4118,7 @@ static struct ggml_cgraph * llm_build_falcon(
         inpL = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
 
         ggml_allocr_alloc(lctx.alloc, inpL);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inpL->data, embd, N * n_embd * ggml_element_size(inpL));
-        }
+        lctx.inp_embd = inpL;
     }
 
     const int i_gpu_start = n_layer - n_gpu_layers;
@@ -3228,10 +4147,17 @@ static struct ggml_cgraph * llm_build_falcon(
 
     struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
     ggml_allocr_alloc(lctx.alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(lctx.alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
-    }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    lctx.inp_KQ_scale = KQ_scale;
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = llama_build_inp_kq_mask(lctx, ctx0, batch, n_kv);
+
+    // inp_pos - contains the positions
+    struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(inp_pos, "inp_pos");
+    ggml_allocr_alloc(lctx.alloc, inp_pos);
+    lctx.inp_pos = inp_pos;
 
     for (int il = 0; il < n_layer; ++il) {
         struct ggml_tensor * attn_norm;
@@ -3308,80 +4234,97 @@ static struct ggml_cgraph * llm_build_falcon(
                 wsize * n_embd_head * (n_head +     n_head_kv));
             offload_func_v(tmpv);
 
+            struct ggml_tensor * Vcont = ggml_cont(ctx0, tmpv);
+            offload_func_v(Vcont);
+
+            // the three copies are next to each other in the graph and alive at the same time,
+            // so that ggml_graph_schedule can compute them together
+            ggml_build_forward_expand(gf, tmpq);
+            ggml_build_forward_expand(gf, tmpk);
+            ggml_build_forward_expand(gf, Vcont);
+
             // using mode = 2 for neox mode
-            struct ggml_tensor * Qcur = ggml_rope_custom_inplace(ctx0, tmpq, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
+            struct ggml_tensor * Qcur = ggml_rope_custom_pos_inplace(ctx0, tmpq, inp_pos, n_embd_head, 2, 0, freq_base, freq_scale);
             offload_func_kq(Qcur);
-            struct ggml_tensor * Kcur = ggml_rope_custom_inplace(ctx0, tmpk, n_past, n_embd_head, 2, 0, freq_base, freq_scale);
+            struct ggml_tensor * Kcur = ggml_rope_custom_pos_inplace(ctx0, tmpk, inp_pos, n_embd_head, 2, 0, freq_base, freq_scale);
             offload_func_kq(Kcur);
 
             {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, N));
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, Vcont, n_embd_gqa, N);
+                if (!lctx.flash_attn) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 offload_func_v(Vcur);
-                offload_func_v(Vcur->src[0]->src[0]);
                 ggml_set_name(Vcur, "Vcur");
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, ggml_row_size(kv_self.k->type, n_embd_gqa)*(il*n_ctx + kv_head));
                 offload_func_kq(k);
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
+                struct ggml_tensor * v = lctx.flash_attn
+                    ? ggml_view_1d(ctx0, kv_self.v, N*n_embd_gqa, ggml_row_size(kv_self.v->type, n_embd_gqa)*(il*n_ctx + kv_head))
+                    : ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
                         (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + n_past*ggml_element_size(kv_self.v));
+                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
                 offload_func_v(v);
 
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
             }
 
-            struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
-            offload_func_kq(Q);
-            ggml_set_name(Q, "Q");
-
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_embd_head, n_past + N, n_head_kv,
-                        ggml_element_size(kv_self.k)*n_embd_gqa,
-                        ggml_element_size(kv_self.k)*n_embd_head,
-                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
-            offload_func_kq(K);
-            ggml_set_name(K, "K");
-
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            offload_func_kq(KQ);
-            ggml_set_name(KQ, "KQ");
-
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            offload_func_kq(KQ_scaled);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-            offload_func_kq(KQ_masked);
-            ggml_set_name(KQ_masked, "KQ_masked");
-
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            offload_func_v(KQ_soft_max);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            offload_func_v(V);
-            ggml_set_name(V, "V");
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            offload_func_v(KQV);
-            ggml_set_name(KQV, "KQV");
-
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            offload_func_v(KQV_merged);
-            ggml_set_name(KQV_merged, "KQV_merged");
-
-            cur = ggml_cpy(ctx0, KQV_merged, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-            offload_func_v(cur);
-            ggml_set_name(cur, "KQV_merged_contiguous");
+            if (lctx.flash_attn) {
+                cur = llm_build_flash_attn(lctx, ctx0, Qcur, KQ_mask, n_kv, il);
+            } else {
+                struct ggml_tensor * Q = ggml_permute(ctx0, Qcur, 0, 2, 1, 3);
+                offload_func_kq(Q);
+                ggml_set_name(Q, "Q");
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_kv, n_head_kv,
+                            ggml_row_size(kv_self.k->type, n_embd_gqa),
+                            ggml_row_size(kv_self.k->type, n_embd_head),
+                            ggml_row_size(kv_self.k->type, n_embd_gqa)*n_ctx*il);
+                offload_func_kq(K);
+                ggml_set_name(K, "K");
+
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                offload_func_kq(KQ);
+                ggml_set_name(KQ, "KQ");
+
+                struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                offload_func_kq(KQ_scaled);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                offload_func_kq(KQ_masked);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                offload_func_v(KQ_soft_max);
+                ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            ggml_element_size(kv_self.v)*n_ctx,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                offload_func_v(V);
+                ggml_set_name(V, "V");
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                offload_func_v(KQV);
+                ggml_set_name(KQV, "KQV");
+
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                offload_func_v(KQV_merged);
+                ggml_set_name(KQV_merged, "KQV_merged");
+
+                cur = ggml_cpy(ctx0, KQV_merged, ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+                offload_func_v(cur);
+                ggml_set_name(cur, "KQV_merged_contiguous");
+            }
 
             cur = ggml_mul_mat(ctx0, model.layers[il].wo, cur);
             offload_func(cur);
@@ -3437,14 +4380,11 @@ static struct ggml_cgraph * llm_build_falcon(
 
 static struct ggml_cgraph * llm_build_starcoder(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past) {
+     const llama_batch & batch) {
 
-    GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
-    const int N = n_tokens;
+    const int N = batch.n_tokens;
 
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
@@ -3463,6 +4403,9 @@ static struct ggml_cgraph * llm_build_starcoder(
 
     GGML_ASSERT(n_embd_head == hparams.n_rot);
 
+    const int32_t n_kv    = ggml_allocr_is_measure(lctx.alloc) ? n_ctx     : kv_self.n;
+    const int32_t kv_head = ggml_allocr_is_measure(lctx.alloc) ? n_ctx - N : kv_self.head;
+
     const float norm_eps   = hparams.f_norm_eps;
 
     auto & buf_compute = lctx.buf_compute;
@@ -3484,14 +4427,12 @@ static struct ggml_cgraph * llm_build_starcoder(
     struct ggml_tensor * position;
     struct ggml_tensor * inpL;
 
-    if (tokens) {
+    if (batch.token) {
         struct ggml_tensor * inp_tokens = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
 
         ggml_allocr_alloc(lctx.alloc, inp_tokens);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(inp_tokens->data, tokens, N*ggml_element_size(inp_tokens));
-        }
         ggml_set_name(inp_tokens, "inp_tokens");
+        lctx.inp_tokens = inp_tokens;
 
         token = ggml_get_rows(ctx0, model.tok_embeddings, inp_tokens);
     } else {
@@ -3502,31 +4443,25 @@ static struct ggml_cgraph * llm_build_starcoder(
         token = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N);
 
         ggml_allocr_alloc(lctx.alloc, token);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            memcpy(token->data, embd, N * n_embd * ggml_element_size(token));
-        }
-    }
-
-    {
-        // Compute position embeddings.
-        struct ggml_tensor * inp_positions = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
-        ggml_allocr_alloc(lctx.alloc, inp_positions);
-        if (!ggml_allocr_is_measure(lctx.alloc)) {
-            for (int i = 0; i < N; ++i) {
-                ((int32_t *) inp_positions->data)[i] = n_past + i;
-            }
-        }
-        ggml_set_name(inp_positions, "inp_positions");
-
-        position = ggml_get_rows(ctx0, model.pos_embeddings, inp_positions);
+        lctx.inp_embd = token;
     }
 
     struct ggml_tensor * KQ_scale = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, 1);
     ggml_allocr_alloc(lctx.alloc, KQ_scale);
-    if (!ggml_allocr_is_measure(lctx.alloc)) {
-        ggml_set_f32(KQ_scale, 1.0f/sqrtf(float(n_embd)/n_head));
-    }
     ggml_set_name(KQ_scale, "1/sqrt(n_embd_head)");
+    lctx.inp_KQ_scale = KQ_scale;
+
+    // KQ_mask (mask for 1 head, it will be broadcasted to all heads)
+    struct ggml_tensor * KQ_mask = llama_build_inp_kq_mask(lctx, ctx0, batch, n_kv);
+
+    // inp_pos - contains the positions
+    struct ggml_tensor * inp_pos = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, N);
+    ggml_set_name(inp_pos, "inp_pos");
+    ggml_allocr_alloc(lctx.alloc, inp_pos);
+    lctx.inp_pos = inp_pos;
+
+    // position embeddings
+    position = ggml_get_rows(ctx0, model.pos_embeddings, inp_pos);
 
     inpL = ggml_add(ctx0, token, position);
     ggml_set_name(inpL, "inpL");
@@ -3550,74 +4485,87 @@ static struct ggml_cgraph * llm_build_starcoder(
             struct ggml_tensor * Kcur = tmpk;
 
             {
-                struct ggml_tensor * Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, N));
+                struct ggml_tensor * Vcur = ggml_reshape_2d(ctx0, ggml_cont(ctx0, tmpv), n_embd_gqa, N);
+                if (!lctx.flash_attn) {
+                    Vcur = ggml_transpose(ctx0, Vcur);
+                }
                 ggml_set_name(Vcur, "Vcur");
 
-                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, (ggml_element_size(kv_self.k)*n_embd_gqa)*(il*n_ctx + n_past));
+                struct ggml_tensor * k = ggml_view_1d(ctx0, kv_self.k, N*n_embd_gqa, ggml_row_size(kv_self.k->type, n_embd_gqa)*(il*n_ctx + kv_head));
                 ggml_set_name(k, "k");
 
-                struct ggml_tensor * v = ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
+                struct ggml_tensor * v = lctx.flash_attn
+                    ? ggml_view_1d(ctx0, kv_self.v, N*n_embd_gqa, ggml_row_size(kv_self.v->type, n_embd_gqa)*(il*n_ctx + kv_head))
+                    : ggml_view_2d(ctx0, kv_self.v, N, n_embd_gqa,
                         (   n_ctx)*ggml_element_size(kv_self.v),
-                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + n_past*ggml_element_size(kv_self.v));
+                        (il*n_ctx)*ggml_element_size(kv_self.v)*n_embd_gqa + kv_head*ggml_element_size(kv_self.v));
 
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
             }
 
-            struct ggml_tensor * Q =
-                ggml_permute(ctx0,
-                        ggml_cpy(ctx0,
-                            Qcur,
-                            ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd_head, n_head, N)),
-                        0, 2, 1, 3);
-            ggml_set_name(Q, "Q");
-
-            struct ggml_tensor * K =
-                ggml_view_3d(ctx0, kv_self.k,
-                        n_embd_head, n_past + N, n_head_kv,
-                        ggml_element_size(kv_self.k)*n_embd_gqa,
-                        ggml_element_size(kv_self.k)*n_embd_head,
-                        ggml_element_size(kv_self.k)*n_embd_gqa*n_ctx*il);
-            ggml_set_name(K, "K");
-
-            // K * Q
-            struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
-            ggml_set_name(KQ, "KQ");
-
-            // KQ_scaled = KQ / sqrt(n_embd_head)
-            // KQ_scaled shape [n_past + N, N, n_head, 1]
-            struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
-            ggml_set_name(KQ_scaled, "KQ_scaled");
-
-            // KQ_masked = mask_past(KQ_scaled)
-            struct ggml_tensor * KQ_masked = ggml_diag_mask_inf_inplace(ctx0, KQ_scaled, n_past);
-            ggml_set_name(KQ_masked, "KQ_masked");
-
-            // KQ = soft_max(KQ_masked)
-            struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
-            ggml_set_name(KQ_soft_max, "KQ_soft_max");
-
-            // split cached V into n_head heads
-            struct ggml_tensor * V =
-                ggml_view_3d(ctx0, kv_self.v,
-                        n_past + N, n_embd_head, n_head_kv,
-                        ggml_element_size(kv_self.v)*n_ctx,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
-                        ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
-            ggml_set_name(V, "V");
-
-            struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
-            ggml_set_name(KQV, "KQV");
-
-            // KQV_merged = KQV.permute(0, 2, 1, 3)
-            struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
-            ggml_set_name(KQV_merged, "KQV_merged");
-
-            // cur = KQV_merged.contiguous().view(n_embd, N)
-            cur = ggml_cpy(ctx0,
-                    KQV_merged,
-                    ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
-            ggml_set_name(cur, "KQV_merged_contiguous");
+            if (lctx.flash_attn) {
+                struct ggml_tensor * Q = ggml_view_3d(ctx0, cur, n_embd_head, n_head, N,
+                        ggml_element_size(cur)*n_embd_head, cur->nb[1], 0);
+                ggml_set_name(Q, "Q");
+
+                cur = llm_build_flash_attn(lctx, ctx0, Q, KQ_mask, n_kv, il);
+            } else {
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_cpy(ctx0,
+                                Qcur,
+                                ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, n_embd_head, n_head, N)),
+                            0, 2, 1, 3);
+                ggml_set_name(Q, "Q");
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_embd_head, n_kv, n_head_kv,
+                            ggml_row_size(kv_self.k->type, n_embd_gqa),
+                            ggml_row_size(kv_self.k->type, n_embd_head),
+                            ggml_row_size(kv_self.k->type, n_embd_gqa)*n_ctx*il);
+                ggml_set_name(K, "K");
+
+                // K * Q
+                struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+                ggml_set_name(KQ, "KQ");
+
+                // KQ_scaled = KQ / sqrt(n_embd_head)
+                // KQ_scaled shape [n_kv, N, n_head, 1]
+                struct ggml_tensor * KQ_scaled = ggml_scale_inplace(ctx0, KQ, KQ_scale);
+                ggml_set_name(KQ_scaled, "KQ_scaled");
+
+                // KQ_masked = mask_past(KQ_scaled)
+                struct ggml_tensor * KQ_masked = ggml_add(ctx0, KQ_scaled, KQ_mask);
+                ggml_set_name(KQ_masked, "KQ_masked");
+
+                // KQ = soft_max(KQ_masked)
+                struct ggml_tensor * KQ_soft_max = ggml_soft_max_inplace(ctx0, KQ_masked);
+                ggml_set_name(KQ_soft_max, "KQ_soft_max");
+
+                // split cached V into n_head heads
+                struct ggml_tensor * V =
+                    ggml_view_3d(ctx0, kv_self.v,
+                            n_kv, n_embd_head, n_head_kv,
+                            ggml_element_size(kv_self.v)*n_ctx,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_head,
+                            ggml_element_size(kv_self.v)*n_ctx*n_embd_gqa*il);
+                ggml_set_name(V, "V");
+
+                struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+                ggml_set_name(KQV, "KQV");
+
+                // KQV_merged = KQV.permute(0, 2, 1, 3)
+                struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+                ggml_set_name(KQV_merged, "KQV_merged");
+
+                // cur = KQV_merged.contiguous().view(n_embd, N)
+                cur = ggml_cpy(ctx0,
+                        KQV_merged,
+                        ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, N));
+                ggml_set_name(cur, "KQV_merged_contiguous");
+            }
         }
 
         // Projection
@@ -3666,30 +4614,37 @@ static struct ggml_cgraph * llm_build_starcoder(
 
 static struct ggml_cgraph * llama_build_graph(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past) {
+     const llama_batch & batch) {
     const auto & model = lctx.model;
 
+    // the new graph is built in the same memory as the cached one
+    lctx.gf_cached    = NULL;
+    lctx.gf_n_threads = 0;
+
+    lctx.inp_tokens   = NULL;
+    lctx.inp_embd     = NULL;
+    lctx.inp_pos      = NULL;
+    lctx.inp_KQ_mask  = NULL;
+    lctx.inp_KQ_scale = NULL;
+
     struct ggml_cgraph * result = NULL;
 
     switch (model.arch) {
         case LLM_ARCH_LLAMA:
             {
-                result = llm_build_llama(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_llama(lctx, batch);
             } break;
         case LLM_ARCH_BAICHUAN:
             {
-                result = llm_build_baichaun(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_baichaun(lctx, batch);
             } break;
         case LLM_ARCH_FALCON:
             {
-                result = llm_build_falcon(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_falcon(lctx, batch);
             } break;
         case LLM_ARCH_STARCODER:
             {
-                result = llm_build_starcoder(lctx, tokens, embd, n_tokens, n_past);
+                result = llm_build_starcoder(lctx, batch);
             } break;
         default:
             GGML_ASSERT(false);
@@ -3698,36 +4653,140 @@ static struct ggml_cgraph * llama_build_graph(
     return result;
 }
 
-// evaluate the transformer
+// fill the inputs of the last graph built for a batch
+static void llama_set_inputs(llama_context & lctx, const llama_batch & batch) {
+    const auto & hparams = lctx.model.hparams;
+
+    const int32_t N = batch.n_tokens;
+
+    if (lctx.inp_tokens) {
+        memcpy(lctx.inp_tokens->data, batch.token, N*ggml_element_size(lctx.inp_tokens));
+    }
+
+    if (lctx.inp_embd) {
+        memcpy(lctx.inp_embd->data, batch.embd, N*hparams.n_embd*ggml_element_size(lctx.inp_embd));
+    }
+
+    memcpy(lctx.inp_pos->data, batch.pos, N*ggml_element_size(lctx.inp_pos));
+
+    llama_build_kq_mask(lctx.kv_self, batch, lctx.inp_KQ_mask->ne[0], (float *) lctx.inp_KQ_mask->data);
+
+    ggml_set_f32(lctx.inp_KQ_scale, 1.0f/sqrtf(float(hparams.n_embd)/hparams.n_head));
+}
+
+// remember the copies of the new K and V into the cache of a graph built for the cells starting at kv_head
+static void llama_graph_find_kv_writes(llama_context & lctx, ggml_cgraph * gf, int32_t kv_head) {
+    const auto & kv_self = lctx.kv_self;
+
+    lctx.gf_kv_head = kv_head;
+    lctx.gf_kv_writes.clear();
+
+    for (int i = 0; i < gf->n_nodes; i++) {
+        ggml_tensor * node = gf->nodes[i];
+        if (node->op == GGML_OP_CPY && (node->view_src == kv_self.k || node->view_src == kv_self.v)) {
+            lctx.gf_kv_writes.push_back(node);
+        }
+    }
+}
+
+// move the copies of the new K and V into the cache of the cached graph to the cells starting at kv_head
+static void llama_graph_move_kv_writes(llama_context & lctx, int32_t kv_head) {
+    const auto & kv_self = lctx.kv_self;
+
+    const int64_t n_embd_gqa = lctx.split.n_embd_gqa();
+
+    // size of one cell in the K and V cache, see the views of the cache in the llm_build_* functions
+    const int64_t k_cell = ggml_row_size(kv_self.k->type, n_embd_gqa);
+    const int64_t v_cell = lctx.flash_attn ? ggml_row_size(kv_self.v->type, n_embd_gqa) : ggml_element_size(kv_self.v);
+
+    const int64_t delta = kv_head - lctx.gf_kv_head;
+
+    for (ggml_tensor * cpy : lctx.gf_kv_writes) {
+        const int64_t offs = delta*(cpy->view_src == kv_self.k ? k_cell : v_cell);
+
+        // the copy is a view of its destination, which is a view of the cache
+        ggml_tensor * dst = cpy->src[1];
+        for (ggml_tensor * t : { cpy, dst }) {
+            t->view_offs = (size_t) ((int64_t) t->view_offs + offs);
+            t->data      = (char *) t->view_src->data + t->view_offs;
+        }
+        memcpy(dst->op_params, &dst->view_offs, sizeof(dst->view_offs));
+    }
+
+    lctx.gf_kv_head = kv_head;
+}
+
+// same as ggml_graph_compute_helper, with the element-wise nodes fused into the nodes before them and the independent
+// nodes computed together. the work plan is kept with the cached graph
+static void llama_graph_compute(llama_context & lctx, ggml_cgraph * gf, int n_threads) {
+    struct ggml_cplan & plan = lctx.gf_plan;
+
+    if (lctx.gf_n_threads != n_threads) {
+        plan = ggml_graph_plan(gf, n_threads);
+        ggml_graph_fuse(gf, &plan);
+        // moving the kv cache writes of a reused graph to other cells keeps them within the cache of their layer,
+        // so the nodes they are independent of stay the same
+        ggml_graph_schedule(gf, &plan);
+        lctx.gf_n_threads = n_threads;
+    }
+
+    plan.threadpool = lctx.threadpool;
+    plan.n_spin     = lctx.n_spin;
+
+    if (plan.work_size > 0) {
+        lctx.work_buffer.resize(plan.work_size);
+        plan.work_data = lctx.work_buffer.data();
+    }
+
+    ggml_graph_compute(gf, &plan);
+}
+
+// decode a batch of tokens by evaluating the transformer
 //
 //   - lctx:      llama context
-//   - tokens:    new batch of tokens to process
-//   - embd       embeddings input
-//   - n_tokens   number of tokens
-//   - n_past:    the context size so far
+//   - batch:     batch to evaluate
 //   - n_threads: number of threads to use
 //
-static bool llama_eval_internal(
+// return 0 on success
+// return positive int on warning
+// return negative int on error
+//
+static int llama_decode_internal(
          llama_context & lctx,
-     const llama_token * tokens,
-           const float * embd,
-                   int   n_tokens,
-                   int   n_past,
+           llama_batch   batch,
                    int   n_threads,
             const char * cgraph_fname) {
+    int32_t n_tokens = batch.n_tokens;
 
-    GGML_ASSERT((!tokens && embd) || (tokens && !embd)); // NOLINT
+    if (n_tokens <= 0) {
+        LLAMA_LOG_ERROR("%s: n_tokens <= 0\n", __func__);
+        return -1;
+    }
 
-    GGML_ASSERT(n_tokens > 0);
-    GGML_ASSERT(n_past >= 0);
-    // TODO: keep the values of n_batch and n_ctx
-    // GGML_ASSERT(n_tokens <= n_batch);
-    // GGML_ASSERT(n_past + n_tokens <= n_ctx);
+    GGML_ASSERT((!batch.token && batch.embd) || (batch.token && !batch.embd)); // NOLINT
 
     const int64_t t_start_us = ggml_time_us();
 
 #ifdef GGML_USE_MPI
-    ggml_mpi_eval_init(lctx.ctx_mpi, &n_tokens, &n_past, &n_threads);
+    // TODO: only single-sequence batches with consecutive positions are distributed to the other nodes
+    {
+        int n_past = batch.pos ? batch.pos[0] : batch.all_pos_0;
+        ggml_mpi_eval_init(lctx.ctx_mpi, &n_tokens, &n_past, &n_threads);
+        if (ggml_mpi_rank(lctx.ctx_mpi) > 0) {
+            if (n_tokens == 0) {
+                // the main node is done: not an error, the decode loop of the node ends on this code
+                return 2;
+            }
+            llama_kv_cache_tokens_rm(lctx.kv_self, n_past, -1);
+            batch.n_tokens   = n_tokens;
+            batch.pos        = nullptr;
+            batch.seq_id     = nullptr;
+            batch.logits     = nullptr;
+            batch.all_pos_0  = n_past;
+            batch.all_pos_1  = 1;
+            batch.all_seq_id = 0;
+        }
+    }
 #endif
 
     GGML_ASSERT(n_threads > 0);
@@ -3737,35 +4796,89 @@ static bool llama_eval_internal(
     const auto & model   = lctx.model;
     const auto & hparams = model.hparams;
 
-    const auto & kv_self = lctx.kv_self;
+    auto & kv_self = lctx.kv_self;
 
     GGML_ASSERT(!!kv_self.ctx);
 
     const int64_t n_embd  = hparams.n_embd;
     const int64_t n_vocab = hparams.n_vocab;
 
-    ggml_allocr_reset(lctx.alloc);
+    // helpers for smoother batch API transistion
+    // after deprecating the llama_eval calls, these will be removed
+    std::vector<llama_pos>    pos;
+    std::vector<llama_seq_id> seq_id;
 
-    ggml_cgraph * gf = llama_build_graph(lctx, tokens, embd, n_tokens, n_past);
+    if (batch.pos == nullptr) {
+        pos.resize(n_tokens);
+        for (int32_t i = 0; i < n_tokens; i++) {
+            pos[i] = batch.all_pos_0 + i*batch.all_pos_1;
+        }
 
-    ggml_allocr_alloc_graph(lctx.alloc, gf);
+        batch.pos = pos.data();
+    }
 
-#ifdef GGML_USE_CUBLAS
-    for (int i = 0; i < gf->n_leafs; i++) {
-        ggml_tensor * node = gf->leafs[i];
-        if (node->backend == GGML_BACKEND_GPU && node->extra == NULL) {
-            ggml_cuda_assign_scratch_offset(node, (char*)node->data - (char *) lctx.buf_alloc.data);
+    if (batch.seq_id == nullptr) {
+        seq_id.resize(n_tokens);
+        for (int32_t i = 0; i < n_tokens; i++) {
+            seq_id[i] = batch.all_seq_id;
         }
+
+        batch.seq_id = seq_id.data();
     }
 
-    for (int i = 0; i < gf->n_nodes; i++) {
-        ggml_tensor * node = gf->nodes[i];
-        if (node->backend == GGML_BACKEND_GPU && node->extra == NULL) {
-            ggml_cuda_assign_scratch_offset(node, (char*)node->data - (char *) lctx.buf_alloc.data);
-        }
+    if (!llama_kv_cache_find_slot(kv_self, batch)) {
+        return 1;
+    }
+
+    // a heuristic, to avoid attending the full cache if it is not yet utilized
+    // after enough generations, the benefit from this heuristic disappears
+    // the padding keeps the number of attended cells a multiple of 32 for the GPU backends
+    kv_self.n = std::min((int32_t) hparams.n_ctx, std::max(32, GGML_PAD(llama_kv_cache_cell_max(kv_self), 32)));
+
+    ggml_cgraph * gf = NULL;
+
+    // the graph only depends on the number of tokens and of attended cells: the last graph is reused as long as they
+    // do not change, with the copies into the KV cache moved to the new head. the tensors keep their allocations
+    // the CUDA views of the cache and the MPI changes to the graph are made when the graph is built
+#if !defined(GGML_USE_CUBLAS) && !defined(GGML_USE_MPI)
+    if (lctx.gf_cached && lctx.gf_n_tokens == n_tokens && lctx.gf_n_kv == kv_self.n &&
+        (lctx.inp_tokens != NULL) == (batch.token != NULL)) {
+        gf = lctx.gf_cached;
+        llama_graph_move_kv_writes(lctx, kv_self.head);
     }
 #endif
 
+    if (gf == NULL) {
+        ggml_allocr_reset(lctx.alloc);
+
+        gf = llama_build_graph(lctx, batch);
+
+        ggml_allocr_alloc_graph(lctx.alloc, gf);
+
+#ifdef GGML_USE_CUBLAS
+        for (int i = 0; i < gf->n_leafs; i++) {
+            ggml_tensor * node = gf->leafs[i];
+            if (node->backend == GGML_BACKEND_GPU && node->extra == NULL) {
+                ggml_cuda_assign_scratch_offset(node, (char*)node->data - (char *) lctx.buf_alloc.data);
+            }
+        }
+
+        for (int i = 0; i < gf->n_nodes; i++) {
+            ggml_tensor * node = gf->nodes[i];
+            if (node->backend == GGML_BACKEND_GPU && node->extra == NULL) {
+                ggml_cuda_assign_scratch_offset(node, (char*)node->data - (char *) lctx.buf_alloc.data);
+            }
+        }
+#endif
+
+        lctx.gf_cached   = gf;
+        lctx.gf_n_tokens = n_tokens;
+        lctx.gf_n_kv     = kv_self.n;
+        llama_graph_find_kv_writes(lctx, gf, kv_self.head);
+    }
+
+    llama_set_inputs(lctx, batch);
+
     // LLAMA_LOG_INFO("graph build time: %.3f ms (%d nodes, %d leafs)\n", (ggml_time_us() - t_start_us)/1000.0, gf->n_nodes, gf->n_leafs);
 
     // for big prompts, if BLAS is enabled, it is better to use only one thread
@@ -3788,23 +4901,29 @@ static bool llama_eval_internal(
     ggml_mpi_graph_compute_pre(lctx.ctx_mpi, gf, n_layer);
 #endif
 
+    // keep the worker threads alive between tokens instead of creating them for every graph
+    if (n_threads > 1 && (!lctx.threadpool || ggml_threadpool_n_threads(lctx.threadpool) < n_threads)) {
+        ggml_threadpool_free(lctx.threadpool);
+        lctx.threadpool = ggml_threadpool_new(n_threads);
+    }
+
 #ifdef GGML_USE_METAL
     if (lctx.ctx_metal) {
         ggml_metal_set_n_cb     (lctx.ctx_metal, n_threads);
         ggml_metal_graph_compute(lctx.ctx_metal, gf);
     } else {
-        ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+        llama_graph_compute(lctx, gf, n_threads);
     }
 #else
-    ggml_graph_compute_helper(lctx.work_buffer, gf, n_threads);
+    llama_graph_compute(lctx, gf, n_threads);
 #endif
 
 #if GGML_USE_MPI
     ggml_mpi_graph_compute_post(lctx.ctx_mpi, gf, n_layer);
 #endif
 
-    // update kv token count
-    lctx.kv_self.n = n_past + N;
+    // update the kv ring buffer head
+    lctx.kv_self.head += N;
 
     if (cgraph_fname) {
         ggml_graph_export(gf, cgraph_fname);
@@ -3817,7 +4936,7 @@ static bool llama_eval_internal(
 #endif
 
     // plot the computation graph in dot format (for debugging purposes)
-    //if (n_past%100 == 0) {
+    //if (n_tokens%100 == 0) {
     //    ggml_graph_dump_dot(gf, NULL, "llama.dot");
     //}
 
@@ -3825,7 +4944,16 @@ static bool llama_eval_internal(
     {
         auto & logits_out = lctx.logits;
 
-        if (lctx.logits_all) {
+        if (batch.logits) {
+            // copy only the rows that were requested, the layout stays [n_tokens][n_vocab]
+            logits_out.resize(n_vocab * N);
+            for (int32_t i = 0; i < N; i++) {
+                if (batch.logits[i] == 0) {
+                    continue;
+                }
+                memcpy(logits_out.data() + (n_vocab*i), (float *) ggml_get_data(res) + (n_vocab*i), sizeof(float)*n_vocab);
+            }
+        } else if (lctx.logits_all) {
             logits_out.resize(n_vocab * N);
             memcpy(logits_out.data(), (float *) ggml_get_data(res), sizeof(float)*n_vocab*N);
         } else {
@@ -3853,7 +4981,7 @@ static bool llama_eval_internal(
         lctx.n_p_eval += N;
     }
 
-    return true;
+    return 0;
 }
 
 //
@@ -3891,7 +5019,11 @@ static llama_token llama_byte_to_token(const llama_vocab & vocab, uint8_t ch) {
     char buf[7];
     int result = snprintf(buf, sizeof(buf), "<0x%02X>", ch);
     GGML_ASSERT(0 <= result && result < 7);
-    return vocab.token_to_id.at(buf);
+    const llama_token id = vocab.find_token(buf, result);
+    if (id == -1) {
+        return vocab.token_to_id.at(buf);
+    }
+    return id;
 }
 
 static void llama_escape_whitespace(std::string & text) {
@@ -3918,12 +5050,11 @@ static_assert(std::is_trivially_copyable<llm_symbol>::value, "llm_symbol is not
 
 struct llm_bigram_spm {
     struct comparator {
-        bool operator()(llm_bigram_spm & l, llm_bigram_spm & r) {
+        bool operator()(const llm_bigram_spm & l, const llm_bigram_spm & r) const {
             return (l.score < r.score) || (l.score == r.score && l.left > r.left);
         }
     };
     using queue_storage = std::vector<llm_bigram_spm>;
-    using queue = std::priority_queue<llm_bigram_spm, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
     float score;
@@ -3933,7 +5064,10 @@ struct llm_bigram_spm {
 struct llm_tokenizer_spm {
     llm_tokenizer_spm(const llama_vocab & vocab): vocab(vocab) {}
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
+    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output, std::vector<int32_t> * offsets) {
+        symbols.clear();
+        work_queue.clear();
+
         // split string into utf8 chars
         int index = 0;
         size_t offs = 0;
@@ -3956,8 +5090,9 @@ struct llm_tokenizer_spm {
 
         // keep substituting the highest frequency pairs for as long as we can.
         while (!work_queue.empty()) {
-            auto bigram = work_queue.top();
-            work_queue.pop();
+            std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
+            const auto bigram = work_queue.back();
+            work_queue.pop_back();
 
             auto & left_sym = symbols[bigram.left];
             auto & right_sym = symbols[bigram.right];
@@ -3987,34 +5122,32 @@ struct llm_tokenizer_spm {
 
         for (int i = 0; i != -1; i = symbols[i].next) {
             auto & symbol = symbols[i];
-            resegment(symbol, output);
+            resegment(symbol, symbol.text - text.c_str(), output, offsets);
         }
     }
 
 private:
-    void resegment(llm_symbol & symbol, std::vector<llama_vocab::id> & output) {
-        auto text = std::string(symbol.text, symbol.n);
-        auto token = vocab.token_to_id.find(text);
+    void resegment(llm_symbol & symbol, size_t offs, std::vector<llama_vocab::id> & output, std::vector<int32_t> * offsets) {
+        const llama_vocab::id token = vocab.find_token(symbol.text, symbol.n);
 
         // Do we need to support is_unused?
-        if (token != vocab.token_to_id.end()) {
-            output.push_back((*token).second);
+        if (token != -1) {
+            output.push_back(token);
+            if (offsets) {
+                offsets->push_back(offs);
+            }
             return;
         }
 
-        const auto p = rev_merge.find(text);
-
-        if (p == rev_merge.end()) {
-            // output any symbols that did not form tokens as bytes.
-            for (int j = 0; j < (int)symbol.n; ++j) {
-                llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
-                output.push_back(token_id);
+        // symbols only grow by merging into a token of the vocabulary, so one that is not a token is a
+        // single utf8 char: output it as bytes.
+        for (int j = 0; j < (int)symbol.n; ++j) {
+            llama_vocab::id token_id = llama_byte_to_token(vocab, symbol.text[j]);
+            output.push_back(token_id);
+            if (offsets) {
+                offsets->push_back(offs + j);
             }
-            return;
         }
-
-        resegment(symbols[p->second.first],  output);
-        resegment(symbols[p->second.second], output);
     }
 
     void try_add_bigram(int left, int right) {
@@ -4022,39 +5155,39 @@ private:
             return;
         }
 
-        const std::string text = std::string(symbols[left].text, symbols[left].n + symbols[right].n);
-        auto token = vocab.token_to_id.find(text);
+        const size_t n = symbols[left].n + symbols[right].n;
+        const llama_vocab::id token = vocab.find_token(symbols[left].text, n);
 
-        if (token == vocab.token_to_id.end()) {
+        if (token == -1) {
             return;
         }
 
-        if (static_cast<size_t>((*token).second) >= vocab.id_to_token.size()) {
+        if (static_cast<size_t>(token) >= vocab.id_to_token.size()) {
             return;
         }
 
-        const auto & tok_data = vocab.id_to_token[(*token).second];
+        const auto & tok_data = vocab.id_to_token[token];
 
         llm_bigram_spm bigram;
         bigram.left  = left;
         bigram.right = right;
         bigram.score = tok_data.score;
-        bigram.size  = text.size();
-
-        work_queue.push(bigram);
+        bigram.size  = n;
 
-        // Do we need to support is_unused?
-        rev_merge[text] = std::make_pair(left, right);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_spm::comparator());
     }
 
     const llama_vocab & vocab;
 
-    std::vector<llm_symbol> symbols;
-    llm_bigram_spm::queue work_queue;
-
-    std::map<std::string, std::pair<int, int>> rev_merge;
+    // kept per thread and only cleared between texts, so that tokenizing many texts reuses their capacity
+    static thread_local std::vector<llm_symbol>       symbols;
+    static thread_local llm_bigram_spm::queue_storage work_queue;
 };
 
+thread_local std::vector<llm_symbol>       llm_tokenizer_spm::symbols;
+thread_local llm_bigram_spm::queue_storage llm_tokenizer_spm::work_queue;
+
 // BPE tokenizer
 // adapted from https://github.com/cmp-nct/ggllm.cpp [MIT License]
 // tried to simplify unicode stuff, so most likely does not work 100% correctly!
@@ -4069,41 +5202,41 @@ struct llm_bigram_bpe {
     };
 
     using queue_storage = std::vector<llm_bigram_bpe>;
-    using queue = std::priority_queue<llm_bigram_bpe, queue_storage, comparator>;
     llm_symbol::index left;
     llm_symbol::index right;
-    std::string text;
     int rank;
+    int result;
     size_t size;
 };
 
 struct llm_tokenizer_bpe {
     llm_tokenizer_bpe(const llama_vocab & vocab): vocab(vocab) {}
 
-    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output) {
-        int final_prev_index = -1;
-        auto word_collection = bpe_gpt2_preprocess(text);
+    void tokenize(const std::string & text, std::vector<llama_vocab::id> & output, std::vector<int32_t> * offsets) {
+        bpe_gpt2_preprocess(text, words);
 
-        symbols_final.clear();
-
-        for (auto & word : word_collection) {
-            work_queue = llm_bigram_bpe::queue();
+        for (const auto & word : words) {
+            work_queue.clear();
             symbols.clear();
+            pieces.clear();
+
+            const char * word_text = text.c_str() + word.first;
+            const size_t word_size = word.second;
 
             int index = 0;
             size_t offset = 0;
 
-            while (offset < word.size()) {
+            while (offset < word_size) {
                 llm_symbol sym;
-                size_t char_len = std::min(word.size() - offset, (size_t) ::utf8_len(word[offset]));
-                sym.text = word.c_str() + offset;
-                sym.n = 1;
+                size_t char_len = std::min(word_size - offset, (size_t) ::utf8_len(word_text[offset]));
+                sym.text = word_text + offset;
                 sym.n = char_len;
                 offset += sym.n;
                 sym.prev = index - 1;
-                sym.next = offset == word.size() ? -1 : index + 1;
+                sym.next = offset == word_size ? -1 : index + 1;
                 index++;
                 symbols.emplace_back(sym);
+                pieces.push_back(vocab.find_bpe_char_piece(sym.text, sym.n));
             }
             for (size_t i = 1; i < symbols.size(); ++i) {
                 add_new_bigram(i - 1, i);
@@ -4111,24 +5244,23 @@ struct llm_tokenizer_bpe {
 
             // build token(s)
             while (!work_queue.empty()) {
-                auto bigram = work_queue.top();
-                work_queue.pop();
+                std::pop_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
+                const auto bigram = work_queue.back();
+                work_queue.pop_back();
 
                 auto & left_symbol = symbols[bigram.left];
                 auto & right_symbol = symbols[bigram.right];
 
-                if (left_symbol.n == 0 || right_symbol.n == 0) {
+                // skip this bigram if it's outdated
+                if (left_symbol.n == 0 || right_symbol.n == 0 ||
+                    left_symbol.n + right_symbol.n != bigram.size) {
                     continue;
                 }
-                std::string left_token = std::string(left_symbol.text, left_symbol.n);
-                std::string right_token = std::string(right_symbol.text, right_symbol.n);
-                if (left_token + right_token != bigram.text) {
-                    continue;  // Skip this bigram if it's outdated
-                }
 
                 // merge the right sym into the left one
                 left_symbol.n += right_symbol.n;
                 right_symbol.n = 0;
+                pieces[bigram.left] = bigram.result;
 
                 // remove the right sym from the chain
                 left_symbol.next = right_symbol.next;
@@ -4140,51 +5272,113 @@ struct llm_tokenizer_bpe {
                 add_new_bigram(bigram.left, left_symbol.next);  // right side of current symbol
             }
 
-            // add the fnished tokens to the final list keeping correct order for next and prev
-            for (auto & sym : symbols) {
-                if (sym.n > 0) {
-                    sym.prev = final_prev_index;
-                    sym.next = -1;
-                    if (final_prev_index != -1) {
-                        symbols_final[final_prev_index].next = symbols_final.size();
-                    }
-                    symbols_final.emplace_back(sym);
-                    final_prev_index = symbols_final.size() - 1;
-                }
+            if (symbols.empty()) {
+                continue;
             }
-        }
-
-        symbols = symbols_final;
 
-        if (!symbols.empty()) {
             for (int i = 0; i != -1; i = symbols[i].next) {
-                auto & symbol = symbols[i];
-                if (symbol.n == 0) {
-                    continue;
-                }
+                const auto & symbol = symbols[i];
+                const size_t offs = symbol.text - text.c_str();
 
-                const std::string str = std::string(symbol.text, symbol.n);
-                const auto token = vocab.token_to_id.find(str);
+                const llama_vocab::id token = vocab.find_token(symbol.text, symbol.n);
 
-                if (token == vocab.token_to_id.end()) {
-                    for (auto j = str.begin(); j != str.end(); ++j) {
-                        std::string byte_str(1, *j);
-                        auto token_multibyte = vocab.token_to_id.find(byte_str);
-                        if (token_multibyte == vocab.token_to_id.end()) {
+                if (token == -1) {
+                    for (size_t j = 0; j < symbol.n; ++j) {
+                        const llama_vocab::id token_multibyte = vocab.find_token(symbol.text + j, 1);
+                        if (token_multibyte == -1) {
                             try {
-                                llama_token token_byte = llama_byte_to_token(vocab, *j);
+                                llama_token token_byte = llama_byte_to_token(vocab, symbol.text[j]);
                                 output.push_back(token_byte);
                             } catch (const std::out_of_range & err) {
-                                fprintf(stderr,"ERROR: byte not found in vocab: '%s'\n", byte_str.c_str());
+                                fprintf(stderr,"ERROR: byte not found in vocab: '%c'\n", symbol.text[j]);
+                                continue;
                             }
                         } else {
-                            output.push_back((*token_multibyte).second);
+                            output.push_back(token_multibyte);
+                        }
+                        if (offsets) {
+                            offsets->push_back(offs + j);
                         }
                     }
                 } else {
-                    output.push_back((*token).second);
+                    output.push_back(token);
+                    if (offsets) {
+                        offsets->push_back(offs);
+                    }
+                }
+            }
+        }
+    }
+
+    // split the text into the words of the GPT-2 pre-tokenizer, as (offset, length) spans
+    // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+    //
+    // the result is the same as matching
+    //
+    //   's|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+
+    //
+    // with std::regex in the "C" locale: the classes are ASCII only, every other byte counts as punctuation
+    // probably not 100% correct compared to the original, which matches unicode classes
+    static void bpe_gpt2_preprocess(const std::string & text, std::vector<std::pair<size_t, size_t>> & words) {
+        enum char_class : uint8_t { CC_OTHER, CC_ALPHA, CC_DIGIT, CC_SPACE };
+
+        static const struct char_class_table {
+            uint8_t cls[256];
+
+            char_class_table() {
+                for (int c = 0; c < 256; ++c) {
+                    cls[c] = CC_OTHER;
+                    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+                        cls[c] = CC_ALPHA;
+                    } else if (c >= '0' && c <= '9') {
+                        cls[c] = CC_DIGIT;
+                    } else if (c == ' ' || (c >= '\t' && c <= '\r')) {
+                        cls[c] = CC_SPACE;
+                    }
+                }
+            }
+        } table;
+
+        const char * s = text.data();
+        const size_t n = text.size();
+
+        auto cls = [&](size_t i) { return table.cls[(uint8_t) s[i]]; };
+
+        words.clear();
+
+        size_t pos = 0;
+        while (pos < n) {
+            size_t end = pos;
+
+            // 's|'t|'re|'ve|'m|'ll|'d
+            if (s[pos] == '\'' && pos + 1 < n) {
+                const char c1 = s[pos + 1];
+                const char c2 = pos + 2 < n ? s[pos + 2] : 0;
+                if (c1 == 's' || c1 == 't' || c1 == 'm' || c1 == 'd') {
+                    end = pos + 2;
+                } else if ((c1 == 'r' && c2 == 'e') || (c1 == 'v' && c2 == 'e') || (c1 == 'l' && c2 == 'l')) {
+                    end = pos + 3;
                 }
             }
+
+            if (end == pos) {
+                // ' ?' followed by a run of letters, digits or other chars
+                const size_t start = s[pos] == ' ' && pos + 1 < n && cls(pos + 1) != CC_SPACE ? pos + 1 : pos;
+                const uint8_t c = cls(start);
+
+                end = start + 1;
+                while (end < n && cls(end) == c) {
+                    ++end;
+                }
+
+                // \s+(?!\S)|\s+ : a run of spaces leaves its last one to the word that follows it
+                if (c == CC_SPACE && end < n && end - start > 1) {
+                    --end;
+                }
+            }
+
+            words.emplace_back(pos, end - pos);
+            pos = end;
         }
     }
 
@@ -4194,56 +5388,56 @@ private:
             return;
         }
 
-        std::string left_token  = std::string(symbols[left].text,  symbols[left].n);
-        std::string right_token = std::string(symbols[right].text, symbols[right].n);
-
-        int rank_found = -1;
+        const llama_vocab::bpe_merge * merge = vocab.find_bpe_merge(pieces[left], pieces[right]);
 
-        rank_found = vocab.find_bpe_rank(left_token, right_token);
-
-        if (rank_found < 0) {
+        if (merge == nullptr) {
             return;
         }
 
         llm_bigram_bpe bigram;
 
-        bigram.left  = left;
-        bigram.right = right;
-        bigram.text  = left_token + right_token;
-        bigram.size  = left_token.size() + right_token.size();
-        bigram.rank  = rank_found;
+        bigram.left   = left;
+        bigram.right  = right;
+        bigram.size   = symbols[left].n + symbols[right].n;
+        bigram.rank   = merge->rank;
+        bigram.result = merge->result;
 
-        work_queue.push(bigram);
+        work_queue.push_back(bigram);
+        std::push_heap(work_queue.begin(), work_queue.end(), llm_bigram_bpe::comparator());
     }
 
-    // probably not 100% correct
-    static std::vector<std::string> bpe_gpt2_preprocess(const std::string & text) {
-        std::vector<std::string> words;
+    const llama_vocab & vocab;
 
-        // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-        const std::string pattern = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
-        const std::regex re(pattern);
+    std::vector<std::pair<size_t, size_t>> words;
 
-        auto words_begin = std::sregex_iterator(text.begin(), text.end(), re);
-        auto words_end = std::sregex_iterator();
-        auto n_words = std::distance(words_begin, words_end);
-        words.reserve(n_words);
-        for (auto it = words_begin; it != words_end; ++it) {
-            words.push_back(it->str());
-        }
-        return words;
+    std::vector<llm_symbol> symbols;
+    std::vector<int>        pieces; // piece id of each symbol, -1 if it takes part in no merge
 
-    }
+    llm_bigram_bpe::queue_storage work_queue;
+};
 
-    const llama_vocab & vocab;
+// map the offsets of tokens in the escaped text seen by the SPM tokenizer (a space, then the text, with every space
+// replaced by U+2581) back to offsets in the text; the offsets must be in increasing order, as the tokens are
+static void llama_unescape_offsets(const std::string & text, int32_t * offsets, size_t n_offsets) {
+    const size_t n_escaped = strlen("\xe2\x96\x81");
 
-    std::vector<llm_symbol> symbols;
-    std::vector<llm_symbol> symbols_final;
+    size_t pos_escaped = n_escaped; // the leading space is not part of the text
+    size_t pos = 0;
 
-    llm_bigram_bpe::queue work_queue;
-};
+    for (size_t i = 0; i < n_offsets; ++i) {
+        while (pos < text.size()) {
+            const size_t n = text[pos] == ' ' ? n_escaped : 1;
+            if (pos_escaped + n > (size_t) offsets[i]) {
+                break;
+            }
+            pos_escaped += n;
+            pos++;
+        }
+        offsets[i] = pos;
+    }
+}
 
-static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos) {
+static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab & vocab, std::string raw_text, bool bos, std::vector<int32_t> * offsets) {
     std::vector<llama_vocab::id> output;
 
     // OG tokenizer behavior:
@@ -4253,6 +5447,9 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
 
     if (bos && vocab.special_bos_id != -1) {
         output.push_back(vocab.special_bos_id);
+        if (offsets) {
+            offsets->push_back(0);
+        }
     }
 
     if (raw_text.empty()) {
@@ -4263,16 +5460,21 @@ static std::vector<llama_vocab::id> llama_tokenize_internal(const llama_vocab &
         case LLAMA_VOCAB_TYPE_SPM:
             {
                 // without adding this leading whitespace, we do not get the same results as the original tokenizer
-                raw_text = " " + raw_text;
+                std::string text = " " + raw_text;
 
                 llm_tokenizer_spm tokenizer(vocab);
-                llama_escape_whitespace(raw_text);
-                tokenizer.tokenize(raw_text, output);
+                llama_escape_whitespace(text);
+
+                const size_t n_before = offsets ? offsets->size() : 0;
+                tokenizer.tokenize(text, output, offsets);
+                if (offsets) {
+                    llama_unescape_offsets(raw_text, offsets->data() + n_before, offsets->size() - n_before);
+                }
             } break;
         case LLAMA_VOCAB_TYPE_BPE:
             {
                 llm_tokenizer_bpe tokenizer(vocab);
-                tokenizer.tokenize(raw_text, output);
+                tokenizer.tokenize(raw_text, output, offsets);
             } break;
     };
 
@@ -4288,12 +5490,59 @@ struct llama_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+// the stacks met while matching a grammar, interned so that each distinct stack has an id, and the transitions
+// between them, computed once: long outputs keep meeting the same stacks, which then cost a hash lookup per code
+// point instead of copying and re-expanding vectors
+struct llama_grammar_stack_pool {
+    using stack = std::vector<const llama_grammar_element *>;
+
+    struct stack_hash {
+        size_t operator()(const stack * s) const {
+            size_t h = s->size();
+            for (const llama_grammar_element * pos : *s) {
+                h ^= std::hash<const void *>()(pos) + 0x9e3779b9 + (h << 6) + (h >> 2);
+            }
+            return h;
+        }
+    };
+
+    struct stack_equal {
+        bool operator()(const stack * a, const stack * b) const {
+            return *a == *b;
+        }
+    };
+
+    struct step_hash {
+        size_t operator()(const std::pair<uint32_t, const llama_grammar_element *> & step) const {
+            return std::hash<const void *>()(step.second) ^ (std::hash<uint32_t>()(step.first) << 1);
+        }
+    };
+
+    std::deque<stack>                                                stacks; // by id, a deque keeps the addresses stable
+    std::unordered_map<const stack *, uint32_t, stack_hash, stack_equal> ids;
+
+    // (stack id, position after the char range at the top of the stack) -> ids of the stacks that follow
+    std::unordered_map<std::pair<uint32_t, const llama_grammar_element *>, std::vector<uint32_t>, step_hash> next;
+
+    // a recursive grammar can keep meeting new stacks for as long as it generates, the pool starts over past this size
+    static constexpr size_t max_stacks = 16384;
+
+    void clear() {
+        next.clear();
+        ids.clear();
+        stacks.clear();
+    }
+};
+
 struct llama_grammar {
     const std::vector<std::vector<llama_grammar_element>>   rules;
     std::vector<std::vector<const llama_grammar_element *>> stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     llama_partial_utf8                                      partial_utf8;
+
+    // derived from the rules only, so it can grow while sampling from a const grammar
+    mutable llama_grammar_stack_pool                        pool;
 };
 
 struct llama_grammar_candidate {
@@ -4532,6 +5781,79 @@ static std::vector<std::vector<const llama_grammar_element *>> llama_grammar_acc
     return new_stacks;
 }
 
+static uint32_t llama_grammar_intern_stack(
+        llama_grammar_stack_pool                         & pool,
+        const std::vector<const llama_grammar_element *> & stack) {
+    auto it = pool.ids.find(&stack);
+    if (it != pool.ids.end()) {
+        return it->second;
+    }
+    const uint32_t id = pool.stacks.size();
+    pool.stacks.push_back(stack);
+    pool.ids.emplace(&pool.stacks.back(), id);
+    return id;
+}
+
+// ids of the stacks that follow the stack `id` once the char range at its top matched and left `pos_after`
+static const std::vector<uint32_t> & llama_grammar_next_stacks(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        uint32_t                                                id,
+        const llama_grammar_element                           * pos_after) {
+    auto it = pool.next.find({ id, pos_after });
+    if (it != pool.next.end()) {
+        return it->second;
+    }
+
+    const auto & stack = pool.stacks[id];
+
+    // update top of stack to next element, if any
+    std::vector<const llama_grammar_element *> stack_after(stack.begin(), stack.end() - 1);
+    if (!llama_grammar_is_end_of_sequence(pos_after)) {
+        stack_after.push_back(pos_after);
+    }
+    std::vector<std::vector<const llama_grammar_element *>> advanced;
+    llama_grammar_advance_stack(rules, stack_after, advanced);
+
+    // ambiguous grammars reach the same stack in several ways, keep it once
+    std::vector<uint32_t> next_ids;
+    for (const auto & next_stack : advanced) {
+        const uint32_t next_id = llama_grammar_intern_stack(pool, next_stack);
+        if (std::find(next_ids.begin(), next_ids.end(), next_id) == next_ids.end()) {
+            next_ids.push_back(next_id);
+        }
+    }
+
+    return pool.next.emplace(std::make_pair(id, pos_after), std::move(next_ids)).first->second;
+}
+
+// same as llama_grammar_accept, on interned stacks, without duplicates in the result
+static std::vector<uint32_t> llama_grammar_accept_ids(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        llama_grammar_stack_pool                              & pool,
+        const std::vector<uint32_t>                           & ids,
+        const uint32_t                                          chr) {
+    std::vector<uint32_t> new_ids;
+
+    for (const uint32_t id : ids) {
+        const auto & stack = pool.stacks[id];
+        if (stack.empty()) {
+            continue;
+        }
+
+        const auto match = llama_grammar_match_char(stack.back(), chr);
+        if (match.first) {
+            const auto & next_ids = llama_grammar_next_stacks(rules, pool, id, match.second);
+            new_ids.insert(new_ids.end(), next_ids.begin(), next_ids.end());
+        }
+    }
+
+    std::sort(new_ids.begin(), new_ids.end());
+    new_ids.erase(std::unique(new_ids.begin(), new_ids.end()), new_ids.end());
+
+    return new_ids;
+}
+
 static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
         const std::vector<std::vector<llama_grammar_element>>         & rules,
         const std::vector<std::vector<const llama_grammar_element *>> & stacks,
@@ -4607,6 +5929,159 @@ static std::vector<llama_grammar_candidate> llama_grammar_reject_candidates(
     return rejects;
 }
 
+// builds the trie of the token pieces, pieces[id] being the text of token id. empty pieces and pieces
+// that are not valid UTF-8 are left out, as no grammar can accept them
+static llama_token_trie llama_token_trie_build(const std::vector<std::string> & pieces) {
+    struct entry {
+        std::vector<uint32_t> code_points;
+        llama_partial_utf8    partial_utf8;
+        llama_token           id;
+    };
+
+    std::vector<entry> entries;
+    entries.reserve(pieces.size());
+
+    for (size_t id = 0; id < pieces.size(); ++id) {
+        const std::string & piece = pieces[id];
+        if (piece.empty() || piece[0] == 0) {
+            continue;
+        }
+        auto decoded = decode_utf8(piece.c_str(), { 0, 0 });
+        if (decoded.second.n_remain < 0) {
+            continue;
+        }
+        decoded.first.pop_back(); // terminating 0
+        entries.push_back({ std::move(decoded.first), decoded.second, (llama_token) id });
+    }
+
+    // the pieces sharing a prefix are now adjacent, and a prefix comes before its extensions
+    std::stable_sort(entries.begin(), entries.end(), [](const entry & a, const entry & b) {
+        return a.code_points < b.code_points;
+    });
+
+    llama_token_trie trie;
+    trie.nodes.push_back({ 0, 0, 0, 0, 0 });
+    trie.toks.reserve(entries.size());
+
+    // breadth-first, so that the children of a node get consecutive indices
+    struct pending {
+        uint32_t node;
+        size_t   begin; // entries[begin, end) have the path to node as prefix
+        size_t   end;
+        size_t   depth;
+    };
+
+    std::queue<pending> queue;
+    queue.push({ 0, 0, entries.size(), 0 });
+
+    while (!queue.empty()) {
+        const pending cur = queue.front();
+        queue.pop();
+
+        size_t i = cur.begin;
+
+        trie.nodes[cur.node].tok_begin = trie.toks.size();
+        for (; i < cur.end && entries[i].code_points.size() == cur.depth; ++i) {
+            trie.toks.push_back({ entries[i].id, entries[i].partial_utf8.value, entries[i].partial_utf8.n_remain });
+        }
+        trie.nodes[cur.node].tok_end = trie.toks.size();
+
+        trie.nodes[cur.node].child_begin = trie.nodes.size();
+        while (i < cur.end) {
+            const uint32_t chr = entries[i].code_points[cur.depth];
+
+            size_t j = i;
+            while (j < cur.end && entries[j].code_points[cur.depth] == chr) {
+                ++j;
+            }
+
+            queue.push({ (uint32_t) trie.nodes.size(), i, j, cur.depth + 1 });
+            trie.nodes.push_back({ chr, 0, 0, 0, 0 });
+
+            i = j;
+        }
+        trie.nodes[cur.node].child_end = trie.nodes.size();
+    }
+
+    return trie;
+}
+
+static const llama_token_trie & llama_model_get_token_trie(const llama_model & model) {
+    std::call_once(model.token_trie_once, [&model]() {
+        const int64_t t_start_us = ggml_time_us();
+
+        const int n_vocab = llama_model_n_vocab(&model);
+
+        std::vector<std::string> pieces(n_vocab);
+        std::vector<char> buf(8, 0);
+        for (int id = 0; id < n_vocab; ++id) {
+            int n = llama_token_to_piece_with_model(&model, id, buf.data(), buf.size());
+            if (n < 0) {
+                buf.resize(-n);
+                n = llama_token_to_piece_with_model(&model, id, buf.data(), buf.size());
+            }
+            pieces[id].assign(buf.data(), n);
+        }
+
+        model.token_trie = llama_token_trie_build(pieces);
+
+        LLAMA_LOG_INFO("%s: token trie with %zu nodes built in %.2f ms\n", "llama_model_get_token_trie",
+                model.token_trie.nodes.size(), (ggml_time_us() - t_start_us) / 1000.0);
+    });
+
+    return model.token_trie;
+}
+
+// marks the tokens below `node` that the stack `id` accepts, the stack having matched the code points on the
+// path to `node`. every code point is matched once for all the tokens sharing it, and the subtrees that the stack
+// cannot enter are skipped as a whole
+static void llama_grammar_accept_trie(
+        const std::vector<std::vector<llama_grammar_element>> & rules,
+        const llama_token_trie                                & trie,
+        const llama_token_trie::node                          & node,
+        llama_grammar_stack_pool                              & pool,
+        uint32_t                                                id,
+        std::vector<bool>                                     & accepted) {
+
+    const auto & stack = pool.stacks[id];
+
+    for (uint32_t i = node.tok_begin; i < node.tok_end; ++i) {
+        const auto & tok = trie.toks[i];
+        if (tok.partial_n_remain == 0) {
+            // all code points of the piece matched
+            accepted[tok.id] = true;
+        } else if (!stack.empty() && llama_grammar_match_partial_char(stack.back(), { tok.partial_value, tok.partial_n_remain })) {
+            accepted[tok.id] = true;
+        }
+    }
+
+    if (stack.empty()) {
+        return;
+    }
+
+    const llama_grammar_element * pos = stack.back();
+
+    // the position after the char range does not depend on the matched char, so neither do the next stacks
+    const std::vector<uint32_t> * next_ids = nullptr;
+
+    for (uint32_t i = node.child_begin; i < node.child_end; ++i) {
+        const auto & child = trie.nodes[i];
+
+        const auto match = llama_grammar_match_char(pos, child.chr);
+        if (!match.first) {
+            continue;
+        }
+
+        if (!next_ids) {
+            next_ids = &llama_grammar_next_stacks(rules, pool, id, match.second);
+        }
+
+        for (const uint32_t next_id : *next_ids) {
+            llama_grammar_accept_trie(rules, trie, child, pool, next_id, accepted);
+        }
+    }
+}
+
 //
 // grammar - external
 //
@@ -4648,7 +6123,7 @@ struct llama_grammar * llama_grammar_init(
         }
     } while (true);
 
-    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {} };
+    return new llama_grammar{ std::move(vec_rules), std::move(stacks), {}, {} };
 }
 
 void llama_grammar_free(struct llama_grammar * grammar) {
@@ -4656,7 +6131,8 @@ void llama_grammar_free(struct llama_grammar * grammar) {
 }
 
 struct llama_grammar * llama_grammar_copy(const struct llama_grammar * grammar) {
-    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8 };
+    // the pool points into the rules of the source grammar, the copy builds its own
+    llama_grammar * result = new llama_grammar{ grammar->rules, grammar->stacks, grammar->partial_utf8, {} };
 
     // redirect elements in stacks to point to new rules
     for (size_t is = 0; is < result->stacks.size(); is++) {
@@ -4707,29 +6183,162 @@ void llama_sample_softmax(struct llama_context * ctx, llama_token_data_array * c
     }
 }
 
+// histogram of the logits of the candidates, over the range of their finite values, to find in linear time the
+// bin in which a selection from the top ends
+struct llama_logit_histogram {
+    static const int n_bins = 1024;
+
+    float min_l;
+    float scale;
+
+    bool init(const llama_token_data * data, size_t n) {
+        float max_l = -INFINITY;
+        min_l = INFINITY;
+        for (size_t i = 0; i < n; ++i) {
+            const float l = data[i].logit;
+            if (std::isfinite(l)) {
+                max_l = std::max(max_l, l);
+                min_l = std::min(min_l, l);
+            } else if (l > 0.0f) {
+                return false;
+            }
+        }
+        if (!(max_l > min_l)) {
+            return false;
+        }
+        scale = (n_bins - 1)/(max_l - min_l);
+        return std::isfinite(scale);
+    }
+
+    int bin(float l) const {
+        return l > min_l ? std::min(n_bins - 1, (int) ((l - min_l)*scale)) : 0;
+    }
+};
+
+// move the n_top candidates with the highest logits to the front, in no particular order: only the candidates of the
+// histogram bin in which the n_top-th highest logit falls need an exact selection
+static void llama_sample_select_top(llama_token_data * data, size_t n, size_t n_top) {
+    if (n_top == 0 || n_top >= n) {
+        return;
+    }
+
+    auto comp = [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    };
+
+    llama_logit_histogram hist;
+    if (!hist.init(data, n)) {
+        std::nth_element(data, data + n_top, data + n, comp);
+        return;
+    }
+
+    std::vector<size_t> counts(llama_logit_histogram::n_bins, 0);
+    for (size_t i = 0; i < n; ++i) {
+        counts[hist.bin(data[i].logit)]++;
+    }
+
+    int b = llama_logit_histogram::n_bins - 1;
+    for (size_t n_above = 0; n_above + counts[b] < n_top; --b) {
+        n_above += counts[b];
+    }
+
+    llama_token_data * end = std::partition(data, data + n, [&](const llama_token_data & t) {
+        return hist.bin(t.logit) >= b;
+    });
+    if (data + n_top < end) {
+        std::nth_element(data, data + n_top, end, comp);
+    }
+}
+
 void llama_sample_top_k(struct llama_context * ctx, llama_token_data_array * candidates, int k, size_t min_keep) {
     const int64_t t_start_sample_us = ggml_time_us();
 
     k = std::max(k, (int) min_keep);
     k = std::min(k, (int) candidates->size);
 
-    // Sort scores in descending order
-    if (!candidates->sorted) {
+    // Sort the top k scores in descending order
+    // (keeping all the candidates needs no sorting: the samplers that need the order sort them themselves)
+    if (!candidates->sorted && k < (int) candidates->size) {
         auto comp = [](const llama_token_data & a, const llama_token_data & b) {
             return a.logit > b.logit;
         };
-        if (k == (int) candidates->size) {
-            std::sort(candidates->data, candidates->data + candidates->size, comp);
-        } else {
-            std::partial_sort(candidates->data, candidates->data + k, candidates->data + candidates->size, comp);
+        llama_sample_select_top(candidates->data, candidates->size, k);
+        std::sort(candidates->data, candidates->data + k, comp);
+        candidates->sorted = true;
+    }
+    candidates->size = k;
+
+    if (ctx) {
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+    }
+}
+
+// top-p on unsorted candidates: the softmax and a histogram of the probability mass over the logits find the smallest
+// set of histogram bins that holds p; only the candidates in those bins are sorted. returns false if rounding left the
+// exact cut outside of them, for the caller to sort everything instead
+static bool llama_sample_top_p_unsorted(llama_token_data_array * candidates, float p, size_t min_keep) {
+    llama_token_data * data = candidates->data;
+    const size_t n = candidates->size;
+
+    llama_logit_histogram hist;
+    if (!hist.init(data, n)) {
+        return false;
+    }
+
+    float max_l = -INFINITY;
+    for (size_t i = 0; i < n; ++i) {
+        max_l = std::max(max_l, data[i].logit);
+    }
+
+    std::vector<float>  mass  (llama_logit_histogram::n_bins, 0.0f);
+    std::vector<size_t> counts(llama_logit_histogram::n_bins, 0);
+
+    float cum_sum = 0.0f;
+    for (size_t i = 0; i < n; ++i) {
+        const float pi = expf(data[i].logit - max_l);
+        data[i].p = pi;
+        cum_sum += pi;
+
+        const int b = hist.bin(data[i].logit);
+        mass[b] += pi;
+        counts[b]++;
+    }
+
+    int b = llama_logit_histogram::n_bins - 1;
+    {
+        float  mass_above  = 0.0f;
+        size_t count_above = 0;
+        for (; b > 0; --b) {
+            mass_above  += mass[b];
+            count_above += counts[b];
+            if (mass_above >= p*cum_sum && count_above >= min_keep) {
+                break;
+            }
+        }
+    }
+
+    llama_token_data * end = std::partition(data, data + n, [&](const llama_token_data & t) {
+        return hist.bin(t.logit) >= b;
+    });
+    std::sort(data, end, [](const llama_token_data & a, const llama_token_data & b) {
+        return a.logit > b.logit;
+    });
+
+    const size_t n_sel = end - data;
+
+    float cum_p = 0.0f;
+    for (size_t i = 0; i < n_sel; ++i) {
+        data[i].p /= cum_sum;
+        cum_p += data[i].p;
+
+        if (cum_p >= p && i + 1 >= min_keep) {
+            candidates->size = i + 1;
+            candidates->sorted = true;
+            return true;
         }
-        candidates->sorted = true;
     }
-    candidates->size = k;
 
-    if (ctx) {
-        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
-    }
+    return false;
 }
 
 void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * candidates, float p, size_t min_keep) {
@@ -4737,6 +6346,20 @@ void llama_sample_top_p(struct llama_context * ctx, llama_token_data_array * can
         return;
     }
 
+    if (!candidates->sorted) {
+        const int64_t t_start_sample_us = ggml_time_us();
+
+        const bool done = llama_sample_top_p_unsorted(candidates, p, min_keep);
+
+        if (ctx) {
+            ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        }
+
+        if (done) {
+            return;
+        }
+    }
+
     llama_sample_softmax(ctx, candidates);
 
     const int64_t t_start_sample_us = ggml_time_us();
@@ -4898,6 +6521,33 @@ void llama_sample_temperature(struct llama_context * ctx, llama_token_data_array
     }
 }
 
+// apply fn(logit, count) to the candidates whose token has a non-zero count
+// candidates taken straight from the logits are indexed by token id, then only the distinct tokens are visited;
+// otherwise every candidate is looked up in the table
+template<typename F>
+static void llama_sample_apply_counts(llama_token_data_array * candidates, const llama_token_counts & counts, F fn) {
+    bool by_id = true;
+    for (const llama_token id : counts.ids) {
+        if ((size_t) id >= candidates->size || candidates->data[id].id != id) {
+            by_id = false;
+            break;
+        }
+    }
+
+    if (by_id) {
+        for (const llama_token id : counts.ids) {
+            fn(candidates->data[id].logit, counts.count[id]);
+        }
+    } else {
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const int32_t count = counts.get(candidates->data[i].id);
+            if (count > 0) {
+                fn(candidates->data[i].logit, count);
+            }
+        }
+    }
+}
+
 void llama_sample_repetition_penalty(struct llama_context * ctx, llama_token_data_array * candidates, const llama_token * last_tokens, size_t last_tokens_size, float penalty) {
     if (last_tokens_size == 0 || penalty == 1.0f) {
         return;
@@ -4905,20 +6555,22 @@ void llama_sample_repetition_penalty(struct llama_context * ctx, llama_token_dat
 
     const int64_t t_start_sample_us = ggml_time_us();
 
-    for (size_t i = 0; i < candidates->size; ++i) {
-        const auto * token_iter = std::find(last_tokens, last_tokens + last_tokens_size, candidates->data[i].id);
-        if (token_iter == last_tokens + last_tokens_size) {
-            continue;
-        }
+    llama_token_counts counts_local;
+    llama_token_counts & counts = ctx ? ctx->token_counts : counts_local;
+
+    counts.add(last_tokens, last_tokens_size);
 
+    llama_sample_apply_counts(candidates, counts, [penalty](float & logit, int32_t /*count*/) {
         // The academic publication that described this technique actually just only divided, but that would cause tokens with negative logits to become more likely, which is obviously wrong.
         // This is common fix for this problem, which is to multiply by the penalty instead of dividing.
-        if (candidates->data[i].logit <= 0) {
-            candidates->data[i].logit *= penalty;
+        if (logit <= 0) {
+            logit *= penalty;
         } else {
-            candidates->data[i].logit /= penalty;
+            logit /= penalty;
         }
-    }
+    });
+
+    counts.clear();
 
     candidates->sorted = false;
 
@@ -4934,22 +6586,18 @@ void llama_sample_frequency_and_presence_penalties(struct llama_context * ctx, l
 
     const int64_t t_start_sample_us = ggml_time_us();
 
-    // Create a frequency map to count occurrences of each token in last_tokens
-    std::unordered_map<llama_token, int> token_count;
-    for (size_t i = 0; i < last_tokens_size; ++i) {
-        token_count[last_tokens_p[i]]++;
-    }
+    // Count the occurrences of each token in last_tokens
+    llama_token_counts counts_local;
+    llama_token_counts & counts = ctx ? ctx->token_counts : counts_local;
+
+    counts.add(last_tokens_p, last_tokens_size);
 
     // Apply frequency and presence penalties to the candidates
-    for (size_t i = 0; i < candidates->size; ++i) {
-        auto token_iter = token_count.find(candidates->data[i].id);
-        if (token_iter == token_count.end()) {
-            continue;
-        }
+    llama_sample_apply_counts(candidates, counts, [alpha_frequency, alpha_presence](float & logit, int32_t count) {
+        logit -= float(count) * alpha_frequency + float(count > 0) * alpha_presence;
+    });
 
-        int count = token_iter->second;
-        candidates->data[i].logit -= float(count) * alpha_frequency + float(count > 0) * alpha_presence;
-    }
+    counts.clear();
 
     candidates->sorted = false;
 
@@ -4972,6 +6620,28 @@ void llama_sample_grammar(struct llama_context * ctx, llama_token_data_array * c
 
     const llama_token eos = llama_token_eos(ctx);
 
+    if (grammar->partial_utf8.n_remain == 0) {
+        // match the whole vocabulary at once on the pre-decoded trie
+        const llama_token_trie & trie = llama_model_get_token_trie(ctx->model);
+
+        std::vector<bool> accepted(llama_n_vocab(ctx), false);
+        for (const auto & stack : grammar->stacks) {
+            const uint32_t id = llama_grammar_intern_stack(grammar->pool, stack);
+            llama_grammar_accept_trie(grammar->rules, trie, trie.nodes[0], grammar->pool, id, accepted);
+        }
+
+        for (size_t i = 0; i < candidates->size; ++i) {
+            const llama_token id = candidates->data[i].id;
+            if (id == eos ? !allow_eos : !accepted[id]) {
+                candidates->data[i].logit = -INFINITY;
+            }
+        }
+
+        ctx->t_sample_us += ggml_time_us() - t_start_sample_us;
+        return;
+    }
+
+    // the previous token ended in an incomplete UTF-8 sequence that the pieces continue, decode them again
     std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> candidates_decoded;
     std::vector<llama_grammar_candidate>                              candidates_grammar;
 
@@ -5194,8 +6864,23 @@ void llama_grammar_accept_token(struct llama_context * ctx, struct llama_grammar
     // Note terminating 0 in decoded string
     const auto   decoded     = decode_utf8(piece.c_str(), grammar->partial_utf8);
     const auto & code_points = decoded.first;
-    for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar->stacks = llama_grammar_accept(grammar->rules, grammar->stacks, *it);
+    if (code_points.size() > 1) {
+        std::vector<uint32_t> ids;
+        for (const auto & stack : grammar->stacks) {
+            ids.push_back(llama_grammar_intern_stack(grammar->pool, stack));
+        }
+        for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
+            ids = llama_grammar_accept_ids(grammar->rules, grammar->pool, ids, *it);
+        }
+        grammar->stacks.clear();
+        for (const uint32_t id : ids) {
+            grammar->stacks.push_back(grammar->pool.stacks[id]);
+        }
+
+        // the stacks of the grammar are copies, no id is kept past this point
+        if (grammar->pool.stacks.size() > llama_grammar_stack_pool::max_stacks) {
+            grammar->pool.clear();
+        }
     }
     grammar->partial_utf8 = decoded.second;
     GGML_ASSERT(!grammar->stacks.empty());
@@ -5275,6 +6960,7 @@ struct llama_beam_search_data {
     size_t n_beams;
     int n_past;
     int n_predict;
+    llama_seq_id seq_id;
     int n_threads;
     std::vector<llama_beam> beams;
     std::vector<llama_beam> next_beams;
@@ -5285,11 +6971,12 @@ struct llama_beam_search_data {
     // Used to communicate to/from callback on beams state.
     std::vector<llama_beam_view> beam_views;
 
-    llama_beam_search_data(llama_context * ctx, size_t n_beams, int n_past, int n_predict, int n_threads)
+    llama_beam_search_data(llama_context * ctx, size_t n_beams, int n_past, int n_predict, llama_seq_id seq_id, int n_threads)
       : ctx(ctx)
       , n_beams(n_beams)
       , n_past(n_past)
       , n_predict(n_predict)
+      , seq_id(seq_id)
       , n_threads(n_threads)
       , beam_views(n_beams) {
         beams.reserve(n_beams);
@@ -5327,7 +7014,8 @@ struct llama_beam_search_data {
         } else {
             // beam is not at end-of-sentence, so branch with next top_k tokens.
             if (!beam.tokens.empty()) {
-                llama_eval(ctx, beam.tokens.data(), beam.tokens.size(), n_past, n_threads);
+                llama_kv_cache_seq_rm(ctx->kv_self, seq_id, n_past, -1);
+                llama_decode(ctx, llama_batch_get_one(beam.tokens.data(), beam.tokens.size(), n_past, seq_id), n_threads);
             }
             llama_logit_info logit_info(ctx);
             std::vector<llama_token_data> next_tokens = logit_info.top_k(n_beams);
@@ -5401,7 +7089,8 @@ struct llama_beam_search_data {
             callback(callback_data, get_beams_state(false));  // Sets common_prefix_length
             update_beams_from_beam_views();   // Update values (p,eob) that callback may have changed.
             if (common_prefix_length) {
-                llama_eval(ctx, beams[0].tokens.data(), common_prefix_length, n_past, n_threads);
+                llama_kv_cache_seq_rm(ctx->kv_self, seq_id, n_past, -1);
+                llama_decode(ctx, llama_batch_get_one(beams[0].tokens.data(), common_prefix_length, n_past, seq_id), n_threads);
                 n_past += common_prefix_length;
             }
             // Zero-out next_beam probabilities to place them last in following min-heap.
@@ -5442,11 +7131,11 @@ struct llama_beam_search_data {
 
 void llama_beam_search(llama_context * ctx,
                        llama_beam_search_callback_fn_t callback, void * callback_data,
-                       size_t n_beams, int n_past, int n_predict, int n_threads) {
+                       size_t n_beams, int n_past, int n_predict, llama_seq_id seq_id, int n_threads) {
     assert(ctx);
     const int64_t t_start_sample_us = ggml_time_us();
 
-    llama_beam_search_data beam_search_data(ctx, n_beams, n_past, n_predict, n_threads);
+    llama_beam_search_data beam_search_data(ctx, n_beams, n_past, n_predict, seq_id, n_threads);
 
     beam_search_data.loop(callback, callback_data);
 
@@ -5464,6 +7153,46 @@ struct no_init {
     no_init() { /* do nothing */ }
 };
 
+// a queue connecting two stages of a pipeline
+// close() aborts the pipeline: pending and future pops fail, pushes are dropped
+template <typename T>
+struct llama_pipeline_queue {
+    std::mutex              mutex;
+    std::condition_variable cv;
+    std::queue<T>           items;
+    bool                    closed = false;
+
+    void push(T && item) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed) {
+                return;
+            }
+            items.push(std::move(item));
+        }
+        cv.notify_one();
+    }
+
+    bool pop(T & item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [this] { return closed || !items.empty(); });
+        if (closed) {
+            return false;
+        }
+        item = std::move(items.front());
+        items.pop();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+        cv.notify_all();
+    }
+};
+
 static void llama_convert_tensor_internal(
     struct ggml_tensor * tensor, std::vector<no_init<float>> & output, std::vector<std::thread> & workers,
     const size_t nelements, const int nthread
@@ -5720,8 +7449,6 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
 
     int idx = 0;
 
-    std::vector<no_init<uint8_t>> read_data;
-    std::vector<no_init<uint8_t>> work;
     std::vector<no_init<float>> f32_conv_buf;
 
     // populate the original tensors so we get an initial meta data
@@ -5739,16 +7466,105 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
     // placeholder for the meta data
     ::zeros(fout, meta_size);
 
+    // the tensors go through a pipeline: a reader thread loads the next tensors from the input file and a
+    // writer thread writes the previous ones, while this thread and the workers convert and quantize the
+    // current one. the buffers circulate between the stages, two of them for each direction bound how far
+    // the reader can get ahead and how much quantized data can wait for the writer
+    struct quantize_item {
+        int    i    = -1;
+        size_t size = 0; // size of the data to write
+        std::vector<no_init<uint8_t>> buf;
+    };
+
+    llama_pipeline_queue<std::vector<no_init<uint8_t>>> read_free;
+    llama_pipeline_queue<std::vector<no_init<uint8_t>>> write_free;
+    llama_pipeline_queue<quantize_item> read_done;
+    llama_pipeline_queue<quantize_item> write_todo;
+
+    for (int k = 0; k < 2; ++k) {
+        read_free.push({});
+        write_free.push({});
+    }
+
+    std::exception_ptr reader_error;
+
+    auto abort_pipeline = [&]() {
+        read_free.close();
+        write_free.close();
+        read_done.close();
+        write_todo.close();
+    };
+
+    std::thread reader([&]() {
+        try {
+            for (int i = 0; i < ml->n_tensors; ++i) {
+                quantize_item item;
+                if (!read_free.pop(item.buf)) {
+                    return;
+                }
+
+                struct ggml_tensor * tensor = ml->get_tensor_meta(i);
+
+                if (item.buf.size() < ggml_nbytes(tensor)) {
+                    item.buf.resize(ggml_nbytes(tensor));
+                }
+                tensor->data = item.buf.data();
+                ml->load_data_for(tensor);
+
+                item.i = i;
+                read_done.push(std::move(item));
+            }
+        } catch (...) {
+            reader_error = std::current_exception();
+            abort_pipeline();
+        }
+    });
+
+    std::thread writer([&]() {
+        for (int i = 0; i < ml->n_tensors; ++i) {
+            quantize_item item;
+            if (!write_todo.pop(item)) {
+                return;
+            }
+            GGML_ASSERT(item.i == i);
+
+            // write tensor data + padding
+            fout.write((const char *) item.buf.data(), item.size);
+            zeros(fout, GGML_PAD(item.size, align) - item.size);
+
+            write_free.push(std::move(item.buf));
+        }
+    });
+
+    // if the quantization throws, stop the other stages before the buffers and the output file go away
+    struct pipeline_guard {
+        decltype(abort_pipeline) & abort;
+        std::thread & reader;
+        std::thread & writer;
+        ~pipeline_guard() {
+            if (reader.joinable() || writer.joinable()) {
+                abort();
+                reader.join();
+                writer.join();
+            }
+        }
+    } guard = { abort_pipeline, reader, writer };
+
     for (int i = 0; i < ml->n_tensors; ++i) {
+        quantize_item item;
+        if (!read_done.pop(item)) {
+            break;
+        }
+        GGML_ASSERT(item.i == i);
+
         struct ggml_tensor * tensor = ml->get_tensor_meta(i);
 
         const std::string name = ggml_get_name(tensor);
 
-        if (read_data.size() < ggml_nbytes(tensor)) {
-            read_data.resize(ggml_nbytes(tensor));
+        std::vector<no_init<uint8_t>> work;
+        if (!write_free.pop(work)) {
+            break;
         }
-        tensor->data = read_data.data();
-        ml->load_data_for(tensor);
 
         LLAMA_LOG_INFO("[%4d/%4d] %36s - [%s], type = %6s, ",
                ++idx, ml->n_tensors,
@@ -5780,8 +7596,10 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
             quantize = tensor->type != new_type;
         }
         if (!quantize) {
+            // hand the read buffer over to the writer as is
+            std::swap(item.buf, work);
             new_type = tensor->type;
-            new_data = tensor->data;
+            new_data = work.data();
             new_size = ggml_nbytes(tensor);
             LLAMA_LOG_INFO("size = %8.3f MB\n", ggml_nbytes(tensor)/1024.0/1024.0);
         } else {
@@ -5864,9 +7682,18 @@ static void llama_model_quantize_internal(const std::string & fname_inp, const s
         gguf_set_tensor_type(ctx_out, name.c_str(), new_type);
         gguf_set_tensor_data(ctx_out, name.c_str(), new_data, new_size);
 
-        // write tensor data + padding
-        fout.write((const char *) new_data, new_size);
-        zeros(fout, GGML_PAD(new_size, align) - new_size);
+        read_free.push(std::move(item.buf));
+
+        item.size = new_size;
+        item.buf  = std::move(work);
+        write_todo.push(std::move(item));
+    }
+
+    reader.join();
+    writer.join();
+
+    if (reader_error) {
+        std::rethrow_exception(reader_error);
     }
 
     // go back to beginning of file and write the updated meta data
@@ -5985,6 +7812,10 @@ static int llama_apply_lora_from_file_internal(
 
     std::vector<uint8_t> work_buffer;
 
+    // one graph is computed per adapted tensor, reuse the same threads for all of them
+    std::unique_ptr<ggml_threadpool, decltype(&ggml_threadpool_free)> threadpool(
+            n_threads > 1 ? ggml_threadpool_new(n_threads) : nullptr, ggml_threadpool_free);
+
     while (true) {
         int32_t n_dims;
         int32_t length;
@@ -6150,7 +7981,7 @@ static int llama_apply_lora_from_file_internal(
 
             struct ggml_cgraph gf = ggml_build_forward(r);
 
-            ggml_graph_compute_helper(work_buffer, &gf, n_threads);
+            ggml_graph_compute_helper(work_buffer, &gf, n_threads, threadpool.get(), GGML_DEFAULT_N_SPIN);
 
             // we won't need these tensors again, reset the context to save memory
             ggml_free(lora_ctx);
@@ -6187,11 +8018,14 @@ struct llama_context_params llama_context_default_params() {
         /*.n_batch                     =*/ 512,
         /*.n_gpu_layers                =*/ 0,
         /*.main_gpu                    =*/ 0,
+        /*.n_spin                      =*/ GGML_DEFAULT_N_SPIN,
         /*.tensor_split                =*/ nullptr,
         /*.rope_freq_base              =*/ 10000.0f,
         /*.rope_freq_scale             =*/ 1.0f,
         /*.progress_callback           =*/ nullptr,
         /*.progress_callback_user_data =*/ nullptr,
+        /*.type_k                      =*/ GGML_TYPE_F16,
+        /*.type_v                      =*/ GGML_TYPE_F16,
         /*.low_vram                    =*/ false,
         /*.mul_mat_q                   =*/ true,
         /*.f16_kv                      =*/ true,
@@ -6200,6 +8034,9 @@ struct llama_context_params llama_context_default_params() {
         /*.use_mmap                    =*/ true,
         /*.use_mlock                   =*/ false,
         /*.embedding                   =*/ false,
+        /*.flash_attn                  =*/ true,
+        /*.use_hugepages               =*/ false,
+        /*.mpi_tensor_parallel         =*/ false,
     };
 
 #ifdef GGML_USE_METAL
@@ -6289,7 +8126,7 @@ struct llama_model * llama_load_model_from_file(
 
     if (!llama_model_load(path_model, *model, params.n_ctx, params.n_batch, params.n_gpu_layers,
                 params.main_gpu, params.tensor_split, params.mul_mat_q, params.rope_freq_base, params.rope_freq_scale,
-                params.low_vram, memory_type, params.use_mmap, params.use_mlock, params.vocab_only,
+                params.low_vram, memory_type, params.use_mmap, params.use_mlock, params.use_hugepages, params.vocab_only,
                 params.progress_callback, params.progress_callback_user_data)) {
         LLAMA_LOG_ERROR("%s: failed to load model\n", __func__);
         delete model;
@@ -6319,12 +8156,105 @@ struct llama_context * llama_new_context_with_model(
 
     ctx->rng = std::mt19937(params.seed);
     ctx->logits_all = params.logits_all;
+    ctx->n_spin     = params.n_spin;
+    ctx->flash_attn = params.flash_attn;
 
-    ggml_type memory_type = params.f16_kv ? GGML_TYPE_F16 : GGML_TYPE_F32;
+    // the fused attention op is only implemented on the CPU
+#if defined(GGML_USE_METAL)
+    if (ctx->flash_attn && params.n_gpu_layers > 0) {
+        LLAMA_LOG_INFO("%s: flash attention is not supported with Metal, disabling it\n", __func__);
+        ctx->flash_attn = false;
+    }
+#elif defined(GGML_USE_CUBLAS)
+    if (ctx->flash_attn && params.n_gpu_layers > (int) ctx->model.hparams.n_layer) {
+        LLAMA_LOG_INFO("%s: flash attention is not supported with an offloaded KV cache, disabling it\n", __func__);
+        ctx->flash_attn = false;
+    }
+#endif
+    if (ctx->flash_attn && ctx->model.arch == LLM_ARCH_BAICHUAN && ctx->model.type == MODEL_13B) {
+        // ALiBi is not supported by ggml_flash_attn_ext
+        ctx->flash_attn = false;
+    }
+
+    ggml_type type_k = params.type_k;
+    ggml_type type_v = params.type_v;
+
+    if (!params.f16_kv) {
+        type_k = type_k == GGML_TYPE_F16 ? GGML_TYPE_F32 : type_k;
+        type_v = type_v == GGML_TYPE_F16 ? GGML_TYPE_F32 : type_v;
+    }
+
+    for (ggml_type type : { type_k, type_v }) {
+        if (type != GGML_TYPE_F32 && type != GGML_TYPE_F16 && type != GGML_TYPE_Q8_0 && type != GGML_TYPE_Q4_0) {
+            LLAMA_LOG_ERROR("%s: unsupported KV cache type %s\n", __func__, ggml_type_name(type));
+            llama_free(ctx);
+            return nullptr;
+        }
+        // the K cache is viewed per head, the V cache is read one row per cell
+        if (ggml_is_quantized(type) && ctx->model.hparams.n_embd_head() % ggml_blck_size(type) != 0) {
+            LLAMA_LOG_ERROR("%s: KV cache type %s requires a head size that is a multiple of %d\n",
+                    __func__, ggml_type_name(type), ggml_blck_size(type));
+            llama_free(ctx);
+            return nullptr;
+        }
+    }
+
+    // only the fused attention op can read a quantized V cache, which has no transposed layout
+    if (ggml_is_quantized(type_v) && !ctx->flash_attn) {
+        LLAMA_LOG_ERROR("%s: V cache type %s requires flash attention\n", __func__, ggml_type_name(type_v));
+        llama_free(ctx);
+        return nullptr;
+    }
+
+#if defined(GGML_USE_METAL)
+    if ((ggml_is_quantized(type_k) || ggml_is_quantized(type_v)) && params.n_gpu_layers > 0) {
+        LLAMA_LOG_ERROR("%s: a quantized KV cache is not supported with Metal\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+#elif defined(GGML_USE_CUBLAS)
+    if (ggml_is_quantized(type_k) && params.n_gpu_layers > (int) ctx->model.hparams.n_layer + 2) {
+        LLAMA_LOG_ERROR("%s: a quantized K cache is not supported when it is offloaded\n", __func__);
+        llama_free(ctx);
+        return nullptr;
+    }
+#endif
+
+    llama_split_init(ctx->split, ctx->model, 0, 1);
+
+#ifdef GGML_USE_MPI
+    ctx->ctx_mpi = ggml_mpi_init();
+
+    bool tensor_parallel = params.mpi_tensor_parallel && !params.vocab_only;
+#if defined(GGML_USE_METAL) || defined(GGML_USE_CUBLAS)
+    // the weights of a node are views of the weights of the model on the CPU
+    tensor_parallel = tensor_parallel && params.n_gpu_layers == 0;
+#endif
+    if (tensor_parallel && !ggml_mpi_tensor_parallel_supported(ctx->ctx_mpi)) {
+        LLAMA_LOG_WARN("%s: the MPI library does not allow calls from the compute threads, splitting the layers by layer\n", __func__);
+        tensor_parallel = false;
+    }
+    if (tensor_parallel) {
+        const int mpi_rank = ggml_mpi_rank(ctx->ctx_mpi);
+        const int mpi_size = ggml_mpi_size(ctx->ctx_mpi);
+
+        if (llama_split_init(ctx->split, ctx->model, mpi_rank, mpi_size)) {
+            const auto & split = ctx->split;
+            LLAMA_LOG_INFO("%s: node %d of %d: query heads [%" PRId64 ", %" PRId64 "), key/value heads [%" PRId64 ", %" PRId64 "), "
+                    "feed-forward columns [%" PRId64 ", %" PRId64 ")\n", __func__, mpi_rank, mpi_size,
+                    split.head0, split.head0 + split.n_head, split.head_kv0, split.head_kv0 + split.n_head_kv,
+                    split.ff0, split.ff0 + split.n_ff);
+        } else {
+            LLAMA_LOG_WARN("%s: the layers of this model cannot be split by tensor across %d nodes, splitting them by layer\n",
+                    __func__, mpi_size);
+        }
+        ggml_mpi_set_tensor_parallel(ctx->ctx_mpi, ctx->split.enabled);
+    }
+#endif
 
     // reserve memory for context buffers
     if (!params.vocab_only) {
-        if (!llama_kv_cache_init(ctx->model.hparams, ctx->kv_self, memory_type, ctx->model.hparams.n_ctx, params.n_gpu_layers)) {
+        if (!llama_kv_cache_init(ctx->model.hparams, ctx->split, ctx->kv_self, type_k, type_v, ctx->model.hparams.n_ctx, params.n_gpu_layers, params.use_hugepages)) {
             LLAMA_LOG_ERROR("%s: llama_kv_cache_init() failed for self-attention cache\n", __func__);
             llama_free(ctx);
             return nullptr;
@@ -6332,7 +8262,8 @@ struct llama_context * llama_new_context_with_model(
 
         {
             const size_t memory_size = ggml_nbytes(ctx->kv_self.k) + ggml_nbytes(ctx->kv_self.v);
-            LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1024.0 / 1024.0);
+            LLAMA_LOG_INFO("%s: kv self size  = %7.2f MB (K %s, V %s)\n", __func__, memory_size / 1024.0 / 1024.0,
+                    ggml_type_name(type_k), ggml_type_name(type_v));
         }
 
         const auto & hparams = ctx->model.hparams;
@@ -6351,16 +8282,15 @@ struct llama_context * llama_new_context_with_model(
         {
             static const size_t tensor_alignment = 32;
             // the compute buffer is used to store the tensor and graph structs, while the allocator buffer is used for the tensor data
-            ctx->buf_compute.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead());
+            ctx->buf_compute.resize(ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead(), params.use_hugepages);
 
             // create measure allocator
             ctx->alloc = ggml_allocr_new_measure(tensor_alignment);
 
             // build worst-case graph
             int n_tokens = std::min((int)hparams.n_ctx, params.n_batch);
-            int n_past = hparams.n_ctx - n_tokens;
             llama_token token = llama_token_bos(ctx); // not actually used by llama_build_graph, but required to choose between token and embedding inputs graph
-            ggml_cgraph * gf = llama_build_graph(*ctx, &token, NULL, n_tokens, n_past);
+            ggml_cgraph * gf = llama_build_graph(*ctx, llama_batch_get_one(&token, n_tokens, hparams.n_ctx - n_tokens, 0));
 #ifdef GGML_USE_METAL
             if (params.n_gpu_layers > 0) {
                 ctx->ctx_metal = ggml_metal_init(1);
@@ -6381,7 +8311,7 @@ struct llama_context * llama_new_context_with_model(
             // recreate allocator with exact memory requirements
             ggml_allocr_free(ctx->alloc);
 
-            ctx->buf_alloc.resize(alloc_size);
+            ctx->buf_alloc.resize(alloc_size, params.use_hugepages);
             ctx->alloc = ggml_allocr_new(ctx->buf_alloc.data, ctx->buf_alloc.size, tensor_alignment);
 #ifdef GGML_USE_METAL
             if (ctx->ctx_metal) {
@@ -6437,14 +8367,14 @@ struct llama_context * llama_new_context_with_model(
     }
 
 #ifdef GGML_USE_MPI
-    ctx->ctx_mpi = ggml_mpi_init();
-
     if (ggml_mpi_rank(ctx->ctx_mpi) > 0) {
         // Enter a blocking eval loop with dummy input, letting rank=0 drive the process
-        const std::vector<llama_token> tmp(ctx->model.hparams.n_ctx, llama_token_bos(ctx));
-        while (!llama_eval(ctx, tmp.data(), tmp.size(), 0, 0)) {};
+        std::vector<llama_token> tmp(ctx->model.hparams.n_ctx, llama_token_bos(ctx));
+        int ret;
+        while ((ret = llama_decode(ctx, llama_batch_get_one(tmp.data(), tmp.size(), 0, 0), 0)) == 0) {};
         llama_backend_free();
-        exit(1);
+        // 2 - the main node ended the run
+        exit(ret == 2 ? 0 : 1);
     }
 #endif
 
@@ -6560,7 +8490,32 @@ int llama_model_apply_lora_from_file(const struct llama_model * model, const cha
 }
 
 int llama_get_kv_cache_token_count(const struct llama_context * ctx) {
-    return ctx->kv_self.n;
+    int count = 0;
+    for (const auto & cell : ctx->kv_self.cells) {
+        if (cell.pos >= 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+void llama_kv_cache_tokens_rm(struct llama_context * ctx, int32_t c0, int32_t c1) {
+    llama_kv_cache_tokens_rm(ctx->kv_self, c0, c1);
+}
+
+void llama_kv_cache_seq_rm(struct llama_context * ctx, llama_seq_id seq_id, llama_pos p0, llama_pos p1) {
+    llama_kv_cache_seq_rm(ctx->kv_self, seq_id, p0, p1);
+}
+
+void llama_kv_cache_seq_cp(struct llama_context * ctx, llama_seq_id seq_id_src, llama_seq_id seq_id_dst, llama_pos p0, llama_pos p1) {
+    if (seq_id_src == seq_id_dst) {
+        return;
+    }
+    llama_kv_cache_seq_cp(ctx->kv_self, seq_id_src, seq_id_dst, p0, p1);
+}
+
+void llama_kv_cache_seq_keep(struct llama_context * ctx, llama_seq_id seq_id) {
+    llama_kv_cache_seq_keep(ctx->kv_self, seq_id);
 }
 
 #define LLAMA_MAX_RNG_STATE (64*1024)
@@ -6587,6 +8542,12 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
     const size_t s_kv_ntok         = sizeof(int);
     const size_t s_kv              = ctx->kv_self.buf.size;
 
+    // per-cell metadata: position, number of sequences and the sequence ids
+    size_t s_kv_cells = 0;
+    for (const auto & cell : ctx->kv_self.cells) {
+        s_kv_cells += sizeof(llama_pos) + sizeof(size_t) + std::max<size_t>(1, cell.seq_id.size())*sizeof(llama_seq_id);
+    }
+
     const size_t s_total = (
         + s_rng_size
         + s_rng
@@ -6598,6 +8559,7 @@ size_t llama_get_state_size(const struct llama_context * ctx) {
         + s_kv_size
         + s_kv_ntok
         + s_kv
+        + s_kv_cells
     );
 
     return s_total;
@@ -6708,47 +8670,70 @@ static void llama_copy_state_data_internal(struct llama_context * ctx, llama_dat
         const auto & kv_self = ctx->kv_self;
         const auto & hparams = ctx->model.hparams;
         const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd_gqa();
+        const int    n_embd  = ctx->split.n_embd_gqa(); // the key/value heads of this node only if the layers are split
         const int    n_ctx   = hparams.n_ctx;
 
         const size_t kv_size = kv_self.buf.size;
-        const int    kv_ntok = llama_get_kv_cache_token_count(ctx);
+        const int    kv_ntok = llama_kv_cache_cell_max(kv_self);
 
         data_ctx->write(&kv_size, sizeof(kv_size));
         data_ctx->write(&kv_ntok, sizeof(kv_ntok));
 
         if (kv_size) {
-            const size_t elt_size = ggml_element_size(kv_self.k);
+            // the K rows of a layer are contiguous, copy them as they are
+            const size_t k_row_size = ggml_row_size(kv_self.k->type, n_embd);
+
+            for (int il = 0; il < n_layer; ++il) {
+                data_ctx->write((const uint8_t *) kv_self.k->data + il*k_row_size*n_ctx, k_row_size*kv_ntok);
+            }
+
+            if (ggml_is_quantized(kv_self.v->type)) {
+                // a quantized V cache always has the row-wise layout of the flash attention path and cannot be transposed
+                const size_t v_row_size = ggml_row_size(kv_self.v->type, n_embd);
 
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
+                for (int il = 0; il < n_layer; ++il) {
+                    data_ctx->write((const uint8_t *) kv_self.v->data + il*v_row_size*n_ctx, v_row_size*kv_ntok);
+                }
+            } else {
+                const size_t elt_size = ggml_element_size(kv_self.v);
+
+                ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
+                ggml_cgraph gf{};
+
+                ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
+                std::vector<uint8_t> vout3d_data(ggml_nbytes(vout3d), 0);
+                vout3d->data = vout3d_data.data();
 
-            ggml_tensor * kout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            std::vector<uint8_t> kout3d_data(ggml_nbytes(kout3d), 0);
-            kout3d->data = kout3d_data.data();
+                // V is saved transposed, whatever the layout of the cache
+                ggml_tensor * v3d = ctx->flash_attn
+                    ? ggml_transpose(cpy_ctx, ggml_view_3d(cpy_ctx, kv_self.v,
+                        n_embd, kv_ntok, n_layer,
+                        elt_size*n_embd, elt_size*n_embd*n_ctx, 0))
+                    : ggml_view_3d(cpy_ctx, kv_self.v,
+                        kv_ntok, n_embd, n_layer,
+                        elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
 
-            ggml_tensor * vout3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            std::vector<uint8_t> vout3d_data(ggml_nbytes(vout3d), 0);
-            vout3d->data = vout3d_data.data();
+                ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
+                ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1, /*threadpool*/ NULL, GGML_DEFAULT_N_SPIN);
 
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+                ggml_free(cpy_ctx);
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+                // our data is now in the vout3d_data buffer
+                // write it to file
+                data_ctx->write(vout3d_data.data(), vout3d_data.size());
+            }
+        }
 
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, k3d, kout3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, v3d, vout3d));
-            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
+        for (int i = 0; i < kv_ntok; ++i) {
+            const llama_pos pos   = kv_self.cells[i].pos;
+            const size_t    n_seq = kv_self.cells[i].seq_id.size();
 
-            ggml_free(cpy_ctx);
+            data_ctx->write(&pos,   sizeof(pos));
+            data_ctx->write(&n_seq, sizeof(n_seq));
 
-            // our data is now in the kout3d_data and vout3d_data buffers
-            // write them to file
-            data_ctx->write(kout3d_data.data(), kout3d_data.size());
-            data_ctx->write(vout3d_data.data(), vout3d_data.size());
+            for (const llama_seq_id seq_id : kv_self.cells[i].seq_id) {
+                data_ctx->write(&seq_id, sizeof(seq_id));
+            }
         }
     }
 }
@@ -6813,10 +8798,10 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
 
     // set kv cache
     {
-        const auto & kv_self = ctx->kv_self;
+        auto & kv_self = ctx->kv_self;
         const auto & hparams = ctx->model.hparams;
         const int    n_layer = hparams.n_layer;
-        const int    n_embd  = hparams.n_embd_gqa();
+        const int    n_embd  = ctx->split.n_embd_gqa();
         const int    n_ctx   = hparams.n_ctx;
 
         size_t kv_size;
@@ -6828,35 +8813,67 @@ size_t llama_set_state_data(struct llama_context * ctx, uint8_t * src) {
         if (kv_size) {
             GGML_ASSERT(kv_self.buf.size == kv_size);
 
-            const size_t elt_size = ggml_element_size(kv_self.k);
+            const size_t k_row_size = ggml_row_size(kv_self.k->type, n_embd);
 
-            ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
-            ggml_cgraph gf{};
+            for (int il = 0; il < n_layer; ++il) {
+                memcpy((uint8_t *) kv_self.k->data + il*k_row_size*n_ctx, inp, k_row_size*kv_ntok);
+                inp += k_row_size*kv_ntok;
+            }
+
+            if (ggml_is_quantized(kv_self.v->type)) {
+                const size_t v_row_size = ggml_row_size(kv_self.v->type, n_embd);
+
+                for (int il = 0; il < n_layer; ++il) {
+                    memcpy((uint8_t *) kv_self.v->data + il*v_row_size*n_ctx, inp, v_row_size*kv_ntok);
+                    inp += v_row_size*kv_ntok;
+                }
+            } else {
+                const size_t elt_size = ggml_element_size(kv_self.v);
+
+                ggml_context * cpy_ctx = ggml_init({ 4096, NULL, /* no_alloc */ true });
+                ggml_cgraph gf{};
 
-            ggml_tensor * kin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.k->type, n_embd, kv_ntok, n_layer);
-            kin3d->data = (void *) inp;
-            inp += ggml_nbytes(kin3d);
+                ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
+                vin3d->data = (void *) inp;
+                inp += ggml_nbytes(vin3d);
 
-            ggml_tensor * vin3d = ggml_new_tensor_3d(cpy_ctx, kv_self.v->type, kv_ntok, n_embd, n_layer);
-            vin3d->data = (void *) inp;
-            inp += ggml_nbytes(vin3d);
+                // V is saved transposed, whatever the layout of the cache
+                ggml_tensor * v3d = ctx->flash_attn
+                    ? ggml_transpose(cpy_ctx, ggml_view_3d(cpy_ctx, kv_self.v,
+                        n_embd, kv_ntok, n_layer,
+                        elt_size*n_embd, elt_size*n_embd*n_ctx, 0))
+                    : ggml_view_3d(cpy_ctx, kv_self.v,
+                        kv_ntok, n_embd, n_layer,
+                        elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
 
-            ggml_tensor * k3d = ggml_view_3d(cpy_ctx, kv_self.k,
-                n_embd, kv_ntok, n_layer,
-                elt_size*n_embd, elt_size*n_embd*n_ctx, 0);
+                ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
+                ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1, /*threadpool*/ NULL, GGML_DEFAULT_N_SPIN);
+
+                ggml_free(cpy_ctx);
+            }
+        }
 
-            ggml_tensor * v3d = ggml_view_3d(cpy_ctx, kv_self.v,
-                kv_ntok, n_embd, n_layer,
-                elt_size*n_ctx, elt_size*n_ctx*n_embd, 0);
+        GGML_ASSERT(kv_ntok >= 0 && (uint32_t) kv_ntok <= kv_self.size);
 
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, kin3d, k3d));
-            ggml_build_forward_expand(&gf, ggml_cpy(cpy_ctx, vin3d, v3d));
-            ggml_graph_compute_helper(ctx->work_buffer, &gf, /*n_threads*/ 1);
+        kv_self.head = kv_ntok;
 
-            ggml_free(cpy_ctx);
+        for (uint32_t i = 0; i < kv_self.size; ++i) {
+            kv_self.cells[i].pos = -1;
+            kv_self.cells[i].seq_id.clear();
         }
 
-        ctx->kv_self.n = kv_ntok;
+        for (int i = 0; i < kv_ntok; ++i) {
+            size_t n_seq;
+
+            memcpy(&kv_self.cells[i].pos, inp, sizeof(llama_pos)); inp += sizeof(llama_pos);
+            memcpy(&n_seq,                inp, sizeof(n_seq));     inp += sizeof(n_seq);
+
+            for (size_t j = 0; j < n_seq; ++j) {
+                llama_seq_id seq_id;
+                memcpy(&seq_id, inp, sizeof(seq_id)); inp += sizeof(seq_id);
+                kv_self.cells[i].seq_id.insert(seq_id);
+            }
+        }
     }
 
     const size_t nread    = inp - src;
@@ -6955,9 +8972,12 @@ int llama_eval(
                          int   n_tokens,
                          int   n_past,
                          int   n_threads) {
-    if (!llama_eval_internal(*ctx, tokens, nullptr, n_tokens, n_past, n_threads, nullptr)) {
-        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+    llama_kv_cache_tokens_rm(ctx->kv_self, n_past, -1);
+
+    const int ret = llama_decode_internal(*ctx, llama_batch_get_one(const_cast<llama_token *>(tokens), n_tokens, n_past, 0), n_threads, nullptr);
+    if (ret != 0) {
+        LLAMA_LOG_ERROR("%s: failed to eval, ret = %d\n", __func__, ret);
+        return ret;
     }
 
     // get a more accurate load time, upon first eval
@@ -6976,9 +8996,14 @@ int llama_eval_embd(
                              int   n_tokens,
                              int   n_past,
                              int   n_threads) {
-    if (!llama_eval_internal(*ctx, nullptr, embd, n_tokens, n_past, n_threads, nullptr)) {
-        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+    llama_kv_cache_tokens_rm(ctx->kv_self, n_past, -1);
+
+    llama_batch batch = { n_tokens, nullptr, const_cast<float *>(embd), nullptr, nullptr, nullptr, n_past, 1, 0, };
+
+    const int ret = llama_decode_internal(*ctx, batch, n_threads, nullptr);
+    if (ret != 0) {
+        LLAMA_LOG_ERROR("%s: failed to eval, ret = %d\n", __func__, ret);
+        return ret;
     }
 
     // get a more accurate load time, upon first eval
@@ -6995,20 +9020,88 @@ int llama_eval_export(struct llama_context * ctx, const char * fname) {
     const int n_batch = 1;
     const int n_ctx   = 512 - n_batch;
 
-    const std::vector<llama_token> tmp(n_batch, llama_token_bos(ctx));
+    std::vector<llama_token> tmp(n_batch, llama_token_bos(ctx));
 
-    if (!llama_eval_internal(*ctx, tmp.data(), nullptr, tmp.size(), n_ctx, 1, fname)) {
-        LLAMA_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+    llama_kv_cache_tokens_rm(ctx->kv_self, n_ctx, -1);
+
+    const int ret = llama_decode_internal(*ctx, llama_batch_get_one(tmp.data(), tmp.size(), n_ctx, 0), 1, fname);
+    if (ret != 0) {
+        LLAMA_LOG_ERROR("%s: failed to eval, ret = %d\n", __func__, ret);
+        return ret;
     }
 
     return 0;
 }
 
+struct llama_batch llama_batch_get_one(
+             llama_token * tokens,
+                 int32_t   n_tokens,
+               llama_pos   pos_0,
+            llama_seq_id   seq_id) {
+    return {
+        /*n_tokens    =*/ n_tokens,
+        /*tokens      =*/ tokens,
+        /*embd        =*/ nullptr,
+        /*pos         =*/ nullptr,
+        /*seq_id      =*/ nullptr,
+        /*logits      =*/ nullptr,
+        /*all_pos_0   =*/ pos_0,
+        /*all_pos_1   =*/ 1,
+        /*all_seq_id  =*/ seq_id,
+    };
+}
+
+struct llama_batch llama_batch_init(int32_t n_tokens, int32_t embd) {
+    llama_batch batch = { -1, nullptr, nullptr, nullptr, nullptr, nullptr, 0, 0, 0, };
+
+    if (embd) {
+        batch.embd = (float *) malloc(sizeof(float) * n_tokens * embd);
+    } else {
+        batch.token = (llama_token *) malloc(sizeof(llama_token) * n_tokens);
+    }
+
+    batch.pos    = (llama_pos *)    malloc(sizeof(llama_pos)    * n_tokens);
+    batch.seq_id = (llama_seq_id *) malloc(sizeof(llama_seq_id) * n_tokens);
+    batch.logits = (int8_t *)       malloc(sizeof(int8_t)       * n_tokens);
+
+    return batch;
+}
+
+void llama_batch_free(struct llama_batch batch) {
+    if (batch.token)  free(batch.token);
+    if (batch.embd)   free(batch.embd);
+    if (batch.pos)    free(batch.pos);
+    if (batch.seq_id) free(batch.seq_id);
+    if (batch.logits) free(batch.logits);
+}
+
+int llama_decode(
+        struct llama_context * ctx,
+          struct llama_batch   batch,
+                         int   n_threads) {
+    const int ret = llama_decode_internal(*ctx, batch, n_threads, nullptr);
+    if (ret < 0) {
+        LLAMA_LOG_ERROR("%s: failed to decode, ret = %d\n", __func__, ret);
+    }
+
+    // get a more accurate load time, upon first eval
+    // TODO: fix this
+    if (!ctx->has_evaluated_once) {
+        ctx->t_load_us = ggml_time_us() - ctx->t_start_us;
+        ctx->has_evaluated_once = true;
+    }
+
+    return ret;
+}
+
 float * llama_get_logits(struct llama_context * ctx) {
     return ctx->logits.data();
 }
 
+float * llama_get_logits_ith(struct llama_context * ctx, int32_t i) {
+    return ctx->logits.data() + i*ctx->model.hparams.n_vocab;
+}
+
 float * llama_get_embeddings(struct llama_context * ctx) {
     return ctx->embedding.data();
 }
@@ -7054,7 +9147,7 @@ int llama_tokenize_with_model(
                  llama_token * tokens,
                          int   n_max_tokens,
                         bool   add_bos) {
-    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos);
+    auto res = llama_tokenize_internal(model->vocab, std::string(text, text_len), add_bos, nullptr);
 
     if (n_max_tokens < (int) res.size()) {
         // LLAMA_LOG_ERROR("%s: too many tokens\n", __func__);
@@ -7068,6 +9161,93 @@ int llama_tokenize_with_model(
     return res.size();
 }
 
+int llama_tokenize_batch(
+        struct llama_context * ctx,
+                 const char ** texts,
+                   const int * text_lens,
+                         int   n_texts,
+                 llama_token ** tokens,
+                     int32_t ** offsets,
+                   const int * n_max_tokens,
+                         int * n_tokens,
+                        bool   add_bos,
+                         int   n_threads) {
+    return llama_tokenize_batch_with_model(&ctx->model, texts, text_lens, n_texts, tokens, offsets, n_max_tokens, n_tokens, add_bos, n_threads);
+}
+
+int llama_tokenize_batch_with_model(
+    const struct llama_model * model,
+                 const char ** texts,
+                   const int * text_lens,
+                         int   n_texts,
+                 llama_token ** tokens,
+                     int32_t ** offsets,
+                   const int * n_max_tokens,
+                         int * n_tokens,
+                        bool   add_bos,
+                         int   n_threads) {
+    std::atomic<int> next_text(0);
+    std::atomic<int> n_failed(0);
+
+    // an exception thrown by a worker is passed on to the caller once all the threads are joined,
+    // as llama_tokenize would have thrown it
+    std::mutex mutex;
+    std::exception_ptr error;
+
+    // the texts are handed out one at a time, so that a few long texts do not hold up the rest
+    auto compute = [&]() {
+        std::vector<int32_t> offs;
+
+        for (int i = next_text++; i < n_texts; i = next_text++) {
+            offs.clear();
+
+            std::vector<llama_vocab::id> res;
+            try {
+                res = llama_tokenize_internal(model->vocab, std::string(texts[i], text_lens[i]), add_bos, offsets ? &offs : nullptr);
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                // stop handing out texts
+                next_text = n_texts;
+                return;
+            }
+
+            if (n_max_tokens[i] < (int) res.size()) {
+                n_tokens[i] = -((int) res.size());
+                n_failed++;
+                continue;
+            }
+
+            std::copy(res.begin(), res.end(), tokens[i]);
+            if (offsets) {
+                std::copy(offs.begin(), offs.end(), offsets[i]);
+            }
+
+            n_tokens[i] = res.size();
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, n_texts));
+
+    std::vector<std::thread> workers;
+    workers.reserve(n_threads - 1);
+    for (int i = 0; i < n_threads - 1; ++i) {
+        workers.emplace_back(compute);
+    }
+    compute();
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    return n_failed;
+}
+
 int llama_token_to_piece(const struct llama_context * ctx, llama_token token, char * buf, int length) {
     return llama_token_to_piece_with_model(&ctx->model, token, buf, length);
 }
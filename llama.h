@@ -40,7 +40,7 @@
 #define LLAMA_FILE_MAGIC_GGSN 0x6767736eu // 'ggsn'
 
 #define LLAMA_SESSION_MAGIC   LLAMA_FILE_MAGIC_GGSN
-#define LLAMA_SESSION_VERSION 1
+#define LLAMA_SESSION_VERSION 2
 
 #if defined(GGML_USE_CUBLAS) || defined(GGML_USE_CLBLAST) || defined(GGML_USE_METAL)
 // Defined when llama.cpp is compiled with support for offloading model layers to GPU.
@@ -60,7 +60,9 @@ extern "C" {
     struct llama_model;
     struct llama_context;
 
+    typedef int llama_pos;
     typedef int llama_token;
+    typedef int llama_seq_id;
 
     enum llama_log_level {
         LLAMA_LOG_LEVEL_ERROR = 2,
@@ -122,12 +124,42 @@ extern "C" {
 
     typedef void (*llama_progress_callback)(float progress, void *ctx);
 
+    // Input data for llama_decode
+    // A llama_batch object can contain input about one or many sequences
+    // The provided arrays (i.e. token, embd, pos, etc.) must have size of n_tokens
+    //
+    // - token  : the token ids of the input (used when embd is NULL)
+    // - embd   : token embeddings (i.e. float vector of size n_embd) (used when token is NULL)
+    // - pos    : the positions of the respective token in the sequence
+    // - seq_id : the sequence to which the respective token belongs
+    // - logits : if zero, the logits for the respective token will not be output
+    //
+    typedef struct llama_batch {
+        int32_t n_tokens;
+
+        llama_token  * token;
+        float        * embd;
+        llama_pos    * pos;
+        llama_seq_id * seq_id;
+        int8_t       * logits;
+
+        // NOTE: helpers for smooth API transition - can be deprecated in the future
+        //       for future-proof code, use the above fields instead and ignore everything below
+        //
+        // pos[i] = all_pos_0 + i*all_pos_1
+        //
+        llama_pos    all_pos_0;  // used if pos == NULL
+        llama_pos    all_pos_1;  // used if pos == NULL
+        llama_seq_id all_seq_id; // used if seq_id == NULL
+    } llama_batch;
+
     struct llama_context_params {
         uint32_t seed;         // RNG seed, -1 for random
         int32_t  n_ctx;        // text context
         int32_t  n_batch;      // prompt processing batch size
         int32_t  n_gpu_layers; // number of layers to store in VRAM
         int32_t  main_gpu;     // the GPU that is used for scratch and small tensors
+        int32_t  n_spin;       // checks a compute thread spins for while waiting for the other threads before it sleeps, -1 = never sleep
 
         const float * tensor_split; // how to split layers across multiple GPUs (size: LLAMA_MAX_DEVICES)
 
@@ -140,15 +172,21 @@ extern "C" {
         // context pointer passed to the progress callback
         void * progress_callback_user_data;
 
+        enum ggml_type type_k; // data type for the K cache: f32, f16, q8_0 or q4_0
+        enum ggml_type type_v; // data type for the V cache: f32, f16, q8_0 or q4_0 (quantized types require flash_attn)
+
         // Keep the booleans together to avoid misalignment during copy-by-value.
         bool low_vram;   // if true, reduce VRAM usage at the cost of performance
         bool mul_mat_q;  // if true, use experimental mul_mat_q kernels
-        bool f16_kv;     // use fp16 for KV cache
+        bool f16_kv;     // use fp16 for KV cache, if false f16 cache types are promoted to f32
         bool logits_all; // the llama_eval() call computes all logits, not just the last one
         bool vocab_only; // only load the vocabulary, no weights
         bool use_mmap;   // use mmap if possible
         bool use_mlock;  // force system to keep model in RAM
         bool embedding;  // embedding mode only
+        bool flash_attn; // use the fused attention op on the CPU (disabled automatically for GPU offloading)
+        bool use_hugepages; // back the weights, KV cache and compute buffers with huge pages (Linux), the weights are then not mmapped
+        bool mpi_tensor_parallel; // with MPI, split every layer across the nodes by attention heads and feed-forward columns instead of giving each node a range of layers (llama models only)
     };
 
     // Signature for logging events
@@ -289,9 +327,51 @@ extern "C" {
                           const char * path_base_model,
                                  int   n_threads);
 
+    //
+    // KV cache
+    //
+
     // Returns the number of tokens in the KV cache
     LLAMA_API int llama_get_kv_cache_token_count(const struct llama_context * ctx);
 
+    // Remove all tokens data of cells in [c0, c1)
+    // c0 < 0 : [0,  c1]
+    // c1 < 0 : [c0, inf)
+    LLAMA_API void llama_kv_cache_tokens_rm(
+            struct llama_context * ctx,
+                         int32_t   c0,
+                         int32_t   c1);
+
+    // Removes all tokens that belong to the specified sequence and have positions in [p0, p1)
+    // p0 < 0 : [0,  p1]
+    // p1 < 0 : [p0, inf)
+    LLAMA_API void llama_kv_cache_seq_rm(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Copy all tokens that belong to the specified sequence to another sequence
+    // The cells are shared by both sequences, the K and V data is not copied
+    // Note that this does not remove the tokens that the destination sequence already had in [p0, p1)
+    // p0 < 0 : [0,  p1]
+    // p1 < 0 : [p0, inf)
+    LLAMA_API void llama_kv_cache_seq_cp(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id_src,
+                    llama_seq_id   seq_id_dst,
+                       llama_pos   p0,
+                       llama_pos   p1);
+
+    // Removes all tokens that do not belong to the specified sequence
+    LLAMA_API void llama_kv_cache_seq_keep(
+            struct llama_context * ctx,
+                    llama_seq_id   seq_id);
+
+    //
+    // State / sessions
+    //
+
     // Sets the current rng seed.
     LLAMA_API void llama_set_rng_seed(struct llama_context * ctx, uint32_t seed);
 
@@ -312,23 +392,64 @@ extern "C" {
     LLAMA_API bool llama_load_session_file(struct llama_context * ctx, const char * path_session, llama_token * tokens_out, size_t n_token_capacity, size_t * n_token_count_out);
     LLAMA_API bool llama_save_session_file(struct llama_context * ctx, const char * path_session, const llama_token * tokens, size_t n_token_count);
 
+    //
+    // Decoding
+    //
+
     // Run the llama inference to obtain the logits and probabilities for the next token.
     // tokens + n_tokens is the provided batch of new tokens to process
     // n_past is the number of tokens to use from previous eval calls
     // Returns 0 on success
-    LLAMA_API int llama_eval(
+    // NOTE: equivalent to llama_decode() with a single-sequence batch (seq_id 0) starting at n_past;
+    //       all cells of the KV cache at index n_past and above are cleared first
+    LLAMA_API DEPRECATED(int llama_eval(
             struct llama_context * ctx,
                const llama_token * tokens,
                              int   n_tokens,
                              int   n_past,
-                             int   n_threads);
+                             int   n_threads),
+            "use llama_decode() instead");
 
     // Same as llama_eval, but use float matrix input directly.
-    LLAMA_API int llama_eval_embd(
+    LLAMA_API DEPRECATED(int llama_eval_embd(
             struct llama_context * ctx,
                      const float * embd,
                              int   n_tokens,
                              int   n_past,
+                             int   n_threads),
+            "use llama_decode() instead");
+
+    // Return batch for single sequence of tokens starting at pos_0
+    //
+    // NOTE: this is a helper function to facilitate transition to the new batch API - avoid using it
+    //
+    LLAMA_API struct llama_batch llama_batch_get_one(
+                  llama_token * tokens,
+                      int32_t   n_tokens,
+                    llama_pos   pos_0,
+                 llama_seq_id   seq_id);
+
+    // Allocates a batch of tokens on the heap
+    // The batch has to be freed with llama_batch_free()
+    // If embd != 0, llama_batch.embd will be allocated with size of n_tokens * embd * sizeof(float)
+    // Otherwise, llama_batch.token will be allocated to store n_tokens llama_token
+    // The rest of the llama_batch members are allocated with size n_tokens
+    // All members are left uninitialized
+    // NOTE: llama_batch.logits must be set explicitly for every token
+    LLAMA_API struct llama_batch llama_batch_init(
+            int32_t n_tokens,
+            int32_t embd);
+
+    // Frees a batch of tokens allocated with llama_batch_init()
+    LLAMA_API void llama_batch_free(struct llama_batch batch);
+
+    // Positive return values does not mean a fatal error, but rather a warning.
+    //   0 - success
+    //   1 - could not find a KV slot for the batch (try reducing the size of the batch or increase the context)
+    // < 0 - error
+    LLAMA_API int llama_decode(
+            struct llama_context * ctx,
+              struct llama_batch   batch,
                              int   n_threads);
 
     // Export a static computation graph for context of 511 and batch size of 1
@@ -337,13 +458,19 @@ extern "C" {
     // IMPORTANT: do not use for anything else other than debugging and testing!
     LLAMA_API int llama_eval_export(struct llama_context * ctx, const char * fname);
 
-    // Token logits obtained from the last call to llama_eval()
+    // Token logits obtained from the last call to llama_decode()
     // The logits for the last token are stored in the last row
+    // If the batch had per-token logits flags, only the rows of the flagged tokens are filled
+    // Otherwise, only the last token has logits (a single row), unless logits_all is set
     // Can be mutated in order to change the probabilities of the next token
     // Rows: n_tokens
     // Cols: n_vocab
     LLAMA_API float * llama_get_logits(struct llama_context * ctx);
 
+    // Logits for the ith token of the last batch. Equivalent to:
+    // llama_get_logits(ctx) + i*n_vocab
+    LLAMA_API float * llama_get_logits_ith(struct llama_context * ctx, int32_t i);
+
     // Get the embeddings for the input
     // shape: [n_embd] (1-dimensional)
     LLAMA_API float * llama_get_embeddings(struct llama_context * ctx);
@@ -387,6 +514,35 @@ extern "C" {
                              int   n_max_tokens,
                             bool   add_bos);
 
+    // Convert n_texts texts into tokens at once, spread over n_threads threads.
+    // The tokens of texts[i] are written to tokens[i], which must have room for n_max_tokens[i] tokens.
+    // n_tokens[i] is set to the number of tokens of texts[i], or to its negation if they did not fit, as in llama_tokenize.
+    // If offsets is not NULL, offsets[i][j] is set to the byte offset in texts[i] at which token j starts (0 for BOS).
+    // Returns the number of texts whose tokens did not fit.
+    LLAMA_API int llama_tokenize_batch(
+            struct llama_context * ctx,
+                     const char ** texts,
+                       const int * text_lens,
+                             int   n_texts,
+                     llama_token ** tokens,
+                         int32_t ** offsets,
+                       const int * n_max_tokens,
+                             int * n_tokens,
+                            bool   add_bos,
+                             int   n_threads);
+
+    LLAMA_API int llama_tokenize_batch_with_model(
+        const struct llama_model * model,
+                     const char ** texts,
+                       const int * text_lens,
+                             int   n_texts,
+                     llama_token ** tokens,
+                         int32_t ** offsets,
+                       const int * n_max_tokens,
+                             int * n_tokens,
+                            bool   add_bos,
+                             int   n_threads);
+
     // Token Id -> Piece.
     // Uses the vocabulary in the provided context.
     // Does not write null terminator to the buffer.
@@ -513,8 +669,9 @@ extern "C" {
     /// @param n_beams Number of beams to use.
     /// @param n_past Number of tokens already evaluated.
     /// @param n_predict Maximum number of tokens to predict. EOS may occur earlier.
-    /// @param n_threads Number of threads as passed to llama_eval().
-    LLAMA_API void llama_beam_search(struct llama_context * ctx, llama_beam_search_callback_fn_t callback, void * callback_data, size_t n_beams, int n_past, int n_predict, int n_threads);
+    /// @param seq_id Sequence of the KV cache holding the evaluated tokens. The beams only modify this sequence.
+    /// @param n_threads Number of threads as passed to llama_decode().
+    LLAMA_API void llama_beam_search(struct llama_context * ctx, llama_beam_search_callback_fn_t callback, void * callback_data, size_t n_beams, int n_past, int n_predict, llama_seq_id seq_id, int n_threads);
 
     // Performance information
     LLAMA_API struct llama_timings llama_get_timings(struct llama_context * ctx);
@@ -0,0 +1,192 @@
+// Check the graph allocator against a graph with every tensor allocated in its own memory
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int N = 32;
+
+struct test_graph {
+    struct ggml_cgraph * gf;
+    std::vector<struct ggml_tensor *> outputs;
+};
+
+// build a random graph over two shapes, [N, N] and [N, N/2], with in-place capable ops, views with and without
+// offset and inputs allocated before the graph like the inputs of the llama graphs
+// alloc is NULL for the reference graph, which is built in a context that allocates every tensor
+static test_graph build_graph(
+        struct ggml_context * ctx, struct ggml_allocr * alloc,
+        const std::vector<struct ggml_tensor *> & weights, uint32_t seed, int n_ops) {
+    std::mt19937 rng(seed);
+
+    std::vector<struct ggml_tensor *> pool[2];
+    for (auto * w : weights) {
+        pool[w->ne[1] == N ? 0 : 1].push_back(w);
+    }
+
+    // inputs
+    for (int i = 0; i < 3; i++) {
+        struct ggml_tensor * inp = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, N, i == 2 ? N/2 : N);
+        if (alloc) {
+            ggml_allocr_alloc(alloc, inp);
+        }
+        if (!alloc || !ggml_allocr_is_measure(alloc)) {
+            float * data = (float *) inp->data;
+            for (int j = 0; j < ggml_nelements(inp); j++) {
+                data[j] = 0.01f*((seed + 31*i + 7*j) % 97) - 0.5f;
+            }
+        }
+        pool[i == 2 ? 1 : 0].push_back(inp);
+    }
+
+    auto pick = [&](int s) {
+        // prefer recent tensors, so that the lifetimes vary
+        const size_t n = pool[s].size();
+        const size_t k = std::min<size_t>(n, 1 + rng() % 6);
+        return pool[s][n - 1 - rng() % k];
+    };
+
+    for (int i = 0; i < n_ops; i++) {
+        const int s = rng() % 2;
+        struct ggml_tensor * a = pick(s);
+        struct ggml_tensor * cur = NULL;
+        switch (rng() % 9) {
+            case 0: cur = ggml_add(ctx, a, pick(s)); break;
+            case 1: cur = ggml_mul(ctx, a, pick(s)); break;
+            case 2: cur = ggml_sqr(ctx, a); break;
+            case 3: cur = ggml_scale(ctx, a, ggml_view_1d(ctx, weights[0], 1, 0)); break;
+            case 4: cur = ggml_soft_max(ctx, a); break;
+            case 5: cur = ggml_silu(ctx, a); break;
+            case 6:
+                if (s == 0) {
+                    // half of a square tensor, at offset 0 or N/2 rows
+                    const size_t offs = (rng() % 2)*(N/2)*a->nb[1];
+                    cur = ggml_cont(ctx, ggml_view_2d(ctx, a, N, N/2, a->nb[1], offs));
+                } else {
+                    cur = ggml_cont(ctx, ggml_view_2d(ctx, a, N, N/2, a->nb[1], 0));
+                }
+                pool[1].push_back(cur);
+                continue;
+            case 7:
+                if (s == 0) {
+                    cur = ggml_cont(ctx, ggml_transpose(ctx, a));
+                } else {
+                    cur = ggml_mul_mat(ctx, pick(0), a); // [N, N] x [N, N/2] -> [N, N/2]
+                }
+                break;
+            case 8: cur = ggml_rms_norm(ctx, a, 1e-5f); break;
+        }
+        pool[s].push_back(cur);
+    }
+
+    test_graph res;
+    res.gf = ggml_new_graph(ctx);
+
+    // the outputs must not be used by other nodes, or the allocator may reuse their memory
+    // one output per shape from the last tensors, plus a sum that keeps a few older ones alive until the end
+    for (int s = 0; s < 2; s++) {
+        const size_t n = pool[s].size();
+        res.outputs.push_back(ggml_add(ctx, ggml_add(ctx, pool[s][n - 3], pool[s][n - 2]), pool[s][n - 1]));
+    }
+    res.outputs.push_back(ggml_add(ctx, pool[0][pool[0].size()/2], pool[0][pool[0].size()/3]));
+
+    for (auto * out : res.outputs) {
+        ggml_build_forward_expand(res.gf, out);
+    }
+
+    return res;
+}
+
+static void compute(struct ggml_cgraph * gf) {
+    struct ggml_cplan plan = ggml_graph_plan(gf, 1);
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data = work.data();
+    ggml_graph_compute(gf, &plan);
+}
+
+static bool test_seed(const std::vector<struct ggml_tensor *> & weights, uint32_t seed, int n_ops) {
+    const size_t alignment = 32;
+    const size_t ctx_size  = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
+
+    // reference
+    struct ggml_init_params params_ref = { 64*1024*1024, NULL, false };
+    struct ggml_context * ctx_ref = ggml_init(params_ref);
+    test_graph ref = build_graph(ctx_ref, NULL, weights, seed, n_ops);
+    compute(ref.gf);
+
+    // measure
+    std::vector<uint8_t> buf_ctx(ctx_size);
+    struct ggml_init_params params = { ctx_size, buf_ctx.data(), true };
+
+    size_t size;
+    {
+        struct ggml_context * ctx = ggml_init(params);
+        struct ggml_allocr * alloc = ggml_allocr_new_measure(alignment);
+        test_graph g = build_graph(ctx, alloc, weights, seed, n_ops);
+        size = ggml_allocr_alloc_graph(alloc, g.gf) + alignment;
+        ggml_allocr_free(alloc);
+        ggml_free(ctx);
+    }
+
+    // allocate twice with the same allocator: the second time uses the cached plan
+    std::vector<uint8_t> buf(size);
+    struct ggml_allocr * alloc = ggml_allocr_new(buf.data(), buf.size(), alignment);
+
+    bool ok = true;
+    for (int it = 0; it < 2 && ok; it++) {
+        struct ggml_context * ctx = ggml_init(params);
+        ggml_allocr_reset(alloc);
+        test_graph g = build_graph(ctx, alloc, weights, seed, n_ops);
+        ggml_allocr_alloc_graph(alloc, g.gf);
+        compute(g.gf);
+
+        for (size_t i = 0; i < g.outputs.size(); i++) {
+            if (memcmp(g.outputs[i]->data, ref.outputs[i]->data, ggml_nbytes(ref.outputs[i])) != 0) {
+                fprintf(stderr, "%s: seed %u, iteration %d: output %zu differs\n", __func__, seed, it, i);
+                ok = false;
+            }
+        }
+        ggml_free(ctx);
+    }
+
+    ggml_allocr_free(alloc);
+    ggml_free(ctx_ref);
+
+    return ok;
+}
+
+int main(void) {
+    struct ggml_init_params params_w = { 16*1024*1024, NULL, false };
+    struct ggml_context * ctx_w = ggml_init(params_w);
+
+    // weights: external to the allocator
+    std::vector<struct ggml_tensor *> weights;
+    for (int i = 0; i < 4; i++) {
+        struct ggml_tensor * w = ggml_new_tensor_2d(ctx_w, GGML_TYPE_F32, N, i % 2 ? N/2 : N);
+        float * data = (float *) w->data;
+        for (int j = 0; j < ggml_nelements(w); j++) {
+            data[j] = 0.02f*((13*i + 5*j) % 51) - 0.5f;
+        }
+        weights.push_back(w);
+    }
+
+    bool ok = true;
+    for (uint32_t seed = 0; seed < 200; seed++) {
+        ok = test_seed(weights, seed, 10 + seed % 60) && ok;
+    }
+
+    ggml_free(ctx_w);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,217 @@
+// Check that ggml_graph_fuse does not change the results of a graph with the chains of a transformer layer
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_embd = 64;
+static const int n_ff   = 96;
+static const int n_tok  = 5;
+
+struct test_weights {
+    struct ggml_tensor * norm_w;
+    struct ggml_tensor * ln_w;
+    struct ggml_tensor * ln_b;
+    struct ggml_tensor * w1;
+    struct ggml_tensor * w2;
+    struct ggml_tensor * w3;
+    struct ggml_tensor * up;
+    struct ggml_tensor * up_b;
+    struct ggml_tensor * down;
+};
+
+static void fill(struct ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(t));
+    for (auto & v : data) {
+        v = dist(rng);
+    }
+    switch (t->type) {
+        case GGML_TYPE_F32:
+            memcpy(t->data, data.data(), data.size()*sizeof(float));
+            break;
+        case GGML_TYPE_F16:
+            ggml_fp32_to_fp16_row(data.data(), (ggml_fp16_t *) t->data, data.size());
+            break;
+        default:
+            {
+                std::vector<int64_t> hist(16);
+                ggml_quantize_chunk(t->type, data.data(), t->data, 0, data.size(), hist.data());
+            } break;
+    }
+}
+
+// the chains of the llama, falcon and starcoder layers: rms_norm -> mul, norm -> mul -> add, mul_mat -> silu -> mul,
+// mul_mat -> add -> gelu and mul_mat -> add
+static struct ggml_tensor * build_layer(struct ggml_context * ctx, const test_weights & w, struct ggml_tensor * x) {
+    struct ggml_tensor * cur = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), w.norm_w);
+
+    struct ggml_tensor * h = ggml_add(ctx, ggml_mul(ctx, ggml_norm(ctx, cur, 1e-5f), w.ln_w), w.ln_b);
+
+    struct ggml_tensor * tmp = ggml_mul_mat(ctx, w.w3, h);
+    struct ggml_tensor * ffn = ggml_mul(ctx, ggml_silu(ctx, ggml_mul_mat(ctx, w.w1, h)), tmp);
+
+    struct ggml_tensor * o = ggml_add(ctx, ggml_mul_mat(ctx, w.w2, ffn), x);
+
+    struct ggml_tensor * g = ggml_gelu(ctx, ggml_add(ctx, ggml_mul_mat(ctx, w.up, h), w.up_b));
+
+    return ggml_add(ctx, o, ggml_mul_mat(ctx, w.down, g));
+}
+
+static void compute(struct ggml_cgraph * gf, int n_threads, bool fuse, int n_fused_exp) {
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+    if (fuse) {
+        const int n_fused = ggml_graph_fuse(gf, &plan);
+        if (n_fused != n_fused_exp) {
+            fprintf(stderr, "%s: expected %d fused nodes, got %d\n", __func__, n_fused_exp, n_fused);
+            assert(false);
+        }
+    }
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data = work.data();
+    ggml_graph_compute(gf, &plan);
+}
+
+static bool test_type(enum ggml_type type, int n_threads) {
+    std::mt19937 rng(1234);
+
+    struct ggml_init_params params = { 16*1024*1024, NULL, false };
+    struct ggml_context * ctx = ggml_init(params);
+
+    test_weights w;
+    w.norm_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    w.ln_w   = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    w.ln_b   = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    w.w1     = ggml_new_tensor_2d(ctx, type, n_embd, n_ff);
+    w.w2     = ggml_new_tensor_2d(ctx, type, n_ff,   n_embd);
+    w.w3     = ggml_new_tensor_2d(ctx, type, n_embd, n_ff);
+    w.up     = ggml_new_tensor_2d(ctx, type, n_embd, n_ff);
+    w.up_b   = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_ff);
+    w.down   = ggml_new_tensor_2d(ctx, type, n_ff,   n_embd);
+
+    for (auto * t : { w.norm_w, w.ln_w, w.ln_b, w.w1, w.w2, w.w3, w.up, w.up_b, w.down }) {
+        fill(t, rng);
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tok);
+    fill(x, rng);
+
+    bool ok = true;
+
+    // every tensor in its own memory: all the nodes, including the ones in the middle of a chain, must match
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, build_layer(ctx, w, x));
+
+    std::vector<std::vector<uint8_t>> ref(gf->n_nodes);
+    compute(gf, n_threads, false, 0);
+    for (int i = 0; i < gf->n_nodes; i++) {
+        const uint8_t * data = (const uint8_t *) gf->nodes[i]->data;
+        ref[i].assign(data, data + ggml_nbytes(gf->nodes[i]));
+        memset(gf->nodes[i]->data, 0, ggml_nbytes(gf->nodes[i]));
+    }
+
+    compute(gf, n_threads, true, 9);
+    for (int i = 0; i < gf->n_nodes; i++) {
+        if (memcmp(gf->nodes[i]->data, ref[i].data(), ref[i].size()) != 0) {
+            fprintf(stderr, "%s: type %s, %d threads: node %d (%s) differs\n", __func__,
+                    ggml_type_name(type), n_threads, i, ggml_op_name(gf->nodes[i]->op));
+            ok = false;
+        }
+    }
+    const std::vector<uint8_t> & out_ref = ref[gf->n_nodes - 1];
+
+    // with the graph allocator, which computes nodes in-place when it can
+    {
+        const size_t alignment = 32;
+        const size_t ctx_size  = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
+
+        std::vector<uint8_t> buf_ctx(ctx_size);
+        struct ggml_init_params params_graph = { ctx_size, buf_ctx.data(), true };
+
+        size_t size;
+        {
+            struct ggml_context * ctx0 = ggml_init(params_graph);
+            struct ggml_allocr * alloc = ggml_allocr_new_measure(alignment);
+            struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tok);
+            ggml_allocr_alloc(alloc, inp);
+            struct ggml_cgraph * gf0 = ggml_new_graph(ctx0);
+            ggml_build_forward_expand(gf0, build_layer(ctx0, w, inp));
+            size = ggml_allocr_alloc_graph(alloc, gf0) + alignment;
+            ggml_allocr_free(alloc);
+            ggml_free(ctx0);
+        }
+
+        std::vector<uint8_t> buf(size);
+        struct ggml_allocr * alloc = ggml_allocr_new(buf.data(), buf.size(), alignment);
+
+        struct ggml_context * ctx0 = ggml_init(params_graph);
+        struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tok);
+        ggml_allocr_alloc(alloc, inp);
+        memcpy(inp->data, x->data, ggml_nbytes(x));
+
+        struct ggml_cgraph * gf0 = ggml_new_graph(ctx0);
+        struct ggml_tensor * out = build_layer(ctx0, w, inp);
+        ggml_build_forward_expand(gf0, out);
+        ggml_allocr_alloc_graph(alloc, gf0);
+
+        struct ggml_cplan plan = ggml_graph_plan(gf0, n_threads);
+        ggml_graph_fuse(gf0, &plan);
+        std::vector<uint8_t> work(plan.work_size);
+        plan.work_data = work.data();
+        ggml_graph_compute(gf0, &plan);
+
+        if (memcmp(out->data, out_ref.data(), out_ref.size()) != 0) {
+            fprintf(stderr, "%s: type %s, %d threads: output differs with the graph allocator\n", __func__,
+                    ggml_type_name(type), n_threads);
+            ok = false;
+        }
+
+        ggml_free(ctx0);
+        ggml_allocr_free(alloc);
+    }
+
+    // a node that would overwrite a source of the mul_mat while other threads still read it is not fused
+    {
+        struct ggml_tensor * h  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd);
+        struct ggml_tensor * mm = ggml_mul_mat(ctx, ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_embd), h);
+        struct ggml_tensor * y  = ggml_add(ctx, mm, w.ln_b);
+        y->data = h->data;
+
+        struct ggml_cgraph * gf1 = ggml_new_graph(ctx);
+        ggml_build_forward_expand(gf1, y);
+
+        struct ggml_cplan plan = ggml_graph_plan(gf1, n_threads);
+        if (ggml_graph_fuse(gf1, &plan) != 0) {
+            fprintf(stderr, "%s: type %s, %d threads: node overlapping a mul_mat source was fused\n", __func__,
+                    ggml_type_name(type), n_threads);
+            ok = false;
+        }
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    bool ok = true;
+
+    for (auto type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0, GGML_TYPE_Q8_0 }) {
+        for (int n_threads = 1; n_threads <= 4; n_threads++) {
+            ok = test_type(type, n_threads) && ok;
+        }
+    }
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,194 @@
+// Check that computing the independent nodes of a graph together with ggml_graph_schedule does not change the results
+
+#include "ggml.h"
+#include "ggml-alloc.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <vector>
+
+static const int n_embd  = 64;
+static const int n_tok   = 5;
+static const int n_cache = 16;
+static const int n_layer = 2;
+
+struct test_weights {
+    struct ggml_tensor * norm_w;
+    struct ggml_tensor * wq;
+    struct ggml_tensor * wk;
+    struct ggml_tensor * wv;
+    struct ggml_tensor * wo;
+    struct ggml_tensor * cache; // [n_embd, n_cache] per layer, written and read through views like the kv cache
+};
+
+static void fill(struct ggml_tensor * t, std::mt19937 & rng) {
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> data(ggml_nelements(t));
+    for (auto & v : data) {
+        v = dist(rng);
+    }
+    switch (t->type) {
+        case GGML_TYPE_F32:
+            memcpy(t->data, data.data(), data.size()*sizeof(float));
+            break;
+        default:
+            {
+                std::vector<int64_t> hist(16);
+                ggml_quantize_chunk(t->type, data.data(), t->data, 0, data.size(), hist.data());
+            } break;
+    }
+}
+
+// three projections of the same input, the write of one of them to the cache and a read of the cache through another
+// view, which does not depend on the write through an edge of the graph
+static struct ggml_tensor * build_graph(
+        struct ggml_context * ctx, struct ggml_cgraph * gf, const test_weights & w, struct ggml_tensor * x) {
+    for (int il = 0; il < n_layer; il++) {
+        struct ggml_tensor * h = ggml_mul(ctx, ggml_rms_norm(ctx, x, 1e-5f), w.norm_w);
+
+        struct ggml_tensor * q = ggml_mul_mat(ctx, w.wq, h);
+        struct ggml_tensor * k = ggml_mul_mat(ctx, w.wk, h);
+        struct ggml_tensor * v = ggml_mul_mat(ctx, w.wv, h);
+        ggml_build_forward_expand(gf, q);
+        ggml_build_forward_expand(gf, k);
+        ggml_build_forward_expand(gf, v);
+
+        const size_t offs_layer = il*n_cache*w.cache->nb[1];
+        ggml_build_forward_expand(gf, ggml_cpy(ctx, ggml_silu(ctx, k),
+                    ggml_view_2d(ctx, w.cache, n_embd, n_tok, w.cache->nb[1], offs_layer + (n_cache - n_tok)*w.cache->nb[1])));
+
+        struct ggml_tensor * kk = ggml_view_2d(ctx, w.cache, n_embd, n_cache, w.cache->nb[1], offs_layer);
+
+        struct ggml_tensor * kq = ggml_soft_max(ctx, ggml_mul_mat(ctx, kk, q)); // [n_cache, n_tok]
+        struct ggml_tensor * o  = ggml_mul_mat(ctx, ggml_cont(ctx, ggml_transpose(ctx, kk)), kq); // [n_embd, n_tok]
+
+        x = ggml_add(ctx, ggml_mul_mat(ctx, w.wo, ggml_add(ctx, o, v)), x);
+    }
+
+    ggml_build_forward_expand(gf, x);
+
+    return x;
+}
+
+static bool test_type(enum ggml_type type, int n_threads, bool fuse) {
+    std::mt19937 rng(1234);
+
+    struct ggml_init_params params = { 16*1024*1024, NULL, false };
+    struct ggml_context * ctx = ggml_init(params);
+
+    test_weights w;
+    w.norm_w = ggml_new_tensor_1d(ctx, GGML_TYPE_F32, n_embd);
+    w.wq     = ggml_new_tensor_2d(ctx, type, n_embd, n_embd);
+    w.wk     = ggml_new_tensor_2d(ctx, type, n_embd, n_embd);
+    w.wv     = ggml_new_tensor_2d(ctx, type, n_embd, n_embd);
+    w.wo     = ggml_new_tensor_2d(ctx, type, n_embd, n_embd);
+    w.cache  = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_cache*n_layer);
+
+    for (auto * t : { w.norm_w, w.wq, w.wk, w.wv, w.wo, w.cache }) {
+        fill(t, rng);
+    }
+
+    struct ggml_tensor * x = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, n_embd, n_tok);
+    fill(x, rng);
+
+    const std::vector<uint8_t> cache0((uint8_t *) w.cache->data, (uint8_t *) w.cache->data + ggml_nbytes(w.cache));
+
+    const size_t alignment = 32;
+    const size_t ctx_size  = ggml_tensor_overhead()*GGML_MAX_NODES + ggml_graph_overhead();
+
+    std::vector<uint8_t> buf_ctx(ctx_size);
+    struct ggml_init_params params_graph = { ctx_size, buf_ctx.data(), true };
+
+    size_t size;
+    {
+        struct ggml_context * ctx0 = ggml_init(params_graph);
+        struct ggml_allocr * alloc = ggml_allocr_new_measure(alignment);
+        struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tok);
+        ggml_allocr_alloc(alloc, inp);
+        struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+        build_graph(ctx0, gf, w, inp);
+        size = ggml_allocr_alloc_graph(alloc, gf) + alignment;
+        ggml_allocr_free(alloc);
+        ggml_free(ctx0);
+    }
+
+    // with the graph allocator, which reuses the memory of the tensors after their last use
+    std::vector<uint8_t> out[2];
+    std::vector<uint8_t> cache[2];
+
+    for (int sched = 0; sched < 2; sched++) {
+        memcpy(w.cache->data, cache0.data(), cache0.size());
+
+        std::vector<uint8_t> buf(size);
+        struct ggml_allocr * alloc = ggml_allocr_new(buf.data(), buf.size(), alignment);
+
+        struct ggml_context * ctx0 = ggml_init(params_graph);
+        struct ggml_tensor * inp = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_embd, n_tok);
+        ggml_allocr_alloc(alloc, inp);
+        memcpy(inp->data, x->data, ggml_nbytes(x));
+
+        struct ggml_cgraph * gf = ggml_new_graph(ctx0);
+        struct ggml_tensor * res = build_graph(ctx0, gf, w, inp);
+        ggml_allocr_alloc_graph(alloc, gf);
+
+        struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+        if (fuse) {
+            ggml_graph_fuse(gf, &plan);
+        }
+        if (sched) {
+            int n_nodes = 0;
+            for (int i = 0; i < gf->n_nodes; i++) {
+                n_nodes += plan.n_tasks[i] > 0;
+            }
+            const int n_steps = ggml_graph_schedule(gf, &plan);
+            if (n_steps == 0 || n_steps >= n_nodes - 4*n_layer) {
+                fprintf(stderr, "%s: type %s, %d threads: %d nodes in %d steps\n", __func__,
+                        ggml_type_name(type), n_threads, n_nodes, n_steps);
+                assert(false);
+            }
+        }
+        std::vector<uint8_t> work(plan.work_size);
+        plan.work_data = work.data();
+        ggml_graph_compute(gf, &plan);
+
+        out[sched].assign((uint8_t *) res->data, (uint8_t *) res->data + ggml_nbytes(res));
+        cache[sched].assign((uint8_t *) w.cache->data, (uint8_t *) w.cache->data + ggml_nbytes(w.cache));
+
+        ggml_free(ctx0);
+        ggml_allocr_free(alloc);
+    }
+
+    bool ok = true;
+
+    if (out[0] != out[1] || cache[0] != cache[1]) {
+        fprintf(stderr, "%s: type %s, %d threads%s: results differ\n", __func__,
+                ggml_type_name(type), n_threads, fuse ? ", fused" : "");
+        ok = false;
+    }
+
+    ggml_free(ctx);
+
+    return ok;
+}
+
+int main(void) {
+    bool ok = true;
+
+    for (auto type : { GGML_TYPE_F32, GGML_TYPE_F16, GGML_TYPE_Q4_0 }) {
+        for (int n_threads = 1; n_threads <= 4; n_threads++) {
+            for (bool fuse : { false, true }) {
+                ok = test_type(type, n_threads, fuse) && ok;
+            }
+        }
+    }
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
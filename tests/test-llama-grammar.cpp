@@ -398,6 +398,96 @@ int main()
         delete[] candidate.code_points;
         candidate.code_points = nullptr;
     }
+
+    // the token trie must accept exactly the pieces that llama_grammar_reject_candidates does not reject
+    std::vector<std::string> pieces = {
+        "a", "ab", "abc", "b", "1", "12", "(", "(a", "a=", "a=b", "a=b\n", "=", "\n", " ", "  ", "a b", "+", "-1",
+        "x*y", "zz", ")", "a)", "", "\xe2", "\xe2\x82", "a\xe2", "\xff", "a\x80", "\xc3\xa9", "9=9\n9",
+    };
+
+    std::vector<std::vector<std::vector<const llama_grammar_element *>>> all_stacks = { grammar->stacks };
+    for (uint32_t chr : { 'a', 'b', '=', '(', '1' })
+    {
+        all_stacks.push_back(llama_grammar_accept(grammar->rules, all_stacks.back(), chr));
+    }
+
+    // the interned stacks must step through the same states as llama_grammar_accept, without the duplicates,
+    // also once the pool has started over
+    for (int pass = 0; pass < 2; pass++)
+    {
+        if (pass > 0)
+        {
+            grammar->pool.clear();
+            assert(grammar->pool.stacks.empty() && grammar->pool.next.empty());
+        }
+
+        std::vector<uint32_t> ids;
+        for (const auto & stack : all_stacks[0])
+        {
+            ids.push_back(llama_grammar_intern_stack(grammar->pool, stack));
+        }
+        std::size_t step = 1;
+        for (uint32_t chr : { 'a', 'b', '=', '(', '1' })
+        {
+            ids = llama_grammar_accept_ids(grammar->rules, grammar->pool, ids, chr);
+
+            std::set<std::vector<const llama_grammar_element *>> expected_stacks(all_stacks[step].begin(), all_stacks[step].end());
+            std::set<std::vector<const llama_grammar_element *>> actual_stacks;
+            for (uint32_t id : ids)
+            {
+                actual_stacks.insert(grammar->pool.stacks[id]);
+            }
+            assert(ids.size() == actual_stacks.size());
+            assert(actual_stacks == expected_stacks);
+            step++;
+        }
+    }
+
+    const llama_token_trie trie = llama_token_trie_build(pieces);
+
+    for (const auto & stacks : all_stacks)
+    {
+        if (stacks.empty())
+        {
+            continue;
+        }
+
+        std::vector<std::pair<std::vector<uint32_t>, llama_partial_utf8>> decoded;
+        std::vector<llama_grammar_candidate> candidates;
+        std::vector<bool> expected(pieces.size(), false);
+        decoded.reserve(pieces.size());
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            if (pieces[i].empty())
+            {
+                continue;
+            }
+            decoded.push_back(decode_utf8(pieces[i].c_str(), {}));
+            candidates.push_back({ i, decoded.back().first.data(), decoded.back().second });
+            expected[i] = true;
+        }
+        for (const auto & reject : llama_grammar_reject_candidates(grammar->rules, stacks, candidates))
+        {
+            expected[reject.index] = false;
+        }
+
+        std::vector<bool> accepted(pieces.size(), false);
+        for (const auto & stack : stacks)
+        {
+            const uint32_t id = llama_grammar_intern_stack(grammar->pool, stack);
+            llama_grammar_accept_trie(grammar->rules, trie, trie.nodes[0], grammar->pool, id, accepted);
+        }
+
+        for (size_t i = 0; i < pieces.size(); ++i)
+        {
+            if (accepted[i] != expected[i])
+            {
+                fprintf(stderr, "piece %zu \"%s\": trie %d, expected %d\n", i, pieces[i].c_str(), (int) accepted[i], (int) expected[i]);
+            }
+            assert(accepted[i] == expected[i]);
+        }
+    }
+
     delete grammar;
     return 0;
 }
@@ -11,6 +11,7 @@
 #include <iostream>
 #include <vector>
 #include <algorithm>
+#include <random>
 
 
 static void dump(const llama_token_data_array * candidates) {
@@ -163,6 +164,86 @@ static void test_frequency_presence_penalty(
     }
 }
 
+// the penalties must give the same logits whether the candidates are indexed by token id or shuffled
+static void test_penalties_large(size_t n_vocab, size_t n_last, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+    std::uniform_int_distribution<llama_token> pick(0, (llama_token)n_vocab - 1);
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, dist(rng), 0.0f});
+    }
+
+    // a skewed window, so that some tokens repeat many times
+    std::vector<llama_token> last_tokens(n_last);
+    for (auto & id : last_tokens) {
+        id = pick(rng) % (llama_token)(n_vocab/8 + 1);
+    }
+
+    std::vector<llama_token_data> shuffled = candidates;
+    std::shuffle(shuffled.begin(), shuffled.end(), rng);
+
+    // reference: count every candidate in the window
+    std::vector<float> expected(n_vocab);
+    for (const auto & cur : candidates) {
+        const int count = (int) std::count(last_tokens.begin(), last_tokens.end(), cur.id);
+        float logit = cur.logit;
+        if (count > 0) {
+            logit = logit <= 0 ? logit*1.3f : logit/1.3f;
+        }
+        expected[cur.id] = logit - (float(count)*0.2f + float(count > 0)*0.4f);
+    }
+
+    for (auto * data : { &candidates, &shuffled }) {
+        llama_token_data_array candidates_p = { data->data(), data->size(), false };
+        llama_sample_repetition_penalty(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), 1.3f);
+        llama_sample_frequency_and_presence_penalties(nullptr, &candidates_p, last_tokens.data(), last_tokens.size(), 0.2f, 0.4f);
+        for (const auto & cur : *data) {
+            assert(fabs(cur.logit - expected[cur.id]) <= 1e-6f*fabs(expected[cur.id]));
+        }
+    }
+}
+
+// top-k and top-p on a large unsorted vocabulary must select the same tokens as on the sorted one
+static void test_top_k_top_p_large(size_t n_vocab, int k, float p, uint32_t seed) {
+    std::mt19937 rng(seed);
+    std::normal_distribution<float> dist(0.0f, 3.0f);
+
+    std::vector<llama_token_data> candidates;
+    candidates.reserve(n_vocab);
+    for (llama_token token_id = 0; token_id < (llama_token)n_vocab; token_id++) {
+        candidates.emplace_back(llama_token_data{token_id, dist(rng), 0.0f});
+    }
+    // a few tokens ruled out, as by a grammar
+    for (size_t i = 0; i < n_vocab; i += 97) {
+        candidates[i].logit = -INFINITY;
+    }
+
+    std::vector<llama_token_data> expected = candidates;
+    llama_token_data_array expected_p = { expected.data(), expected.size(), false };
+    llama_sample_softmax(nullptr, &expected_p);
+    llama_sample_top_k(nullptr, &expected_p, k, 1);
+    llama_sample_top_p(nullptr, &expected_p, p, 1);
+
+    llama_token_data_array candidates_p = { candidates.data(), candidates.size(), false };
+    llama_sample_top_k(nullptr, &candidates_p, k, 1);
+    llama_sample_top_p(nullptr, &candidates_p, p, 1);
+    llama_sample_softmax(nullptr, &candidates_p);
+    llama_sample_softmax(nullptr, &expected_p);
+
+    // the softmax of the unsorted candidates adds up the probabilities in another order, so a top-p cut among
+    // many tiny probabilities may move by a few tokens from rounding; tokens with equal logits may come in any order
+    const size_t n = std::min(candidates_p.size, expected_p.size);
+    assert(candidates_p.size - n <= std::max<size_t>(4, n/100));
+    assert(expected_p.size   - n <= std::max<size_t>(4, n/100));
+    for (size_t i = 0; i < n; i++) {
+        assert(candidates_p.data[i].logit == expected_p.data[i].logit);
+        assert(fabs(candidates_p.data[i].p - expected_p.data[i].p) <= 1e-3*expected_p.data[i].p);
+    }
+}
+
 int main(void) {
     ggml_time_init();
 
@@ -174,6 +255,14 @@ int main(void) {
     test_top_p({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f}, 0.8f);
     test_top_p({0.1f, 0.2f, 0.3f, 0.4f}, {0.4f, 0.3f, 0.2f, 0.1f}, 1);
 
+    for (uint32_t seed = 0; seed < 4; seed++) {
+        test_top_k_top_p_large(32000,     40, 0.95f, seed);
+        test_top_k_top_p_large(32000,  32000, 0.95f, seed);
+        test_top_k_top_p_large(32000,  32000, 0.5f,  seed);
+        test_top_k_top_p_large(150000,  1000, 0.9f,  seed);
+        test_top_k_top_p_large(150000, 150000, 0.9f, seed);
+    }
+
     test_tfs({0.1f, 0.15f, 0.2f, 0.25f, 0.3f}, {0.3f}, 0.25f);
     test_tfs({0.1f, 0.15f, 0.2f, 0.25f, 0.3f}, {0.3f, 0.25f}, 0.75f);
     test_tfs({0.1f, 0.15f, 0.2f, 0.25f, 0.3f}, {0.3f, 0.25f}, 0.99f);
@@ -189,6 +278,10 @@ int main(void) {
     test_frequency_presence_penalty({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2},       {0.499966f, 0.499966f, 0.000023f, 0.000023f, 0.000023f}, 5.0f, 5.0f);
     test_frequency_presence_penalty({0.2f, 0.2f, 0.2f, 0.2f, 0.2f}, {0, 1, 2, 0, 0}, {0.499977f, 0.499977f, 0.000023f, 0.000023f, 0.000000f}, 5.0f, 5.0f);
 
+    test_penalties_large(32000,   64, 0);
+    test_penalties_large(32000, 4096, 1);
+    test_penalties_large(   16, 1024, 2);
+
     printf("OK\n");
 
     return 0;
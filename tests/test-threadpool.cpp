@@ -0,0 +1,82 @@
+// Check that a thread pool computes graphs that use fewer threads than the pool has, which leaves workers with
+// nothing to do that must not touch the graph
+
+#include "ggml.h"
+
+#undef NDEBUG
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <vector>
+
+static const int n_pool = 8;
+static const int n_iter = 2000;
+
+static bool compute(struct ggml_threadpool * pool, struct ggml_cgraph * gf, int n_threads) {
+    struct ggml_cplan plan = ggml_graph_plan(gf, n_threads);
+    std::vector<uint8_t> work(plan.work_size);
+    plan.work_data  = work.data();
+    plan.threadpool = pool;
+    return ggml_graph_compute(gf, &plan) == GGML_EXIT_SUCCESS;
+}
+
+int main(void) {
+    struct ggml_init_params params = { 16*1024*1024, NULL, false };
+    struct ggml_context * ctx = ggml_init(params);
+
+    struct ggml_tensor * a = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 16);
+    struct ggml_tensor * b = ggml_new_tensor_2d(ctx, GGML_TYPE_F32, 32, 8);
+    for (int i = 0; i < ggml_nelements(a); i++) {
+        ((float *) a->data)[i] = 0.01f*(i % 17);
+    }
+    for (int i = 0; i < ggml_nelements(b); i++) {
+        ((float *) b->data)[i] = 0.02f*(i % 13);
+    }
+
+    struct ggml_tensor * out = ggml_silu(ctx, ggml_mul_mat(ctx, a, b));
+
+    struct ggml_cgraph * gf = ggml_new_graph(ctx);
+    ggml_build_forward_expand(gf, out);
+
+    std::vector<float> ref(ggml_nelements(out));
+    {
+        struct ggml_cplan plan = ggml_graph_plan(gf, 1);
+        std::vector<uint8_t> work(plan.work_size);
+        plan.work_data = work.data();
+        ggml_graph_compute(gf, &plan);
+        ref.assign((float *) out->data, (float *) out->data + ggml_nelements(out));
+    }
+
+    struct ggml_threadpool * pool = ggml_threadpool_new(n_pool);
+
+    bool ok = true;
+
+    for (int it = 0; it < n_iter && ok; it++) {
+        // mostly fewer threads than the pool has, the graph state of every call is on a different stack frame
+        const int n_threads = 2 + it % (n_pool - 1);
+
+        if (!compute(pool, gf, n_threads)) {
+            fprintf(stderr, "%s: iteration %d, %d threads: compute failed\n", __func__, it, n_threads);
+            ok = false;
+            break;
+        }
+
+        for (int i = 0; i < ggml_nelements(out); i++) {
+            if (fabsf(((float *) out->data)[i] - ref[i]) > 1e-5f) {
+                fprintf(stderr, "%s: iteration %d, %d threads: output %d differs\n", __func__, it, n_threads, i);
+                ok = false;
+                break;
+            }
+        }
+    }
+
+    ggml_threadpool_free(pool);
+    ggml_free(ctx);
+
+    if (!ok) {
+        return 1;
+    }
+
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,167 @@
+// Benchmark the SPM tokenizer on a large corpus
+
+#include "llama.h"
+#include "common.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#define ITERATIONS 5
+
+// a mix of the inputs the tokenizer meets in practice: prose, code, whitespace runs, digits and text outside
+// of the latin script, which falls back to byte tokens
+static const char * k_corpus_pieces[] = {
+    "The quick brown fox jumps over the lazy dog. ",
+    "Hello, world! This is a test of the tokenizer, with some punctuation; and more... ",
+    "    for (int i = 0; i < n; ++i) {\n        sum += x[i]*y[i];\n    }\n",
+    "w048 7tuijk dsdfhu 3.14159 2718281828 0x7fffffff ",
+    "нещо на Български, и още малко текст на кирилица. ",
+    "កាន់តែពិសេសអាចខលចេញ ",
+    "🚀 (normal) 😶‍🌫️ (multiple emojis concatenated) ✅ ",
+    "\n\n\t\t   \n",
+};
+
+static std::string make_corpus(size_t size) {
+    std::string text;
+    text.reserve(size + 256);
+    uint32_t rng = 42;
+    while (text.size() < size) {
+        rng = rng*1664525u + 1013904223u;
+        text += k_corpus_pieces[(rng >> 16) % (sizeof(k_corpus_pieces)/sizeof(k_corpus_pieces[0]))];
+    }
+    return text;
+}
+
+// split the corpus into documents of about doc_size bytes, at line boundaries where possible
+static std::vector<std::string> split_docs(const std::string & text, size_t doc_size) {
+    std::vector<std::string> docs;
+    size_t pos = 0;
+    while (pos < text.size()) {
+        size_t end = std::min(pos + doc_size, text.size());
+        const size_t nl = text.find('\n', end);
+        end = nl == std::string::npos ? text.size() : nl + 1;
+        docs.push_back(text.substr(pos, end - pos));
+        pos = end;
+    }
+    return docs;
+}
+
+int main(int argc, char ** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s vocab-file [text-file] [doc-size]\n", argv[0]);
+        return 1;
+    }
+
+    const std::string fname = argv[1];
+
+    std::string fname_text;
+    if (argc > 2) {
+        fname_text = argv[2];
+    }
+
+    const size_t doc_size = argc > 3 ? (size_t) atoll(argv[3]) : 1024;
+
+    llama_backend_init(false);
+
+    llama_model * model;
+    llama_context * ctx;
+
+    // load the vocab
+    {
+        auto lparams = llama_context_default_params();
+
+        lparams.vocab_only = true;
+
+        model = llama_load_model_from_file(fname.c_str(), lparams);
+
+        if (model == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            return 1;
+        }
+
+        ctx = llama_new_context_with_model(model, lparams);
+
+        if (ctx == NULL) {
+            fprintf(stderr, "%s: error: failed to load vocab '%s'\n", __func__, fname.c_str());
+            llama_free_model(model);
+            return 1;
+        }
+    }
+
+    if (llama_vocab_type(ctx) != LLAMA_VOCAB_TYPE_SPM) {
+        fprintf(stderr, "%s : error: vocab type is not SPM\n", __func__);
+        llama_free_model(model);
+        llama_free(ctx);
+        return 2;
+    }
+
+    std::string text;
+    if (!fname_text.empty()) {
+        std::ifstream ifs(fname_text);
+        if (!ifs) {
+            fprintf(stderr, "%s : error: could not open file '%s'\n", __func__, fname_text.c_str());
+            llama_free_model(model);
+            llama_free(ctx);
+            return 1;
+        }
+        text = std::string(std::istreambuf_iterator<char>(ifs), std::istreambuf_iterator<char>());
+    } else {
+        text = make_corpus(8*1024*1024);
+    }
+
+    const std::vector<std::string> docs = split_docs(text, doc_size);
+
+    fprintf(stderr, "%s : corpus: %zu bytes in %zu documents\n", __func__, text.size(), docs.size());
+
+    std::vector<llama_token> tokens(text.size() + 1);
+    std::vector<llama_token> tokens_ref;
+
+    int64_t t_min_us = INT64_MAX;
+    size_t n_tokens = 0;
+
+    for (int it = 0; it < ITERATIONS; ++it) {
+        std::vector<llama_token> tokens_it;
+        tokens_it.reserve(tokens_ref.size());
+
+        const int64_t t_start_us = ggml_time_us();
+        for (const auto & doc : docs) {
+            const int n = llama_tokenize(ctx, doc.data(), doc.size(), tokens.data(), tokens.size(), false);
+            if (n < 0) {
+                fprintf(stderr, "%s : error: token buffer too small\n", __func__);
+                llama_free_model(model);
+                llama_free(ctx);
+                return 1;
+            }
+            tokens_it.insert(tokens_it.end(), tokens.begin(), tokens.begin() + n);
+        }
+        t_min_us = std::min(t_min_us, ggml_time_us() - t_start_us);
+
+        // the tokenizer keeps buffers between calls: the output must not depend on what was tokenized before
+        if (it == 0) {
+            tokens_ref = std::move(tokens_it);
+            n_tokens   = tokens_ref.size();
+        } else if (tokens_it != tokens_ref) {
+            fprintf(stderr, "%s : error: iteration %d produced different tokens\n", __func__, it);
+            llama_free_model(model);
+            llama_free(ctx);
+            return 3;
+        }
+    }
+
+    printf("%s : %zu tokens, best of %d: %8.2f ms, %8.2f MB/s, %10.0f tokens/s\n", __func__,
+            n_tokens, ITERATIONS, t_min_us/1000.0,
+            text.size()/(double) t_min_us, n_tokens*1e6/(double) t_min_us);
+
+    llama_free_model(model);
+    llama_free(ctx);
+
+    llama_backend_free();
+
+    return 0;
+}
@@ -143,6 +143,42 @@ int main(int argc, char **argv) {
         }
     }
 
+    // the batched API must give the same tokens, with offsets that map every token back to its text
+    {
+        std::vector<std::string> texts;
+        for (const auto & test_kv : k_tests()) {
+            texts.push_back(test_kv.first);
+        }
+
+        std::vector<std::vector<int32_t>> offsets;
+        const auto res = llama_tokenize_batch(ctx, texts, true, 4, &offsets);
+
+        for (size_t i = 0; i < texts.size(); ++i) {
+            const std::string & text = texts[i];
+
+            bool correct = res[i] == llama_tokenize(ctx, text, true) && offsets[i].size() == res[i].size();
+
+            for (size_t j = 1; j < res[i].size() && correct; ++j) {
+                const size_t offs = offsets[i][j];
+                const size_t next = j + 1 < res[i].size() ? offsets[i][j + 1] : text.size();
+                if (offs > next || next > text.size()) {
+                    correct = false;
+                    break;
+                }
+
+                // the first token carries the leading space added by the tokenizer
+                const std::string piece = llama_token_to_piece(ctx, res[i][j]);
+                const std::string span  = text.substr(offs, next - offs);
+                correct = piece == span || (j == 1 && piece == " " + span);
+            }
+
+            if (!correct) {
+                fprintf(stderr, "%s : failed batch test: '%s'\n", __func__, text.c_str());
+                success = false;
+            }
+        }
+    }
+
     if (!fname_text.empty()) {
         fprintf(stderr, "%s : tokenizing: '%s'\n", __func__, fname_text.c_str());
 
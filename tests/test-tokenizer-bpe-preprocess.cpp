@@ -0,0 +1,94 @@
+#ifdef NDEBUG
+#undef NDEBUG
+#endif
+
+#include "llama.cpp" // TODO: not great
+
+#include <cassert>
+#include <random>
+#include <regex>
+
+// the previous implementation of the pre-tokenizer, to check the hand-written one against
+static std::vector<std::string> bpe_gpt2_preprocess_regex(const std::string & text) {
+    std::vector<std::string> words;
+
+    // ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+    const std::string pattern = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    const std::regex re(pattern);
+
+    auto words_begin = std::sregex_iterator(text.begin(), text.end(), re);
+    auto words_end = std::sregex_iterator();
+    for (auto it = words_begin; it != words_end; ++it) {
+        words.push_back(it->str());
+    }
+    return words;
+}
+
+static bool check(const std::string & text) {
+    std::vector<std::pair<size_t, size_t>> spans;
+    llm_tokenizer_bpe::bpe_gpt2_preprocess(text, spans);
+
+    std::vector<std::string> words;
+    for (const auto & span : spans) {
+        words.push_back(text.substr(span.first, span.second));
+    }
+
+    const std::vector<std::string> words_ref = bpe_gpt2_preprocess_regex(text);
+    if (words == words_ref) {
+        return true;
+    }
+
+    fprintf(stderr, "%s : mismatch on '%s'\n", __func__, text.c_str());
+    for (size_t i = 0; i < std::max(words.size(), words_ref.size()); ++i) {
+        fprintf(stderr, "%s :   '%s' vs '%s'\n", __func__,
+                i < words.size()     ? words[i].c_str()     : "",
+                i < words_ref.size() ? words_ref[i].c_str() : "");
+    }
+    return false;
+}
+
+int main() {
+    const std::vector<std::string> k_tests = {
+        "",
+        " ",
+        "  ",
+        "   Hello",
+        "Hello world",
+        " Hello, world!",
+        "\t\n",
+        " \t\n x",
+        "it's, I'm, we've, they're, you'll, he'd, don't",
+        "'S 'RE ' s 'x ''s '",
+        "w048 7tuijk dsdfhu 3.14159",
+        "нещо на Български",
+        "🚀 (normal) 😶‍🌫️ (multiple emojis concatenated) ✅",
+        "    Hello\n    Hello",
+        "trailing spaces   ",
+        "a\r\nb\v\fc",
+    };
+
+    for (const auto & text : k_tests) {
+        assert(check(text));
+    }
+
+    // random strings over an alphabet that exercises every branch of the pattern
+    const std::vector<std::string> alphabet = {
+        " ", " ", " ", "\t", "\n", "\r", "\v", "\f", "'", "'", "s", "t", "r", "e", "v", "m", "l", "d",
+        "a", "Z", "0", "9", ",", "!", "_", "\xc3\xa9", "\xe2\x96\x81", "\xf0\x9f\x9a\x80", "\x80", "\xff",
+        std::string(1, '\0'),
+    };
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<size_t> pick(0, alphabet.size() - 1);
+    std::uniform_int_distribution<int>    len(0, 32);
+
+    for (int i = 0; i < 20000; ++i) {
+        std::string text;
+        for (int j = len(rng); j > 0; --j) {
+            text += alphabet[pick(rng)];
+        }
+        assert(check(text));
+    }
+
+    return 0;
+}